@@ -35,9 +35,8 @@ struct _FpDeviceEgis0570
   gboolean      running;
   gboolean      stop;
 
-  GSList       *strips;
-  guint8       *background;
-  gsize         strips_len;
+  FpiFrameAssembler *assembler;
+  guint8            *background;
 
   int           pkt_num;
   int           pkt_type;
@@ -56,6 +55,7 @@ static struct fpi_frame_asmbl_ctx assembling_ctx = {
   .frame_height = EGIS0570_RFMGHEIGHT,
   .image_width = EGIS0570_IMGWIDTH * 4 / 3,
   .get_pixel = egis_get_pixel,
+  .plain_rows = TRUE,
 };
 
 /*
@@ -170,8 +170,9 @@ data_resp_cb (FpiUsbTransfer *transfer, FpDevice *dev, gpointer user_data, GErro
                   stripe->delta_y = 0;
                   stripdata = stripe->data;
                   memcpy (stripdata, (transfer->buffer) + (((k) * EGIS0570_IMGSIZE) + EGIS0570_IMGWIDTH * EGIS0570_RFMDIS), EGIS0570_IMGWIDTH * EGIS0570_RFMGHEIGHT);
-                  self->strips = g_slist_prepend (self->strips, stripe);
-                  self->strips_len += 1;
+                  if (!self->assembler)
+                    self->assembler = fpi_frame_assembler_new (&assembling_ctx, EGIS0570_STRIPS_HINT);
+                  fpi_frame_assembler_add (self->assembler, stripe);
                 }
               else
                 {
@@ -188,16 +189,13 @@ data_resp_cb (FpiUsbTransfer *transfer, FpDevice *dev, gpointer user_data, GErro
 
   if (end)
     {
-      if (!self->stop && (self->strips_len > 0))
+      g_autoptr(FpiFrameAssembler) assembler = g_steal_pointer (&self->assembler);
+
+      if (!self->stop && assembler)
         {
           g_autoptr(FpImage) img = NULL;
-          self->strips = g_slist_reverse (self->strips);
-          fpi_do_movement_estimation (&assembling_ctx, self->strips);
-          img = fpi_assemble_frames (&assembling_ctx, self->strips);
+          img = fpi_frame_assembler_finish (assembler);
           img->flags |= (FPI_IMAGE_COLORS_INVERTED | FPI_IMAGE_PARTIAL);
-          g_slist_free_full (self->strips, g_free);
-          self->strips = NULL;
-          self->strips_len = 0;
           FpImage *resizeImage = fpi_image_resize (img, EGIS0570_RESIZE, EGIS0570_RESIZE);
           fpi_image_device_image_captured (img_self, g_steal_pointer (&resizeImage));
         }
@@ -383,8 +381,11 @@ dev_init (FpImageDevice *dev)
 static void
 dev_deinit (FpImageDevice *dev)
 {
+  FpDeviceEgis0570 *self = FPI_DEVICE_EGIS0570 (dev);
   GError *error = NULL;
 
+  g_clear_pointer (&self->assembler, fpi_frame_assembler_free);
+
   g_usb_device_release_interface (fpi_device_get_usb_device (FP_DEVICE (dev)), 0, 0, &error);
 
   fpi_image_device_close_complete (dev, error);
@@ -144,6 +144,9 @@ static unsigned char init_pkts[][EGIS0570_PKTSIZE] =
 #define EGIS0570_RFMDIS (EGIS0570_IMGHEIGHT - EGIS0570_RFMGHEIGHT) / 2
 #define EGIS0570_IMGCOUNT 5
 
+/* Preallocate the image for this many strips */
+#define EGIS0570_STRIPS_HINT 40
+
 /*
  * Image repeat request
  * First 4 bytes are the same as in initialization packets
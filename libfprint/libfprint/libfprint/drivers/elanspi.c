@@ -1341,6 +1341,7 @@ elanspi_fp_frame_stitch_and_submit (FpiDeviceElanSpi *self)
     .frame_height = self->frame_height,
 
     .get_pixel = elanspi_fp_assembling_get_pixel,
+    .plain_rows = TRUE,
   };
 
   /* stitch image */
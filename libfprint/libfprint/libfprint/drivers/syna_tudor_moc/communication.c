@@ -23,6 +23,7 @@
 
 #include "communication.h"
 #include "container.c"
+#include "emulator.h"
 #include "fpi-byte-reader.h"
 #include "fpi-byte-writer.h"
 #include "fpi-usb-transfer.h"
@@ -31,7 +32,14 @@
 #include <glib.h>
 #include <gnutls/abstract.h>
 
-#define COMMUNICATION_DEBUG
+// #define COMMUNICATION_DEBUG
+
+/* with -Dsyna_tudor_moc_usdt=true each finished command is also exported as
+ * the syna_tudor_moc:cmd USDT probe, which can be traced with perf, bpftrace
+ * or LTTng */
+#ifdef SYNA_TUDOR_MOC_USDT
+#include <sys/sdt.h>
+#endif
 
 static gboolean sensor_status_is_result_ok(guint16 status)
 {
@@ -112,7 +120,7 @@ static const char *sensor_status_to_string(guint16 status)
    return ret;
 }
 
-static const char *cmd_id_to_str(guint8 cmd_id)
+const char *cmd_id_to_str(guint8 cmd_id)
 {
    const char *ret;
 
@@ -299,162 +307,599 @@ error:
    return ret;
 }
 
+/* USB transfers =========================================================== */
+
+/* a command is a bulk out and a bulk in transfer, so only in and control
+ * transfers are counted */
+static void count_round_trip(FpiDeviceSynaTudorMoc *self,
+                             FpiUsbTransfer *transfer)
+{
+   if (transfer->type == FP_TRANSFER_CONTROL ||
+       (transfer->endpoint & FPI_USB_ENDPOINT_IN) != 0) {
+      self->usb_round_trips++;
+   }
+}
+
+void syna_usb_transfer_submit(FpiUsbTransfer *transfer, guint timeout_ms,
+                              GCancellable *cancellable,
+                              FpiUsbTransferCallback callback,
+                              gpointer user_data)
+{
+   FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(transfer->device);
+
+   count_round_trip(self, transfer);
+#ifdef SYNA_TUDOR_MOC_TESTING
+   if (self->emulator != NULL) {
+      /* the emulator always replies, so there are no timeouts */
+      emulator_submit(self->emulator, transfer, cancellable, callback,
+                      user_data);
+      return;
+   }
+#endif
+   fpi_usb_transfer_submit(transfer, timeout_ms, cancellable, callback,
+                           user_data);
+}
+
+gboolean syna_usb_transfer_submit_sync(FpiUsbTransfer *transfer,
+                                       guint timeout_ms, GError **error)
+{
+   FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(transfer->device);
+
+   count_round_trip(self, transfer);
+#ifdef SYNA_TUDOR_MOC_TESTING
+   if (self->emulator != NULL) {
+      return emulator_submit_sync(self->emulator, transfer, error);
+   }
+#endif
+   return fpi_usb_transfer_submit_sync(transfer, timeout_ms, error);
+}
+
 /* ========================================================================= */
 
-/* Async cmd send ========================================================== */
+/* Command arena =========================================================== */
+
+/* initial size of arena buffers, so that most commands do not need to grow
+ * them */
+#define CMD_ARENA_INITIAL_SIZE 1024
+
+static guint8 *cmd_arena_reserve(guint8 **buf, gsize *buf_size,
+                                 const gsize needed_size)
+{
+   if (*buf_size < needed_size) {
+      /* no need to preserve the previous content */
+      g_free(*buf);
+      *buf_size = MAX(needed_size, CMD_ARENA_INITIAL_SIZE);
+      *buf = g_malloc(*buf_size);
+   }
+   return *buf;
+}
+
+static void cmd_arena_slot_free(gpointer data)
+{
+   cmd_arena_slot_t *slot = data;
+
+   g_free(slot->buf);
+   g_free(slot);
+}
+
+/* Returns a buffer to which a command of send_size is to be serialized before
+ * calling synaptics_secure_connect. It lies at the plaintext offset of a free
+ * send slot, so that the command can be wrapped in place. It is valid until the
+ * command is sent; if the command is not queued, it is returned again by the
+ * next call of this function. */
+guint8 *cmd_arena_get_send_buffer(FpiDeviceSynaTudorMoc *self,
+                                  const gsize send_size)
+{
+   cmd_arena_t *arena = &self->cmd_arena;
+   cmd_arena_slot_t *slot = arena->reserved_slot;
+
+   if (slot == NULL) {
+      if (arena->send_slots == NULL) {
+         arena->send_slots =
+             g_ptr_array_new_with_free_func(cmd_arena_slot_free);
+      }
+      for (guint i = 0; i < arena->send_slots->len && slot == NULL; ++i) {
+         cmd_arena_slot_t *candidate = g_ptr_array_index(arena->send_slots, i);
+         if (!candidate->in_use) {
+            slot = candidate;
+         }
+      }
+      if (slot == NULL) {
+         slot = g_new0(cmd_arena_slot_t, 1);
+         g_ptr_array_add(arena->send_slots, slot);
+      }
+      slot->in_use = TRUE;
+      arena->reserved_slot = slot;
+   }
+
+   cmd_arena_reserve(&slot->buf, &slot->size,
+                     TLS_RECORD_PTEXT_OFFSET + send_size + AES_GCM_TAG_SIZE);
+   return slot->buf + TLS_RECORD_PTEXT_OFFSET;
+}
+
+/* returns the reserved slot if send_data were serialized to it, NULL otherwise
+ */
+static cmd_arena_slot_t *cmd_arena_take_send_slot(FpiDeviceSynaTudorMoc *self,
+                                                  const guint8 *send_data)
+{
+   cmd_arena_t *arena = &self->cmd_arena;
+   cmd_arena_slot_t *slot = arena->reserved_slot;
+
+   if (slot == NULL || send_data != slot->buf + TLS_RECORD_PTEXT_OFFSET) {
+      return NULL;
+   }
+   arena->reserved_slot = NULL;
+   return slot;
+}
+
+static void cmd_arena_release_send_slot(cmd_arena_slot_t *slot)
+{
+   if (slot != NULL) {
+      slot->in_use = FALSE;
+   }
+}
+
+/* receive buffers are used alternately, so that a reply can be received while
+ * the previous one is processed */
+static guint8 *cmd_arena_get_recv_buffer(FpiDeviceSynaTudorMoc *self,
+                                         const gsize recv_size)
+{
+   cmd_arena_t *arena = &self->cmd_arena;
+   const guint i = arena->next_recv_buf;
+
+   arena->next_recv_buf = (i + 1) % G_N_ELEMENTS(arena->recv_buf);
+   return cmd_arena_reserve(&arena->recv_buf[i], &arena->recv_buf_size[i],
+                            recv_size);
+}
+
+/* must not be called while a command is queued */
+void cmd_arena_free(FpiDeviceSynaTudorMoc *self)
+{
+   cmd_arena_t *arena = &self->cmd_arena;
+
+   g_clear_pointer(&arena->send_slots, g_ptr_array_unref);
+   arena->reserved_slot = NULL;
+   for (guint i = 0; i < G_N_ELEMENTS(arena->recv_buf); ++i) {
+      g_clear_pointer(&arena->recv_buf[i], g_free);
+      arena->recv_buf_size[i] = 0;
+   }
+   arena->next_recv_buf = 0;
+}
+
+/* Command trace =========================================================== */
+
+static void cmd_trace_record(FpiDeviceSynaTudorMoc *self,
+                             const cmd_trace_entry_t *entry)
+{
+   cmd_trace_t *trace = &self->cmd_trace;
+   const guint pos = (trace->head + trace->len) % CMD_TRACE_SIZE;
+
+   trace->entries[pos] = *entry;
+   if (trace->len < CMD_TRACE_SIZE) {
+      trace->len += 1;
+   } else {
+      trace->head = (trace->head + 1) % CMD_TRACE_SIZE;
+   }
+
+#ifdef SYNA_TUDOR_MOC_USDT
+   DTRACE_PROBE8(syna_tudor_moc, cmd, entry->cmd_id, entry->failed,
+                 entry->queued_time, entry->submit_time, entry->reply_time,
+                 entry->handled_time, entry->wrapped_size, entry->recv_size);
+#endif
+}
+
+static gint64 cmd_trace_since_queued(const cmd_trace_entry_t *entry,
+                                     gint64 time)
+{
+   return time != 0 ? time - entry->queued_time : -1;
+}
 
-typedef enum {
-   CMD_STATE_SEND,
-   CMD_STATE_GET_RESP,
-   CMD_NUM_STATES,
-} cmd_state_t;
+/* logs the recorded commands from the oldest one and totals per command ID;
+ * steps are in us since the command was queued, -1 if they did not happen */
+void cmd_trace_dump(FpiDeviceSynaTudorMoc *self)
+{
+   const cmd_trace_t *trace = &self->cmd_trace;
+   guint counts[256] = {0};
+   gint64 totals[256] = {0};
+
+   fp_info("Last %u commands (wrap/submit/reply/unwrap/handled us since "
+           "queued, sent/wrapped/received/unwrapped bytes):",
+           trace->len);
+   for (guint i = 0; i < trace->len; ++i) {
+      const cmd_trace_entry_t *entry =
+          &trace->entries[(trace->head + i) % CMD_TRACE_SIZE];
+      fp_info("\t0x%02x %-36s %5" G_GINT64_FORMAT " %5" G_GINT64_FORMAT
+              " %6" G_GINT64_FORMAT " %6" G_GINT64_FORMAT " %6" G_GINT64_FORMAT
+              " %5u %5u %5u %5u%s",
+              entry->cmd_id, cmd_id_to_str(entry->cmd_id),
+              cmd_trace_since_queued(entry, entry->wrapped_time),
+              cmd_trace_since_queued(entry, entry->submit_time),
+              cmd_trace_since_queued(entry, entry->reply_time),
+              cmd_trace_since_queued(entry, entry->unwrap_time),
+              cmd_trace_since_queued(entry, entry->handled_time),
+              entry->send_size, entry->wrapped_size, entry->recv_size,
+              entry->unwrapped_size, entry->failed ? " failed" : "");
+      if (entry->handled_time != 0) {
+         counts[entry->cmd_id] += 1;
+         totals[entry->cmd_id] += entry->handled_time - entry->queued_time;
+      }
+   }
+
+   for (guint i = 0; i < G_N_ELEMENTS(counts); ++i) {
+      if (counts[i] != 0) {
+         fp_info("\t0x%02x = %s: %u handled, %" G_GINT64_FORMAT
+                 " us on average",
+                 i, cmd_id_to_str(i), counts[i], totals[i] / counts[i]);
+      }
+   }
+}
+
+void cmd_trace_clear(FpiDeviceSynaTudorMoc *self)
+{
+   self->cmd_trace.head = 0;
+   self->cmd_trace.len = 0;
+}
+
+/* Command queue ===========================================================
+ *
+ * Commands are sent one by one in the order in which they were queued, except
+ * for commands queued from a CmdCallback, which are sent before the pending
+ * ones (in the order in which they were queued). This keeps the order of the
+ * original one-command-at-a-time flow while allowing a task to queue several
+ * commands at once in a batch.
+ *
+ * To decrease the latency between commands:
+ * - the reply transfer is posted together with the request transfer
+ * - the next command of a batch is wrapped while the previous reply is in
+ *   flight and it is sent as soon as the reply has an OK status, before the
+ *   reply is processed
+ * - if a command is queued in front of an already wrapped command, the wrap is
+ *   reverted, so that TLS sequence numbers follow the order of sending */
+
+static void queued_cmd_free(queued_cmd_t *cmd)
+{
+   cmd_arena_release_send_slot(cmd->slot);
+   g_clear_object(&cmd->cancellable);
+   g_clear_error(&cmd->send_error);
+   g_free(cmd);
+}
+
+static void queued_cmd_transfer_done(queued_cmd_t *cmd)
+{
+   g_assert(cmd->transfers_left > 0);
+   cmd->transfers_left -= 1;
+   if (cmd->transfers_left == 0) {
+      queued_cmd_free(cmd);
+   }
+}
+
+static gboolean queued_cmd_wrap(FpiDeviceSynaTudorMoc *self, queued_cmd_t *cmd,
+                                GError **error)
+{
+   if (cmd->wrapped) {
+      return TRUE;
+   }
+
+   /* Wrap command in place in its send slot if in TLS session */
+   if (self->tls.established) {
+      cmd->wrapped_data = cmd->slot->buf;
+      if (!tls_wrap(self, cmd->wrapped_data, cmd->send_size,
+                    &cmd->wrapped_size, error)) {
+         return FALSE;
+      }
+      cmd->wrapped = TRUE;
+      cmd->trace.wrapped_time = g_get_monotonic_time();
+      /* TLS response is expected to be larger */
+      cmd->expected_recv_size += WRAP_RESPONSE_ADDITIONAL_SIZE;
+   } else {
+      cmd->wrapped_data = cmd->send_data;
+      cmd->wrapped_size = cmd->send_size;
+   }
+
+   return TRUE;
+}
+
+/* reverts wrapping of a command which was wrapped ahead, but was not sent */
+static gboolean queued_cmd_unwrap_unsent(FpiDeviceSynaTudorMoc *self,
+                                         queued_cmd_t *cmd, GError **error)
+{
+   if (!cmd->wrapped) {
+      return TRUE;
+   }
+
+   if (!tls_unwrap_unsent(self, cmd->wrapped_data, cmd->wrapped_size, error)) {
+      return FALSE;
+   }
+   cmd->wrapped = FALSE;
+   cmd->trace.wrapped_time = 0;
+   cmd->expected_recv_size -= WRAP_RESPONSE_ADDITIONAL_SIZE;
+
+   return TRUE;
+}
+
+static void cmd_queue_report_error(FpiDeviceSynaTudorMoc *self,
+                                   queued_cmd_t *cmd, GError *error)
+{
+   FP_ERR_FANCY("Cmd transfer resulted in error: %s", error->message);
+   if (self->task_ssm != NULL && cmd->task_ssm == self->task_ssm) {
+      fpi_ssm_mark_failed(self->task_ssm, error);
+   } else {
+      g_error_free(error);
+   }
+}
+
+/* drops pending commands of tasks which have already ended */
+static void cmd_queue_drop_stale(FpiDeviceSynaTudorMoc *self)
+{
+   GQueue *pending = &self->cmd_queue.pending;
+   GList *link = pending->head;
+
+   while (link != NULL) {
+      GList *next = link->next;
+      queued_cmd_t *cmd = link->data;
+
+      if (cmd->task_ssm != self->task_ssm) {
+         GError *error = NULL;
+         fp_dbg("Dropping queued command 0x%x as its task has ended",
+                cmd->cmd_id);
+         /* only the first pending command can be wrapped */
+         if (!queued_cmd_unwrap_unsent(self, cmd, &error)) {
+            fp_warn("Unable to revert wrap of dropped command: %s",
+                    error->message);
+            g_error_free(error);
+         }
+         g_queue_delete_link(pending, link);
+         queued_cmd_free(cmd);
+      }
+      link = next;
+   }
+}
+
+/* wraps the next command of a batch while the previous reply is in flight */
+static void cmd_queue_wrap_next(FpiDeviceSynaTudorMoc *self)
+{
+   queued_cmd_t *next = g_queue_peek_head(&self->cmd_queue.pending);
+   GError *error = NULL;
+
+   if (next == NULL || !next->pipelined || !self->tls.established) {
+      return;
+   }
+
+   if (!queued_cmd_wrap(self, next, &error)) {
+      /* it will be wrapped again when it is sent */
+      fp_warn("Unable to wrap command ahead: %s", error->message);
+      g_error_free(error);
+   }
+}
+
+static void cmd_send_cb(FpiUsbTransfer *transfer, FpDevice *device,
+                        gpointer user_data, GError *error)
+{
+   queued_cmd_t *cmd = (queued_cmd_t *)user_data;
+
+   /* the send slot can be used by following commands */
+   cmd_arena_release_send_slot(cmd->slot);
+   cmd->slot = NULL;
+
+   if (error != NULL) {
+      if (cmd->transfers_left > 1) {
+         /* reported by the reply transfer */
+         cmd->send_error = error;
+         g_cancellable_cancel(cmd->cancellable);
+      } else {
+         g_error_free(error);
+      }
+   }
+
+   queued_cmd_transfer_done(cmd);
+}
+
+static void cmd_queue_kick(FpiDeviceSynaTudorMoc *self);
 
 static void cmd_receive_cb(FpiUsbTransfer *transfer, FpDevice *device,
                            gpointer user_data, GError *error)
 {
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
-   cmd_ssm_data_t *ssm_data = (cmd_ssm_data_t *)user_data;
-   const int status_header_len = 2;
+   queued_cmd_t *cmd = (queued_cmd_t *)user_data;
+   cmd_queue_t *queue = &self->cmd_queue;
+   const int status_header_len = SENSOR_FW_REPLY_STATUS_HEADER_LEN;
+
+   g_assert(queue->in_flight == cmd);
+   queue->in_flight = NULL;
+   queue->processing = TRUE;
+   cmd->trace.reply_time = g_get_monotonic_time();
+   cmd->trace.recv_size = transfer->actual_length;
 
+   if (cmd->send_error != NULL) {
+      /* reply transfer was cancelled because sending failed */
+      g_clear_error(&error);
+      error = g_steal_pointer(&cmd->send_error);
+   }
    if (error != NULL) {
       /* NOTE: assumes timeout should never happen for receiving. */
       goto error;
    }
 
-   /* some debug output */
+#ifdef COMMUNICATION_DEBUG
    fp_dbg("  Transfer: length: %lu, actual_length: %lu", transfer->length,
           transfer->actual_length);
    fp_dbg("  raw wrapped resp:");
    fp_dbg_large_hex(transfer->buffer, transfer->actual_length);
+#endif
 
-   /* Unwrap command if in TLS session */
+   /* Unwrap command in place in the receive arena if in TLS session */
    if (self->tls.established && transfer->actual_length != status_header_len) {
-      tls_unwrap(self, transfer->buffer, transfer->actual_length,
-                 &ssm_data->recv_data, &ssm_data->recv_size, &error);
-      if (error != NULL) {
+      if (!tls_unwrap(self, transfer->buffer, transfer->actual_length,
+                      &cmd->recv_data, &cmd->recv_size, &error)) {
          goto error;
       }
+      cmd->trace.unwrap_time = g_get_monotonic_time();
    } else {
       /* Response can be shorter, e.g. on error */
-      ssm_data->recv_size = transfer->actual_length;
-      ssm_data->recv_data = g_malloc(ssm_data->recv_size);
-      memcpy(ssm_data->recv_data, transfer->buffer, transfer->actual_length);
+      cmd->recv_size = transfer->actual_length;
+      cmd->recv_data = transfer->buffer;
    }
 
 #ifdef COMMUNICATION_DEBUG
    fp_dbg("  raw unwrapped resp:");
-   fp_dbg_large_hex(ssm_data->recv_data, ssm_data->recv_size);
-   fp_dbg("<--- 0x%x = %s", ssm_data->cmd_id, cmd_id_to_str(ssm_data->cmd_id));
+   fp_dbg_large_hex(cmd->recv_data, cmd->recv_size);
+   fp_dbg("<--- 0x%x = %s", cmd->cmd_id, cmd_id_to_str(cmd->cmd_id));
 #endif
 
-   /* stauts is not initialized to 0 as 0 marks success */
-   guint16 status = 0xffff;
-   status = FP_READ_UINT16_LE(ssm_data->recv_data);
-   if ((ssm_data->check_status) && !sensor_status_is_result_ok(status)) {
-      fpi_ssm_mark_failed(
-          transfer->ssm,
-          set_and_report_error(FP_DEVICE_ERROR_PROTO,
-                               "Device responded with status: 0x%04x aka %s",
-                               status, sensor_status_to_string(status)));
-      return;
+   if (cmd->recv_size < SENSOR_FW_REPLY_STATUS_HEADER_LEN) {
+      error = set_and_report_error(FP_DEVICE_ERROR_PROTO,
+                                   "Response is too short: %lu",
+                                   cmd->recv_size);
+      goto error;
    }
 
-   if (error != NULL) {
-      g_free(ssm_data->recv_data);
-      fpi_ssm_mark_failed(self->task_ssm, error);
+   const guint16 status = FP_READ_UINT16_LE(cmd->recv_data);
+   if ((cmd->check_status) && !sensor_status_is_result_ok(status)) {
+      error = set_and_report_error(
+          FP_DEVICE_ERROR_PROTO, "Device responded with status: 0x%04x aka %s",
+          status, sensor_status_to_string(status));
+      goto error;
+   }
+
+   /* the next command of a batch does not depend on the content of this
+    * reply, so it is sent before the reply is processed */
+   queued_cmd_t *next = g_queue_peek_head(&queue->pending);
+   if (sensor_status_is_result_ok(status) && next != NULL && next->pipelined &&
+       next->task_ssm == cmd->task_ssm) {
+      cmd_queue_kick(self);
+   }
+
+   if (self->task_ssm != NULL && cmd->task_ssm == self->task_ssm) {
+      queue->handling_reply = TRUE;
+      queue->insert_pos = 0;
+      (cmd->callback)(self, cmd->recv_data, cmd->recv_size, NULL);
+      queue->handling_reply = FALSE;
+      cmd->trace.handled_time = g_get_monotonic_time();
    } else {
-      (ssm_data->callback)(self, ssm_data->recv_data, ssm_data->recv_size,
-                           NULL);
+      fp_dbg("Dropping reply to 0x%x as its task has ended", cmd->cmd_id);
    }
-   fpi_ssm_mark_completed(transfer->ssm);
-   return;
+   goto done;
+
 error:
-   fpi_ssm_mark_failed(transfer->ssm, error);
+   cmd->trace.failed = TRUE;
+   cmd_queue_report_error(self, cmd, error);
+done:
+   cmd->trace.unwrapped_size = cmd->recv_size;
+   cmd_trace_record(self, &cmd->trace);
+   cmd_queue_drop_stale(self);
+   queued_cmd_transfer_done(cmd);
+   queue->processing = FALSE;
+   cmd_queue_kick(self);
 }
 
-static void cmd_state_send(FpiDeviceSynaTudorMoc *self,
-                           cmd_ssm_data_t *ssm_data)
+static void cmd_queue_dispatch(FpiDeviceSynaTudorMoc *self)
 {
-   g_autofree guint8 *wrapped_data = NULL;
-   gsize wrapped_size = 0;
+   cmd_queue_t *queue = &self->cmd_queue;
+   queued_cmd_t *cmd = g_queue_pop_head(&queue->pending);
+   FpiUsbTransfer *transfer = NULL;
+   GError *error = NULL;
 
 #ifdef COMMUNICATION_DEBUG
    /* some debug info */
-   fp_dbg("---> 0x%x = %s", ssm_data->cmd_id, cmd_id_to_str(ssm_data->cmd_id));
-   fp_dbg("  expected recv size: %lu", ssm_data->expected_recv_size);
-   fp_dbg("  raw unwrapped req:");
-   fp_dbg_large_hex(ssm_data->send_data, ssm_data->send_size);
+   fp_dbg("---> 0x%x = %s", cmd->cmd_id, cmd_id_to_str(cmd->cmd_id));
+   fp_dbg("  wrapped ahead: %d", cmd->wrapped);
 #endif
 
-   /* Wrap command if in TLS session */
-   if (self->tls.established) {
-      GError *error = NULL;
-      if (!tls_wrap(self, ssm_data->send_data, ssm_data->send_size,
-                    &wrapped_data, &wrapped_size, &error)) {
-         fpi_ssm_mark_failed(self->cmd_ssm, error);
-         return;
-      } else {
-         g_free(ssm_data->send_data);
-      }
-      /* TLS response is expected to be larger */
-      ssm_data->expected_recv_size += WRAP_RESPONSE_ADDITIONAL_SIZE;
-   } else {
-      wrapped_data = ssm_data->send_data;
-      wrapped_size = ssm_data->send_size;
+   if (!queued_cmd_wrap(self, cmd, &error)) {
+      cmd_queue_report_error(self, cmd, error);
+      queued_cmd_free(cmd);
+      cmd_queue_drop_stale(self);
+      return;
    }
 
 #ifdef COMMUNICATION_DEBUG
+   fp_dbg("  expected recv size: %lu", cmd->expected_recv_size);
    fp_dbg("  raw wrapped req:");
-   fp_dbg_large_hex(wrapped_data, wrapped_size);
+   fp_dbg_large_hex(cmd->wrapped_data, cmd->wrapped_size);
 #endif
 
-   /* Send out the command */
-   g_assert(self->cmd_transfer == NULL);
-   self->cmd_transfer = fpi_usb_transfer_new(FP_DEVICE(self));
-   self->cmd_transfer->short_is_error = FALSE;
-   fpi_usb_transfer_fill_bulk(self->cmd_transfer, USB_EP_REQUEST, wrapped_size);
-   memcpy(self->cmd_transfer->buffer, wrapped_data, wrapped_size);
+   queue->in_flight = cmd;
+   cmd->cancellable = g_cancellable_new();
+   cmd->transfers_left = 2;
+   cmd->trace.wrapped_size = cmd->wrapped_size;
+   cmd->trace.submit_time = g_get_monotonic_time();
 
-   self->cmd_transfer->ssm = self->cmd_ssm;
-   fpi_usb_transfer_submit(self->cmd_transfer, USB_TRANSFER_TIMEOUT_MS, NULL,
-                           fpi_ssm_usb_transfer_cb, NULL);
-   self->cmd_transfer = NULL;
+   /* Send out the command; the arena is owned by the device, so the transfers
+    * must not free it */
+   transfer = fpi_usb_transfer_new(FP_DEVICE(self));
+   transfer->short_is_error = FALSE;
+   fpi_usb_transfer_fill_bulk_full(transfer, USB_EP_REQUEST, cmd->wrapped_data,
+                                   cmd->wrapped_size, NULL);
+   syna_usb_transfer_submit(transfer, USB_TRANSFER_TIMEOUT_MS, NULL,
+                            cmd_send_cb, cmd);
+
+   /* Post the reply transfer right away, so that it is ready when the sensor
+    * responds */
+   transfer = fpi_usb_transfer_new(FP_DEVICE(self));
+   fpi_usb_transfer_fill_bulk_full(
+       transfer, USB_EP_REPLY,
+       cmd_arena_get_recv_buffer(self, cmd->expected_recv_size),
+       cmd->expected_recv_size, NULL);
+   syna_usb_transfer_submit(transfer, USB_TRANSFER_TIMEOUT_MS,
+                            cmd->cancellable, cmd_receive_cb, cmd);
+
+   cmd_queue_wrap_next(self);
 }
 
-static void cmd_run_state(FpiSsm *ssm, FpDevice *dev)
+/* sends the next command if none is in flight */
+static void cmd_queue_kick(FpiDeviceSynaTudorMoc *self)
 {
-   FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(dev);
-   cmd_ssm_data_t *ssm_data = fpi_ssm_get_data(ssm);
-
-   switch (fpi_ssm_get_cur_state(ssm)) {
-   case CMD_STATE_SEND:
-      cmd_state_send(self, ssm_data);
-      break;
+   cmd_queue_t *queue = &self->cmd_queue;
+   const gboolean was_processing = queue->processing;
+
+   queue->processing = TRUE;
+   while (queue->in_flight == NULL && !g_queue_is_empty(&queue->pending)) {
+      if (!queue->in_critical_section) {
+         queue->in_critical_section = TRUE;
+         fpi_device_critical_enter(FP_DEVICE(self));
+      }
+      cmd_queue_dispatch(self);
+   }
+   queue->processing = was_processing;
 
-   case CMD_STATE_GET_RESP:
-      self->cmd_transfer = fpi_usb_transfer_new(dev);
-      self->cmd_transfer->ssm = ssm;
-      fpi_usb_transfer_fill_bulk(self->cmd_transfer, USB_EP_REPLY,
-                                 ssm_data->expected_recv_size);
-      fpi_usb_transfer_submit(self->cmd_transfer, USB_TRANSFER_TIMEOUT_MS, NULL,
-                              cmd_receive_cb, fpi_ssm_get_data(ssm));
-      self->cmd_transfer = NULL;
-      break;
+   if (!queue->processing && queue->in_flight == NULL &&
+       g_queue_is_empty(&queue->pending) && queue->in_critical_section) {
+      queue->in_critical_section = FALSE;
+      fpi_device_critical_leave(FP_DEVICE(self));
    }
 }
 
-static void cmd_ssm_done(FpiSsm *ssm, FpDevice *dev, GError *error)
+/* whether no command is queued, in flight or being handled */
+gboolean cmd_queue_is_idle(FpiDeviceSynaTudorMoc *self)
 {
-   FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(dev);
+   const cmd_queue_t *queue = &self->cmd_queue;
 
-   if (error != NULL) {
-      FP_ERR_FANCY("Cmd transfer resulted in error: %s", error->message);
-      fpi_ssm_mark_failed(self->task_ssm, error);
-      return;
+   return !queue->processing && !queue->batching && queue->in_flight == NULL &&
+          g_queue_is_empty(&queue->pending);
+}
+
+/* Commands queued until cmd_queue_batch_end are sent back to back - each of
+ * them is sent as soon as the previous one got a reply with an OK status.
+ * Their CmdCallbacks are still called one by one in order. */
+void cmd_queue_batch_begin(FpiDeviceSynaTudorMoc *self)
+{
+   g_assert(!self->cmd_queue.batching);
+
+   self->cmd_queue.batching = TRUE;
+   self->cmd_queue.batch_cnt = 0;
+}
+
+/* returns the number of commands queued in the batch after the first one */
+guint cmd_queue_batch_end(FpiDeviceSynaTudorMoc *self)
+{
+   g_assert(self->cmd_queue.batching);
+
+   self->cmd_queue.batching = FALSE;
+   if (!self->cmd_queue.processing) {
+      cmd_queue_kick(self);
    }
 
-   self->cmd_ssm = NULL;
-   fpi_device_critical_leave(dev);
+   return self->cmd_queue.batch_cnt > 0 ? self->cmd_queue.batch_cnt - 1 : 0;
 }
 
 void synaptics_secure_connect(FpiDeviceSynaTudorMoc *self, guint8 *send_data,
@@ -463,25 +908,65 @@ void synaptics_secure_connect(FpiDeviceSynaTudorMoc *self, guint8 *send_data,
                               const gboolean check_status,
                               const CmdCallback callback)
 {
-   /* Start of a new command, create the state machine. */
+   cmd_queue_t *queue = &self->cmd_queue;
+   GError *error = NULL;
+
    g_assert(callback != NULL);
    g_assert(expected_recv_size > 0);
-   g_assert(self->cmd_transfer == NULL);
 
-   self->cmd_ssm = fpi_ssm_new_full(FP_DEVICE(self), cmd_run_state,
-                                    CMD_NUM_STATES, CMD_NUM_STATES, "Cmd");
+   queued_cmd_t *cmd = g_new0(queued_cmd_t, 1);
+
+   /* commands which were not serialized to the arena are moved there */
+   cmd->slot = cmd_arena_take_send_slot(self, send_data);
+   if (cmd->slot == NULL) {
+      guint8 *arena_send_data = cmd_arena_get_send_buffer(self, send_size);
+      memcpy(arena_send_data, send_data, send_size);
+      g_free(send_data);
+      send_data = arena_send_data;
+      cmd->slot = cmd_arena_take_send_slot(self, send_data);
+   }
+
+   cmd->send_data = send_data;
+   cmd->send_size = send_size;
+   cmd->expected_recv_size = expected_recv_size;
+   cmd->callback = callback;
+   cmd->check_status = check_status;
+   cmd->cmd_id = send_data[0];
+   cmd->task_ssm = self->task_ssm;
+   cmd->trace.cmd_id = cmd->cmd_id;
+   cmd->trace.queued_time = g_get_monotonic_time();
+   cmd->trace.send_size = send_size;
+   if (queue->batching) {
+      /* the first command of a batch waits for processing of the previous
+       * reply */
+      cmd->pipelined = queue->batch_cnt > 0;
+      queue->batch_cnt += 1;
+   }
 
-   cmd_ssm_data_t *data = g_new0(cmd_ssm_data_t, 1);
-   data->send_data = send_data;
-   data->send_size = send_size;
-   data->expected_recv_size = expected_recv_size;
-   data->callback = callback;
-   data->check_status = check_status;
-   data->cmd_id = send_data[0];
-   fpi_ssm_set_data(self->cmd_ssm, data, g_free);
+#ifdef COMMUNICATION_DEBUG
+   fp_dbg("queued 0x%x = %s", cmd->cmd_id, cmd_id_to_str(cmd->cmd_id));
+   fp_dbg("  raw unwrapped req:");
+   fp_dbg_large_hex(cmd->send_data, cmd->send_size);
+#endif
 
-   fpi_device_critical_enter(FP_DEVICE(self));
-   fpi_ssm_start(self->cmd_ssm, cmd_ssm_done);
+   if (queue->handling_reply) {
+      /* the command has to be wrapped before the first pending one */
+      if (queue->insert_pos == 0 && !g_queue_is_empty(&queue->pending) &&
+          !queued_cmd_unwrap_unsent(self, g_queue_peek_head(&queue->pending),
+                                    &error)) {
+         cmd_queue_report_error(self, cmd, error);
+         queued_cmd_free(cmd);
+         return;
+      }
+      g_queue_push_nth(&queue->pending, cmd, queue->insert_pos);
+      queue->insert_pos += 1;
+   } else {
+      g_queue_push_tail(&queue->pending, cmd);
+   }
+
+   if (!queue->processing && !queue->batching) {
+      cmd_queue_kick(self);
+   }
 }
 
 static void recv_no_operation(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
@@ -494,8 +979,6 @@ static void recv_no_operation(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
    g_assert(recv_data != NULL);
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -585,8 +1068,6 @@ static void recv_get_version(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
    fp_dbg_get_version(&self->mis_version);
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -599,7 +1080,7 @@ void send_get_version(FpiDeviceSynaTudorMoc *self)
 {
    const guint send_size = 1;
    const guint expected_recv_size = 38;
-   guint8 *send_data = g_malloc(send_size);
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    send_data[0] = VCSFW_CMD_GET_VERSION;
 
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
@@ -643,8 +1124,6 @@ static void recv_frame_acq(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
    }
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -661,8 +1140,9 @@ void send_frame_acq(FpiDeviceSynaTudorMoc *self, capture_flags_t capture_flags)
    // TODO: consider a better place for init
    self->frame_acq_config.num_retries = 3;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, FALSE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    /* As there were only two capture flags used, I simplified the request logic
@@ -685,8 +1165,6 @@ void send_frame_acq(FpiDeviceSynaTudorMoc *self, capture_flags_t capture_flags)
    written &= fpi_byte_writer_put_uint8(&writer, 0);              // +17
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    self->frame_acq_config.last_capture_flags = capture_flags;
 
    /* Do not check the response status as there is a status on which we
@@ -701,7 +1179,7 @@ void send_frame_finish(FpiDeviceSynaTudorMoc *self)
 
    const guint send_size = 1;
    const guint expected_recv_size = 2;
-   guint8 *send_data = g_malloc(send_size);
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    send_data[0] = VCSFW_CMD_FRAME_FINISH;
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_no_operation);
@@ -717,8 +1195,9 @@ void send_enroll_start(FpiDeviceSynaTudorMoc *self)
    const guint send_size = 13;
    const guint expected_recv_size = 6 + nonce_buffer_size;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &= fpi_byte_writer_put_uint8(&writer, VCSFW_CMD_ENROLL);        // +0
@@ -729,8 +1208,6 @@ void send_enroll_start(FpiDeviceSynaTudorMoc *self)
    written &= fpi_byte_writer_put_uint32_le(&writer, nonce_buffer_size); // +9
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    /* no need to receive nonce buffer as it it not used here */
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_no_operation);
@@ -821,8 +1298,6 @@ static void recv_enroll_add_image(FpiDeviceSynaTudorMoc *self,
    }
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -835,8 +1310,9 @@ void send_enroll_add_image(FpiDeviceSynaTudorMoc *self)
    const guint send_size = 5;
    const guint expected_recv_size = 82;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &= fpi_byte_writer_put_uint8(&writer, VCSFW_CMD_ENROLL); // +0
@@ -844,8 +1320,6 @@ void send_enroll_add_image(FpiDeviceSynaTudorMoc *self)
        fpi_byte_writer_put_uint32_le(&writer, ENROLL_SUBCMD_ADD_IMAGE); // +1
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_enroll_add_image);
 }
@@ -857,8 +1331,9 @@ void send_enroll_commit(FpiDeviceSynaTudorMoc *self, guint8 *enroll_commit_data,
    const guint expected_recv_size = 2;
    g_assert((enroll_commit_data_size != 0) && (enroll_commit_data != NULL));
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &= fpi_byte_writer_put_uint8(&writer, VCSFW_CMD_ENROLL); // +0
@@ -871,8 +1346,6 @@ void send_enroll_commit(FpiDeviceSynaTudorMoc *self, guint8 *enroll_commit_data,
                                        enroll_commit_data_size); // +13
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_no_operation);
 }
@@ -882,8 +1355,9 @@ void send_enroll_finish(FpiDeviceSynaTudorMoc *self)
    const guint send_size = 5;
    const guint expected_recv_size = 2;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &= fpi_byte_writer_put_uint8(&writer, VCSFW_CMD_ENROLL); // +0
@@ -891,8 +1365,6 @@ void send_enroll_finish(FpiDeviceSynaTudorMoc *self)
        fpi_byte_writer_put_uint32_le(&writer, ENROLL_SUBCMD_FINISH); // +1
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_no_operation);
 }
@@ -972,8 +1444,6 @@ static void recv_identify_match(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
    fp_dbg_enrollment(&match_result->matched_enrollment);
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -1002,8 +1472,9 @@ void send_identify_match(FpiDeviceSynaTudorMoc *self,
    const guint send_size = 13 + data_2_size + template_id_array_size;
    const guint expected_recv_size = 1602;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &=
@@ -1014,16 +1485,13 @@ void send_identify_match(FpiDeviceSynaTudorMoc *self,
        fpi_byte_writer_put_uint32_le(&writer, template_id_array_size); // +5
    written &= fpi_byte_writer_put_uint32_le(&writer, data_2_size);     // +9
    if (template_ids_to_match != NULL) {
-      fpi_byte_writer_put_data(&writer, *template_ids_to_match,
-                               template_ids_cnt *
-                                   template_id_array_size); // +13
+      written &= fpi_byte_writer_put_data(&writer, *template_ids_to_match,
+                                          template_id_array_size); // +13
    } else if (data_2 != NULL) {
-      fpi_byte_writer_put_data(&writer, data_2, data_2_size); // +13
+      written &= fpi_byte_writer_put_data(&writer, data_2, data_2_size); // +13
    }
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             FALSE, recv_identify_match);
 }
@@ -1096,8 +1564,6 @@ static void recv_get_image_metrics(FpiDeviceSynaTudorMoc *self,
    }
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -1117,8 +1583,9 @@ void send_get_image_metrics(FpiDeviceSynaTudorMoc *self,
       expected_recv_size = 70;
    }
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &=
@@ -1127,8 +1594,6 @@ void send_get_image_metrics(FpiDeviceSynaTudorMoc *self,
                                             type); // +1
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_get_image_metrics);
 }
@@ -1154,8 +1619,6 @@ static void recv_event_config(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
    fp_dbg("Current event sequence number is %d", self->events.seq_num);
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -1171,8 +1634,9 @@ void send_event_config(FpiDeviceSynaTudorMoc *self, guint32 event_mask)
    const guint send_size = 37;
    const guint expected_recv_size = 66;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    fpi_byte_writer_put_uint8(&writer, VCSFW_CMD_EVENT_CONFIG);
@@ -1187,11 +1651,99 @@ void send_event_config(FpiDeviceSynaTudorMoc *self, guint32 event_mask)
    }
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_event_config);
 }
 
+/* Event ring buffer ======================================================= */
+
+/* stores an event behind the not yet committed events of the current chain */
+static void event_ring_push(FpiDeviceSynaTudorMoc *self,
+                            const sensor_event_t *event)
+{
+   events_t *events = &self->events;
+
+   if (events->ring_len + events->chain_num_events == EVENT_RING_SIZE) {
+      fp_warn("Event ring buffer is full, dropping the oldest event");
+      events->ring_head = (events->ring_head + 1) % EVENT_RING_SIZE;
+      if (events->ring_len > 0) {
+         events->ring_len -= 1;
+      } else {
+         events->chain_num_events -= 1;
+      }
+   }
+   const guint pos =
+       (events->ring_head + events->ring_len + events->chain_num_events) %
+       EVENT_RING_SIZE;
+   events->ring[pos] = *event;
+   events->chain_num_events += 1;
+   events->chain_event_mask |= 1U << event->type;
+}
+
+/* makes the events of the current chain available to events_consume */
+static void event_ring_commit(FpiDeviceSynaTudorMoc *self)
+{
+   events_t *events = &self->events;
+
+   fp_dbg("Read %u events in %u event reads, event mask: 0b%b",
+          events->chain_num_events, events->chain_num_reads,
+          events->chain_event_mask);
+
+   events->ring_len += events->chain_num_events;
+   events->capture_num_reads += events->chain_num_reads;
+   events->chain_num_events = 0;
+   events->chain_num_reads = 0;
+   events->chain_event_mask = 0;
+}
+
+/* drops events of a chain which did not finish */
+static void event_ring_discard_chain(FpiDeviceSynaTudorMoc *self)
+{
+   self->events.chain_num_events = 0;
+   self->events.chain_num_reads = 0;
+   self->events.chain_event_mask = 0;
+}
+
+/* removes all read events from the ring buffer and returns their mask
+ * - the data of the last event of each type is kept in events.last_events */
+guint32 events_consume(FpiDeviceSynaTudorMoc *self)
+{
+   events_t *events = &self->events;
+   guint32 event_mask = 0;
+
+   while (events->ring_len > 0) {
+      const sensor_event_t *event = &events->ring[events->ring_head];
+      event_mask |= 1U << event->type;
+      events->last_events[event->type] = *event;
+      events->ring_head = (events->ring_head + 1) % EVENT_RING_SIZE;
+      events->ring_len -= 1;
+   }
+   return event_mask;
+}
+
+/* drops events left over from previous captures and starts counting event
+ * reads */
+void events_capture_start(FpiDeviceSynaTudorMoc *self)
+{
+   events_consume(self);
+   self->events.capture_num_reads = 0;
+}
+
+void events_capture_end(FpiDeviceSynaTudorMoc *self)
+{
+   events_t *events = &self->events;
+
+   events->num_captures += 1;
+   events->total_num_reads += events->capture_num_reads;
+   events->max_num_reads_per_capture =
+       MAX(events->max_num_reads_per_capture, events->capture_num_reads);
+
+   fp_info("Capture needed %u event reads (%u reads in %u captures, at most "
+           "%u per capture)",
+           events->capture_num_reads, events->total_num_reads,
+           events->num_captures, events->max_num_reads_per_capture);
+}
+
 /* VCSFW_CMD_EVENT_READ ==================================================== */
 
 static void recv_event_read(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
@@ -1202,6 +1754,8 @@ static void recv_event_read(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
    }
    g_assert(recv_data != NULL);
 
+   self->events.chain_num_reads += 1;
+
    gboolean read_ok = TRUE;
    FpiByteReader reader;
    fpi_byte_reader_init(&reader, recv_data, recv_size);
@@ -1231,16 +1785,20 @@ static void recv_event_read(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
    fp_dbg("Received num_events: %d, num_pending_events: %d", recv_num_events,
           recv_num_pending_events);
 
-   /* read event types */
-   self->parsed_recv_data.read_event_mask = 0;
+   /* read event records */
    for (int i = 0; i < recv_num_events && read_ok; ++i) {
-      guint8 event;
-      read_ok &= fpi_byte_reader_get_uint8(&reader, &event);
-      if (read_ok) {
-         self->parsed_recv_data.read_event_mask |= 1 << event;
+      sensor_event_t event;
+      const guint8 *event_data = NULL;
+      read_ok &= fpi_byte_reader_get_uint8(&reader, &event.type);
+      /* the meaning of the data is unknown, but keep it */
+      read_ok &=
+          fpi_byte_reader_get_data(&reader, EVENT_DATA_SIZE, &event_data);
+      if (read_ok && event.type >= G_N_ELEMENTS(self->events.last_events)) {
+         fp_warn("Ignoring event with unknown type %u", event.type);
+      } else if (read_ok) {
+         memcpy(event.data, event_data, EVENT_DATA_SIZE);
+         event_ring_push(self, &event);
       }
-      /* skip over unknown stuff */
-      read_ok &= fpi_byte_reader_skip(&reader, 11);
    }
    READ_OK_CHECK_ASYNC(self->task_ssm, read_ok);
 
@@ -1262,11 +1820,11 @@ static void recv_event_read(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
       send_event_read(self);
       return;
    }
+   event_ring_commit(self);
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
+      event_ring_discard_chain(self);
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
       fpi_ssm_next_state(self->task_ssm);
@@ -1275,13 +1833,17 @@ error:
 
 void send_event_read(FpiDeviceSynaTudorMoc *self)
 {
-   const guint16 max_num_events_in_resp = 32;
+   /* always ask for as many events as fit into one reply to keep the number
+    * of reads low when many events are pending */
+   const guint16 max_num_events_in_resp = EVENT_READ_MAX_EVENTS;
 
    const guint send_size = self->events.read_in_legacy_mode ? 5 : 9;
-   const guint expected_recv_size = 6 + 12 * max_num_events_in_resp;
+   const guint expected_recv_size =
+       EVENT_READ_HEADER_SIZE + EVENT_READ_RECORD_SIZE * max_num_events_in_resp;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    fpi_byte_writer_put_uint8(&writer, VCSFW_CMD_EVENT_READ);       // +0
@@ -1292,7 +1854,6 @@ void send_event_read(FpiDeviceSynaTudorMoc *self)
    }
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
    /* do not check status as some statuses indicate that legacy reading mode
     * should be used */
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
@@ -1385,17 +1946,20 @@ static void recv_db2_info(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
 
    fp_dbg_db2_info(&db2_info);
 
+   self->storage.partition_version = db2_info.partition_version;
    self->storage.num_current_users = db2_info.num_current_users;
    self->storage.num_current_templates = db2_info.num_current_templates;
    self->storage.num_current_payloads = db2_info.num_current_payloads;
+   self->storage.num_deleted_users = db2_info.num_deleted_users;
+   self->storage.num_deleted_templates = db2_info.num_deleted_templates;
+   self->storage.num_deleted_payloads = db2_info.num_deleted_payloads;
+   self->storage.payload_object_slot_size = db2_info.payload_object_slot_size;
 
    self->parsed_recv_data.cleanup_required =
        db2_info.num_deleted_users != 0 &&
        db2_info.num_available_user_slots == 0;
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -1403,15 +1967,16 @@ error:
    }
 }
 
-/* prints DB2 info on debug output and stores numbers of current users,
- * templates and payloads */
+/* prints DB2 info on debug output and stores the partition version and numbers
+ * of current and deleted users, templates and payloads */
 void send_db2_info(FpiDeviceSynaTudorMoc *self)
 {
    const guint send_size = 2;
    const guint expected_recv_size = 64;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &=
@@ -1419,8 +1984,6 @@ void send_db2_info(FpiDeviceSynaTudorMoc *self)
    written &= fpi_byte_writer_put_uint8(&writer, 1);                  // +1
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_db2_info);
 }
@@ -1451,8 +2014,6 @@ static void recv_db2_format(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
           new_partition_version);
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -1467,8 +2028,9 @@ void send_db2_format(FpiDeviceSynaTudorMoc *self)
    const guint send_size = 12;
    const guint expected_recv_size = 8;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &= fpi_byte_writer_put_uint8(&writer, VCSFW_CMD_DB2_FORMAT); // +0
@@ -1476,8 +2038,6 @@ void send_db2_format(FpiDeviceSynaTudorMoc *self)
    written &= fpi_byte_writer_fill(&writer, 0, send_size - 2);
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_db2_format);
 }
@@ -1509,8 +2069,6 @@ static void recv_db2_cleanup(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
    fp_dbg("\tNew partition version: %u", new_partition_version);
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -1527,16 +2085,15 @@ void send_db2_cleanup(FpiDeviceSynaTudorMoc *self)
    const guint send_size = 2;
    const guint expected_recv_size = 8;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &= fpi_byte_writer_put_uint8(&writer, VCSFW_CMD_DB2_CLEANUP); // +0
    written &= fpi_byte_writer_put_uint32_le(&writer, unused_param);      // +1
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_db2_cleanup);
 }
@@ -1571,8 +2128,6 @@ static void recv_db2_delete_object(FpiDeviceSynaTudorMoc *self,
           num_deleted_objects);
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -1586,8 +2141,9 @@ void send_db2_delete_object(FpiDeviceSynaTudorMoc *self,
    const guint send_size = 21;
    const guint expected_recv_size = 4;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &=
@@ -1597,8 +2153,6 @@ void send_db2_delete_object(FpiDeviceSynaTudorMoc *self,
                                        DB2_ID_SIZE); // +5
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    fp_dbg("Sending delete object of type: %d with ID:", obj_type);
    fp_dbg_large_hex((guint8 *)obj_id, DB2_ID_SIZE);
 
@@ -1662,8 +2216,6 @@ static void recv_db2_get_object_list(FpiDeviceSynaTudorMoc *self,
    fp_dbg_object_list(db2_obj_list);
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -1683,8 +2235,9 @@ void send_db2_get_object_list(FpiDeviceSynaTudorMoc *self,
           obj_type);
    fp_dbg_large_hex(obj_id, DB2_ID_SIZE);
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &=
@@ -1693,8 +2246,6 @@ void send_db2_get_object_list(FpiDeviceSynaTudorMoc *self,
    written &= fpi_byte_writer_put_data(&writer, obj_id, DB2_ID_SIZE);     // +5
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_db2_get_object_list);
 }
@@ -1716,13 +2267,13 @@ static void recv_db2_get_object_info(FpiDeviceSynaTudorMoc *self,
    fp_dbg("Received object info:");
    fp_dbg_large_hex(recv_data, recv_size);
 
-   raw_resp->data = recv_data;
+   /* the receive buffer is reused by the next command */
+   raw_resp->data = g_memdup2(recv_data, recv_size);
    raw_resp->size = recv_size;
 
 error:
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
-      g_free(recv_data);
    } else {
       fpi_ssm_next_state(self->task_ssm);
    }
@@ -1734,8 +2285,9 @@ void send_db2_get_object_info(FpiDeviceSynaTudorMoc *self,
    const guint send_size = 21;
    const guint expected_recv_size = obj_type == OBJ_TYPE_USERS ? 12 : 52;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &= fpi_byte_writer_put_uint8(&writer,
@@ -1744,8 +2296,6 @@ void send_db2_get_object_info(FpiDeviceSynaTudorMoc *self,
    written &= fpi_byte_writer_put_data(&writer, obj_id, DB2_ID_SIZE);   // +5
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    fp_dbg("Getting object info for object of type: %u with id:", obj_type);
    fp_dbg_large_hex(obj_id, DB2_ID_SIZE);
 
@@ -1755,19 +2305,15 @@ void send_db2_get_object_info(FpiDeviceSynaTudorMoc *self,
 
 /* VCSFW_CMD_GET_OBJECT_DATA =============================================== */
 
-static void recv_db2_get_object_data(FpiDeviceSynaTudorMoc *self,
-                                     guint8 *recv_data, gsize recv_size,
-                                     GError *error)
+static gboolean parse_db2_object_data(db2_obj_data_t *obj_data,
+                                      guint8 *recv_data, gsize recv_size)
 {
-   if (error != NULL) {
-      goto error;
-   }
-   g_assert(recv_data != NULL);
-
-   db2_obj_data_t *obj_data = &self->parsed_recv_data.db2_obj_data;
    FpiByteReader reader;
    fpi_byte_reader_init(&reader, recv_data, recv_size);
 
+   obj_data->size = 0;
+   obj_data->data = NULL;
+
    gboolean read_ok = TRUE;
    /* no need to read status again */
    read_ok &= fpi_byte_reader_skip(&reader, SENSOR_FW_REPLY_STATUS_HEADER_LEN);
@@ -1778,11 +2324,23 @@ static void recv_db2_get_object_data(FpiDeviceSynaTudorMoc *self,
    read_ok &=
        fpi_byte_reader_dup_data(&reader, obj_data->size, &obj_data->data);
 
+   return read_ok;
+}
+
+static void recv_db2_get_object_data(FpiDeviceSynaTudorMoc *self,
+                                     guint8 *recv_data, gsize recv_size,
+                                     GError *error)
+{
+   if (error != NULL) {
+      goto error;
+   }
+   g_assert(recv_data != NULL);
+
+   gboolean read_ok = parse_db2_object_data(
+       &self->parsed_recv_data.db2_obj_data, recv_data, recv_size);
    READ_OK_CHECK_ASYNC(self->task_ssm, read_ok);
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -1790,9 +2348,42 @@ error:
    }
 }
 
-void send_db2_get_object_data(FpiDeviceSynaTudorMoc *self,
-                              const obj_type_t obj_type, const db2_id_t obj_id,
-                              gsize obj_data_size)
+/* an object requested in bulk is requested again by itself, so an error status
+ * or a short reply is not an error here; the data is left NULL instead */
+static void recv_db2_get_object_data_in_bulk(FpiDeviceSynaTudorMoc *self,
+                                             guint8 *recv_data,
+                                             gsize recv_size, GError *error)
+{
+   if (error != NULL) {
+      fpi_ssm_mark_failed(self->task_ssm, error);
+      return;
+   }
+   g_assert(recv_data != NULL);
+
+   db2_obj_data_t *obj_data = &self->parsed_recv_data.db2_obj_data;
+   const guint16 status = FP_READ_UINT16_LE(recv_data);
+
+   if (!sensor_status_is_result_ok(status)) {
+      fp_warn("Object data requested in bulk got status: 0x%04x aka %s",
+              status, sensor_status_to_string(status));
+      obj_data->size = 0;
+      obj_data->data = NULL;
+   } else if (!parse_db2_object_data(obj_data, recv_data, recv_size)) {
+      fp_warn("Object data requested in bulk got short reply: %lu",
+              recv_size);
+      g_clear_pointer(&obj_data->data, g_free);
+      obj_data->size = 0;
+   }
+
+   fpi_ssm_next_state(self->task_ssm);
+}
+
+static void send_db2_get_object_data_full(FpiDeviceSynaTudorMoc *self,
+                                          const obj_type_t obj_type,
+                                          const db2_id_t obj_id,
+                                          gsize obj_data_size,
+                                          const gboolean check_status,
+                                          const CmdCallback callback)
 {
    g_assert(obj_data_size < 65535);
 
@@ -1806,8 +2397,9 @@ void send_db2_get_object_data(FpiDeviceSynaTudorMoc *self,
       expected_recv_size = 8 + obj_data_size;
    }
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &= fpi_byte_writer_put_uint8(&writer,
@@ -1816,10 +2408,28 @@ void send_db2_get_object_data(FpiDeviceSynaTudorMoc *self,
    written &= fpi_byte_writer_put_data(&writer, obj_id, DB2_ID_SIZE);   // +5
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
-                            TRUE, recv_db2_get_object_data);
+                            check_status, callback);
+}
+
+void send_db2_get_object_data(FpiDeviceSynaTudorMoc *self,
+                              const obj_type_t obj_type, const db2_id_t obj_id,
+                              gsize obj_data_size)
+{
+   send_db2_get_object_data_full(self, obj_type, obj_id, obj_data_size, TRUE,
+                                 recv_db2_get_object_data);
+}
+
+/* like send_db2_get_object_data, but obj_data_size is only an upper bound and
+ * on failure the task continues with NULL data, see
+ * recv_db2_get_object_data_in_bulk */
+void send_db2_get_object_data_in_bulk(FpiDeviceSynaTudorMoc *self,
+                                      const obj_type_t obj_type,
+                                      const db2_id_t obj_id,
+                                      gsize max_obj_data_size)
+{
+   send_db2_get_object_data_full(self, obj_type, obj_id, max_obj_data_size,
+                                 FALSE, recv_db2_get_object_data_in_bulk);
 }
 
 /* VCSFW_CMD_PAIR async ==================================================== */
@@ -1869,8 +2479,6 @@ static void recv_pair(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
    }
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -1886,8 +2494,9 @@ void send_pair(FpiDeviceSynaTudorMoc *self, const guint8 *send_host_cert_bytes)
    const guint expected_recv_size =
        SENSOR_FW_REPLY_STATUS_HEADER_LEN + 2 * CERTIFICATE_SIZE;
 
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, TRUE);
+   fpi_byte_writer_init_with_data(&writer, send_data, send_size, FALSE);
 
    gboolean written = TRUE;
    written &= fpi_byte_writer_put_uint8(&writer, VCSFW_CMD_PAIR); // +0
@@ -1895,35 +2504,90 @@ void send_pair(FpiDeviceSynaTudorMoc *self, const guint8 *send_host_cert_bytes)
                                        CERTIFICATE_SIZE); // +1
    CHECK_WRITER(self, self->task_ssm, &writer, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
-
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             TRUE, recv_pair);
 }
 
-/* Wait for eevnts interrupt =============================================== */
+/* Interrupt listener ======================================================
+ *
+ * While the device is open, INTERRUPT_LISTENER_TRANSFERS transfers are kept
+ * queued on USB_EP_INTERRUPT. Each of them reports the current event sequence
+ * number of the sensor, so a task which waits for events continues as soon as
+ * the sensor has new ones, even if the interrupt arrived before the task
+ * started to wait. Events read by EVENT_READ are stored to a ring buffer from
+ * which the state machines consume them. */
+
+static void interrupt_listener_submit(FpiDeviceSynaTudorMoc *self);
+
+/* returns TRUE if the last interrupt reported events which were not read
+ * - the sensor reports only 5 bits of its sequence number, so an interrupt is
+ *   considered to be older than the last read if it is more than half of the
+ *   range behind */
+static gboolean events_are_pending(FpiDeviceSynaTudorMoc *self)
+{
+   const guint16 seq_num_mask = 0x1f;
 
-static void recv_interrupt_wait_for_events(FpiUsbTransfer *transfer,
-                                           FpDevice *device, gpointer user_data,
-                                           GError *error)
+   if (!self->events.sensor_seq_num_valid) {
+      return FALSE;
+   }
+
+   const guint16 ahead =
+       (self->events.sensor_seq_num - self->events.seq_num) & seq_num_mask;
+   return ahead != 0 && ahead <= seq_num_mask / 2;
+}
+
+static void events_wake_waiter(FpiDeviceSynaTudorMoc *self, GError *error)
+{
+   FpiSsm *waiting_ssm = self->events.waiting_ssm;
+
+   if (waiting_ssm == NULL || (error == NULL && !events_are_pending(self))) {
+      g_clear_error(&error);
+      return;
+   }
+   self->events.waiting_ssm = NULL;
+
+   if (waiting_ssm != self->task_ssm) {
+      /* task has ended in the meantime */
+      g_clear_error(&error);
+   } else if (error != NULL) {
+      fpi_ssm_mark_failed(waiting_ssm, error);
+   } else {
+      fpi_ssm_next_state(waiting_ssm);
+   }
+}
+
+static void interrupt_listener_cb(FpiUsbTransfer *transfer, FpDevice *device,
+                                  gpointer user_data, GError *error)
 {
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
    const guint smallest_expected_resp_len = 7;
-   self->cmd_transfer = NULL;
+
+   /* submitted before the listener was stopped or paused */
+   if (GPOINTER_TO_UINT(user_data) != self->events.listener_generation) {
+      g_clear_error(&error);
+      return;
+   }
+
+   self->events.listener_transfers -= 1;
 
    if (error != NULL) {
-      FP_ERR_FANCY("Error in fpi_usb_transfer_submit: %s", error->message);
-      goto error;
+      if (!self->events.listening ||
+          g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+         g_error_free(error);
+         return;
+      }
+      FP_ERR_FANCY("Error in interrupt listener: %s", error->message);
+      /* the endpoint is not usable, so waiting would never finish */
+      self->events.listening = FALSE;
+      g_cancellable_cancel(self->interrupt_cancellable);
+      events_wake_waiter(self, error);
+      return;
    }
 
-   fp_dbg("recv_wait_for_events_interrupt");
-   fp_dbg("\traw resp:");
+#ifdef COMMUNICATION_DEBUG
+   fp_dbg("Interrupt listener received:");
    fp_dbg_large_hex(transfer->buffer, transfer->actual_length);
-
-   guint16 sensor_event_seq_num = FP_READ_UINT16_LE(&transfer->buffer[6]);
-   sensor_event_seq_num &= 0x1f;
-   fp_dbg("\tEvent sequence numbers - host: %u, sensor: %u",
-          self->events.seq_num, sensor_event_seq_num);
+#endif
 
    if (transfer->actual_length > EVENT_BUFFER_SIZE ||
        transfer->actual_length < smallest_expected_resp_len) {
@@ -1931,39 +2595,117 @@ static void recv_interrupt_wait_for_events(FpiUsbTransfer *transfer,
               "received array: ",
               __func__, transfer->actual_length, EVENT_BUFFER_SIZE);
       fp_dbg_large_hex(transfer->buffer, transfer->actual_length);
+   } else {
+      self->events.sensor_seq_num = transfer->buffer[6] & 0x1f;
+      self->events.sensor_seq_num_valid = TRUE;
+      self->events.last_interrupt_time = g_get_monotonic_time();
+      fp_dbg("\tEvent sequence numbers - host: %u, sensor: %u",
+             self->events.seq_num, self->events.sensor_seq_num);
    }
 
-   if (sensor_event_seq_num != self->events.seq_num) {
-      memcpy(self->parsed_recv_data.event_buffer, transfer->buffer,
-             transfer->actual_length);
+   /* keep the number of queued transfers */
+   interrupt_listener_submit(self);
+   events_wake_waiter(self, NULL);
+}
 
-      fpi_ssm_next_state(self->task_ssm);
-   } else {
-      send_interrupt_wait_for_events(self);
+static void interrupt_listener_submit(FpiDeviceSynaTudorMoc *self)
+{
+   FpiUsbTransfer *transfer = fpi_usb_transfer_new(FP_DEVICE(self));
+
+   transfer->short_is_error = FALSE;
+   fpi_usb_transfer_fill_bulk(transfer, USB_EP_INTERRUPT, EVENT_BUFFER_SIZE);
+   self->events.listener_transfers += 1;
+   /* no timeout, the transfers are cancelled on close */
+   syna_usb_transfer_submit(
+       transfer, 0, self->interrupt_cancellable, interrupt_listener_cb,
+       GUINT_TO_POINTER(self->events.listener_generation));
+}
+
+void interrupt_listener_start(FpiDeviceSynaTudorMoc *self)
+{
+   g_assert(!self->events.listening);
+
+   self->events.listening = TRUE;
+   self->events.sensor_seq_num_valid = FALSE;
+   while (self->events.listener_transfers < INTERRUPT_LISTENER_TRANSFERS) {
+      interrupt_listener_submit(self);
    }
+}
 
-   return;
+/* the queued transfers complete later, but they are not counted anymore */
+static void interrupt_listener_drop_transfers(FpiDeviceSynaTudorMoc *self)
+{
+   self->events.listener_generation += 1;
+   self->events.listener_transfers = 0;
+}
 
-error:
-   fpi_ssm_mark_failed(self->task_ssm, error);
+void interrupt_listener_stop(FpiDeviceSynaTudorMoc *self)
+{
+   self->events.listening = FALSE;
+   interrupt_listener_drop_transfers(self);
+   self->events.waiting_ssm = NULL;
+   g_cancellable_cancel(self->interrupt_cancellable);
 }
 
+/* stops the transfers, but keeps the task which waits for events, so that it
+ * continues once the listener is started again */
+void interrupt_listener_pause(FpiDeviceSynaTudorMoc *self)
+{
+   self->events.listening = FALSE;
+   interrupt_listener_drop_transfers(self);
+   g_cancellable_cancel(self->interrupt_cancellable);
+   g_clear_object(&self->interrupt_cancellable);
+   self->interrupt_cancellable = g_cancellable_new();
+}
+
+/* continues the task as soon as the sensor has events to read */
 void send_interrupt_wait_for_events(FpiDeviceSynaTudorMoc *self)
 {
-   const guint8 recv_size = 7;
-   g_assert(EVENT_BUFFER_SIZE >= recv_size);
+   if (g_cancellable_is_cancelled(fpi_device_get_cancellable(FP_DEVICE(self)))) {
+      fpi_ssm_mark_failed(self->task_ssm,
+                          g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                              "Cancelled"));
+      return;
+   }
+
+   /* the listener is started again on resume */
+   if (!self->events.listening && !self->suspended) {
+      fpi_ssm_mark_failed(self->task_ssm,
+                          set_and_report_error(FP_DEVICE_ERROR_GENERAL,
+                                               "Interrupt listener is not "
+                                               "running"));
+      return;
+   }
+
+   if (events_are_pending(self)) {
+      fpi_ssm_next_state(self->task_ssm);
+      return;
+   }
 
    fp_info("Waiting for sensor to have events");
+   self->events.waiting_ssm = self->task_ssm;
+}
 
-   /* receive data */
-   g_assert(self->cmd_transfer == NULL);
-   self->cmd_transfer = fpi_usb_transfer_new(FP_DEVICE(self));
-   self->cmd_transfer->short_is_error = FALSE;
-   fpi_usb_transfer_fill_bulk(self->cmd_transfer, USB_EP_INTERRUPT,
-                              EVENT_BUFFER_SIZE);
-   fpi_usb_transfer_submit(self->cmd_transfer, USB_INTERRUPT_TIMEOUT_MS,
-                           self->interrupt_cancellable,
-                           recv_interrupt_wait_for_events, NULL);
+/* fails a task which waits for events */
+void events_cancel_wait(FpiDeviceSynaTudorMoc *self)
+{
+   events_wake_waiter(self, g_error_new_literal(G_IO_ERROR,
+                                                G_IO_ERROR_CANCELLED,
+                                                "Cancelled"));
+}
+
+/* whether the task is parked waiting for events */
+gboolean events_task_is_waiting(FpiDeviceSynaTudorMoc *self)
+{
+   return self->task_ssm != NULL && self->events.waiting_ssm == self->task_ssm;
+}
+
+/* fails the task which is parked waiting for events with error, also if a
+ * cancellation has already unregistered it as the waiter */
+void events_fail_parked_task(FpiDeviceSynaTudorMoc *self, GError *error)
+{
+   self->events.waiting_ssm = NULL;
+   fpi_ssm_mark_failed(self->task_ssm, error);
 }
 
 /* ========================================================================= */
@@ -2002,8 +2744,6 @@ static void recv_get_version_tls_force_close(FpiDeviceSynaTudorMoc *self,
    }
 
 error:
-   g_free(recv_data);
-
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else {
@@ -2019,7 +2759,7 @@ void send_cmd_to_force_close_sensor_tls_session(FpiDeviceSynaTudorMoc *self)
    const guint send_size = 1;
    /* we may get a TLS alert message, so increase the recv_size accordingly */
    const guint expected_recv_size = 38 + WRAP_RESPONSE_ADDITIONAL_SIZE;
-   guint8 *send_data = g_malloc(send_size);
+   guint8 *send_data = cmd_arena_get_send_buffer(self, send_size);
    send_data[0] = VCSFW_CMD_GET_VERSION;
 
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
@@ -2044,8 +2784,8 @@ static void write_dft(FpiDeviceSynaTudorMoc *self, const guint8 *data,
    transfer->short_is_error = FALSE;
    memcpy(transfer->buffer, data, data_size);
 
-   fpi_usb_transfer_submit(transfer, USB_TRANSFER_TIMEOUT_MS, NULL, callback,
-                           NULL);
+   syna_usb_transfer_submit(transfer, USB_TRANSFER_TIMEOUT_MS, NULL,
+                            callback, NULL);
 }
 
 gboolean sensor_is_in_bootloader_mode(FpiDeviceSynaTudorMoc *self)
@@ -2063,9 +2803,12 @@ static void reset_usb_device_on_callback(FpiUsbTransfer *transfer,
       goto error;
    }
 
-   g_usb_device_reset(fpi_device_get_usb_device(device), &error);
-   if (error != NULL) {
-      goto error;
+   /* the emulated sensor does not enter bootloader mode */
+   if (self->emulator == NULL) {
+      g_usb_device_reset(fpi_device_get_usb_device(device), &error);
+      if (error != NULL) {
+         goto error;
+      }
    }
 
    fpi_ssm_next_state(self->task_ssm);
@@ -24,6 +24,7 @@
 #pragma once
 
 #include "device.h"
+#include "fpi-usb-transfer.h"
 #include <glib.h>
 
 /* Response statuses ======================================================= */
@@ -78,6 +79,11 @@
 
 #define MATCH_STATS_SIZE 36
 
+/* maximum number of events which the sensor returns in one EVENT_READ */
+#define EVENT_READ_MAX_EVENTS 32
+#define EVENT_READ_HEADER_SIZE 6
+#define EVENT_READ_RECORD_SIZE (1 + EVENT_DATA_SIZE)
+
 #define WRAP_RESPONSE_ADDITIONAL_SIZE 0x45
 #define SENSOR_FW_CMD_HEADER_LEN 1
 #define SENSOR_FW_REPLY_STATUS_HEADER_LEN 2
@@ -181,6 +187,18 @@ typedef struct {
 
 /* Functions =============================================================== */
 
+const char *cmd_id_to_str(guint8 cmd_id);
+
+/* submit functions which pass the transfer to the emulator if the device uses
+ * one and to fpi_usb_transfer_submit(_sync) otherwise */
+void syna_usb_transfer_submit(FpiUsbTransfer *transfer, guint timeout_ms,
+                              GCancellable *cancellable,
+                              FpiUsbTransferCallback callback,
+                              gpointer user_data);
+
+gboolean syna_usb_transfer_submit_sync(FpiUsbTransfer *transfer,
+                                       guint timeout_ms, GError **error);
+
 void send_get_version(FpiDeviceSynaTudorMoc *self);
 
 void send_frame_acq(FpiDeviceSynaTudorMoc *self, capture_flags_t frame_flags);
@@ -207,6 +225,17 @@ void send_event_config(FpiDeviceSynaTudorMoc *self, guint32 event_mask);
 
 void send_event_read(FpiDeviceSynaTudorMoc *self);
 
+guint8 *cmd_arena_get_send_buffer(FpiDeviceSynaTudorMoc *self,
+                                  const gsize send_size);
+
+void cmd_arena_free(FpiDeviceSynaTudorMoc *self);
+
+gboolean cmd_queue_is_idle(FpiDeviceSynaTudorMoc *self);
+
+void cmd_queue_batch_begin(FpiDeviceSynaTudorMoc *self);
+
+guint cmd_queue_batch_end(FpiDeviceSynaTudorMoc *self);
+
 void synaptics_secure_connect(FpiDeviceSynaTudorMoc *self, guint8 *send_data,
                               gsize send_size, gsize expected_recv_size,
                               gboolean check_status, CmdCallback callback);
@@ -230,10 +259,37 @@ void send_db2_get_object_data(FpiDeviceSynaTudorMoc *self,
                               const obj_type_t obj_type, const db2_id_t obj_id,
                               gsize obj_data_size);
 
+void send_db2_get_object_data_in_bulk(FpiDeviceSynaTudorMoc *self,
+                                      const obj_type_t obj_type,
+                                      const db2_id_t obj_id,
+                                      gsize max_obj_data_size);
+
 void send_pair(FpiDeviceSynaTudorMoc *self, const guint8 *host_cert_bytes);
 
 void send_interrupt_wait_for_events(FpiDeviceSynaTudorMoc *self);
 
+void cmd_trace_dump(FpiDeviceSynaTudorMoc *self);
+
+void cmd_trace_clear(FpiDeviceSynaTudorMoc *self);
+
+void interrupt_listener_start(FpiDeviceSynaTudorMoc *self);
+
+void interrupt_listener_stop(FpiDeviceSynaTudorMoc *self);
+
+void interrupt_listener_pause(FpiDeviceSynaTudorMoc *self);
+
+void events_cancel_wait(FpiDeviceSynaTudorMoc *self);
+
+gboolean events_task_is_waiting(FpiDeviceSynaTudorMoc *self);
+
+void events_fail_parked_task(FpiDeviceSynaTudorMoc *self, GError *error);
+
+guint32 events_consume(FpiDeviceSynaTudorMoc *self);
+
+void events_capture_start(FpiDeviceSynaTudorMoc *self);
+
+void events_capture_end(FpiDeviceSynaTudorMoc *self);
+
 gboolean serialize_enrollment_data(FpiDeviceSynaTudorMoc *self,
                                    enrollment_t *enrollment,
                                    guint8 **serialized, gsize *serialized_size,
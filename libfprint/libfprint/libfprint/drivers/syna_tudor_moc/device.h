@@ -23,15 +23,19 @@
 
 #pragma once
 
+#include "../synatls.h"
+#include <config.h>
 #include "fpi-device.h"
 #include "fpi-ssm.h"
 #include <glib.h>
+#include <gnutls/crypto.h>
 #include <gnutls/gnutls.h>
 
-G_DECLARE_FINAL_TYPE(FpiDeviceSynaTudorMoc, fpi_device_synaptics_moc, FPI,
+G_DECLARE_FINAL_TYPE(FpiDeviceSynaTudorMoc, fpi_device_syna_tudor_moc, FPI,
                      DEVICE_SYNA_TUDOR_MOC, FpDevice)
 
 #define SESSION_ID_LEN 7
+#define MASTER_SECRET_SIZE 48
 #define CERTIFICATE_KEY_SIZE 68
 #define SIGNATURE_SIZE 256
 #define PROVISION_STATE_PROVISIONED 3
@@ -40,6 +44,12 @@ G_DECLARE_FINAL_TYPE(FpiDeviceSynaTudorMoc, fpi_device_synaptics_moc, FPI,
 #define DB2_ID_SIZE 16
 
 #define EVENT_BUFFER_SIZE 8
+/* size of the data which follows the event type in an EVENT_READ record */
+#define EVENT_DATA_SIZE 11
+/* number of events which can be read and not consumed yet */
+#define EVENT_RING_SIZE 64
+/* number of transfers kept queued on the interrupt endpoint */
+#define INTERRUPT_LISTENER_TRANSFERS 2
 
 typedef enum {
    OBJ_TYPE_USERS = 1,
@@ -115,12 +125,22 @@ typedef struct {
    gboolean usb_device_claimed;
    gboolean tried_to_close_tls_session;
 
+   /* for timing of full vs. resumed TLS handshake */
+   gint64 open_start_time;
+   gint64 handshake_start_time;
+
+   /* both sides were still in the TLS session, so no handshake was needed */
+   gboolean tls_session_kept;
+   /* the resumed handshake failed and the open is retried with a full one */
+   gboolean resume_failed;
 } open_ssm_data_t;
 
 typedef struct {
    enrollment_t match_enrollment;
    enroll_stats_t enroll_stats;
    guint32 event_mask_to_read;
+   /* number of following states whose commands were queued in a batch */
+   guint cmds_queued_ahead;
    GError *error;
 } enroll_ssm_data_t;
 
@@ -129,9 +149,24 @@ typedef struct {
    gboolean matched;
    enrollment_t match_enrollment;
    guint32 event_mask_to_read;
+   /* number of following states whose commands were queued in a batch */
+   guint cmds_queued_ahead;
+   gint64 start_time;
+   /* time of the interrupt after which the finger was detected */
+   gint64 finger_down_time;
+   /* send identify together with image metrics without waiting for them */
+   gboolean pipeline_identify;
+   /* send identify first and get image metrics only on match failure */
+   gboolean identify_first;
+   guint low_quality_captures;
+   /* TRUE if the capture should be reported as FP_DEVICE_RETRY */
+   gboolean low_quality;
 
    gboolean verify_template_id_present;
    db2_id_t verify_template_id;
+   /* template IDs of prints to identify against */
+   GArray *identify_template_ids;
+   GHashTable *identify_prints; /* GBytes template ID -> FpPrint */
 } auth_ssm_data_t;
 
 typedef struct {
@@ -140,7 +175,17 @@ typedef struct {
    guint current_template_id_idx;
 
    GArray *payload_id_list;
+   /* payloads which are not in the template index cache */
+   GArray *missing_payload_id_list;
    guint current_payload_id_idx;
+   /* payloads for the new template index cache */
+   GHashTable *payloads;
+   gboolean cleanup_done;
+   /* payload data is fetched in a batch, see list_can_fetch_in_bulk */
+   gboolean bulk_fetch;
+   guint cmds_queued_ahead;
+   /* replies of the last batch which were not stored yet */
+   guint bulk_replies_left;
 
    GPtrArray *fp_print_array;
 } list_ssm_data_t;
@@ -151,8 +196,24 @@ typedef struct {
 
 /* ========================================================================= */
 
+/* source of the random numbers, the time and the keys sent to the sensor, see
+ * random_provider_init_from_env */
+typedef struct random_provider {
+   gboolean (*fill)(struct random_provider *provider, guint8 *data, gsize size,
+                    GError **error);
+   guint32 (*unix_time)(struct random_provider *provider);
+   gboolean (*generate_key)(struct random_provider *provider,
+                            gnutls_privkey_t privkey, GError **error);
+   /* set for seeded providers: ECDSA signatures are deterministic (RFC 6979)
+    * and the record nonces are the sequence numbers */
+   gboolean reproducible;
+   GRand *rand;
+} random_provider_t;
+
 typedef struct {
    gboolean established;
+   /* TRUE if the sensor accepted the cached session in server hello */
+   gboolean resumed;
    guint8 session_id[SESSION_ID_LEN];
 
    guint8 version_major;
@@ -166,35 +227,51 @@ typedef struct {
    guint8 server_random[32]; /* note: the first 4 bytes are time */
    guint8 derive_input[32 * 2];
    gnutls_datum_t master_secret;
-   gnutls_datum_t encryption_key;
-   gnutls_datum_t decryption_key;
-   gnutls_datum_t encryption_iv;
-   gnutls_datum_t decryption_iv;
-   guint tag_size;
-
-   guint64 encrypt_seq_num;
-   guint64 decrypt_seq_num;
+   /* cipher contexts are created together with the keys and reused for every
+    * record until the session is closed */
+   SynaTlsRecordLayer record_layer;
 
    tls_certificate_type_t requested_cert;
-   gnutls_cipher_algorithm_t cipher_alg;
    gboolean remote_sends_encrypted;
 
    tls_handshake_state_t handshake_state;
    guint alert_level;
    guint alert_desc;
 
-   /* for hashing */
-   guint8 *sent_handshake_msgs;
-   gsize sent_handshake_msgs_size;
-   gsize sent_handshake_msgs_alloc_size;
+   /* running digest of the handshake messages, cloned whenever the
+    * CertificateVerify or a Finished message needs it */
+   SynaTlsTranscript transcript;
 } tls_t;
 
+/* session from the last full handshake, which can be resumed with an
+ * abbreviated handshake on next open */
+typedef struct {
+   gboolean present;
+   guint8 session_id[SESSION_ID_LEN];
+   guint8 master_secret[MASTER_SECRET_SIZE];
+} tls_session_cache_t;
+
 typedef struct {
+   guint32 partition_version;
    guint16 num_current_users;
    guint16 num_current_templates;
    guint16 num_current_payloads;
+   guint16 num_deleted_users;
+   guint16 num_deleted_templates;
+   guint16 num_deleted_payloads;
+   /* upper bound of the size of a payload object, not part of the state */
+   guint16 payload_object_slot_size;
 } storage_t;
 
+/* host-side copy of the payloads listed by list, which is valid as long as the
+ * DB2 info reported by the sensor is the same as when it was created */
+typedef struct {
+   gboolean valid;
+   storage_t storage;
+   GArray *payload_ids;  /* db2_id_t in the order reported by the sensor */
+   GHashTable *payloads; /* GBytes payload ID -> GBytes payload data */
+} template_index_cache_t;
+
 #pragma pack(push, 1)
 typedef struct {
    guint16 magic;
@@ -239,30 +316,150 @@ typedef struct {
 
    gboolean private_key_initialized;
    gnutls_privkey_t private_key;
+
+   /* entry of the process-wide pairing cache which owns private_key when the
+    * pairing data were loaded from the persistent storage */
+   struct pairing_cache_entry *cache_entry;
 } pairing_data_t;
 
+typedef struct {
+   guint8 type;
+   guint8 data[EVENT_DATA_SIZE];
+} sensor_event_t;
+
 typedef struct {
    guint16 seq_num;     /* current host event sequence number */
    guint16 num_pending; /* number of pending events which are unread */
    gboolean read_in_legacy_mode;
+
+   /* sequence number from the last interrupt */
+   guint16 sensor_seq_num;
+   gboolean sensor_seq_num_valid;
+   gint64 last_interrupt_time;
+
+   /* read events which were not consumed yet */
+   sensor_event_t ring[EVENT_RING_SIZE];
+   guint ring_head;
+   guint ring_len;
+   /* last consumed event of each type, indexed by event type */
+   sensor_event_t last_events[32];
+
+   /* events read by the current chain of EVENT_READ commands, they are added
+    * to the ring buffer at once when no more events are pending */
+   guint chain_num_events;
+   guint chain_num_reads;
+   guint32 chain_event_mask;
+
+   /* number of EVENT_READ commands needed per capture */
+   guint capture_num_reads;
+   guint num_captures;
+   guint total_num_reads;
+   guint max_num_reads_per_capture;
+
+   gboolean listening;
+   /* queued transfers of the current generation, the generation changes when
+    * the listener is stopped or paused, so that transfers which were
+    * cancelled but did not complete yet are not counted */
+   guint listener_generation;
+   guint listener_transfers;
+   /* task which waits for the sensor to have events */
+   FpiSsm *waiting_ssm;
 } events_t;
 
 typedef void (*CmdCallback)(FpiDeviceSynaTudorMoc *self, guint8 *recv_data,
                             gsize recv_size, GError *error);
 
+/* buffer of the send arena holding one queued command */
 typedef struct {
+   guint8 *buf;
+   gsize size;
+   gboolean in_use;
+} cmd_arena_slot_t;
+
+/* per-device buffers of the command path
+ * - commands are serialized directly at TLS_RECORD_PTEXT_OFFSET of a send
+ *   slot, wrapped in place and submitted without a copy; there is a slot for
+ *   each queued command
+ * - responses are received to one of two receive buffers and unwrapped in
+ *   place, so the data passed to a CmdCallback are valid only until the
+ *   callback returns */
+typedef struct {
+   GPtrArray *send_slots;
+   /* slot returned by cmd_arena_get_send_buffer, which was not queued yet */
+   cmd_arena_slot_t *reserved_slot;
+   guint8 *recv_buf[2];
+   gsize recv_buf_size[2];
+   guint next_recv_buf;
+} cmd_arena_t;
+
+/* timing of one command through the queue, for finding where the time of a
+ * task goes; times are monotonic in us and 0 for steps which did not happen */
+typedef struct {
+   guint8 cmd_id;
+   gboolean failed;
+   gint64 queued_time;  /* serialized and queued */
+   gint64 wrapped_time; /* TLS record created */
+   gint64 submit_time;  /* request transfer submitted */
+   gint64 reply_time;   /* reply transfer finished */
+   gint64 unwrap_time;  /* TLS record of the reply decrypted */
+   gint64 handled_time; /* reply processed by the task */
+   guint32 send_size;
+   guint32 wrapped_size;
+   guint32 recv_size;
+   guint32 unwrapped_size;
+} cmd_trace_entry_t;
+
+#define CMD_TRACE_SIZE 128
+
+/* ring buffer of the last CMD_TRACE_SIZE finished commands */
+typedef struct {
+   cmd_trace_entry_t entries[CMD_TRACE_SIZE];
+   guint head;
+   guint len;
+} cmd_trace_t;
+
+typedef struct {
+   cmd_arena_slot_t *slot;
    guint8 *send_data;
    gsize send_size;
+   /* TRUE if the command was already wrapped in its slot */
+   gboolean wrapped;
+   guint8 *wrapped_data;
+   gsize wrapped_size;
 
    guint8 *recv_data;
    gsize recv_size;
    gsize expected_recv_size;
 
    gboolean check_status;
+   /* queued in a batch - may be sent as soon as the reply to the previous
+    * command has an OK status */
+   gboolean pipelined;
    guint8 cmd_id;
 
+   /* task which queued the command - replies are dropped if it has ended */
+   FpiSsm *task_ssm;
+   cmd_trace_entry_t trace;
+   /* request and reply transfers which have not finished yet */
+   guint transfers_left;
+   GCancellable *cancellable;
+   GError *send_error;
+
    CmdCallback callback;
-} cmd_ssm_data_t;
+} queued_cmd_t;
+
+typedef struct {
+   GQueue pending;          /* commands which were not sent yet */
+   queued_cmd_t *in_flight; /* command which waits for its reply */
+   /* commands queued while a reply is processed precede the pending ones */
+   gboolean handling_reply;
+   guint insert_pos;
+   /* the queue is being processed and is kicked when it is done */
+   gboolean processing;
+   gboolean batching;
+   guint batch_cnt;
+   gboolean in_critical_section;
+} cmd_queue_t;
 
 typedef enum {
    OPEN_STATE_GET_REMOTE_TLS_STATUS,
@@ -328,8 +525,6 @@ typedef union {
    img_metrics_t img_metrics;
    db2_obj_list_t db2_obj_list;
    db2_obj_data_t db2_obj_data;
-   guint32 read_event_mask;
-   guint8 event_buffer[EVENT_BUFFER_SIZE];
    raw_resp_t raw_resp;
    gboolean cleanup_required;
    gboolean sensor_is_in_tls_session;
@@ -348,6 +543,9 @@ typedef struct {
    capture_flags_t last_capture_flags;
 } frame_acq_config_t;
 
+/* emulated sensor, see emulator.c */
+typedef struct emulator emulator_t;
+
 struct _FpiDeviceSynaTudorMoc {
    FpDevice parent;
 
@@ -355,9 +553,18 @@ struct _FpiDeviceSynaTudorMoc {
 
    FpiSsm *task_ssm;
    FpiSsm *subtask_ssm;
-   FpiSsm *cmd_ssm;
-   /* stores everything needed for sending/receiving of a command to sensor */
+   /* task which was running at suspend while the TLS session is checked on
+    * resume */
+   FpiSsm *suspended_task_ssm;
+   gboolean suspended;
+   /* queue of commands to the sensor */
+   cmd_queue_t cmd_queue;
+   /* used for transfers which are not part of the command queue */
    FpiUsbTransfer *cmd_transfer;
+   cmd_arena_t cmd_arena;
+   cmd_trace_t cmd_trace;
+   /* counted by syna_usb_transfer_submit(_sync), reset when an action starts */
+   guint usb_round_trips;
    /* stores parsed data received from sending a command if response cannot be
     * stored to self (e.g. not mis_version)*/
    parsed_recv_data parsed_recv_data;
@@ -366,6 +573,17 @@ struct _FpiDeviceSynaTudorMoc {
    mis_version_t mis_version;
    pairing_data_t pairing_data;
    tls_t tls;         /* TLS session things */
+   tls_session_cache_t tls_session_cache;
    storage_t storage; /* sensor storage */
+   template_index_cache_t template_index;
    events_t events;
+
+   /* properties */
+   guint img_quality_threshold;
+   gboolean identify_first;
+
+   random_provider_t random;
+   /* set if the sensor is emulated instead of using the USB device, always
+    * NULL unless built with the syna_tudor_moc_testing option */
+   emulator_t *emulator;
 };
@@ -0,0 +1,1995 @@
+/*
+ * Synaptics Tudor Match-In-Sensor driver for libfprint
+ *
+ * Copyright (c) 2024 Vojtěch Pluskal
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The emulator is only built with the syna_tudor_moc_testing option. With
+ * SYNA_TUDOR_MOC_EMULATOR_ENV set to 1, the transfers of the driver are
+ * passed to an emulated sensor instead of the USB device. The emulator
+ * implements the sensor side of the TLS session and of the commands used by
+ * the state machines and delays its replies by a configurable latency, so that
+ * the time and CPU spent in the driver itself can be measured without the
+ * hardware. Statistics are logged on device close.
+ *
+ * NOTE: the device is still probed as a USB device, so one has to be present
+ * (e.g. a umockdev device created from the descriptors of a real one), but no
+ * transfers are done on it
+ * NOTE: the emulated sensor has its own key - the sample pairing data are used
+ * with the sensor certificate replaced by the one of the emulator, which is
+ * not verified, and the stored pairing data are neither read nor written
+ * NOTE: the emulated sensor always starts a new TLS session, so resumption is
+ * refused and each open does a full handshake
+ */
+
+/* defines FP_COMPONENT, so it has to come before the logging header */
+#include "syna_tudor_moc.h"
+
+#include "communication.h"
+#include "container.h"
+#include "device.h"
+#include "emulator.h"
+#include "fpi-byte-reader.h"
+#include "fpi-byte-utils.h"
+#include "fpi-byte-writer.h"
+#include "fpi-log.h"
+#include "fpi-usb-transfer.h"
+#include "tls.h"
+#include "utils.h"
+#include <gio/gio.h>
+#include <glib.h>
+#include <gnutls/abstract.h>
+#include <gnutls/crypto.h>
+#include <gnutls/gnutls.h>
+#include <openssl/sha.h>
+#include <time.h>
+
+#define EMULATOR_NUM_CMD_IDS 256
+/* number of events which are kept for EVENT_READ */
+#define EMULATOR_EVENT_HISTORY 64
+#define EMULATOR_MAX_PRINTS 100
+#define EMULATOR_IMAGE_QUALITY 80
+#define EMULATOR_SENSOR_COVERAGE 100
+#define EMULATOR_RANDOM_SIZE 32
+/* client write key, server write key, client write IV and server write IV */
+/* status of plain commands sent while the sensor is in a TLS session */
+#define EMULATOR_STATUS_UNCLOSED_TLS_SESSION 0x315
+/* advanced security, which is needed for pairing */
+#define EMULATOR_SECURITY 0x100
+
+#define EMULATOR_EVENT_CONFIG_REPLY_SIZE 66
+#define EMULATOR_DB2_INFO_REPLY_SIZE 64
+/* largest payload which can be committed, reported in DB2 info */
+#define EMULATOR_PAYLOAD_SLOT_SIZE 4096
+#define EMULATOR_ENROLL_STATS_SIZE 60
+#define EMULATOR_OBJECT_INFO_REPLY_SIZE 52
+#define EMULATOR_OBJECT_INFO_DATA_SIZE_OFFSET 48
+#define EMULATOR_USER_INFO_REPLY_SIZE 12
+
+typedef enum {
+   EMULATOR_TLS_STATE_NONE,
+   EMULATOR_TLS_STATE_HANDSHAKE,
+   EMULATOR_TLS_STATE_ESTABLISHED,
+} emulator_tls_state_t;
+
+typedef struct {
+   db2_id_t template_id;
+   db2_id_t payload_id;
+   /* serialized container sent with ENROLL_SUBCMD_COMMIT */
+   GBytes *payload;
+} emulator_print_t;
+
+typedef struct {
+   guint count;
+   /* sum of the emulated latencies of the replies */
+   gint64 latency_us;
+} emulator_cmd_stats_t;
+
+/* reply which was not read from USB_EP_REPLY yet */
+typedef struct {
+   GBytes *data;
+   gint64 ready_time;
+} emulator_reply_t;
+
+/* transfer submitted to the emulator, which is completed from its source */
+typedef struct {
+   emulator_t *emulator;
+   FpiUsbTransfer *transfer;
+   GSource *source;
+
+   GCancellable *cancellable;
+   gulong cancelled_handler_id;
+   gboolean cancelled;
+
+   /* queue of the emulator in which the transfer waits for data or NULL */
+   GQueue *waiting_queue;
+   /* data received by the transfer, NULL for host to device transfers */
+   GBytes *data;
+   GError *error;
+} emulator_transfer_t;
+
+struct emulator {
+   /* the provider of the device, so that a seeded one makes runs the same */
+   random_provider_t *random;
+   gint64 default_latency_us;
+   gint64 latency_us[EMULATOR_NUM_CMD_IDS];
+   gint64 finger_delay_us;
+   guint poll_events;
+
+   gboolean privkey_initialized;
+   gnutls_privkey_t privkey;
+   cert_t cert;
+
+   struct {
+      emulator_tls_state_t state;
+      gboolean client_sends_encrypted;
+      guint8 client_random[EMULATOR_RANDOM_SIZE];
+      guint8 server_random[EMULATOR_RANDOM_SIZE];
+      /* X and Y of the ephemeral key from client key exchange */
+      guint8 client_point[2 * ECC_KEY_SIZE];
+      gboolean client_point_present;
+      /* handshake messages without finished ones */
+      GByteArray *handshake_msgs;
+      gnutls_datum_t master_secret;
+      /* keyed with the client and server keys swapped against the driver */
+      SynaTlsRecordLayer record_layer;
+   } tls;
+
+   GQueue transfers;       /* all emulator_transfer_t which did not complete */
+   GQueue replies;         /* emulator_reply_t */
+   GQueue reply_transfers; /* transfers on USB_EP_REPLY waiting for a reply */
+   /* the sensor processes one command at a time */
+   gint64 busy_until;
+
+   guint32 event_mask;
+   guint16 event_seq_num;
+   guint8 event_types[EMULATOR_EVENT_HISTORY];
+   gboolean finger_down_pending;
+   gboolean frame_ready_pending;
+   gboolean finger_up_pending;
+   /* set by FRAME_ACQ, the finger touches the sensor after its reply */
+   gboolean frame_acq_started;
+   GSource *touch_source;
+   /* finger down events left before the frame is ready */
+   guint poll_events_left;
+   GQueue interrupt_transfers; /* transfers on USB_EP_INTERRUPT */
+   /* new events were not reported as no transfer was waiting */
+   gboolean interrupt_pending;
+
+   guint16 enroll_progress;
+   db2_id_t enroll_template_id;
+   GPtrArray *prints; /* emulator_print_t */
+   guint32 partition_version;
+
+   emulator_cmd_stats_t cmd_stats[EMULATOR_NUM_CMD_IDS];
+   guint num_control_transfers;
+   /* CPU time spent in the emulator, which is not overhead of the driver */
+   gint64 cpu_time_us;
+
+   /* event-poll benchmark */
+   guint poll_num_events;
+   gint64 poll_start_process_cpu_us;
+   gint64 poll_start_emulator_cpu_us;
+   gint64 poll_driver_cpu_us;
+};
+
+static void emulator_raise_interrupt(emulator_t *emulator);
+
+/* Utilities =============================================================== */
+
+static gint64 emulator_cpu_time_us(clockid_t clock)
+{
+   struct timespec time;
+
+   clock_gettime(clock, &time);
+   return time.tv_sec * G_USEC_PER_SEC + time.tv_nsec / 1000;
+}
+
+static void emulator_random_bytes(emulator_t *emulator, guint8 *data,
+                                  gsize size)
+{
+   /* a seeded provider cannot fail, the emulated sensor needs no secure
+    * random numbers otherwise */
+   if (emulator->random->reproducible) {
+      emulator->random->fill(emulator->random, data, size, NULL);
+      return;
+   }
+   for (gsize i = 0; i < size; ++i) {
+      data[i] = g_random_int_range(0, 256);
+   }
+}
+
+static void emulator_print_free(emulator_print_t *print)
+{
+   g_bytes_unref(print->payload);
+   g_free(print);
+}
+
+/* finds a print by its template ID or by its payload ID for OBJ_TYPE_PAYLOADS;
+ * each print has its own user with the ID of the template */
+static emulator_print_t *emulator_find_print(emulator_t *emulator,
+                                            obj_type_t id_type,
+                                            const guint8 *id, guint *index)
+{
+   for (guint i = 0; i < emulator->prints->len; ++i) {
+      emulator_print_t *print = g_ptr_array_index(emulator->prints, i);
+      const guint8 *print_id = id_type == OBJ_TYPE_PAYLOADS
+                                   ? print->payload_id
+                                   : print->template_id;
+      if (memcmp(print_id, id, DB2_ID_SIZE) == 0) {
+         if (index != NULL) {
+            *index = i;
+         }
+         return print;
+      }
+   }
+
+   return NULL;
+}
+
+/* NOTE: replies are written to growable writers, which fail only when out of
+ * memory, so the results of the writes are not checked */
+static void emulator_put_status(FpiByteWriter *reply, guint16 status)
+{
+   fpi_byte_writer_put_uint16_le(reply, status);
+}
+
+static gboolean emulator_write_record(FpiByteWriter *writer, guint8 type,
+                                      const guint8 *msg, gsize msg_len)
+{
+   gboolean written = TRUE;
+   const record_t record = {
+       .type = type,
+       .version_major = TLS_PROTOCOL_VERSION_MAJOR,
+       .version_minor = TLS_PROTOCOL_VERSION_MINOR,
+   };
+
+   written &= write_record_header(writer, &record);
+   written &= fpi_byte_writer_put_uint16_be(writer, msg_len);
+   written &= fpi_byte_writer_put_data(writer, msg, msg_len);
+
+   return written;
+}
+
+/* TLS ===================================================================== */
+
+static void emulator_tls_reset(emulator_t *emulator)
+{
+   syna_tls_record_layer_clear(&emulator->tls.record_layer);
+   g_clear_pointer(&emulator->tls.master_secret.data, g_free);
+   emulator->tls.master_secret.size = 0;
+   g_byte_array_set_size(emulator->tls.handshake_msgs, 0);
+   emulator->tls.client_point_present = FALSE;
+   emulator->tls.client_sends_encrypted = FALSE;
+   emulator->tls.state = EMULATOR_TLS_STATE_NONE;
+}
+
+/* derives the session keys the same way as the driver, but from the other
+ * side of the ECDH */
+static gboolean emulator_tls_init_keys(emulator_t *emulator, GError **error)
+{
+   gboolean ret = TRUE;
+   gboolean pubkey_initialized = FALSE;
+   const char *mac_algo = tls_ecdh_ecdsa_with_aes_256_gcm_sha384.mac_algo;
+   gnutls_pubkey_t client_pubkey;
+   gnutls_datum_t premaster_secret = {.data = NULL, .size = 0};
+   guint8 key_block[SYNA_TLS_KEY_BLOCK_SIZE];
+   guint8 seed[2 * EMULATOR_RANDOM_SIZE];
+
+   const gnutls_datum_t x = {.data = emulator->tls.client_point,
+                             .size = ECC_KEY_SIZE};
+   const gnutls_datum_t y = {.data = emulator->tls.client_point + ECC_KEY_SIZE,
+                             .size = ECC_KEY_SIZE};
+
+   if (!emulator->tls.client_point_present) {
+      *error = set_and_report_error(
+          FP_DEVICE_ERROR_PROTO,
+          "Emulator: change cipher spec received before client key exchange");
+      ret = FALSE;
+      goto error;
+   }
+
+   GNUTLS_CHECK(gnutls_pubkey_init(&client_pubkey));
+   pubkey_initialized = TRUE;
+   GNUTLS_CHECK(gnutls_pubkey_import_ecc_raw(
+       client_pubkey, GNUTLS_ECC_CURVE_SECP256R1, &x, &y));
+   GNUTLS_CHECK(gnutls_privkey_derive_secret(emulator->privkey, client_pubkey,
+                                             NULL, &premaster_secret, 0));
+
+   memcpy(seed, emulator->tls.client_random, EMULATOR_RANDOM_SIZE);
+   memcpy(seed + EMULATOR_RANDOM_SIZE, emulator->tls.server_random,
+          EMULATOR_RANDOM_SIZE);
+
+   g_clear_pointer(&emulator->tls.master_secret.data, g_free);
+   BOOL_CHECK(tls_prf(mac_algo, premaster_secret, "master secret", seed,
+                      sizeof(seed), &emulator->tls.master_secret.data,
+                      MASTER_SECRET_SIZE, error));
+   emulator->tls.master_secret.size = MASTER_SECRET_SIZE;
+
+   BOOL_CHECK(syna_tls_prf(mac_algo, emulator->tls.master_secret.data,
+                           emulator->tls.master_secret.size, "key expansion",
+                           seed, sizeof(seed), key_block, sizeof(key_block),
+                           error));
+
+   /* the client encrypts with the client write key, so the sensor decrypts
+    * with it */
+   const guint8 *client_write_key = key_block;
+   const guint8 *server_write_key = client_write_key + AES_GCM_KEY_SIZE;
+   const guint8 *client_write_iv = server_write_key + AES_GCM_KEY_SIZE;
+   const guint8 *server_write_iv = client_write_iv + AES_GCM_IV_SIZE;
+   BOOL_CHECK(syna_tls_record_layer_set_keys(
+       &emulator->tls.record_layer, server_write_key, server_write_iv,
+       client_write_key, client_write_iv, error));
+   emulator->tls.record_layer.sequential_nonce = emulator->random->reproducible;
+
+error:
+   OPENSSL_cleanse(key_block, sizeof(key_block));
+   if (pubkey_initialized) {
+      gnutls_pubkey_deinit(client_pubkey);
+   }
+   g_free(premaster_secret.data);
+   return ret;
+}
+
+/* writes a record encrypted with the server write key */
+static gboolean emulator_tls_write_encrypted_record(emulator_t *emulator,
+                                                    FpiByteWriter *writer,
+                                                    guint8 type,
+                                                    const guint8 *ptext,
+                                                    gsize ptext_size,
+                                                    GError **error)
+{
+   gboolean ret = TRUE;
+   gboolean written = TRUE;
+   gsize fragment_size = 0;
+   const record_t record = {
+       .type = type,
+       .version_major = TLS_PROTOCOL_VERSION_MAJOR,
+       .version_minor = TLS_PROTOCOL_VERSION_MINOR,
+   };
+
+   written &= write_record_header(writer, &record);
+   written &= fpi_byte_writer_put_uint16_be(writer,
+                                            ptext_size + AES_GCM_RECORD_OVERHEAD);
+   /* space for the fragment, which is then encrypted in place */
+   const guint fragment_pos = fpi_byte_writer_get_pos(writer);
+   written &= fpi_byte_writer_fill(writer, 0,
+                                   ptext_size + AES_GCM_RECORD_OVERHEAD);
+   WRITTEN_CHECK(written);
+
+   BOOL_CHECK(syna_tls_record_layer_encrypt(
+       &emulator->tls.record_layer, type, record_version(&record), ptext,
+       ptext_size, writer->parent.data + fragment_pos, &fragment_size, error));
+
+error:
+   return ret;
+}
+
+/* decrypts record msg in place with the client write key */
+static gboolean emulator_tls_decrypt_record(emulator_t *emulator,
+                                            record_t *record, GError **error)
+{
+   gboolean ret = TRUE;
+   guint8 *ptext = NULL;
+   gsize ptext_size = 0;
+
+   if (!emulator->tls.record_layer.keys_set) {
+      *error = set_and_report_error(FP_DEVICE_ERROR_PROTO,
+                                    "Emulator: unable to decrypt record of "
+                                    "type 0x%02x and length %u",
+                                    record->type, record->msg_len);
+      ret = FALSE;
+      goto error;
+   }
+
+   BOOL_CHECK(syna_tls_record_layer_decrypt(
+       &emulator->tls.record_layer, record->type, record_version(record),
+       record->msg, record->msg_len, &ptext, &ptext_size, error));
+
+   record->msg = ptext;
+   record->msg_len = ptext_size;
+
+error:
+   return ret;
+}
+
+static gboolean emulator_tls_get_verify_data(emulator_t *emulator,
+                                             const char *label,
+                                             guint8 **verify_data,
+                                             GError **error)
+{
+   guint8 hash[SHA256_DIGEST_LENGTH];
+
+   SHA256(emulator->tls.handshake_msgs->data, emulator->tls.handshake_msgs->len,
+          hash);
+
+   return tls_prf(tls_ecdh_ecdsa_with_aes_256_gcm_sha384.mac_algo,
+                  emulator->tls.master_secret, label, hash, sizeof(hash),
+                  verify_data, VERIFY_DATA_SIZE, error);
+}
+
+/* replies to client hello with server hello, certificate request and server
+ * hello done in one record */
+static gboolean emulator_tls_handle_client_hello(emulator_t *emulator,
+                                                 FpiByteReader *reader,
+                                                 FpiByteWriter *reply,
+                                                 GError **error)
+{
+   gboolean ret = TRUE;
+   gboolean read_ok = TRUE;
+   gboolean written = TRUE;
+   const guint8 *client_random = NULL;
+   guint8 session_id[SESSION_ID_LEN];
+   g_autofree guint8 *msg = NULL;
+   gsize msg_size = 0;
+
+   FpiByteWriter writer;
+   fpi_byte_writer_init(&writer);
+
+   /* skip over version */
+   read_ok &= fpi_byte_reader_skip(reader, 2);
+   read_ok &= fpi_byte_reader_get_data(reader, EMULATOR_RANDOM_SIZE,
+                                       &client_random);
+   READ_OK_CHECK(read_ok);
+   memcpy(emulator->tls.client_random, client_random, EMULATOR_RANDOM_SIZE);
+
+   /* a new session ID is always sent, which refuses resumption */
+   emulator_random_bytes(emulator, emulator->tls.server_random,
+                         EMULATOR_RANDOM_SIZE);
+   emulator_random_bytes(emulator, session_id, sizeof(session_id));
+
+   /* version + random + session ID + ciphersuite + compression method */
+   written &= fpi_byte_writer_put_uint8(&writer, HS_SERVER_HELLO);
+   written &= fpi_byte_writer_put_uint24_be(
+       &writer, 2 + EMULATOR_RANDOM_SIZE + 1 + SESSION_ID_LEN + 2 + 1);
+   written &= fpi_byte_writer_put_uint8(&writer, TLS_PROTOCOL_VERSION_MAJOR);
+   written &= fpi_byte_writer_put_uint8(&writer, TLS_PROTOCOL_VERSION_MINOR);
+   written &= fpi_byte_writer_put_data(&writer, emulator->tls.server_random,
+                                       EMULATOR_RANDOM_SIZE);
+   written &= fpi_byte_writer_put_uint8(&writer, SESSION_ID_LEN);
+   written &= fpi_byte_writer_put_data(&writer, session_id, SESSION_ID_LEN);
+   written &= fpi_byte_writer_put_uint16_be(
+       &writer, tls_ecdh_ecdsa_with_aes_256_gcm_sha384.id);
+   written &= fpi_byte_writer_put_uint8(&writer, 0);
+
+   /* one ECDSA signing certificate */
+   written &= fpi_byte_writer_put_uint8(&writer, HS_CERTIFICATE_REQUEST);
+   written &= fpi_byte_writer_put_uint24_be(&writer, 4);
+   written &= fpi_byte_writer_put_uint8(&writer, 1);
+   written &= fpi_byte_writer_put_uint8(&writer, TLS_CERT_TYPE_ECDSA_SIGN);
+   written &= fpi_byte_writer_put_uint16_be(&writer, 0);
+
+   written &= fpi_byte_writer_put_uint8(&writer, HS_SERVER_HELLO_DONE);
+   written &= fpi_byte_writer_put_uint24_be(&writer, 0);
+   WRITTEN_CHECK(written);
+
+   msg_size = fpi_byte_writer_get_pos(&writer);
+   msg = fpi_byte_writer_reset_and_get_data(&writer);
+
+   g_byte_array_append(emulator->tls.handshake_msgs, msg, msg_size);
+   written &= emulator_write_record(reply, RECORD_TYPE_HANDSHAKE, msg, msg_size);
+   WRITTEN_CHECK(written);
+
+   emulator->tls.state = EMULATOR_TLS_STATE_HANDSHAKE;
+
+error:
+   fpi_byte_writer_reset(&writer);
+   return ret;
+}
+
+/* checks client finished and replies with change cipher spec and server
+ * finished, which establishes the session */
+static gboolean emulator_tls_handle_finished(emulator_t *emulator,
+                                             FpiByteReader *reader,
+                                             FpiByteWriter *reply,
+                                             GError **error)
+{
+   gboolean ret = TRUE;
+   gboolean written = TRUE;
+   const guint8 *verify_data = NULL;
+   g_autofree guint8 *expected_verify_data = NULL;
+   g_autofree guint8 *server_verify_data = NULL;
+   const guint8 change_cipher_spec = 0x01;
+   guint8 msg[4 + VERIFY_DATA_SIZE];
+
+   if (fpi_byte_reader_get_remaining(reader) != VERIFY_DATA_SIZE ||
+       !fpi_byte_reader_get_data(reader, VERIFY_DATA_SIZE, &verify_data)) {
+      *error = set_and_report_error(
+          FP_DEVICE_ERROR_PROTO,
+          "Emulator: client finished has unexpected length");
+      ret = FALSE;
+      goto error;
+   }
+
+   BOOL_CHECK(emulator_tls_get_verify_data(emulator, "client finished",
+                                           &expected_verify_data, error));
+   if (memcmp(verify_data, expected_verify_data, VERIFY_DATA_SIZE) != 0) {
+      *error = set_and_report_error(
+          FP_DEVICE_ERROR_PROTO,
+          "Emulator: client verify message does not match the one expected");
+      ret = FALSE;
+      goto error;
+   }
+
+   BOOL_CHECK(emulator_tls_get_verify_data(emulator, "server finished",
+                                           &server_verify_data, error));
+   msg[0] = HS_FINISHED;
+   FP_WRITE_UINT24_BE(msg + 1, VERIFY_DATA_SIZE);
+   memcpy(msg + 4, server_verify_data, VERIFY_DATA_SIZE);
+
+   written &= emulator_write_record(reply, RECORD_TYPE_CHANGE_CIPHER_SPEC,
+                                    &change_cipher_spec, 1);
+   WRITTEN_CHECK(written);
+   BOOL_CHECK(emulator_tls_write_encrypted_record(
+       emulator, reply, RECORD_TYPE_HANDSHAKE, msg, sizeof(msg), error));
+
+   emulator->tls.state = EMULATOR_TLS_STATE_ESTABLISHED;
+   fp_dbg("Emulator: TLS session established");
+
+error:
+   return ret;
+}
+
+static gboolean emulator_tls_handle_handshake_record(emulator_t *emulator,
+                                                     const record_t *record,
+                                                     FpiByteWriter *reply,
+                                                     GError **error)
+{
+   gboolean ret = TRUE;
+   gboolean read_ok = TRUE;
+   FpiByteReader reader;
+
+   if (record->msg_len == 0) {
+      *error = set_and_report_error(FP_DEVICE_ERROR_PROTO,
+                                    "Emulator: received empty handshake record");
+      ret = FALSE;
+      goto error;
+   }
+
+   /* client hello starts a new session */
+   if (record->msg[0] == HS_CLIENT_HELLO) {
+      emulator_tls_reset(emulator);
+   }
+   /* same as the driver, finished messages are not hashed */
+   if (record->msg[0] != HS_FINISHED) {
+      g_byte_array_append(emulator->tls.handshake_msgs, record->msg,
+                          record->msg_len);
+   }
+
+   fpi_byte_reader_init(&reader, record->msg, record->msg_len);
+   while (fpi_byte_reader_get_remaining(&reader) != 0) {
+      guint8 msg_type = 0;
+      guint32 msg_len = 0;
+      const guint8 *msg = NULL;
+      read_ok &= fpi_byte_reader_get_uint8(&reader, &msg_type);
+      read_ok &= fpi_byte_reader_get_uint24_be(&reader, &msg_len);
+      read_ok &= fpi_byte_reader_get_data(&reader, msg_len, &msg);
+      READ_OK_CHECK(read_ok);
+
+      FpiByteReader msg_reader;
+      fpi_byte_reader_init(&msg_reader, msg, msg_len);
+
+      switch (msg_type) {
+      case HS_CLIENT_HELLO:
+         BOOL_CHECK(emulator_tls_handle_client_hello(emulator, &msg_reader,
+                                                     reply, error));
+         break;
+      case HS_CERTIFICATE:
+      case HS_CERTIFICATE_VERIFY:
+         /* the host certificate is not verified */
+         break;
+      case HS_CLIENT_KEY_EXCHANGE:;
+         guint8 point_format = 0;
+         const guint8 *point = NULL;
+         read_ok &= fpi_byte_reader_get_uint8(&msg_reader, &point_format);
+         read_ok &= fpi_byte_reader_get_data(
+             &msg_reader, sizeof(emulator->tls.client_point), &point);
+         READ_OK_CHECK(read_ok);
+         /* only uncompressed points are sent */
+         if (point_format != 0x04) {
+            *error = set_and_report_error(
+                FP_DEVICE_ERROR_PROTO, "Emulator: unexpected point format: %u",
+                point_format);
+            ret = FALSE;
+            goto error;
+         }
+         memcpy(emulator->tls.client_point, point,
+                sizeof(emulator->tls.client_point));
+         emulator->tls.client_point_present = TRUE;
+         break;
+      case HS_FINISHED:
+         BOOL_CHECK(
+             emulator_tls_handle_finished(emulator, &msg_reader, reply, error));
+         break;
+      default:
+         *error = set_and_report_error(
+             FP_DEVICE_ERROR_PROTO,
+             "Emulator: received unexpected handshake message type: 0x%02x",
+             msg_type);
+         ret = FALSE;
+         goto error;
+      }
+   }
+
+error:
+   return ret;
+}
+
+/* any alert closes the session, which is confirmed by close notify */
+static gboolean emulator_tls_handle_alert(emulator_t *emulator,
+                                          const record_t *record,
+                                          FpiByteWriter *reply, GError **error)
+{
+   gboolean ret = TRUE;
+   gboolean written = TRUE;
+   const guint8 close_notify[2] = {GNUTLS_AL_WARNING, GNUTLS_A_CLOSE_NOTIFY};
+
+   if (record->msg_len != 2) {
+      *error = set_and_report_error(FP_DEVICE_ERROR_PROTO,
+                                    "Emulator: invalid length of TLS alert: %u",
+                                    record->msg_len);
+      ret = FALSE;
+      goto error;
+   }
+
+   if (record->msg[0] == GNUTLS_AL_WARNING &&
+       record->msg[1] == GNUTLS_A_CLOSE_NOTIFY) {
+      fp_dbg("Emulator: TLS session closed by host");
+   } else {
+      fp_warn("Emulator: received TLS alert of level %u and description %u",
+              record->msg[0], record->msg[1]);
+   }
+
+   if (emulator->tls.record_layer.keys_set) {
+      BOOL_CHECK(emulator_tls_write_encrypted_record(
+          emulator, reply, RECORD_TYPE_ALERT, close_notify,
+          sizeof(close_notify), error));
+   } else {
+      written &= emulator_write_record(reply, RECORD_TYPE_ALERT, close_notify,
+                                       sizeof(close_notify));
+      WRITTEN_CHECK(written);
+   }
+
+   emulator_tls_reset(emulator);
+
+error:
+   return ret;
+}
+
+/* handles records sent with VCSFW_CMD_TLS_DATA or on their own */
+static gboolean emulator_tls_handle_records(emulator_t *emulator, guint8 *data,
+                                            gsize size, FpiByteWriter *reply,
+                                            GError **error)
+{
+   gboolean ret = TRUE;
+   gboolean read_ok = TRUE;
+   FpiByteReader reader;
+
+   fpi_byte_reader_init(&reader, data, size);
+   while (fpi_byte_reader_get_remaining(&reader) != 0) {
+      record_t record = {.msg = NULL};
+      const guint8 *msg = NULL;
+      read_ok &= read_record_header(&reader, &record);
+      read_ok &= fpi_byte_reader_get_uint16_be(&reader, &record.msg_len);
+      read_ok &= fpi_byte_reader_get_data(&reader, record.msg_len, &msg);
+      READ_OK_CHECK(read_ok);
+      /* records are processed in place in the copy of the request */
+      record.msg = (guint8 *)msg;
+
+      if (emulator->tls.client_sends_encrypted) {
+         BOOL_CHECK(emulator_tls_decrypt_record(emulator, &record, error));
+      }
+
+      switch (record.type) {
+      case RECORD_TYPE_HANDSHAKE:
+         BOOL_CHECK(emulator_tls_handle_handshake_record(emulator, &record,
+                                                         reply, error));
+         break;
+      case RECORD_TYPE_CHANGE_CIPHER_SPEC:
+         BOOL_CHECK(emulator_tls_init_keys(emulator, error));
+         emulator->tls.client_sends_encrypted = TRUE;
+         break;
+      case RECORD_TYPE_ALERT:
+         BOOL_CHECK(emulator_tls_handle_alert(emulator, &record, reply, error));
+         break;
+      default:
+         *error = set_and_report_error(
+             FP_DEVICE_ERROR_PROTO,
+             "Emulator: received unexpected record type: 0x%02x", record.type);
+         ret = FALSE;
+         goto error;
+      }
+   }
+
+error:
+   return ret;
+}
+
+/* Commands ================================================================ */
+
+/* command handlers return FALSE if the command is malformed, in which case
+ * nothing may be written to the reply */
+
+static gboolean emulator_cmd_get_version(emulator_t *emulator,
+                                         FpiByteReader *reader,
+                                         FpiByteWriter *reply)
+{
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_put_uint32_le(reply, 0); /* build time */
+   fpi_byte_writer_put_uint32_le(reply, 0); /* build number */
+   fpi_byte_writer_put_uint8(reply, 10);    /* version major */
+   fpi_byte_writer_put_uint8(reply, 1);     /* version minor */
+   fpi_byte_writer_put_uint8(reply, 0);     /* target */
+   fpi_byte_writer_put_uint8(reply, 0);     /* product ID */
+   fpi_byte_writer_put_uint8(reply, 0);     /* silicon revision */
+   fpi_byte_writer_put_uint8(reply, 1);     /* formal release */
+   fpi_byte_writer_put_uint8(reply, 0);     /* platform */
+   fpi_byte_writer_put_uint8(reply, 0);     /* patch */
+   fpi_byte_writer_fill(reply, 0, 6);       /* serial number */
+   fpi_byte_writer_put_uint16_le(reply, EMULATOR_SECURITY);
+   fpi_byte_writer_put_uint8(reply, 0); /* interface */
+   fpi_byte_writer_fill(reply, 0, 7);
+   fpi_byte_writer_put_uint8(reply, 0); /* device type */
+   fpi_byte_writer_fill(reply, 0, 2);
+   fpi_byte_writer_put_uint8(reply, PROVISION_STATE_PROVISIONED);
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_pair(emulator_t *emulator, FpiByteReader *reader,
+                                  FpiByteWriter *reply)
+{
+   const guint8 *host_cert = NULL;
+
+   if (!fpi_byte_reader_get_data(reader, CERTIFICATE_SIZE, &host_cert)) {
+      return FALSE;
+   }
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_put_data(reply, host_cert, CERTIFICATE_SIZE);
+   fpi_byte_writer_put_data(reply, (guint8 *)&emulator->cert, CERTIFICATE_SIZE);
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_frame_acq(emulator_t *emulator,
+                                       FpiByteReader *reader,
+                                       FpiByteWriter *reply)
+{
+   emulator->frame_acq_started = TRUE;
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+
+   return TRUE;
+}
+
+static void emulator_cancel_touch(emulator_t *emulator)
+{
+   emulator->poll_events_left = 0;
+   if (emulator->touch_source != NULL) {
+      g_source_destroy(emulator->touch_source);
+      g_clear_pointer(&emulator->touch_source, g_source_unref);
+   }
+}
+
+static void emulator_add_event(emulator_t *emulator, sensor_event_type_t event)
+{
+   emulator->event_types[emulator->event_seq_num % EMULATOR_EVENT_HISTORY] =
+       g_bit_nth_lsf(event, -1);
+   emulator->event_seq_num += 1;
+}
+
+/* adds events of the finger state which are enabled by the event mask */
+static void emulator_emit_events(emulator_t *emulator)
+{
+   const guint16 seq_num_before = emulator->event_seq_num;
+
+   if (emulator->finger_down_pending &&
+       (emulator->event_mask & EV_FINGER_DOWN) != 0) {
+      emulator_add_event(emulator, EV_FINGER_DOWN);
+      emulator->finger_down_pending = FALSE;
+   }
+   if (emulator->frame_ready_pending &&
+       (emulator->event_mask & EV_FRAME_READY) != 0) {
+      emulator_add_event(emulator, EV_FRAME_READY);
+      emulator->frame_ready_pending = FALSE;
+   }
+   if (emulator->finger_up_pending &&
+       (emulator->event_mask & EV_FINGER_UP) != 0) {
+      emulator_add_event(emulator, EV_FINGER_UP);
+      emulator->finger_up_pending = FALSE;
+   }
+
+   if (emulator->event_seq_num != seq_num_before) {
+      emulator_raise_interrupt(emulator);
+   }
+}
+
+/* the finger is lifted once the frame is finished */
+static gboolean emulator_cmd_frame_finish(emulator_t *emulator,
+                                          FpiByteReader *reader,
+                                          FpiByteWriter *reply)
+{
+   emulator_cancel_touch(emulator);
+   emulator->finger_down_pending = FALSE;
+   emulator->frame_ready_pending = FALSE;
+   emulator->finger_up_pending = TRUE;
+   emulator_emit_events(emulator);
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_event_config(emulator_t *emulator,
+                                          FpiByteReader *reader,
+                                          FpiByteWriter *reply)
+{
+   guint32 event_mask = 0;
+
+   if (!fpi_byte_reader_get_uint32_le(reader, &event_mask)) {
+      return FALSE;
+   }
+   emulator->event_mask = event_mask;
+
+   /* the host reads events from the current sequence number, so the events
+    * enabled by the new mask are added after it */
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_fill(reply, 0, EMULATOR_EVENT_CONFIG_REPLY_SIZE - 4);
+   fpi_byte_writer_put_uint16_le(reply, emulator->event_seq_num);
+
+   emulator_emit_events(emulator);
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_event_read(emulator_t *emulator,
+                                        FpiByteReader *reader,
+                                        FpiByteWriter *reply)
+{
+   gboolean read_ok = TRUE;
+   guint16 seq_num = 0;
+   guint16 max_num_events = 0;
+
+   read_ok &= fpi_byte_reader_get_uint16_le(reader, &seq_num);
+   read_ok &= fpi_byte_reader_get_uint16_le(reader, &max_num_events);
+   if (!read_ok) {
+      return FALSE;
+   }
+   /* the new mode is requested by an additional argument */
+   const gboolean legacy_mode = fpi_byte_reader_get_remaining(reader) == 0;
+
+   guint16 num_available = emulator->event_seq_num - seq_num;
+   if (num_available > EMULATOR_EVENT_HISTORY) {
+      fp_warn("Emulator: %u events were not read in time and are lost",
+              num_available - EMULATOR_EVENT_HISTORY);
+      num_available = EMULATOR_EVENT_HISTORY;
+      seq_num = emulator->event_seq_num - num_available;
+   }
+   const guint16 num_events = MIN(num_available, max_num_events);
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_put_uint16_le(reply, num_events);
+   /* the legacy mode reports the number of pending events including the
+    * returned ones */
+   fpi_byte_writer_put_uint16_le(
+       reply, legacy_mode ? num_available : num_available - num_events);
+   for (guint16 i = 0; i < num_events; ++i) {
+      fpi_byte_writer_put_uint8(
+          reply,
+          emulator->event_types[(seq_num + i) % EMULATOR_EVENT_HISTORY]);
+      fpi_byte_writer_fill(reply, 0, EVENT_DATA_SIZE);
+   }
+
+   /* the next event of the benchmark follows the read of the previous one */
+   if (emulator->poll_events_left > 0 && num_events == num_available) {
+      emulator->poll_events_left -= 1;
+      if (emulator->poll_events_left > 0) {
+         emulator->finger_down_pending = TRUE;
+      } else {
+         emulator->frame_ready_pending = TRUE;
+         emulator->poll_num_events += emulator->poll_events;
+         emulator->poll_driver_cpu_us +=
+             emulator_cpu_time_us(CLOCK_PROCESS_CPUTIME_ID) -
+             emulator->poll_start_process_cpu_us -
+             (emulator->cpu_time_us - emulator->poll_start_emulator_cpu_us);
+      }
+      emulator_emit_events(emulator);
+   }
+
+   return TRUE;
+}
+
+static void emulator_enroll_add_image(emulator_t *emulator,
+                                      FpiByteWriter *reply)
+{
+   const guint16 progress_step = 100 / SYNA_TUDOR_MOC_DRIVER_NR_ENROLL_STAGES;
+
+   if (emulator->enroll_progress < 100) {
+      emulator->enroll_progress =
+          MIN(emulator->enroll_progress + progress_step, 100);
+      if (emulator->enroll_progress == 100) {
+         emulator_random_bytes(emulator, emulator->enroll_template_id,
+                               DB2_ID_SIZE);
+      }
+   }
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_put_data(reply, emulator->enroll_template_id, DB2_ID_SIZE);
+   fpi_byte_writer_put_uint32_le(reply, EMULATOR_ENROLL_STATS_SIZE);
+   /* enroll stats */
+   fpi_byte_writer_fill(reply, 0, 2);
+   fpi_byte_writer_put_uint16_le(reply, emulator->enroll_progress);
+   fpi_byte_writer_put_data(reply, emulator->enroll_template_id, DB2_ID_SIZE);
+   fpi_byte_writer_put_uint32_le(reply, EMULATOR_IMAGE_QUALITY);
+   fpi_byte_writer_put_uint32_le(reply, 0); /* redundant */
+   fpi_byte_writer_put_uint32_le(reply, 0); /* rejected */
+   fpi_byte_writer_fill(reply, 0, 4);
+   fpi_byte_writer_put_uint32_le(reply,
+                                 emulator->enroll_progress / progress_step);
+   fpi_byte_writer_put_uint16_le(reply, EMULATOR_IMAGE_QUALITY);
+   fpi_byte_writer_fill(reply, 0, 6);
+   fpi_byte_writer_put_uint32_le(reply, 0); /* status */
+   fpi_byte_writer_fill(reply, 0, 4);
+   fpi_byte_writer_put_uint32_le(reply, 0); /* has fixed pattern */
+}
+
+/* stores the enrollment container as the payload of a new print */
+static gboolean emulator_enroll_commit(emulator_t *emulator,
+                                       FpiByteReader *reader,
+                                       FpiByteWriter *reply)
+{
+   gboolean read_ok = TRUE;
+   guint32 data_size = 0;
+   const guint8 *data = NULL;
+   enrollment_t enrollment = {0};
+   GError *error = NULL;
+   guint index = 0;
+
+   read_ok &= fpi_byte_reader_skip(reader, 4);
+   read_ok &= fpi_byte_reader_get_uint32_le(reader, &data_size);
+   read_ok &= fpi_byte_reader_get_data(reader, data_size, &data);
+   if (!read_ok) {
+      return FALSE;
+   }
+
+   if (data_size > EMULATOR_PAYLOAD_SLOT_SIZE) {
+      fp_warn("Emulator: enrollment data of %u bytes do not fit a slot",
+              data_size);
+      emulator_put_status(reply, VCS_RESULT_GEN_BAD_PARAM_1);
+      return TRUE;
+   }
+
+   if (!get_enrollment_data_from_serialized_container(data, data_size,
+                                                      &enrollment, &error)) {
+      fp_warn("Emulator: received invalid enrollment data to commit");
+      g_clear_error(&error);
+      emulator_put_status(reply, VCS_RESULT_GEN_BAD_PARAM_1);
+      return TRUE;
+   }
+
+   if (emulator_find_print(emulator, OBJ_TYPE_TEMPLATES,
+                           enrollment.template_id, &index) != NULL) {
+      g_ptr_array_remove_index(emulator->prints, index);
+   } else if (emulator->prints->len >= EMULATOR_MAX_PRINTS) {
+      emulator_put_status(reply, VCS_RESULT_DB_FULL);
+      return TRUE;
+   }
+
+   emulator_print_t *print = g_new0(emulator_print_t, 1);
+   memcpy(print->template_id, enrollment.template_id, DB2_ID_SIZE);
+   emulator_random_bytes(emulator, print->payload_id, DB2_ID_SIZE);
+   print->payload = g_bytes_new(data, data_size);
+   g_ptr_array_add(emulator->prints, print);
+   emulator->partition_version += 1;
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_enroll(emulator_t *emulator,
+                                    FpiByteReader *reader,
+                                    FpiByteWriter *reply)
+{
+   guint32 subcmd = 0;
+
+   if (!fpi_byte_reader_get_uint32_le(reader, &subcmd)) {
+      return FALSE;
+   }
+
+   switch (subcmd) {
+   case ENROLL_SUBCMD_START:
+      emulator->enroll_progress = 0;
+      memset(emulator->enroll_template_id, 0, DB2_ID_SIZE);
+      emulator_put_status(reply, VCS_RESULT_OK_1);
+      fpi_byte_writer_put_uint32_le(reply, 0);
+      break;
+   case ENROLL_SUBCMD_ADD_IMAGE:
+      emulator_enroll_add_image(emulator, reply);
+      break;
+   case ENROLL_SUBCMD_COMMIT:
+      return emulator_enroll_commit(emulator, reader, reply);
+   case ENROLL_SUBCMD_FINISH:
+      emulator_put_status(reply, VCS_RESULT_OK_1);
+      break;
+   default:
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+/* the finger on the sensor matches the first of the requested prints which is
+ * stored, or the first stored print if none are requested */
+static gboolean emulator_cmd_identify_match(emulator_t *emulator,
+                                            FpiByteReader *reader,
+                                            FpiByteWriter *reply)
+{
+   gboolean read_ok = TRUE;
+   guint32 subcmd = 0;
+   guint32 ids_size = 0;
+   guint32 data_2_size = 0;
+   const guint8 *ids = NULL;
+   emulator_print_t *match = NULL;
+
+   read_ok &= fpi_byte_reader_get_uint32_le(reader, &subcmd);
+   read_ok &= fpi_byte_reader_get_uint32_le(reader, &ids_size);
+   read_ok &= fpi_byte_reader_get_uint32_le(reader, &data_2_size);
+   read_ok &= fpi_byte_reader_get_data(reader, ids_size, &ids);
+   if (!read_ok || ids_size % DB2_ID_SIZE != 0) {
+      return FALSE;
+   }
+
+   if (ids_size == 0 && emulator->prints->len != 0) {
+      match = g_ptr_array_index(emulator->prints, 0);
+   }
+   for (guint32 offset = 0; match == NULL && offset < ids_size;
+        offset += DB2_ID_SIZE) {
+      match = emulator_find_print(emulator, OBJ_TYPE_TEMPLATES, ids + offset,
+                                  NULL);
+   }
+
+   if (match == NULL) {
+      emulator_put_status(reply, VCS_RESULT_MATCHER_MATCH_FAILED);
+      return TRUE;
+   }
+
+   gsize payload_size = 0;
+   const guint8 *payload = g_bytes_get_data(match->payload, &payload_size);
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_put_data(reply, match->template_id, DB2_ID_SIZE);
+   fpi_byte_writer_put_uint32_le(reply, MATCH_STATS_SIZE);
+   fpi_byte_writer_put_uint32_le(reply, 0);
+   fpi_byte_writer_put_uint32_le(reply, payload_size);
+   fpi_byte_writer_fill(reply, 0, MATCH_STATS_SIZE);
+   fpi_byte_writer_put_data(reply, payload, payload_size);
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_get_image_metrics(emulator_t *emulator,
+                                               FpiByteReader *reader,
+                                               FpiByteWriter *reply)
+{
+   guint32 type = 0;
+
+   if (!fpi_byte_reader_get_uint32_le(reader, &type)) {
+      return FALSE;
+   }
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_put_uint32_le(reply, type);
+   if (type == MIS_IMAGE_METRICS_IMG_QUALITY) {
+      fpi_byte_writer_put_uint32_le(reply,
+                                    MIS_IMAGE_METRICS_IMG_QUALITY_DATA_SIZE);
+      fpi_byte_writer_put_uint32_le(reply, EMULATOR_IMAGE_QUALITY);
+      fpi_byte_writer_put_uint32_le(reply, EMULATOR_SENSOR_COVERAGE);
+   } else if (type == MIS_IMAGE_METRICS_IPL_FINGER_COVERAGE) {
+      fpi_byte_writer_put_uint32_le(
+          reply, MIS_IMAGE_METRICS_IPL_FINGER_COVERAGE_DATA_SIZE);
+      fpi_byte_writer_put_uint32_le(reply, EMULATOR_SENSOR_COVERAGE);
+   } else {
+      /* no data are available */
+      fpi_byte_writer_put_uint32_le(reply, 0);
+   }
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_db2_get_db_info(emulator_t *emulator,
+                                             FpiByteReader *reader,
+                                             FpiByteWriter *reply)
+{
+   const guint16 num_prints = emulator->prints->len;
+   const guint16 num_available = EMULATOR_MAX_PRINTS - num_prints;
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_put_uint16_le(reply, 0); /* dummy */
+   fpi_byte_writer_put_uint16_le(reply, 1); /* version major */
+   fpi_byte_writer_put_uint16_le(reply, 0); /* version minor */
+   fpi_byte_writer_put_uint32_le(reply, emulator->partition_version);
+   /* object lengths and sizes */
+   fpi_byte_writer_fill(reply, 0, 4 * sizeof(guint16));
+   fpi_byte_writer_put_uint16_le(reply, EMULATOR_PAYLOAD_SLOT_SIZE);
+   /* users, templates and payloads - there is one of each per print and
+    * deleted ones are erased right away */
+   for (guint i = 0; i < 3; ++i) {
+      fpi_byte_writer_put_uint16_le(reply, num_prints);
+      fpi_byte_writer_put_uint16_le(reply, 0);
+      fpi_byte_writer_put_uint16_le(reply, num_available);
+   }
+   fpi_byte_writer_fill(reply, 0,
+                        EMULATOR_DB2_INFO_REPLY_SIZE -
+                            fpi_byte_writer_get_pos(reply));
+
+   return TRUE;
+}
+
+static gboolean emulator_read_object_id(FpiByteReader *reader,
+                                        guint32 *obj_type,
+                                        const guint8 **obj_id)
+{
+   gboolean read_ok = TRUE;
+
+   read_ok &= fpi_byte_reader_get_uint32_le(reader, obj_type);
+   read_ok &= fpi_byte_reader_get_data(reader, DB2_ID_SIZE, obj_id);
+
+   return read_ok && *obj_type >= OBJ_TYPE_USERS &&
+          *obj_type <= OBJ_TYPE_PAYLOADS;
+}
+
+static gboolean emulator_cmd_db2_get_object_list(emulator_t *emulator,
+                                                 FpiByteReader *reader,
+                                                 FpiByteWriter *reply)
+{
+   guint32 obj_type = 0;
+   const guint8 *obj_id = NULL;
+
+   if (!emulator_read_object_id(reader, &obj_type, &obj_id)) {
+      return FALSE;
+   }
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   if (obj_type == OBJ_TYPE_PAYLOADS) {
+      /* payloads of the template */
+      emulator_print_t *print =
+          emulator_find_print(emulator, OBJ_TYPE_TEMPLATES, obj_id, NULL);
+      fpi_byte_writer_put_uint16_le(reply, print != NULL ? 1 : 0);
+      if (print != NULL) {
+         fpi_byte_writer_put_data(reply, print->payload_id, DB2_ID_SIZE);
+      }
+   } else {
+      fpi_byte_writer_put_uint16_le(reply, emulator->prints->len);
+      for (guint i = 0; i < emulator->prints->len; ++i) {
+         emulator_print_t *print = g_ptr_array_index(emulator->prints, i);
+         fpi_byte_writer_put_data(reply, print->template_id, DB2_ID_SIZE);
+      }
+   }
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_db2_get_object_info(emulator_t *emulator,
+                                                 FpiByteReader *reader,
+                                                 FpiByteWriter *reply)
+{
+   guint32 obj_type = 0;
+   const guint8 *obj_id = NULL;
+
+   if (!emulator_read_object_id(reader, &obj_type, &obj_id)) {
+      return FALSE;
+   }
+
+   emulator_print_t *print =
+       emulator_find_print(emulator, obj_type, obj_id, NULL);
+   if (print == NULL) {
+      emulator_put_status(reply, VCS_RESULT_GEN_OBJECT_DOESNT_EXIST_1);
+      return TRUE;
+   }
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   if (obj_type == OBJ_TYPE_USERS) {
+      fpi_byte_writer_fill(reply, 0, EMULATOR_USER_INFO_REPLY_SIZE - 2);
+   } else {
+      const guint32 data_size =
+          obj_type == OBJ_TYPE_PAYLOADS ? g_bytes_get_size(print->payload) : 0;
+      fpi_byte_writer_fill(reply, 0, EMULATOR_OBJECT_INFO_DATA_SIZE_OFFSET - 2);
+      fpi_byte_writer_put_uint32_le(reply, data_size);
+   }
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_db2_get_object_data(emulator_t *emulator,
+                                                 FpiByteReader *reader,
+                                                 FpiByteWriter *reply)
+{
+   guint32 obj_type = 0;
+   const guint8 *obj_id = NULL;
+
+   if (!emulator_read_object_id(reader, &obj_type, &obj_id)) {
+      return FALSE;
+   }
+
+   emulator_print_t *print =
+       emulator_find_print(emulator, obj_type, obj_id, NULL);
+   if (print == NULL) {
+      emulator_put_status(reply, VCS_RESULT_GEN_OBJECT_DOESNT_EXIST_1);
+      return TRUE;
+   }
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_fill(reply, 0, 2);
+   if (obj_type == OBJ_TYPE_PAYLOADS) {
+      gsize payload_size = 0;
+      const guint8 *payload = g_bytes_get_data(print->payload, &payload_size);
+      fpi_byte_writer_put_uint32_le(reply, payload_size);
+      fpi_byte_writer_put_data(reply, payload, payload_size);
+   } else {
+      fpi_byte_writer_put_uint32_le(reply, 0);
+   }
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_db2_delete_object(emulator_t *emulator,
+                                               FpiByteReader *reader,
+                                               FpiByteWriter *reply)
+{
+   guint32 obj_type = 0;
+   const guint8 *obj_id = NULL;
+   guint index = 0;
+
+   if (!emulator_read_object_id(reader, &obj_type, &obj_id)) {
+      return FALSE;
+   }
+
+   /* deleting any object of a print deletes the whole print */
+   if (emulator_find_print(emulator, obj_type, obj_id, &index) == NULL) {
+      emulator_put_status(reply, VCS_RESULT_GEN_OBJECT_DOESNT_EXIST_1);
+      return TRUE;
+   }
+   g_ptr_array_remove_index(emulator->prints, index);
+   emulator->partition_version += 1;
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_put_uint16_le(reply, 1);
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_db2_cleanup(emulator_t *emulator,
+                                         FpiByteReader *reader,
+                                         FpiByteWriter *reply)
+{
+   /* there is nothing to erase as deleted objects are erased right away */
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_put_uint16_le(reply, 0);
+   fpi_byte_writer_put_uint32_le(reply, emulator->partition_version);
+
+   return TRUE;
+}
+
+static gboolean emulator_cmd_db2_format(emulator_t *emulator,
+                                        FpiByteReader *reader,
+                                        FpiByteWriter *reply)
+{
+   g_ptr_array_set_size(emulator->prints, 0);
+   emulator->partition_version += 1;
+
+   emulator_put_status(reply, VCS_RESULT_OK_1);
+   fpi_byte_writer_put_uint32_le(reply, 0);
+   fpi_byte_writer_put_uint32_le(reply, emulator->partition_version);
+
+   return TRUE;
+}
+
+/* writes the plaintext reply to a command */
+static void emulator_handle_cmd(emulator_t *emulator, const guint8 *cmd,
+                                gsize cmd_size, FpiByteWriter *reply)
+{
+   gboolean cmd_ok = TRUE;
+   FpiByteReader reader;
+
+   g_assert(cmd_size >= SENSOR_FW_CMD_HEADER_LEN);
+   fpi_byte_reader_init(&reader, cmd + SENSOR_FW_CMD_HEADER_LEN,
+                        cmd_size - SENSOR_FW_CMD_HEADER_LEN);
+
+   switch (cmd[0]) {
+   case VCSFW_CMD_GET_VERSION:
+      cmd_ok = emulator_cmd_get_version(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_PAIR:
+      cmd_ok = emulator_cmd_pair(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_FRAME_ACQ:
+      cmd_ok = emulator_cmd_frame_acq(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_FRAME_FINISH:
+      cmd_ok = emulator_cmd_frame_finish(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_EVENT_CONFIG:
+      cmd_ok = emulator_cmd_event_config(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_EVENT_READ:
+      cmd_ok = emulator_cmd_event_read(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_ENROLL:
+      cmd_ok = emulator_cmd_enroll(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_IDENTIFY_MATCH:
+      cmd_ok = emulator_cmd_identify_match(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_GET_IMAGE_METRICS:
+      cmd_ok = emulator_cmd_get_image_metrics(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_DB2_GET_DB_INFO:
+      cmd_ok = emulator_cmd_db2_get_db_info(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_DB2_GET_OBJECT_LIST:
+      cmd_ok = emulator_cmd_db2_get_object_list(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_DB2_GET_OBJECT_INFO:
+      cmd_ok = emulator_cmd_db2_get_object_info(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_DB2_GET_OBJECT_DATA:
+      cmd_ok = emulator_cmd_db2_get_object_data(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_DB2_DELETE_OBJECT:
+      cmd_ok = emulator_cmd_db2_delete_object(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_DB2_CLEANUP:
+      cmd_ok = emulator_cmd_db2_cleanup(emulator, &reader, reply);
+      break;
+   case VCSFW_CMD_DB2_FORMAT:
+      cmd_ok = emulator_cmd_db2_format(emulator, &reader, reply);
+      break;
+   default:
+      fp_warn("Emulator: unsupported command 0x%02x = %s", cmd[0],
+              cmd_id_to_str(cmd[0]));
+      emulator_put_status(reply, VCS_RESULT_SENSOR_BAD_CMD);
+      return;
+   }
+
+   if (!cmd_ok) {
+      fp_warn("Emulator: malformed command 0x%02x = %s", cmd[0],
+              cmd_id_to_str(cmd[0]));
+      emulator_put_status(reply, VCS_RESULT_GEN_BAD_PARAM_1);
+   }
+}
+
+static gboolean emulator_handle_app_data(emulator_t *emulator, guint8 *data,
+                                         gsize size, FpiByteWriter *reply,
+                                         guint8 *cmd_id, GError **error)
+{
+   gboolean ret = TRUE;
+   record_t record = {.msg = NULL};
+   g_autofree guint8 *cmd_reply_data = NULL;
+   gsize cmd_reply_size = 0;
+
+   FpiByteWriter cmd_reply;
+   fpi_byte_writer_init(&cmd_reply);
+
+   if (!read_record_in_place(data, size, &record)) {
+      *error = set_and_report_error(FP_DEVICE_ERROR_PROTO,
+                                    "Emulator: received malformed record");
+      ret = FALSE;
+      goto error;
+   }
+   BOOL_CHECK(emulator_tls_decrypt_record(emulator, &record, error));
+   if (record.msg_len == 0) {
+      *error = set_and_report_error(FP_DEVICE_ERROR_PROTO,
+                                    "Emulator: received empty command");
+      ret = FALSE;
+      goto error;
+   }
+
+   *cmd_id = record.msg[0];
+   emulator_handle_cmd(emulator, record.msg, record.msg_len, &cmd_reply);
+   cmd_reply_size = fpi_byte_writer_get_pos(&cmd_reply);
+   cmd_reply_data = fpi_byte_writer_reset_and_get_data(&cmd_reply);
+
+   BOOL_CHECK(emulator_tls_write_encrypted_record(
+       emulator, reply, RECORD_TYPE_APPLICATION_DATA, cmd_reply_data,
+       cmd_reply_size, error));
+
+error:
+   fpi_byte_writer_reset(&cmd_reply);
+   return ret;
+}
+
+/* Transfers =============================================================== */
+
+static gboolean emulator_source_dispatch(GSource *source, GSourceFunc callback,
+                                         gpointer user_data)
+{
+   return callback(user_data);
+}
+
+/* sources are dispatched only by their ready time, which is in microseconds
+ * unlike the timeouts of GLib */
+static GSourceFuncs emulator_source_funcs = {
+    .dispatch = emulator_source_dispatch,
+};
+
+/* creates a source which is dispatched at ready_time of the monotonic clock
+ * or never if it is -1 */
+static GSource *emulator_source_new(gint64 ready_time, GSourceFunc func,
+                                    gpointer user_data)
+{
+   GSource *source = g_source_new(&emulator_source_funcs, sizeof(GSource));
+
+   g_source_set_callback(source, func, user_data, NULL);
+   g_source_set_ready_time(source, ready_time);
+   g_source_attach(source, g_main_context_get_thread_default());
+
+   return source;
+}
+
+static void emulator_transfer_set_ready_time(emulator_transfer_t *emu_transfer,
+                                             gint64 ready_time)
+{
+   /* cancelled transfers are completed right away */
+   if (!emu_transfer->cancelled) {
+      g_source_set_ready_time(emu_transfer->source, ready_time);
+   }
+}
+
+static void emulator_transfer_cancelled(GCancellable *cancellable,
+                                        gpointer user_data)
+{
+   emulator_transfer_t *emu_transfer = user_data;
+
+   emu_transfer->cancelled = TRUE;
+   g_source_set_ready_time(emu_transfer->source, 0);
+}
+
+static void emulator_transfer_free(emulator_transfer_t *emu_transfer)
+{
+   if (emu_transfer->waiting_queue != NULL) {
+      g_queue_remove(emu_transfer->waiting_queue, emu_transfer);
+   }
+   g_queue_remove(&emu_transfer->emulator->transfers, emu_transfer);
+
+   if (emu_transfer->cancellable != NULL) {
+      g_cancellable_disconnect(emu_transfer->cancellable,
+                               emu_transfer->cancelled_handler_id);
+      g_object_unref(emu_transfer->cancellable);
+   }
+   g_source_destroy(emu_transfer->source);
+   g_source_unref(emu_transfer->source);
+   g_clear_pointer(&emu_transfer->data, g_bytes_unref);
+   g_clear_error(&emu_transfer->error);
+   g_free(emu_transfer);
+}
+
+/* copies received data to the transfer; host to device transfers are always
+ * sent whole */
+static void emulator_transfer_fill(FpiUsbTransfer *transfer, GBytes *data)
+{
+   gsize size = 0;
+   const guint8 *to_copy = NULL;
+
+   if (data == NULL) {
+      transfer->actual_length = transfer->length;
+      return;
+   }
+
+   to_copy = g_bytes_get_data(data, &size);
+   if ((gssize)size > transfer->length) {
+      fp_warn("Emulator: %lu bytes of data do not fit to transfer of %ld bytes",
+              size, transfer->length);
+      size = transfer->length;
+   }
+   if (size != 0) {
+      memcpy(transfer->buffer, to_copy, size);
+   }
+   transfer->actual_length = size;
+}
+
+static GError *emulator_transfer_check_short(FpiUsbTransfer *transfer)
+{
+   if (transfer->short_is_error && transfer->actual_length > 0 &&
+       transfer->actual_length != transfer->length) {
+      return g_error_new(G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_IO,
+                         "Unexpected short error of %zd size (expected %zd)",
+                         transfer->actual_length, transfer->length);
+   }
+   return NULL;
+}
+
+/* completes a transfer the same way as fpi_usb_transfer_submit does */
+static gboolean emulator_transfer_complete(gpointer user_data)
+{
+   emulator_transfer_t *emu_transfer = user_data;
+   FpiUsbTransfer *transfer = emu_transfer->transfer;
+   FpiUsbTransferCallback callback = transfer->callback;
+   GError *error = NULL;
+
+   if (emu_transfer->cancelled) {
+      error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                  "Transfer was cancelled");
+      transfer->actual_length = -1;
+   } else if (emu_transfer->error != NULL) {
+      error = g_steal_pointer(&emu_transfer->error);
+      transfer->actual_length = -1;
+   } else {
+      emulator_transfer_fill(transfer, emu_transfer->data);
+      error = emulator_transfer_check_short(transfer);
+   }
+
+   emulator_transfer_free(emu_transfer);
+
+   transfer->callback = NULL;
+   callback(transfer, transfer->device, transfer->user_data, error);
+   fpi_usb_transfer_unref(transfer);
+
+   return G_SOURCE_REMOVE;
+}
+
+/* pairs replies with the transfers waiting for them */
+static void emulator_deliver_replies(emulator_t *emulator)
+{
+   while (!g_queue_is_empty(&emulator->replies) &&
+          !g_queue_is_empty(&emulator->reply_transfers)) {
+      emulator_transfer_t *emu_transfer =
+          g_queue_pop_head(&emulator->reply_transfers);
+      emu_transfer->waiting_queue = NULL;
+      /* the reply is left for the next transfer */
+      if (emu_transfer->cancelled) {
+         continue;
+      }
+
+      emulator_reply_t *reply = g_queue_pop_head(&emulator->replies);
+      emu_transfer->data = reply->data;
+      emulator_transfer_set_ready_time(emu_transfer, reply->ready_time);
+      g_free(reply);
+   }
+}
+
+static void emulator_reply_free(gpointer data)
+{
+   emulator_reply_t *reply = data;
+
+   g_bytes_unref(reply->data);
+   g_free(reply);
+}
+
+/* returns the time at which the reply is ready */
+static gint64 emulator_queue_reply(emulator_t *emulator, guint8 cmd_id,
+                                   GBytes *data)
+{
+   emulator_reply_t *reply = g_new0(emulator_reply_t, 1);
+   const gint64 latency = emulator->latency_us[cmd_id];
+   const gint64 ready_time =
+       MAX(g_get_monotonic_time(), emulator->busy_until) + latency;
+
+   reply->data = data;
+   reply->ready_time = ready_time;
+   emulator->busy_until = ready_time;
+
+   emulator->cmd_stats[cmd_id].count += 1;
+   emulator->cmd_stats[cmd_id].latency_us += latency;
+
+   g_queue_push_tail(&emulator->replies, reply);
+   emulator_deliver_replies(emulator);
+
+   return ready_time;
+}
+
+static gboolean emulator_touch_cb(gpointer user_data)
+{
+   emulator_t *emulator = user_data;
+   const gint64 cpu_start = emulator_cpu_time_us(CLOCK_THREAD_CPUTIME_ID);
+
+   fp_dbg("Emulator: finger is on the sensor");
+   g_clear_pointer(&emulator->touch_source, g_source_unref);
+
+   emulator->finger_down_pending = TRUE;
+   emulator->frame_ready_pending = emulator->poll_events == 0;
+   emulator->finger_up_pending = FALSE;
+   emulator->poll_events_left = emulator->poll_events;
+   emulator->poll_start_process_cpu_us =
+       emulator_cpu_time_us(CLOCK_PROCESS_CPUTIME_ID);
+   emulator->poll_start_emulator_cpu_us = emulator->cpu_time_us;
+   emulator_emit_events(emulator);
+
+   emulator->cpu_time_us +=
+       emulator_cpu_time_us(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+   return G_SOURCE_REMOVE;
+}
+
+/* processes data sent to USB_EP_REQUEST and queues the reply */
+static void emulator_handle_request(emulator_t *emulator,
+                                    const guint8 *request, gsize request_size)
+{
+   gboolean ok = TRUE;
+   GError *error = NULL;
+   guint8 cmd_id = VCSFW_CMD_TLS_DATA;
+   /* requests are processed in place */
+   g_autofree guint8 *data = g_memdup2(request, request_size);
+   const guint tls_data_header_size = 4;
+
+   FpiByteWriter reply;
+   fpi_byte_writer_init(&reply);
+
+   if (request_size == 0) {
+      fp_warn("Emulator: received empty request");
+      emulator_put_status(&reply, VCS_RESULT_SENSOR_BAD_CMD);
+   } else if (emulator->tls.state == EMULATOR_TLS_STATE_ESTABLISHED &&
+              data[0] == RECORD_TYPE_APPLICATION_DATA) {
+      ok = emulator_handle_app_data(emulator, data, request_size, &reply,
+                                    &cmd_id, &error);
+   } else if (emulator->tls.state != EMULATOR_TLS_STATE_NONE &&
+              data[0] == RECORD_TYPE_ALERT) {
+      ok = emulator_tls_handle_records(emulator, data, request_size, &reply,
+                                       &error);
+   } else if (data[0] == VCSFW_CMD_TLS_DATA &&
+              request_size >= tls_data_header_size) {
+      ok = emulator_tls_handle_records(
+          emulator, data + tls_data_header_size,
+          request_size - tls_data_header_size, &reply, &error);
+   } else if (emulator->tls.state == EMULATOR_TLS_STATE_ESTABLISHED) {
+      /* plain commands make the sensor leave the session, which is used by
+       * the driver to close a session it does not know */
+      cmd_id = data[0];
+      emulator_tls_reset(emulator);
+      emulator_put_status(&reply, EMULATOR_STATUS_UNCLOSED_TLS_SESSION);
+   } else {
+      cmd_id = data[0];
+      emulator_handle_cmd(emulator, data, request_size, &reply);
+   }
+
+   if (!ok) {
+      const guint8 handshake_failure[2] = {GNUTLS_AL_FATAL,
+                                           GNUTLS_A_HANDSHAKE_FAILURE};
+      fp_warn("Emulator: TLS error: %s",
+              error != NULL ? error->message : "unknown");
+      g_clear_error(&error);
+      emulator_tls_reset(emulator);
+
+      fpi_byte_writer_reset(&reply);
+      fpi_byte_writer_init(&reply);
+      emulator_write_record(&reply, RECORD_TYPE_ALERT, handshake_failure,
+                            sizeof(handshake_failure));
+   }
+
+   const gsize reply_size = fpi_byte_writer_get_pos(&reply);
+   const gint64 ready_time = emulator_queue_reply(
+       emulator, cmd_id,
+       g_bytes_new_take(fpi_byte_writer_reset_and_get_data(&reply),
+                        reply_size));
+
+   if (emulator->frame_acq_started) {
+      emulator->frame_acq_started = FALSE;
+      emulator_cancel_touch(emulator);
+      emulator->touch_source = emulator_source_new(
+          ready_time + emulator->finger_delay_us, emulator_touch_cb, emulator);
+   }
+}
+
+/* reports the current event sequence number on USB_EP_INTERRUPT */
+static void emulator_raise_interrupt(emulator_t *emulator)
+{
+   guint8 data[USB_INTERRUPT_DATA_SIZE] = {0};
+   emulator_transfer_t *emu_transfer = NULL;
+
+   do {
+      emu_transfer = g_queue_pop_head(&emulator->interrupt_transfers);
+      if (emu_transfer != NULL) {
+         emu_transfer->waiting_queue = NULL;
+      }
+   } while (emu_transfer != NULL && emu_transfer->cancelled);
+
+   if (emu_transfer == NULL) {
+      emulator->interrupt_pending = TRUE;
+      return;
+   }
+   emulator->interrupt_pending = FALSE;
+
+   /* only the low bits of the sequence number are reported */
+   data[USB_INTERRUPT_DATA_SIZE - 1] = emulator->event_seq_num & 0x1f;
+   emu_transfer->data = g_bytes_new(data, sizeof(data));
+   emulator_transfer_set_ready_time(emu_transfer, g_get_monotonic_time());
+}
+
+static GBytes *emulator_control_transfer(emulator_t *emulator,
+                                         FpiUsbTransfer *transfer)
+{
+   emulator->num_control_transfers += 1;
+
+   if (transfer->direction == G_USB_DEVICE_DIRECTION_DEVICE_TO_HOST &&
+       transfer->request == REQUEST_TLS_SESSION_STATUS) {
+      guint8 status[TLS_SESSION_STATUS_DATA_RESP_LEN] = {0};
+      status[0] = emulator->tls.state == EMULATOR_TLS_STATE_ESTABLISHED;
+      return g_bytes_new(status, sizeof(status));
+   } else if (transfer->direction == G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE &&
+              transfer->request == REQUEST_DFT_WRITE) {
+      /* bootloader mode is not emulated */
+      return NULL;
+   }
+
+   fp_warn("Emulator: unsupported control request 0x%02x", transfer->request);
+   if (transfer->direction == G_USB_DEVICE_DIRECTION_DEVICE_TO_HOST) {
+      return g_bytes_new(NULL, 0);
+   }
+   return NULL;
+}
+
+/* Public functions ======================================================== */
+
+void emulator_submit(emulator_t *emulator, FpiUsbTransfer *transfer,
+                     GCancellable *cancellable, FpiUsbTransferCallback callback,
+                     gpointer user_data)
+{
+   const gint64 cpu_start = emulator_cpu_time_us(CLOCK_THREAD_CPUTIME_ID);
+
+   g_return_if_fail(callback);
+   /* Recycling is allowed, but not two at the same time. */
+   g_return_if_fail(transfer->callback == NULL);
+
+   transfer->callback = callback;
+   transfer->user_data = user_data;
+
+   emulator_transfer_t *emu_transfer = g_new0(emulator_transfer_t, 1);
+   emu_transfer->emulator = emulator;
+   emu_transfer->transfer = transfer;
+   emu_transfer->source =
+       emulator_source_new(-1, emulator_transfer_complete, emu_transfer);
+   g_queue_push_tail(&emulator->transfers, emu_transfer);
+
+   if (cancellable != NULL) {
+      emu_transfer->cancellable = g_object_ref(cancellable);
+      emu_transfer->cancelled_handler_id =
+          g_cancellable_connect(cancellable,
+                                G_CALLBACK(emulator_transfer_cancelled),
+                                emu_transfer, NULL);
+   }
+
+   if (emu_transfer->cancelled) {
+      /* cancelled before being started, nothing is sent */
+   } else if (transfer->type == FP_TRANSFER_CONTROL) {
+      emu_transfer->data = emulator_control_transfer(emulator, transfer);
+      emulator_transfer_set_ready_time(
+          emu_transfer, g_get_monotonic_time() + emulator->default_latency_us);
+   } else if (transfer->endpoint == USB_EP_REQUEST) {
+      emulator_handle_request(emulator, transfer->buffer, transfer->length);
+      emulator_transfer_set_ready_time(emu_transfer, g_get_monotonic_time());
+   } else if (transfer->endpoint == USB_EP_REPLY) {
+      emu_transfer->waiting_queue = &emulator->reply_transfers;
+      g_queue_push_tail(&emulator->reply_transfers, emu_transfer);
+      emulator_deliver_replies(emulator);
+   } else if (transfer->endpoint == USB_EP_INTERRUPT) {
+      emu_transfer->waiting_queue = &emulator->interrupt_transfers;
+      g_queue_push_tail(&emulator->interrupt_transfers, emu_transfer);
+      if (emulator->interrupt_pending) {
+         emulator_raise_interrupt(emulator);
+      }
+   } else {
+      emu_transfer->error =
+          g_error_new(G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_NOT_SUPPORTED,
+                      "Emulator does not support endpoint 0x%02x",
+                      transfer->endpoint);
+      emulator_transfer_set_ready_time(emu_transfer, g_get_monotonic_time());
+   }
+
+   emulator->cpu_time_us +=
+       emulator_cpu_time_us(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+}
+
+gboolean emulator_submit_sync(emulator_t *emulator, FpiUsbTransfer *transfer,
+                              GError **error)
+{
+   g_autoptr(GBytes) data = NULL;
+
+   if (transfer->type != FP_TRANSFER_CONTROL) {
+      g_set_error(error, G_USB_DEVICE_ERROR, G_USB_DEVICE_ERROR_NOT_SUPPORTED,
+                  "Emulator supports only synchronous control transfers");
+      return FALSE;
+   }
+
+   data = emulator_control_transfer(emulator, transfer);
+   g_usleep(emulator->default_latency_us);
+   emulator_transfer_fill(transfer, data);
+
+   GError *short_error = emulator_transfer_check_short(transfer);
+   if (short_error != NULL) {
+      g_propagate_error(error, short_error);
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+/* stores a big endian coordinate as little endian number of ECC_KEY_SIZE bytes
+ * like it is stored in certificates */
+static void emulator_store_coordinate(guint8 *dst,
+                                      const gnutls_datum_t *coordinate)
+{
+   /* gnutls may add a leading zero or strip leading zeros */
+   const gsize size = MIN(coordinate->size, ECC_KEY_SIZE);
+
+   memset(dst, 0, CERTIFICATE_KEY_SIZE);
+   memcpy(dst + ECC_KEY_SIZE - size,
+          coordinate->data + coordinate->size - size, size);
+   reverse_array(dst, ECC_KEY_SIZE);
+}
+
+/* generates the key of the emulated sensor and its certificate, which is not
+ * signed as it is not verified */
+static gboolean emulator_create_sensor_key(emulator_t *emulator,
+                                           GError **error)
+{
+   gboolean ret = TRUE;
+   gboolean pubkey_initialized = FALSE;
+   gnutls_pubkey_t pubkey;
+   gnutls_datum_t x = {.data = NULL, .size = 0};
+   gnutls_datum_t y = {.data = NULL, .size = 0};
+
+   GNUTLS_CHECK(gnutls_privkey_init(&emulator->privkey));
+   emulator->privkey_initialized = TRUE;
+   BOOL_CHECK(emulator->random->generate_key(emulator->random,
+                                             emulator->privkey, error));
+
+   GNUTLS_CHECK(gnutls_pubkey_init(&pubkey));
+   pubkey_initialized = TRUE;
+   GNUTLS_CHECK(gnutls_pubkey_import_privkey(pubkey, emulator->privkey,
+                                             GNUTLS_KEY_DIGITAL_SIGNATURE, 0));
+   GNUTLS_CHECK(gnutls_pubkey_export_ecc_raw(pubkey, NULL, &x, &y));
+
+   emulator->cert.magic = CERTIFICATE_MAGIC;
+   emulator->cert.curve = CERTIFICATE_CURVE;
+   emulator_store_coordinate(emulator->cert.pubkey_x, &x);
+   emulator_store_coordinate(emulator->cert.pubkey_y, &y);
+   emulator->cert.sign_size = 0;
+
+error:
+   g_free(x.data);
+   g_free(y.data);
+   if (pubkey_initialized) {
+      gnutls_pubkey_deinit(pubkey);
+   }
+   return ret;
+}
+
+/* an entry without '=' sets the default for all commands, so it is applied
+ * before the others */
+static void emulator_parse_latency(emulator_t *emulator, const gchar *config)
+{
+   g_auto(GStrv) entries = g_strsplit(config, ",", -1);
+
+   for (guint i = 0; entries[i] != NULL; ++i) {
+      if (strchr(entries[i], '=') == NULL && entries[i][0] != '\0') {
+         emulator->default_latency_us =
+             MAX(g_ascii_strtoll(entries[i], NULL, 0), 0);
+      }
+   }
+   for (guint i = 0; i < EMULATOR_NUM_CMD_IDS; ++i) {
+      emulator->latency_us[i] = emulator->default_latency_us;
+   }
+
+   for (guint i = 0; entries[i] != NULL; ++i) {
+      g_auto(GStrv) entry = g_strsplit(entries[i], "=", 2);
+      if (entry[0] == NULL || entry[1] == NULL) {
+         continue;
+      }
+
+      const guint64 cmd_id = g_ascii_strtoull(entry[0], NULL, 0);
+      if (cmd_id >= EMULATOR_NUM_CMD_IDS) {
+         fp_warn("Emulator: invalid command ID in latency entry: %s",
+                 entries[i]);
+         continue;
+      }
+      emulator->latency_us[cmd_id] = MAX(g_ascii_strtoll(entry[1], NULL, 0), 0);
+   }
+}
+
+emulator_t *emulator_new(random_provider_t *random, GError **error)
+{
+   gboolean ret = TRUE;
+   emulator_t *emulator = g_new0(emulator_t, 1);
+   const gchar *latency = g_getenv(SYNA_TUDOR_MOC_EMULATOR_LATENCY_ENV);
+   const gchar *finger_delay = g_getenv(SYNA_TUDOR_MOC_EMULATOR_FINGER_DELAY_ENV);
+   const gchar *poll_events = g_getenv(SYNA_TUDOR_MOC_EMULATOR_POLL_EVENTS_ENV);
+
+   emulator->random = random;
+   emulator->tls.handshake_msgs = g_byte_array_new();
+   emulator->prints =
+       g_ptr_array_new_with_free_func((GDestroyNotify)emulator_print_free);
+
+   emulator_parse_latency(emulator, latency != NULL ? latency : "");
+   if (finger_delay != NULL) {
+      emulator->finger_delay_us = MAX(g_ascii_strtoll(finger_delay, NULL, 0), 0);
+   }
+   if (poll_events != NULL) {
+      emulator->poll_events =
+          CLAMP(g_ascii_strtoll(poll_events, NULL, 0), 0, G_MAXUINT);
+   }
+
+   BOOL_CHECK(emulator_create_sensor_key(emulator, error));
+
+   fp_info("Using emulated sensor with default latency %" G_GINT64_FORMAT
+           " us and finger delay %" G_GINT64_FORMAT " us",
+           emulator->default_latency_us, emulator->finger_delay_us);
+
+error:
+   if (!ret) {
+      emulator_free(emulator);
+      emulator = NULL;
+   }
+   return emulator;
+}
+
+void emulator_free(emulator_t *emulator)
+{
+   /* the device is being destroyed, so callbacks of transfers which did not
+    * complete are not called */
+   while (!g_queue_is_empty(&emulator->transfers)) {
+      emulator_transfer_t *emu_transfer =
+          g_queue_peek_head(&emulator->transfers);
+      FpiUsbTransfer *transfer = emu_transfer->transfer;
+
+      emulator_transfer_free(emu_transfer);
+      transfer->callback = NULL;
+      fpi_usb_transfer_unref(transfer);
+   }
+   g_queue_clear_full(&emulator->replies, emulator_reply_free);
+
+   emulator_cancel_touch(emulator);
+   emulator_tls_reset(emulator);
+   g_byte_array_unref(emulator->tls.handshake_msgs);
+   g_ptr_array_unref(emulator->prints);
+   if (emulator->privkey_initialized) {
+      gnutls_privkey_deinit(emulator->privkey);
+   }
+   g_free(emulator);
+}
+
+/* the CPU time of the process which was not spent in the emulator is the
+ * overhead of the driver, libfprint and the application */
+void emulator_log_stats(emulator_t *emulator)
+{
+   const gint64 process_cpu_time_us =
+       emulator_cpu_time_us(CLOCK_PROCESS_CPUTIME_ID);
+
+   fp_info("Emulator statistics:");
+   for (guint i = 0; i < EMULATOR_NUM_CMD_IDS; ++i) {
+      const emulator_cmd_stats_t *stats = &emulator->cmd_stats[i];
+      if (stats->count == 0) {
+         continue;
+      }
+      fp_info("\t0x%02x = %s: %u replies with emulated latency of %" G_GINT64_FORMAT
+              " us in total",
+              i, cmd_id_to_str(i), stats->count, stats->latency_us);
+   }
+   fp_info("\tcontrol transfers: %u", emulator->num_control_transfers);
+   if (emulator->poll_num_events > 0) {
+      fp_info("\tevent poll: %u events, %" G_GINT64_FORMAT
+              " us of CPU time outside of the emulator per event",
+              emulator->poll_num_events,
+              emulator->poll_driver_cpu_us / emulator->poll_num_events);
+   }
+   fp_info("\tCPU time of the process: %" G_GINT64_FORMAT
+           " us, of the emulator: %" G_GINT64_FORMAT " us",
+           process_cpu_time_us, emulator->cpu_time_us);
+}
+
+void emulator_get_sensor_certificate(emulator_t *emulator, cert_t *cert)
+{
+   memcpy(cert, &emulator->cert, sizeof(*cert));
+}
@@ -0,0 +1,62 @@
+/*
+ * Synaptics Tudor Match-In-Sensor driver for libfprint
+ *
+ * Copyright (c) 2024 Vojtěch Pluskal
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * software emulation of the sensor, which is used in place of the USB device
+ * for benchmarking of the driver; only built with the syna_tudor_moc_testing
+ * option, which defines SYNA_TUDOR_MOC_TESTING
+ */
+
+#pragma once
+
+#include "device.h"
+#include "fpi-usb-transfer.h"
+#include <glib.h>
+
+/* latency of the emulated sensor in us as a comma separated list, where an
+ * entry without '=' is the default latency of all commands and entries in form
+ * <command ID>=<latency> override it for single commands, e.g.
+ * "500,0x80=20000,0x99=80000" */
+#define SYNA_TUDOR_MOC_EMULATOR_LATENCY_ENV "FP_SYNA_TUDOR_MOC_EMULATOR_LATENCY"
+/* time in us after which the finger touches the sensor once a frame
+ * acquisition has started */
+#define SYNA_TUDOR_MOC_EMULATOR_FINGER_DELAY_ENV                               \
+   "FP_SYNA_TUDOR_MOC_EMULATOR_FINGER_DELAY"
+/* number of finger down events which the finger causes before the frame is
+ * ready, one per EVENT_READ, which benchmarks the event-poll loop of the
+ * driver; its CPU time per event is logged on close */
+#define SYNA_TUDOR_MOC_EMULATOR_POLL_EVENTS_ENV                                \
+   "FP_SYNA_TUDOR_MOC_EMULATOR_POLL_EVENTS"
+
+emulator_t *emulator_new(random_provider_t *random, GError **error);
+
+void emulator_free(emulator_t *emulator);
+
+void emulator_log_stats(emulator_t *emulator);
+
+void emulator_get_sensor_certificate(emulator_t *emulator, cert_t *cert);
+
+/* emulated counterparts of fpi_usb_transfer_submit(_sync) */
+void emulator_submit(emulator_t *emulator, FpiUsbTransfer *transfer,
+                     GCancellable *cancellable, FpiUsbTransferCallback callback,
+                     gpointer user_data);
+
+gboolean emulator_submit_sync(emulator_t *emulator, FpiUsbTransfer *transfer,
+                              GError **error);
@@ -22,7 +22,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
-/* WARN: current implementation starts a new TLS session on each device open */
+/* NOTE: on device open the TLS session of the last full handshake is resumed
+ * with an abbreviated handshake if the sensor accepts it, if that handshake
+ * fails, the open falls back to a full one */
 
 #include "communication.c"
 #include "device.h"
@@ -30,13 +32,25 @@
 #include "fpi-ssm.h"
 #include "syna_tudor_moc.h"
 #include "tls.c"
+#include "emulator.h"
 #include <gnutls/abstract.h>
 #include <gnutls/gnutls.h>
 
 /* Needed for testing with libfprint examples they do not support storage of
- * pairing data */
+ * pairing data; the TLS session is still stored for resumption */
 #define USE_SAMPLE_PAIRING_DATA
 
+/* host cert, sensor cert, curve, private key x, y, k, TLS session id, master
+ * secret and template index cache; older formats are without the template
+ * index cache and without the TLS session */
+#define PAIRING_DATA_FORMAT "(@ay@ayu@ay@ay@ay@ay@ayv)"
+#define PAIRING_DATA_FORMAT_WITHOUT_TEMPLATE_INDEX "(@ay@ayu@ay@ay@ay@ay@ay)"
+#define PAIRING_DATA_FORMAT_WITHOUT_TLS_SESSION "(@ay@ayu@ay@ay@ay)"
+/* valid, partition version, numbers of current users, templates, payloads,
+ * numbers of deleted users, templates, payloads and (payload ID, payload data)
+ * pairs */
+#define TEMPLATE_INDEX_FORMAT "(buqqqqqqa(ayay))"
+
 static db2_id_t cache_template_id = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
                                      0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
                                      0xff, 0xff, 0xff, 0xff};
@@ -120,10 +134,167 @@ error:
    return ret;
 }
 
+/* template index cache ==================================================== */
+
+static gboolean storage_is_equal(const storage_t *a, const storage_t *b)
+{
+   return a->partition_version == b->partition_version &&
+          a->num_current_users == b->num_current_users &&
+          a->num_current_templates == b->num_current_templates &&
+          a->num_current_payloads == b->num_current_payloads &&
+          a->num_deleted_users == b->num_deleted_users &&
+          a->num_deleted_templates == b->num_deleted_templates &&
+          a->num_deleted_payloads == b->num_deleted_payloads;
+}
+
+static GHashTable *payload_table_new(void)
+{
+   return g_hash_table_new_full(g_bytes_hash, g_bytes_equal,
+                                (GDestroyNotify)g_bytes_unref,
+                                (GDestroyNotify)g_bytes_unref);
+}
+
+static void template_index_cache_clear(FpiDeviceSynaTudorMoc *self)
+{
+   template_index_cache_t *cache = &self->template_index;
+
+   cache->valid = FALSE;
+   memset(&cache->storage, 0, sizeof(cache->storage));
+   g_clear_pointer(&cache->payload_ids, g_array_unref);
+   g_clear_pointer(&cache->payloads, g_hash_table_unref);
+}
+
+/* takes ownership of payload_ids and payloads */
+static void template_index_cache_set(FpiDeviceSynaTudorMoc *self,
+                                     GArray *payload_ids, GHashTable *payloads)
+{
+   template_index_cache_t *cache = &self->template_index;
+
+   template_index_cache_clear(self);
+   cache->storage = self->storage;
+   cache->payload_ids = payload_ids;
+   cache->payloads = payloads;
+   cache->valid = TRUE;
+}
+
+/* returns cached data of a payload even if the cache is outdated, as payload
+ * data do not change while the payload exists */
+static GBytes *template_index_cache_lookup(FpiDeviceSynaTudorMoc *self,
+                                           const guint8 *payload_id)
+{
+   if (self->template_index.payloads == NULL) {
+      return NULL;
+   }
+
+   g_autoptr(GBytes) key = g_bytes_new_static(payload_id, DB2_ID_SIZE);
+   return g_hash_table_lookup(self->template_index.payloads, key);
+}
+
+static GVariant *template_index_cache_serialize(FpiDeviceSynaTudorMoc *self)
+{
+   template_index_cache_t *cache = &self->template_index;
+   GVariantBuilder builder;
+
+   g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ayay)"));
+   for (guint i = 0; cache->valid && i < cache->payload_ids->len; ++i) {
+      const guint8 *payload_id =
+          g_array_index(cache->payload_ids, db2_id_t, i);
+      GBytes *payload = template_index_cache_lookup(self, payload_id);
+      gsize payload_size = 0;
+      const guint8 *payload_data = g_bytes_get_data(payload, &payload_size);
+
+      g_variant_builder_add(
+          &builder, "(@ay@ay)",
+          g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, payload_id,
+                                    DB2_ID_SIZE, 1),
+          g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, payload_data,
+                                    payload_size, 1));
+   }
+
+   return g_variant_new(
+       TEMPLATE_INDEX_FORMAT, cache->valid, cache->storage.partition_version,
+       cache->storage.num_current_users, cache->storage.num_current_templates,
+       cache->storage.num_current_payloads, cache->storage.num_deleted_users,
+       cache->storage.num_deleted_templates,
+       cache->storage.num_deleted_payloads, &builder);
+}
+
+static void template_index_cache_load(FpiDeviceSynaTudorMoc *self,
+                                      GVariant *template_index_var)
+{
+   template_index_cache_t *cache = &self->template_index;
+   g_autoptr(GVariantIter) iter = NULL;
+   GVariant *payload_id_var = NULL;
+   GVariant *payload_data_var = NULL;
+   gboolean valid = FALSE;
+   storage_t storage = {0};
+
+   template_index_cache_clear(self);
+
+   if (template_index_var == NULL ||
+       !g_variant_check_format_string(template_index_var,
+                                      TEMPLATE_INDEX_FORMAT, FALSE)) {
+      fp_dbg("No template index stored in pairing data");
+      return;
+   }
+
+   g_variant_get(template_index_var, TEMPLATE_INDEX_FORMAT, &valid,
+                 &storage.partition_version, &storage.num_current_users,
+                 &storage.num_current_templates, &storage.num_current_payloads,
+                 &storage.num_deleted_users, &storage.num_deleted_templates,
+                 &storage.num_deleted_payloads, &iter);
+   if (!valid) {
+      fp_dbg("No template index stored in pairing data");
+      return;
+   }
+
+   GArray *payload_ids = g_array_new(FALSE, FALSE, DB2_ID_SIZE);
+   GHashTable *payloads = payload_table_new();
+   while (g_variant_iter_next(iter, "(@ay@ay)", &payload_id_var,
+                              &payload_data_var)) {
+      gsize payload_id_size = 0;
+      gsize payload_data_size = 0;
+      const guint8 *payload_id = g_variant_get_fixed_array(
+          payload_id_var, &payload_id_size, 1);
+      const guint8 *payload_data = g_variant_get_fixed_array(
+          payload_data_var, &payload_data_size, 1);
+
+      if (payload_id_size == DB2_ID_SIZE) {
+         g_array_append_vals(payload_ids, payload_id, 1);
+         g_hash_table_insert(payloads, g_bytes_new(payload_id, DB2_ID_SIZE),
+                             g_bytes_new(payload_data, payload_data_size));
+      } else {
+         valid = FALSE;
+      }
+      g_variant_unref(payload_id_var);
+      g_variant_unref(payload_data_var);
+   }
+
+   if (!valid) {
+      fp_warn("Stored template index is malformed - ignoring it");
+      g_array_unref(payload_ids);
+      g_hash_table_unref(payloads);
+      return;
+   }
+
+   template_index_cache_set(self, payload_ids, payloads);
+   /* the key is what was stored, not the current storage info */
+   cache->storage = storage;
+   fp_dbg("Loaded template index with %u payloads", payload_ids->len);
+}
+
+/* pairing data ============================================================ */
+
 static gboolean store_pairing_data(FpiDeviceSynaTudorMoc *self, GError **error)
 {
    gboolean ret = TRUE;
 
+   /* the stored pairing data belong to the real sensor */
+   if (self->emulator != NULL) {
+      fp_dbg("Pairing data of emulated sensor are not stored");
+      return TRUE;
+   }
+
    if (!self->pairing_data.present) {
       *error = set_and_report_error(
           FP_DEVICE_ERROR_GENERAL,
@@ -154,9 +325,19 @@ static gboolean store_pairing_data(FpiDeviceSynaTudorMoc *self, GError **error)
    GVariant *private_key_k_var =
        g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, k.data, k.size, 1);
 
-   GVariant *pairing_data =
-       g_variant_new("(@ay@ayu@ay@ay@ay)", host_cert, sensor_cert, curve,
-                     private_key_x_var, private_key_y_var, private_key_k_var);
+   /* store empty arrays if there is no session to be resumed */
+   const gboolean session_present = self->tls_session_cache.present;
+   GVariant *session_id_var = g_variant_new_fixed_array(
+       G_VARIANT_TYPE_BYTE, self->tls_session_cache.session_id,
+       session_present ? SESSION_ID_LEN : 0, 1);
+   GVariant *master_secret_var = g_variant_new_fixed_array(
+       G_VARIANT_TYPE_BYTE, self->tls_session_cache.master_secret,
+       session_present ? MASTER_SECRET_SIZE : 0, 1);
+
+   GVariant *pairing_data = g_variant_new(
+       PAIRING_DATA_FORMAT, host_cert, sensor_cert, curve, private_key_x_var,
+       private_key_y_var, private_key_k_var, session_id_var, master_secret_var,
+       template_index_cache_serialize(self));
 
    g_object_set(FP_DEVICE(self), "fpi-persistent-data", pairing_data, NULL);
 
@@ -172,8 +353,6 @@ static gboolean store_pairing_data(FpiDeviceSynaTudorMoc *self, GError **error)
    fp_dbg_large_hex(x.data, x.size);
    fp_dbg("\tPrivate key y:");
    fp_dbg_large_hex(y.data, y.size);
-   fp_dbg("\tPrivate key k:");
-   fp_dbg_large_hex(k.data, k.size);
 
 error:
    if (x.data != NULL) {
@@ -188,17 +367,75 @@ error:
    return ret;
 }
 
+static void load_tls_session_cache(FpiDeviceSynaTudorMoc *self,
+                                   GVariant *session_id_var,
+                                   GVariant *master_secret_var)
+{
+   gsize session_id_size = 0;
+   gsize master_secret_size = 0;
+   const guint8 *session_id = NULL;
+   const guint8 *master_secret = NULL;
+
+   tls_session_cache_clear(self);
+
+   if (session_id_var == NULL || master_secret_var == NULL) {
+      fp_dbg("No TLS session stored in pairing data");
+      return;
+   }
+
+   session_id = g_variant_get_fixed_array(session_id_var, &session_id_size, 1);
+   master_secret =
+       g_variant_get_fixed_array(master_secret_var, &master_secret_size, 1);
+   if (session_id_size != SESSION_ID_LEN ||
+       master_secret_size != MASTER_SECRET_SIZE) {
+      fp_dbg("No TLS session stored in pairing data");
+      return;
+   }
+
+   memcpy(self->tls_session_cache.session_id, session_id, SESSION_ID_LEN);
+   memcpy(self->tls_session_cache.master_secret, master_secret,
+          MASTER_SECRET_SIZE);
+   self->tls_session_cache.present = TRUE;
+   fp_dbg("Loaded TLS session for resumption");
+}
+
+/* loads only the TLS session and the template index from the stored pairing
+ * data, which is used with the sample pairing data */
+static void load_stored_caches(FpiDeviceSynaTudorMoc *self)
+{
+   g_autoptr(GVariant) pairing_data = NULL;
+   g_autoptr(GVariant) session_id_var = NULL;
+   g_autoptr(GVariant) master_secret_var = NULL;
+   g_autoptr(GVariant) template_index_var = NULL;
+
+   g_object_get(FP_DEVICE(self), "fpi-persistent-data", &pairing_data, NULL);
+
+   if (pairing_data == NULL) {
+      fp_dbg("No stored pairing data with TLS session");
+   } else if (g_variant_check_format_string(pairing_data, PAIRING_DATA_FORMAT,
+                                            FALSE)) {
+      g_variant_get(pairing_data, PAIRING_DATA_FORMAT, NULL, NULL, NULL, NULL,
+                    NULL, NULL, &session_id_var, &master_secret_var,
+                    &template_index_var);
+   } else if (g_variant_check_format_string(
+                  pairing_data, PAIRING_DATA_FORMAT_WITHOUT_TEMPLATE_INDEX,
+                  FALSE)) {
+      g_variant_get(pairing_data, PAIRING_DATA_FORMAT_WITHOUT_TEMPLATE_INDEX,
+                    NULL, NULL, NULL, NULL, NULL, NULL, &session_id_var,
+                    &master_secret_var);
+   }
+
+   load_tls_session_cache(self, session_id_var, master_secret_var);
+   template_index_cache_load(self, template_index_var);
+}
+
 static gboolean load_pairing_data(FpiDeviceSynaTudorMoc *self, GError **error)
 {
    gboolean ret = TRUE;
 
    if (self->pairing_data.present) {
       fp_warn("Overwriting currently stored pairing data");
-      self->pairing_data.present = FALSE;
-      if (self->pairing_data.private_key_initialized) {
-         gnutls_privkey_deinit(self->pairing_data.private_key);
-         self->pairing_data.private_key_initialized = FALSE;
-      }
+      free_pairing_data(self);
    }
 
    g_autoptr(GVariant) pairing_data = NULL;
@@ -207,6 +444,9 @@ static gboolean load_pairing_data(FpiDeviceSynaTudorMoc *self, GError **error)
    g_autoptr(GVariant) private_key_x_var = NULL;
    g_autoptr(GVariant) private_key_y_var = NULL;
    g_autoptr(GVariant) private_key_k_var = NULL;
+   g_autoptr(GVariant) session_id_var = NULL;
+   g_autoptr(GVariant) master_secret_var = NULL;
+   g_autoptr(GVariant) template_index_var = NULL;
    gnutls_datum_t x = {.data = NULL};
    gnutls_datum_t y = {.data = NULL};
    gnutls_datum_t k = {.data = NULL};
@@ -221,18 +461,33 @@ static gboolean load_pairing_data(FpiDeviceSynaTudorMoc *self, GError **error)
       goto error;
    }
 
-   if (!g_variant_check_format_string(pairing_data, "(@ay@ayu@ay@ay@ay)",
-                                      FALSE)) {
+   if (g_variant_check_format_string(pairing_data, PAIRING_DATA_FORMAT,
+                                     FALSE)) {
+      g_variant_get(pairing_data, PAIRING_DATA_FORMAT, &host_cert_var,
+                    &sensor_cert_var, &curve, &private_key_x_var,
+                    &private_key_y_var, &private_key_k_var, &session_id_var,
+                    &master_secret_var, &template_index_var);
+   } else if (g_variant_check_format_string(
+                  pairing_data, PAIRING_DATA_FORMAT_WITHOUT_TEMPLATE_INDEX,
+                  FALSE)) {
+      g_variant_get(pairing_data, PAIRING_DATA_FORMAT_WITHOUT_TEMPLATE_INDEX,
+                    &host_cert_var, &sensor_cert_var, &curve,
+                    &private_key_x_var, &private_key_y_var,
+                    &private_key_k_var, &session_id_var, &master_secret_var);
+   } else if (g_variant_check_format_string(
+                  pairing_data, PAIRING_DATA_FORMAT_WITHOUT_TLS_SESSION,
+                  FALSE)) {
+      g_variant_get(pairing_data, PAIRING_DATA_FORMAT_WITHOUT_TLS_SESSION,
+                    &host_cert_var, &sensor_cert_var, &curve,
+                    &private_key_x_var, &private_key_y_var,
+                    &private_key_k_var);
+   } else {
       *error = set_and_report_error(
           FP_DEVICE_ERROR_GENERAL, "Stored pairing data have incorrect format");
       ret = FALSE;
       goto error;
    }
 
-   g_variant_get(pairing_data, "(@ay@ayu@ay@ay@ay)", &host_cert_var,
-                 &sensor_cert_var, &curve, &private_key_x_var,
-                 &private_key_y_var, &private_key_k_var);
-
    gsize host_cert_data_size = 0;
    guint8 *host_cert_data = (guint8 *)g_variant_get_fixed_array(
        host_cert_var, &host_cert_data_size, 1);
@@ -266,17 +521,15 @@ static gboolean load_pairing_data(FpiDeviceSynaTudorMoc *self, GError **error)
    k.data = (guint8 *)g_variant_get_fixed_array(private_key_k_var,
                                                 (gsize *)&k.size, 1);
 
-   GNUTLS_CHECK(gnutls_privkey_init(&self->pairing_data.private_key));
-   self->pairing_data.private_key_initialized = TRUE;
-
-   /* as we use only one curve, there is no need to store it */
-   GNUTLS_CHECK(gnutls_privkey_import_ecc_raw(self->pairing_data.private_key,
-                                              curve, &x, &y, &k));
-   GNUTLS_CHECK(gnutls_privkey_verify_params(self->pairing_data.private_key));
-   self->pairing_data.private_key_initialized = TRUE;
+   /* skips the import and its validation if the same pairing data were
+    * already loaded by this process */
+   BOOL_CHECK(import_pairing_private_key(self, curve, &x, &y, &k, error));
 
    self->pairing_data.present = TRUE;
 
+   load_tls_session_cache(self, session_id_var, master_secret_var);
+   template_index_cache_load(self, template_index_var);
+
    fp_dbg("Pairing data load success");
 
    fp_dbg("Pairing data:");
@@ -289,8 +542,6 @@ static gboolean load_pairing_data(FpiDeviceSynaTudorMoc *self, GError **error)
    fp_dbg_large_hex(x.data, x.size);
    fp_dbg("\tPrivate key y:");
    fp_dbg_large_hex(y.data, y.size);
-   fp_dbg("\tPrivate key k:");
-   fp_dbg_large_hex(k.data, k.size);
 
 error:
    return ret;
@@ -298,15 +549,66 @@ error:
 
 /* open ==================================================================== */
 
+/* stores the new session next to pairing data, so that it can be resumed after
+ * the device is reopened */
+static void persist_tls_session(FpiDeviceSynaTudorMoc *self)
+{
+   tls_session_cache_update(self);
+
+   GError *error = NULL;
+   if (!store_pairing_data(self, &error)) {
+      fp_warn("Unable to store TLS session for resumption: %s",
+              error->message);
+      g_clear_error(&error);
+   }
+}
+
+/* stores the template index next to pairing data, so that list can use it
+ * after the device is reopened */
+static void persist_template_index(FpiDeviceSynaTudorMoc *self)
+{
+   GError *error = NULL;
+   if (!store_pairing_data(self, &error)) {
+      fp_warn("Unable to store template index: %s", error->message);
+      g_clear_error(&error);
+   }
+}
+
+/* enroll, delete and clear storage change the stored prints, so the index is
+ * dropped even if the DB2 info would happen to match it again */
+static void invalidate_template_index(FpiDeviceSynaTudorMoc *self)
+{
+   if (!self->template_index.valid) {
+      return;
+   }
+   template_index_cache_clear(self);
+   persist_template_index(self);
+}
+
 static void fetch_pairing_data(FpiDeviceSynaTudorMoc *self)
 {
    GError *error = NULL;
 
+#ifdef SYNA_TUDOR_MOC_TESTING
+   /* the emulated sensor has its own key and must not touch the stored pairing
+    * data of the real sensor, so it uses the sample ones */
+   if (self->emulator != NULL) {
+      if (!load_sample_pairing_data(self, &error)) {
+         fp_err("Error while loading sample pairing data");
+         goto error;
+      }
+      emulator_get_sensor_certificate(self->emulator,
+                                      &self->pairing_data.sensor_cert);
+      goto error;
+   }
+#endif
+
 #ifdef USE_SAMPLE_PAIRING_DATA
    if (!load_sample_pairing_data(self, &error)) {
       fp_err("Error while loading sample pairing data");
       goto error;
    }
+   load_stored_caches(self);
 #else
 
    g_autoptr(GVariant) pairing_data = NULL;
@@ -375,6 +677,7 @@ static void open_sm_run_state(FpiSsm *ssm, FpDevice *device)
          fpi_ssm_next_state(ssm);
       } else if (self->tls.established && remote_established) {
          fp_dbg("Host and sensor are already in TLS session");
+         ssm_data->tls_session_kept = TRUE;
          fpi_ssm_mark_completed(ssm);
       } else { // both not established
          fpi_ssm_jump_to_state(ssm, OPEN_STATE_SEND_GET_VERSION);
@@ -404,10 +707,22 @@ static void open_sm_run_state(FpiSsm *ssm, FpDevice *device)
       }
       break;
    case OPEN_STATE_LOAD_PAIRING_DATA:
+      /* they were loaded and verified before the resumed handshake */
+      if (ssm_data->resume_failed) {
+         fpi_ssm_jump_to_state(ssm, OPEN_STATE_TLS_HS_PREPARE);
+         break;
+      }
       fetch_pairing_data(self);
       fpi_ssm_next_state(ssm);
       break;
    case OPEN_STATE_VERIFY_SENSOR_CERTIFICATE:
+#ifdef SYNA_TUDOR_MOC_TESTING
+      if (self->emulator != NULL) {
+         fp_dbg("Emulated sensor certificate is not verified");
+         fpi_ssm_next_state(ssm);
+         break;
+      }
+#endif
       verify_sensor_certificate(self, &error);
       if (error != NULL) {
          fpi_ssm_mark_failed(ssm, error);
@@ -418,19 +733,33 @@ static void open_sm_run_state(FpiSsm *ssm, FpDevice *device)
    case OPEN_STATE_TLS_HS_PREPARE:
       g_assert(!self->tls.established);
       fp_dbg("TLS handshake state: prepare");
-      tls_handshake_state_prepare(self);
-      fpi_ssm_next_state(ssm);
+      ssm_data->handshake_start_time = g_get_monotonic_time();
+      if (tls_handshake_state_prepare(self, &error)) {
+         fpi_ssm_next_state(ssm);
+      } else {
+         fpi_ssm_mark_failed(ssm, error);
+      }
       break;
    case OPEN_STATE_TLS_HS_STATE_SEND_CLIENT_HELLO:
       tls_handshake_state_start(self);
       break;
    case OPEN_STATE_TLS_HS_STATE_END:
-      tls_handshake_state_end(self);
+      if (self->tls.resumed) {
+         tls_handshake_state_end_resumed(self);
+      } else {
+         tls_handshake_state_end(self);
+      }
       break;
    case OPEN_STATE_TLS_HS_STATE_FINISHED:
       fp_dbg("TLS handshake state: finished");
       tls_handshake_cleanup(self);
       self->tls.established = TRUE;
+      if (!self->tls.resumed) {
+         persist_tls_session(self);
+      }
+      fp_info("TLS handshake (%s) took %" G_GINT64_FORMAT " us",
+              self->tls.resumed ? "resumed" : "full",
+              g_get_monotonic_time() - ssm_data->handshake_start_time);
       fpi_ssm_mark_completed(ssm);
       break;
    case OPEN_STATE_TLS_HS_STATE_ALERT:
@@ -457,10 +786,44 @@ static void open_ssm_done(FpiSsm *ssm, FpDevice *device, GError *error)
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
    open_ssm_data_t *ssm_data = fpi_ssm_get_data(ssm);
 
+   /* the sensor may have dropped the session, so the open is done again with
+    * a full handshake */
+   if (error != NULL && self->tls.resumed && !ssm_data->resume_failed) {
+      open_ssm_data_t *retry_data = g_new0(open_ssm_data_t, 1);
+
+      fp_warn("Resumed TLS handshake failed - dropping cached session and "
+              "doing full handshake: %s",
+              error->message);
+      g_clear_error(&error);
+      tls_session_cache_clear(self);
+      self->tls.resumed = FALSE;
+
+      retry_data->usb_device_claimed = ssm_data->usb_device_claimed;
+      retry_data->open_start_time = ssm_data->open_start_time;
+      retry_data->resume_failed = TRUE;
+
+      self->task_ssm = fpi_ssm_new_full(device, open_sm_run_state,
+                                        OPEN_NUM_STATES, OPEN_NUM_STATES,
+                                        "Open");
+      fpi_ssm_set_data(self->task_ssm, retry_data, (GDestroyNotify)g_free);
+      fpi_ssm_start(self->task_ssm, open_ssm_done);
+      return;
+   }
+
    if (error != NULL && ssm_data->usb_device_claimed) {
       g_usb_device_release_interface(fpi_device_get_usb_device(device), 0, 0,
                                      NULL);
    }
+   if (error != NULL) {
+      cmd_arena_free(self);
+   } else {
+      interrupt_listener_start(self);
+   }
+
+   if (error == NULL) {
+      fp_info("Device open took %" G_GINT64_FORMAT " us",
+              g_get_monotonic_time() - ssm_data->open_start_time);
+   }
 
    self->task_ssm = NULL;
    fp_dbg("<<<<<<<<<<<<<<<<<<<< open end <<<<<<<<<<<<<<<<<<<<");
@@ -474,9 +837,13 @@ static void open(FpDevice *device)
    GError *error = NULL;
 
    G_DEBUG_HERE();
+   self->usb_round_trips = 0;
    fp_dbg(">>>>>>>>>>>>>>>>>>>> open start >>>>>>>>>>>>>>>>>>>>");
    g_assert(self->task_ssm == NULL);
 
+   ssm_data->open_start_time = g_get_monotonic_time();
+   self->tls.resumed = FALSE;
+
 #ifdef TLS_DEBUG
    /* debug check */
    g_assert(sizeof(cert_t) == 400);
@@ -484,14 +851,17 @@ static void open(FpDevice *device)
 
    self->interrupt_cancellable = g_cancellable_new();
 
-   /* Claim usb interface */
-   if (!g_usb_device_claim_interface(fpi_device_get_usb_device(device), 0, 0,
-                                     &error)) {
-      goto error;
-   }
-   ssm_data->usb_device_claimed = TRUE;
+   /* the USB device is not used when the sensor is emulated */
+   if (self->emulator == NULL) {
+      /* Claim usb interface */
+      if (!g_usb_device_claim_interface(fpi_device_get_usb_device(device), 0,
+                                        0, &error)) {
+         goto error;
+      }
+      ssm_data->usb_device_claimed = TRUE;
 
-   g_usb_device_reset(fpi_device_get_usb_device(device), &error);
+      g_usb_device_reset(fpi_device_get_usb_device(device), &error);
+   }
 
    self->task_ssm = fpi_ssm_new_full(device, open_sm_run_state, OPEN_NUM_STATES,
                                      OPEN_NUM_STATES, "Open");
@@ -529,12 +899,26 @@ static void close_ssm_done(FpiSsm *ssm, FpDevice *device, GError *error)
 {
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
 
+   interrupt_listener_stop(self);
    g_clear_object(&self->interrupt_cancellable);
    deinit_tls(self);
    free_pairing_data(self);
+   template_index_cache_clear(self);
+   cmd_arena_free(self);
+   if (g_strcmp0(g_getenv(SYNA_TUDOR_MOC_TRACE_ENV), "1") == 0) {
+      cmd_trace_dump(self);
+   }
+   cmd_trace_clear(self);
 
-   g_usb_device_release_interface(fpi_device_get_usb_device(FP_DEVICE(self)), 0,
-                                  0, &error);
+#ifdef SYNA_TUDOR_MOC_TESTING
+   if (self->emulator != NULL) {
+      emulator_log_stats(self->emulator);
+   }
+#endif
+   if (self->emulator == NULL) {
+      g_usb_device_release_interface(
+          fpi_device_get_usb_device(FP_DEVICE(self)), 0, 0, &error);
+   }
 
    self->task_ssm = NULL;
 
@@ -649,6 +1033,12 @@ static void enroll_sm_run_state(FpiSsm *ssm, FpDevice *device)
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
    enroll_ssm_data_t *ssm_data = fpi_ssm_get_data(ssm);
 
+   /* command of this state was already queued in a batch */
+   if (ssm_data->cmds_queued_ahead > 0) {
+      ssm_data->cmds_queued_ahead -= 1;
+      return;
+   }
+
    switch (fpi_ssm_get_cur_state(ssm)) {
    case ENROLL_STATE_SEND_ENROLL_START:
       send_enroll_start(self);
@@ -666,21 +1056,29 @@ static void enroll_sm_run_state(FpiSsm *ssm, FpDevice *device)
    case ENROLL_STATE_READ_EVENTS1:
       send_event_read(self);
       break;
-   case ENROLL_STATE_CHECK_READ_EVENTS_FINGER_UP:
-      if ((self->parsed_recv_data.read_event_mask & EV_FINGER_UP) != 0) {
+   case ENROLL_STATE_CHECK_READ_EVENTS_FINGER_UP:;
+      const guint32 finger_up_event_mask = events_consume(self);
+      if ((finger_up_event_mask & EV_FINGER_UP) != 0) {
          // FIXME: how to tell the user to finger is up?
          fpi_device_report_finger_status(FP_DEVICE(self),
                                          FP_FINGER_STATUS_NONE);
       }
-      if ((self->parsed_recv_data.read_event_mask & EV_FINGER_UP) !=
-          EV_FINGER_UP) {
+      if ((finger_up_event_mask & EV_FINGER_UP) != EV_FINGER_UP) {
          fpi_ssm_jump_to_state(ssm, ENROLL_STATE_WAIT_FOR_EVENTS1);
       } else {
          fpi_ssm_next_state(ssm);
       }
       break;
    case ENROLL_STATE_SET_EVENT_MASK_FRAME_READY:
+      /* queue commands up to ENROLL_STATE_SET_EVENT_MASK_STORED at once */
+      ssm_data->event_mask_to_read = EV_FRAME_READY | EV_FINGER_DOWN;
+      events_capture_start(self);
+      cmd_queue_batch_begin(self);
       send_event_config(self, EV_FRAME_READY);
+      send_frame_acq(self, CAPTURE_FLAGS_ENROLL);
+      send_event_config(self, ssm_data->event_mask_to_read);
+      ssm_data->cmds_queued_ahead = cmd_queue_batch_end(self);
+      fpi_device_report_finger_status(FP_DEVICE(self), FP_FINGER_STATUS_NEEDED);
       break;
    case ENROLL_STATE_SEND_FRAME_ACQ:
       send_frame_acq(self, CAPTURE_FLAGS_ENROLL);
@@ -696,33 +1094,36 @@ static void enroll_sm_run_state(FpiSsm *ssm, FpDevice *device)
    case ENROLL_STATE_READ_EVENTS2:
       send_event_read(self);
       break;
-   case ENROLL_STATE_CHECK_READ_EVENTS_FRAME_READY_AND_FINGER_DOWN:
-      if ((self->parsed_recv_data.read_event_mask & EV_FINGER_DOWN) != 0) {
+   case ENROLL_STATE_CHECK_READ_EVENTS_FRAME_READY_AND_FINGER_DOWN:;
+      const guint32 read_event_mask = events_consume(self);
+      if ((read_event_mask & EV_FINGER_DOWN) != 0) {
          fpi_device_report_finger_status(FP_DEVICE(self),
                                          FP_FINGER_STATUS_PRESENT);
       }
-      if ((self->parsed_recv_data.read_event_mask &
-           ssm_data->event_mask_to_read) != ssm_data->event_mask_to_read) {
-         guint32 new_event_mask_to_read = 0;
-         if ((self->parsed_recv_data.read_event_mask & EV_FRAME_READY) == 0) {
-            new_event_mask_to_read |= EV_FRAME_READY;
-         }
-         if ((self->parsed_recv_data.read_event_mask & EV_FINGER_DOWN) == 0) {
-            new_event_mask_to_read |= EV_FINGER_DOWN;
-         }
+      if ((read_event_mask & ssm_data->event_mask_to_read) !=
+          ssm_data->event_mask_to_read) {
+         const guint32 new_event_mask_to_read =
+             ssm_data->event_mask_to_read & ~read_event_mask;
          fp_dbg("Did not receive all required events - required event mask: "
                 "0b%b, received event mask: 0b%b",
-                ssm_data->event_mask_to_read,
-                self->parsed_recv_data.read_event_mask);
-         fp_dbg("\t-> new event mask: 0b%b", new_event_mask_to_read);
+                ssm_data->event_mask_to_read, read_event_mask);
+         fp_dbg("\t-> waiting for: 0b%b", new_event_mask_to_read);
          ssm_data->event_mask_to_read = new_event_mask_to_read;
-         fpi_ssm_jump_to_state(ssm, ENROLL_STATE_SET_EVENT_MASK_STORED);
+         /* the event mask stays configured, so there is no need to set it
+          * again - just wait for the remaining events */
+         fpi_ssm_jump_to_state(ssm, ENROLL_STATE_WAIT_FOR_EVENTS2);
       } else {
+         events_capture_end(self);
          fpi_ssm_next_state(ssm);
       }
       break;
    case ENROLL_STATE_CLEAR_EVENT_MASK:
+      /* queue commands up to ENROLL_STATE_SEND_ENROLL_ADD_IMAGE at once */
+      cmd_queue_batch_begin(self);
       send_event_config(self, NO_EVENTS);
+      send_frame_finish(self);
+      send_enroll_add_image(self);
+      ssm_data->cmds_queued_ahead = cmd_queue_batch_end(self);
       break;
    case ENROLL_STATE_SEND_FRAME_FINISH:
       send_frame_finish(self);
@@ -763,6 +1164,9 @@ static void enroll_ssm_done(FpiSsm *ssm, FpDevice *device, GError *error)
    enroll_ssm_data_t *ssm_data = fpi_ssm_get_data(ssm);
    FpPrint *print = NULL;
 
+   /* a failed enroll may have committed the template already */
+   invalidate_template_index(self);
+
    if (error != NULL) {
       goto error;
    }
@@ -784,6 +1188,7 @@ static void enroll(FpDevice *device)
    g_autofree char *user_id_str = NULL;
 
    G_DEBUG_HERE();
+   self->usb_round_trips = 0;
    fp_dbg(">>>>>>>>>>>>>>>>>>>> enroll start >>>>>>>>>>>>>>>>>>>>");
 
    g_assert(self->task_ssm == NULL);
@@ -825,23 +1230,91 @@ typedef enum {
    AUTH_STATE_SEND_FRAME_FINISH,
    // capture image stop
    AUTH_STATE_GET_IMAGE_METRICS,
-   AUTH_STATE_CHECK_IMAGE_QUALITY,
    AUTH_STATE_IDENTIFY_IMAGE,
+   AUTH_STATE_CHECK_IMAGE_QUALITY,
+   /* identify first mode only */
+   AUTH_STATE_GET_IMAGE_METRICS_ON_MATCH_FAIL,
+   AUTH_STATE_CHECK_IMAGE_QUALITY_ON_MATCH_FAIL,
    AUTH_NUM_STATES,
 } auth_state_t;
 
-static void check_image_quality(FpiSsm *ssm, guint32 img_quality)
+/* returns FALSE if the state is not used in the current auth mode */
+static gboolean auth_state_is_used(auth_ssm_data_t *ssm_data,
+                                   auth_state_t state)
+{
+   switch (state) {
+   case AUTH_STATE_GET_IMAGE_METRICS:
+   case AUTH_STATE_CHECK_IMAGE_QUALITY:
+      return !ssm_data->identify_first;
+   case AUTH_STATE_GET_IMAGE_METRICS_ON_MATCH_FAIL:
+   case AUTH_STATE_CHECK_IMAGE_QUALITY_ON_MATCH_FAIL:
+      return ssm_data->identify_first && !ssm_data->matched;
+   default:
+      return TRUE;
+   }
+}
+
+/* all replies are parsed to the same union, so results needed later are kept
+ * before the next reply overwrites them
+ * - state is the one entered after the reply was received */
+static void auth_keep_reply_results(FpiDeviceSynaTudorMoc *self,
+                                    auth_ssm_data_t *ssm_data,
+                                    auth_state_t state)
 {
-   if (img_quality < IMAGE_QUALITY_THRESHOLD) {
-      fp_info("Image quality %d%% is lower than threshold %d%%", img_quality,
-              IMAGE_QUALITY_THRESHOLD);
-      fpi_ssm_mark_failed(ssm,
-                          set_and_report_error(
-                              FP_DEVICE_ERROR_GENERAL,
-                              "Image quality %d%% is lower than threshold %d%%",
-                              img_quality, IMAGE_QUALITY_THRESHOLD));
+   switch (state) {
+   case AUTH_STATE_IDENTIFY_IMAGE:
+      if (!ssm_data->identify_first) {
+         ssm_data->image_quality = self->parsed_recv_data.img_metrics.data
+                                       .matcher_stats.img_quality;
+      }
+      break;
+   case AUTH_STATE_CHECK_IMAGE_QUALITY:
+      ssm_data->matched = self->parsed_recv_data.match_result.matched;
+      break;
+   case AUTH_STATE_CHECK_IMAGE_QUALITY_ON_MATCH_FAIL:
+      ssm_data->image_quality =
+          self->parsed_recv_data.img_metrics.data.matcher_stats.img_quality;
+      break;
+   default:
+      break;
+   }
+}
+
+/* returns TRUE if the image quality is good enough; otherwise the image is
+ * captured again or the capture is reported as FP_DEVICE_RETRY */
+static gboolean check_image_quality(FpiDeviceSynaTudorMoc *self, FpiSsm *ssm,
+                                    auth_ssm_data_t *ssm_data)
+{
+   if (ssm_data->image_quality >= self->img_quality_threshold) {
+      return TRUE;
+   }
+
+   ssm_data->low_quality_captures += 1;
+   fp_info("Image quality %u%% is lower than threshold %u%% (capture %u/%u)",
+           ssm_data->image_quality, self->img_quality_threshold,
+           ssm_data->low_quality_captures, AUTH_MAX_LOW_QUALITY_CAPTURES);
+
+   if (ssm_data->low_quality_captures < AUTH_MAX_LOW_QUALITY_CAPTURES) {
+      ssm_data->matched = FALSE;
+      fpi_ssm_jump_to_state(ssm, AUTH_STATE_SET_EVENT_MASK_FRAME_READY);
    } else {
-      fpi_ssm_next_state(ssm);
+      ssm_data->low_quality = TRUE;
+      fpi_ssm_mark_completed(ssm);
+   }
+   return FALSE;
+}
+
+static void send_auth_identify_match(FpiDeviceSynaTudorMoc *self,
+                                     auth_ssm_data_t *ssm_data)
+{
+   if (ssm_data->verify_template_id_present) {
+      send_identify_match(self, &ssm_data->verify_template_id, 1);
+   } else if (ssm_data->identify_template_ids->len > 0) {
+      send_identify_match(self,
+                          (db2_id_t *)ssm_data->identify_template_ids->data,
+                          ssm_data->identify_template_ids->len);
+   } else {
+      send_identify_match(self, NULL, 0);
    }
 }
 
@@ -850,9 +1323,30 @@ static void auth_sm_run_state(FpiSsm *ssm, FpDevice *device)
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
    auth_ssm_data_t *ssm_data = fpi_ssm_get_data(ssm);
 
+   auth_keep_reply_results(self, ssm_data, fpi_ssm_get_cur_state(ssm));
+
+   if (!auth_state_is_used(ssm_data, fpi_ssm_get_cur_state(ssm))) {
+      fpi_ssm_next_state(ssm);
+      return;
+   }
+
+   /* command of this state was already queued in a batch */
+   if (ssm_data->cmds_queued_ahead > 0) {
+      ssm_data->cmds_queued_ahead -= 1;
+      return;
+   }
+
    switch (fpi_ssm_get_cur_state(ssm)) {
    case AUTH_STATE_SET_EVENT_MASK_FRAME_READY:
+      /* queue commands up to AUTH_STATE_SET_EVENT_MASK_STORED at once */
+      ssm_data->event_mask_to_read = EV_FRAME_READY | EV_FINGER_DOWN;
+      events_capture_start(self);
+      cmd_queue_batch_begin(self);
       send_event_config(self, EV_FRAME_READY);
+      send_frame_acq(self, CAPTURE_FLAGS_AUTH);
+      send_event_config(self, ssm_data->event_mask_to_read);
+      ssm_data->cmds_queued_ahead = cmd_queue_batch_end(self);
+      fpi_device_report_finger_status(FP_DEVICE(self), FP_FINGER_STATUS_NEEDED);
       break;
    case AUTH_STATE_SEND_FRAME_ACQ:
       send_frame_acq(self, CAPTURE_FLAGS_AUTH);
@@ -868,33 +1362,46 @@ static void auth_sm_run_state(FpiSsm *ssm, FpDevice *device)
    case AUTH_STATE_READ_EVENTS:
       send_event_read(self);
       break;
-   case AUTH_STATE_CHECK_READ_EVENTS:
-      if ((self->parsed_recv_data.read_event_mask & EV_FINGER_DOWN) != 0) {
+   case AUTH_STATE_CHECK_READ_EVENTS:;
+      const guint32 read_event_mask = events_consume(self);
+      if ((read_event_mask & EV_FINGER_DOWN) != 0) {
+         if (ssm_data->finger_down_time == 0) {
+            ssm_data->finger_down_time = self->events.last_interrupt_time;
+         }
          fpi_device_report_finger_status(FP_DEVICE(self),
                                          FP_FINGER_STATUS_PRESENT);
       }
-      if ((self->parsed_recv_data.read_event_mask &
-           ssm_data->event_mask_to_read) != ssm_data->event_mask_to_read) {
-         guint32 new_event_mask_to_read = 0;
-         if ((self->parsed_recv_data.read_event_mask & EV_FRAME_READY) == 0) {
-            new_event_mask_to_read |= EV_FRAME_READY;
-         }
-         if ((self->parsed_recv_data.read_event_mask & EV_FINGER_DOWN) == 0) {
-            new_event_mask_to_read |= EV_FINGER_DOWN;
-         }
+      if ((read_event_mask & ssm_data->event_mask_to_read) !=
+          ssm_data->event_mask_to_read) {
+         const guint32 new_event_mask_to_read =
+             ssm_data->event_mask_to_read & ~read_event_mask;
          fp_dbg("Did not receive all required events - required event mask: "
                 "0b%b, received event mask: 0b%b",
-                ssm_data->event_mask_to_read,
-                self->parsed_recv_data.read_event_mask);
-         fp_dbg("\t-> new event mask: 0b%b", new_event_mask_to_read);
+                ssm_data->event_mask_to_read, read_event_mask);
+         fp_dbg("\t-> waiting for: 0b%b", new_event_mask_to_read);
          ssm_data->event_mask_to_read = new_event_mask_to_read;
-         fpi_ssm_jump_to_state(ssm, AUTH_STATE_SET_EVENT_MASK_STORED);
+         /* the event mask stays configured, so there is no need to set it
+          * again - just wait for the remaining events */
+         fpi_ssm_jump_to_state(ssm, AUTH_STATE_WAIT_FOR_EVENTS);
       } else {
+         events_capture_end(self);
          fpi_ssm_next_state(ssm);
       }
       break;
    case AUTH_STATE_CLEAR_EVENT_MASK:
+      /* queue commands up to AUTH_STATE_GET_IMAGE_METRICS at once, or up to
+       * AUTH_STATE_IDENTIFY_IMAGE when identify does not wait for the image
+       * quality - its result is then discarded if the quality is too low */
+      cmd_queue_batch_begin(self);
       send_event_config(self, NO_EVENTS);
+      send_frame_finish(self);
+      if (!ssm_data->identify_first) {
+         send_get_image_metrics(self, MIS_IMAGE_METRICS_IMG_QUALITY);
+      }
+      if (ssm_data->identify_first || ssm_data->pipeline_identify) {
+         send_auth_identify_match(self, ssm_data);
+      }
+      ssm_data->cmds_queued_ahead = cmd_queue_batch_end(self);
       break;
    case AUTH_STATE_SEND_FRAME_FINISH:
       send_frame_finish(self);
@@ -902,16 +1409,24 @@ static void auth_sm_run_state(FpiSsm *ssm, FpDevice *device)
    case AUTH_STATE_GET_IMAGE_METRICS:
       send_get_image_metrics(self, MIS_IMAGE_METRICS_IMG_QUALITY);
       break;
-   case AUTH_STATE_CHECK_IMAGE_QUALITY:;
-      guint32 img_quality =
-          self->parsed_recv_data.img_metrics.data.matcher_stats.img_quality;
-      check_image_quality(ssm, img_quality);
-      break;
    case AUTH_STATE_IDENTIFY_IMAGE:
-      if (ssm_data->verify_template_id_present) {
-         send_identify_match(self, &ssm_data->verify_template_id, 1);
-      } else {
-         send_identify_match(self, NULL, 0);
+      if (ssm_data->identify_first ||
+          check_image_quality(self, ssm, ssm_data)) {
+         send_auth_identify_match(self, ssm_data);
+      }
+      break;
+   case AUTH_STATE_CHECK_IMAGE_QUALITY:
+      if (check_image_quality(self, ssm, ssm_data)) {
+         fpi_ssm_next_state(ssm);
+      }
+      break;
+   case AUTH_STATE_GET_IMAGE_METRICS_ON_MATCH_FAIL:
+      /* tells whether the match failed because of a bad image */
+      send_get_image_metrics(self, MIS_IMAGE_METRICS_IMG_QUALITY);
+      break;
+   case AUTH_STATE_CHECK_IMAGE_QUALITY_ON_MATCH_FAIL:
+      if (check_image_quality(self, ssm, ssm_data)) {
+         fpi_ssm_next_state(ssm);
       }
       break;
    }
@@ -920,15 +1435,39 @@ static void auth_sm_run_state(FpiSsm *ssm, FpDevice *device)
 static void auth_ssm_done(FpiSsm *ssm, FpDevice *device, GError *error)
 {
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
+   auth_ssm_data_t *ssm_data = fpi_ssm_get_data(ssm);
+
+   fp_info("Auth took %" G_GINT64_FORMAT " us",
+           g_get_monotonic_time() - ssm_data->start_time);
+   if (ssm_data->finger_down_time != 0) {
+      fp_info("Finger down to result took %" G_GINT64_FORMAT " us (%s)",
+              g_get_monotonic_time() - ssm_data->finger_down_time,
+              ssm_data->identify_first      ? "identify first"
+              : ssm_data->pipeline_identify ? "pipelined identify"
+                                            : "sequential identify");
+   }
 
    if (error != NULL) {
       goto error;
    }
 
+   if (ssm_data->low_quality) {
+      GError *retry_error = fpi_device_retry_new_msg(FP_DEVICE_RETRY_GENERAL,
+                                                     "Scan has bad quality");
+      if (fpi_device_get_current_action(device) == FPI_DEVICE_ACTION_VERIFY) {
+         fpi_device_verify_report(device, FPI_MATCH_ERROR, NULL, retry_error);
+      } else {
+         fpi_device_identify_report(device, NULL, NULL, retry_error);
+      }
+      goto error;
+   }
+
+   /* the match result is valid only if matched, as image metrics may have
+    * been received after it */
    match_result_t *match_result = &self->parsed_recv_data.match_result;
-   fp_dbg("Identify matched: %s", match_result->matched ? "TRUE" : "FALSE");
+   fp_dbg("Identify matched: %s", ssm_data->matched ? "TRUE" : "FALSE");
 
-   if (self->parsed_recv_data.match_result.matched) {
+   if (ssm_data->matched) {
       FpPrint *matching = NULL;
       FpPrint *new_scan =
           fp_print_from_enrollment(self, &match_result->matched_enrollment);
@@ -939,14 +1478,9 @@ static void auth_ssm_done(FpiSsm *ssm, FpDevice *device, GError *error)
       if (fpi_device_get_current_action(device) == FPI_DEVICE_ACTION_VERIFY) {
          fpi_device_verify_report(device, FPI_MATCH_SUCCESS, new_scan, error);
       } else {
-         GPtrArray *templates = NULL;
-         fpi_device_get_identify_data(device, &templates);
-         for (gint i = 0; i < templates->len; ++i) {
-            if (fp_print_equal(g_ptr_array_index(templates, i), new_scan)) {
-               matching = g_ptr_array_index(templates, i);
-               break;
-            }
-         }
+         g_autoptr(GBytes) template_id = g_bytes_new_static(
+             match_result->matched_enrollment.template_id, DB2_ID_SIZE);
+         matching = g_hash_table_lookup(ssm_data->identify_prints, template_id);
          fpi_device_identify_report(device, matching, new_scan, NULL);
       }
    } else {
@@ -969,10 +1503,59 @@ error:
    }
 }
 
+/* maps prints to identify against to their template IDs, so that the sensor
+ * matches only them and the matching print can be looked up by template ID */
+static void prepare_identify_templates(FpDevice *device,
+                                       auth_ssm_data_t *ssm_data)
+{
+   GPtrArray *templates = NULL;
+
+   fpi_device_get_identify_data(device, &templates);
+
+   ssm_data->identify_template_ids =
+       g_array_sized_new(FALSE, FALSE, DB2_ID_SIZE, templates->len);
+   ssm_data->identify_prints = g_hash_table_new_full(
+       g_bytes_hash, g_bytes_equal, (GDestroyNotify)g_bytes_unref, NULL);
+
+   for (guint i = 0; i < templates->len; ++i) {
+      FpPrint *print = g_ptr_array_index(templates, i);
+      g_autoptr(GVariant) fp_data = NULL;
+      GError *error = NULL;
+      db2_id_t template_id;
+
+      g_object_get(print, "fpi-data", &fp_data, NULL);
+      if (fp_data == NULL ||
+          !get_template_id_from_print_data(fp_data, template_id, &error)) {
+         fp_warn("Skipping print without a valid template id");
+         g_clear_error(&error);
+         continue;
+      }
+
+      GBytes *key = g_bytes_new(template_id, DB2_ID_SIZE);
+      if (g_hash_table_contains(ssm_data->identify_prints, key)) {
+         g_bytes_unref(key);
+         continue;
+      }
+      g_hash_table_insert(ssm_data->identify_prints, key, print);
+      g_array_append_vals(ssm_data->identify_template_ids, template_id, 1);
+   }
+
+   fp_dbg("Identifying against %u templates",
+          ssm_data->identify_template_ids->len);
+}
+
+static void free_auth_ssm_data_t(auth_ssm_data_t *ssm_data)
+{
+   g_clear_pointer(&ssm_data->identify_template_ids, g_array_unref);
+   g_clear_pointer(&ssm_data->identify_prints, g_hash_table_unref);
+   g_free(ssm_data);
+}
+
 static void auth(FpDevice *device)
 {
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
    G_DEBUG_HERE();
+   self->usb_round_trips = 0;
    if (fpi_device_get_current_action(device) == FPI_DEVICE_ACTION_VERIFY) {
       fp_dbg(">>>>>>>>>>>>>>>>>>>> auth - verify start >>>>>>>>>>>>>>>>>>>>");
    } else {
@@ -988,6 +1571,8 @@ static void auth(FpDevice *device)
                                      AUTH_NUM_STATES, "Auth");
 
    auth_ssm_data_t *ssm_data = g_new0(auth_ssm_data_t, 1);
+   fpi_ssm_set_data(self->task_ssm, ssm_data,
+                    (GDestroyNotify)free_auth_ssm_data_t);
    if (fpi_device_get_current_action(device) == FPI_DEVICE_ACTION_VERIFY) {
       fpi_device_get_verify_data(device, &print_to_verify);
       g_object_get(print_to_verify, "fpi-data", &fp_data, NULL);
@@ -998,9 +1583,14 @@ static void auth(FpDevice *device)
       ssm_data->verify_template_id_present = TRUE;
       fp_dbg("Verifying print with template id:");
       fp_dbg_large_hex(ssm_data->verify_template_id, DB2_ID_SIZE);
+   } else {
+      prepare_identify_templates(device, ssm_data);
    }
-   fpi_ssm_set_data(self->task_ssm, ssm_data, (GDestroyNotify)g_free);
 
+   ssm_data->pipeline_identify =
+       g_strcmp0(g_getenv(SYNA_TUDOR_MOC_SEQUENTIAL_AUTH_ENV), "1") != 0;
+   ssm_data->identify_first = self->identify_first;
+   ssm_data->start_time = g_get_monotonic_time();
    fpi_ssm_start(self->task_ssm, auth_ssm_done);
    return;
 
@@ -1010,7 +1600,7 @@ error:
    } else {
       fp_dbg("<<<<<<<<<<<<<<<<<<<< auth - identify end <<<<<<<<<<<<<<<<<<<<");
    }
-   self->task_ssm = NULL;
+   g_clear_pointer(&self->task_ssm, fpi_ssm_free);
    fpi_device_identify_complete(device, error);
 }
 
@@ -1019,6 +1609,8 @@ error:
 typedef enum {
    LIST_STATE_GET_CURRENT_NUMBER_OF_DB2_OBJECTS,
    LIST_STATE_CLEANUP,
+   LIST_STATE_REFRESH_DB2_INFO,
+   LIST_STATE_CHECK_TEMPLATE_INDEX,
    LIST_STATE_GET_TEMPLATE_LIST,
    LIST_STATE_STORE_TEMPLATE_LIST,
    LIST_STATE_GET_PAYLOAD_LIST,
@@ -1026,13 +1618,105 @@ typedef enum {
    LIST_STATE_GET_PAYLOAD_SIZE,
    LIST_STATE_GET_PAYLOAD_DATA,
    LIST_STATE_STORE_PAYLOAD_DATA,
+   LIST_STATE_UPDATE_TEMPLATE_INDEX,
    LIST_NUM_STATES,
 } list_state_t;
 
+static gboolean list_add_print(FpiDeviceSynaTudorMoc *self,
+                               list_ssm_data_t *ssm_data, GBytes *payload,
+                               GError **error)
+{
+   gsize payload_size = 0;
+   const guint8 *payload_data = g_bytes_get_data(payload, &payload_size);
+   enrollment_t enrollment = {0};
+
+   if (!get_enrollment_data_from_serialized_container(
+           payload_data, payload_size, &enrollment, error)) {
+      return FALSE;
+   }
+
+   FpPrint *print = fp_print_from_enrollment(self, &enrollment);
+   g_ptr_array_add(ssm_data->fp_print_array, g_object_ref_sink(print));
+   return TRUE;
+}
+
+static gboolean list_add_prints_from_template_index(FpiDeviceSynaTudorMoc *self,
+                                                    list_ssm_data_t *ssm_data,
+                                                    GError **error)
+{
+   template_index_cache_t *cache = &self->template_index;
+
+   for (guint i = 0; i < cache->payload_ids->len; ++i) {
+      GBytes *payload = template_index_cache_lookup(
+          self, g_array_index(cache->payload_ids, db2_id_t, i));
+      if (!list_add_print(self, ssm_data, payload, error)) {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+/* adds the prints of payloads in the template index cache and collects the
+ * ones which have to be fetched from the sensor */
+static gboolean list_add_cached_payloads(FpiDeviceSynaTudorMoc *self,
+                                         list_ssm_data_t *ssm_data,
+                                         GError **error)
+{
+   for (guint i = 0; i < ssm_data->payload_id_list->len; ++i) {
+      const guint8 *payload_id =
+          g_array_index(ssm_data->payload_id_list, db2_id_t, i);
+      GBytes *payload = template_index_cache_lookup(self, payload_id);
+      if (payload == NULL) {
+         g_array_append_vals(ssm_data->missing_payload_id_list, payload_id, 1);
+         continue;
+      }
+
+      fp_dbg("Using cached payload at idx: %d/%d", i,
+             ssm_data->payload_id_list->len - 1);
+      if (!list_add_print(self, ssm_data, payload, error)) {
+         return FALSE;
+      }
+      g_hash_table_insert(ssm_data->payloads,
+                          g_bytes_new(payload_id, DB2_ID_SIZE),
+                          g_bytes_ref(payload));
+   }
+   return TRUE;
+}
+
+/* A payload is never larger than its slot, so with the slot size from DB2 info
+ * the data of missing payloads can be requested in batches without getting
+ * the size of each one by GET_OBJECT_INFO first. The replies are shorter than
+ * the receive buffers. A payload whose request fails or gets a short reply is
+ * fetched again by its size afterwards.
+ * The batches are limited as each queued command holds its own send buffer. */
+#define LIST_BULK_FETCH_MAX_PAYLOADS 8
+
+static gboolean list_can_fetch_in_bulk(FpiDeviceSynaTudorMoc *self)
+{
+   const guint slot_size = self->storage.payload_object_slot_size;
+
+   return slot_size > 0 && slot_size < G_MAXUINT16;
+}
+
+/* moves to fetching of the next payload, which is not in the template index
+ * cache */
+static void list_get_next_payload(FpiSsm *ssm, list_ssm_data_t *ssm_data)
+{
+   if (ssm_data->current_payload_id_idx >=
+       ssm_data->missing_payload_id_list->len) {
+      fpi_ssm_jump_to_state(ssm, LIST_STATE_UPDATE_TEMPLATE_INDEX);
+   } else if (ssm_data->bulk_fetch || ssm_data->bulk_replies_left > 0) {
+      fpi_ssm_jump_to_state(ssm, LIST_STATE_GET_PAYLOAD_DATA);
+   } else {
+      fpi_ssm_jump_to_state(ssm, LIST_STATE_GET_PAYLOAD_SIZE);
+   }
+}
+
 static void list_sm_run_state(FpiSsm *ssm, FpDevice *device)
 {
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
    list_ssm_data_t *ssm_data = fpi_ssm_get_data(ssm);
+   GError *error = NULL;
 
    switch (fpi_ssm_get_cur_state(ssm)) {
    case LIST_STATE_GET_CURRENT_NUMBER_OF_DB2_OBJECTS:
@@ -1040,11 +1724,34 @@ static void list_sm_run_state(FpiSsm *ssm, FpDevice *device)
       break;
    case LIST_STATE_CLEANUP:
       if (self->parsed_recv_data.cleanup_required) {
+         ssm_data->cleanup_done = TRUE;
          send_db2_cleanup(self);
       } else {
          fpi_ssm_next_state(ssm);
       }
       break;
+   case LIST_STATE_REFRESH_DB2_INFO:
+      /* cleanup changes DB2 info */
+      if (ssm_data->cleanup_done) {
+         send_db2_info(self);
+      } else {
+         fpi_ssm_next_state(ssm);
+      }
+      break;
+   case LIST_STATE_CHECK_TEMPLATE_INDEX:
+      if (self->template_index.valid &&
+          storage_is_equal(&self->template_index.storage, &self->storage)) {
+         fp_dbg("DB2 info is unchanged - listing from template index");
+         if (!list_add_prints_from_template_index(self, ssm_data, &error)) {
+            template_index_cache_clear(self);
+            fpi_ssm_mark_failed(ssm, error);
+         } else {
+            fpi_ssm_mark_completed(ssm);
+         }
+      } else {
+         fpi_ssm_next_state(ssm);
+      }
+      break;
    case LIST_STATE_GET_TEMPLATE_LIST:
       send_db2_get_object_list(self, OBJ_TYPE_TEMPLATES, cache_template_id);
       break;
@@ -1052,7 +1759,8 @@ static void list_sm_run_state(FpiSsm *ssm, FpDevice *device)
       ssm_data->template_id_cnt = self->parsed_recv_data.db2_obj_list.len;
       if (ssm_data->template_id_cnt == 0) {
          fp_dbg("database is empty");
-         fpi_ssm_mark_completed(ssm);
+         g_free(self->parsed_recv_data.db2_obj_list.obj_list);
+         fpi_ssm_jump_to_state(ssm, LIST_STATE_UPDATE_TEMPLATE_INDEX);
          return;
       }
       ssm_data->template_id_list = self->parsed_recv_data.db2_obj_list.obj_list;
@@ -1071,29 +1779,60 @@ static void list_sm_run_state(FpiSsm *ssm, FpDevice *device)
 
       if (ssm_data->current_template_id_idx < ssm_data->template_id_cnt) {
          fpi_ssm_jump_to_state(ssm, LIST_STATE_GET_PAYLOAD_LIST);
+      } else if (ssm_data->payload_id_list->len == 0) {
+         fp_dbg("database is empty");
+         fpi_ssm_jump_to_state(ssm, LIST_STATE_UPDATE_TEMPLATE_INDEX);
       } else {
-         fpi_ssm_next_state(ssm);
+         /* only payloads which are not cached are fetched */
+         if (!list_add_cached_payloads(self, ssm_data, &error)) {
+            fpi_ssm_mark_failed(ssm, error);
+            return;
+         }
+         ssm_data->bulk_fetch = list_can_fetch_in_bulk(self);
+         list_get_next_payload(ssm, ssm_data);
       }
       break;
    case LIST_STATE_GET_PAYLOAD_SIZE:
-      if (ssm_data->payload_id_list->len == 0) {
-         fp_dbg("database is empty");
-         fpi_ssm_mark_completed(ssm);
-         return;
-      }
-
       fp_dbg("Getting payload at idx: %d/%d", ssm_data->current_payload_id_idx,
-             ssm_data->payload_id_list->len - 1);
-      fp_dbg_large_hex(g_array_index(ssm_data->payload_id_list, db2_id_t,
+             ssm_data->missing_payload_id_list->len - 1);
+      fp_dbg_large_hex(g_array_index(ssm_data->missing_payload_id_list,
+                                     db2_id_t,
                                      ssm_data->current_payload_id_idx),
                        DB2_ID_SIZE);
 
       send_db2_get_object_info(self, OBJ_TYPE_PAYLOADS,
-                               g_array_index(ssm_data->payload_id_list,
+                               g_array_index(ssm_data->missing_payload_id_list,
                                              db2_id_t,
                                              ssm_data->current_payload_id_idx));
       break;
    case LIST_STATE_GET_PAYLOAD_DATA:;
+      /* command of this state was already queued in a batch */
+      if (ssm_data->cmds_queued_ahead > 0) {
+         ssm_data->cmds_queued_ahead -= 1;
+         break;
+      }
+
+      if (ssm_data->bulk_fetch) {
+         const guint first = ssm_data->current_payload_id_idx;
+         const guint end =
+             MIN(first + LIST_BULK_FETCH_MAX_PAYLOADS,
+                 ssm_data->missing_payload_id_list->len);
+         fp_dbg("Getting payloads %d to %d in bulk with slot size %u", first,
+                end - 1, self->storage.payload_object_slot_size);
+
+         /* replies are stored one by one by LIST_STATE_STORE_PAYLOAD_DATA */
+         cmd_queue_batch_begin(self);
+         for (guint i = first; i < end; ++i) {
+            send_db2_get_object_data_in_bulk(
+                self, OBJ_TYPE_PAYLOADS,
+                g_array_index(ssm_data->missing_payload_id_list, db2_id_t, i),
+                self->storage.payload_object_slot_size);
+         }
+         ssm_data->cmds_queued_ahead = cmd_queue_batch_end(self);
+         ssm_data->bulk_replies_left = end - first;
+         break;
+      }
+
       const guint size_offset = 48;
       const guint min_expected_size = size_offset + sizeof(guint32);
       if (self->parsed_recv_data.raw_resp.size < min_expected_size) {
@@ -1103,36 +1842,63 @@ static void list_sm_run_state(FpiSsm *ssm, FpDevice *device)
                                        "payload size - got: %lu, expected: >%u",
                                        self->parsed_recv_data.raw_resp.size,
                                        min_expected_size));
+         g_free(self->parsed_recv_data.raw_resp.data);
+         return;
       }
       guint obj_data_size = FP_READ_UINT32_LE(
           &((self->parsed_recv_data.raw_resp.data)[size_offset]));
       g_free(self->parsed_recv_data.raw_resp.data);
 
       send_db2_get_object_data(self, OBJ_TYPE_PAYLOADS,
-                               g_array_index(ssm_data->payload_id_list,
+                               g_array_index(ssm_data->missing_payload_id_list,
                                              db2_id_t,
                                              ssm_data->current_payload_id_idx),
                                obj_data_size);
-      ssm_data->current_payload_id_idx += 1;
       break;
    case LIST_STATE_STORE_PAYLOAD_DATA:;
-      GError *error = NULL;
-      enrollment_t enrollment = {0};
-      get_enrollment_data_from_serialized_container(
-          self->parsed_recv_data.db2_obj_data.data,
-          self->parsed_recv_data.db2_obj_data.size, &enrollment, &error);
-      g_free(self->parsed_recv_data.db2_obj_data.data);
-      if (error != NULL) {
-         fpi_ssm_mark_failed(ssm, error);
+      const guint8 *payload_id = g_array_index(
+          ssm_data->missing_payload_id_list, db2_id_t,
+          ssm_data->current_payload_id_idx);
+
+      if (ssm_data->bulk_replies_left > 0) {
+         ssm_data->bulk_replies_left -= 1;
+
+         if (self->parsed_recv_data.db2_obj_data.data == NULL) {
+            /* the rest of the batch is still received, everything after it
+             * and this payload again are fetched one by one */
+            db2_id_t retry_id;
+            memcpy(retry_id, payload_id, DB2_ID_SIZE);
+            fp_dbg("Falling back to getting payloads one by one");
+            ssm_data->bulk_fetch = FALSE;
+            g_array_append_vals(ssm_data->missing_payload_id_list, retry_id,
+                                1);
+            ssm_data->current_payload_id_idx += 1;
+            list_get_next_payload(ssm, ssm_data);
+            return;
+         }
       }
-      FpPrint *print = fp_print_from_enrollment(self, &enrollment);
-      g_ptr_array_add(ssm_data->fp_print_array, g_object_ref_sink(print));
 
-      if (ssm_data->current_payload_id_idx < ssm_data->payload_id_list->len) {
-         fpi_ssm_jump_to_state(ssm, LIST_STATE_GET_PAYLOAD_SIZE);
-      } else {
-         fpi_ssm_next_state(ssm);
+      GBytes *payload =
+          g_bytes_new_take(self->parsed_recv_data.db2_obj_data.data,
+                           self->parsed_recv_data.db2_obj_data.size);
+      self->parsed_recv_data.db2_obj_data.data = NULL;
+      if (!list_add_print(self, ssm_data, payload, &error)) {
+         g_bytes_unref(payload);
+         fpi_ssm_mark_failed(ssm, error);
+         return;
       }
+      g_hash_table_insert(ssm_data->payloads,
+                          g_bytes_new(payload_id, DB2_ID_SIZE), payload);
+      ssm_data->current_payload_id_idx += 1;
+
+      list_get_next_payload(ssm, ssm_data);
+      break;
+   case LIST_STATE_UPDATE_TEMPLATE_INDEX:
+      template_index_cache_set(self,
+                               g_steal_pointer(&ssm_data->payload_id_list),
+                               g_steal_pointer(&ssm_data->payloads));
+      persist_template_index(self);
+      fpi_ssm_mark_completed(ssm);
       break;
    }
 }
@@ -1163,7 +1929,9 @@ error:
 
 static void free_list_ssm_data_t(list_ssm_data_t *ssm_data)
 {
-   g_array_free(ssm_data->payload_id_list, TRUE);
+   g_clear_pointer(&ssm_data->payload_id_list, g_array_unref);
+   g_clear_pointer(&ssm_data->missing_payload_id_list, g_array_unref);
+   g_clear_pointer(&ssm_data->payloads, g_hash_table_unref);
    g_free(ssm_data->template_id_list);
    g_free(ssm_data);
 }
@@ -1173,6 +1941,7 @@ static void list(FpDevice *device)
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
 
    G_DEBUG_HERE();
+   self->usb_round_trips = 0;
    fp_dbg(">>>>>>>>>>>>>>>>>>>> list start >>>>>>>>>>>>>>>>>>>>");
    g_assert(self->task_ssm == NULL);
 
@@ -1182,6 +1951,8 @@ static void list(FpDevice *device)
    list_ssm_data_t *ssm_data = g_new0(list_ssm_data_t, 1);
    ssm_data->fp_print_array = g_ptr_array_new_with_free_func(g_object_unref);
    ssm_data->payload_id_list = g_array_new(FALSE, FALSE, DB2_ID_SIZE);
+   ssm_data->missing_payload_id_list = g_array_new(FALSE, FALSE, DB2_ID_SIZE);
+   ssm_data->payloads = payload_table_new();
    fpi_ssm_set_data(self->task_ssm, ssm_data,
                     (GDestroyNotify)free_list_ssm_data_t);
 
@@ -1211,6 +1982,8 @@ static void delete_ssm_done(FpiSsm *ssm, FpDevice *device, GError *error)
 {
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
 
+   invalidate_template_index(self);
+
    fp_dbg("<<<<<<<<<<<<<<<<<<<< delete end <<<<<<<<<<<<<<<<<<<<");
    self->task_ssm = NULL;
    fpi_device_delete_complete(device, error);
@@ -1223,6 +1996,7 @@ static void delete(FpDevice *device)
    delete_ssm_data_t *ssm_data = g_new0(delete_ssm_data_t, 1);
 
    G_DEBUG_HERE();
+   self->usb_round_trips = 0;
    fp_dbg(">>>>>>>>>>>>>>>>>>>> delete start >>>>>>>>>>>>>>>>>>>>");
    g_assert(self->task_ssm == NULL);
 
@@ -1270,6 +2044,8 @@ static void clear_storage_ssm_done(FpiSsm *ssm, FpDevice *device, GError *error)
 {
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
 
+   invalidate_template_index(self);
+
    fp_dbg("<<<<<<<<<<<<<<<<<<<< clear storage end <<<<<<<<<<<<<<<<<<<<");
    self->task_ssm = NULL;
    fpi_device_clear_storage_complete(device, error);
@@ -1280,6 +2056,7 @@ static void clear_storage(FpDevice *device)
    FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
 
    G_DEBUG_HERE();
+   self->usb_round_trips = 0;
    fp_dbg(">>>>>>>>>>>>>>>>>>>> clear storage start >>>>>>>>>>>>>>>>>>>>");
    g_assert(self->task_ssm == NULL);
 
@@ -1298,23 +2075,220 @@ static void cancel(FpDevice *device)
    G_DEBUG_HERE();
    fp_dbg(">>>>>>>>>>>>>>>>>>>> cancel start >>>>>>>>>>>>>>>>>>>>");
 
-   /* cancel ongoing interrupt transfers */
-   g_cancellable_cancel(self->interrupt_cancellable);
+   /* the interrupt listener keeps running, only a task waiting for events is
+    * cancelled */
+   events_cancel_wait(self);
 
    fp_dbg("<<<<<<<<<<<<<<<<<<<< cancel end <<<<<<<<<<<<<<<<<<<<");
 }
 
+/* suspend and resume ====================================================== */
+
+/* Only tasks which wait for the finger are suspended, for others suspend fails
+ * and the core cancels the action. The sensor usually
+ * keeps its TLS session over a system sleep, so on resume only its status is
+ * checked and the session keys and sequence numbers are kept. The handshake
+ * is done again, with the states of open, only if the sensor lost it. */
+
+static void suspend(FpDevice *device)
+{
+   FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
+
+   G_DEBUG_HERE();
+   fp_dbg(">>>>>>>>>>>>>>>>>>>> suspend start >>>>>>>>>>>>>>>>>>>>");
+
+   if (!events_task_is_waiting(self) || !cmd_queue_is_idle(self)) {
+      fpi_device_suspend_complete(
+          device, set_and_report_error(FP_DEVICE_ERROR_NOT_SUPPORTED,
+                                       "Suspend is only supported while "
+                                       "waiting for the finger"));
+      fp_dbg("<<<<<<<<<<<<<<<<<<<< suspend end <<<<<<<<<<<<<<<<<<<<");
+      return;
+   }
+
+   /* a task waiting for events keeps waiting until the listener is started
+    * again on resume */
+   self->suspended = TRUE;
+   interrupt_listener_pause(self);
+   fpi_device_suspend_complete(device, NULL);
+
+   fp_dbg("<<<<<<<<<<<<<<<<<<<< suspend end <<<<<<<<<<<<<<<<<<<<");
+}
+
+static void resume_ssm_done(FpiSsm *ssm, FpDevice *device, GError *error)
+{
+   FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
+   open_ssm_data_t *ssm_data = fpi_ssm_get_data(ssm);
+   /* error of the resume itself, which is reported to its caller */
+   GError *resume_error = NULL;
+
+   self->task_ssm = g_steal_pointer(&self->suspended_task_ssm);
+   self->suspended = FALSE;
+
+   if (error == NULL && !ssm_data->tls_session_kept) {
+      /* the sensor was reset, so the capture the task waits for is gone */
+      fp_info("Resume needed a new TLS session, took %" G_GINT64_FORMAT " us",
+              g_get_monotonic_time() - ssm_data->open_start_time);
+      error = set_and_report_error(FP_DEVICE_ERROR_PROTO,
+                                   "Sensor lost its state during suspend");
+   }
+   if (error != NULL) {
+      resume_error = g_error_copy(error);
+   } else if (!events_task_is_waiting(self)) {
+      /* cancelled while the resume state machine was the task, the resume
+       * itself succeeded */
+      error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                  "Cancelled");
+   }
+
+   if (error == NULL) {
+      fp_info("Resume kept the TLS session, took %" G_GINT64_FORMAT " us",
+              g_get_monotonic_time() - ssm_data->open_start_time);
+      interrupt_listener_start(self);
+   } else {
+      /* the task was parked in its wait for events at suspend, so the action
+       * is completed through it */
+      events_fail_parked_task(self, error);
+   }
+
+   fp_dbg("<<<<<<<<<<<<<<<<<<<< resume end <<<<<<<<<<<<<<<<<<<<");
+   fpi_device_resume_complete(device, resume_error);
+}
+
+static void resume(FpDevice *device)
+{
+   FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(device);
+   open_ssm_data_t *ssm_data = g_new0(open_ssm_data_t, 1);
+
+   G_DEBUG_HERE();
+   fp_dbg(">>>>>>>>>>>>>>>>>>>> resume start >>>>>>>>>>>>>>>>>>>>");
+   g_assert(self->suspended);
+
+   ssm_data->open_start_time = g_get_monotonic_time();
+
+   /* the open states use the task state machine */
+   self->suspended_task_ssm = g_steal_pointer(&self->task_ssm);
+   self->task_ssm = fpi_ssm_new_full(device, open_sm_run_state,
+                                     OPEN_NUM_STATES, OPEN_NUM_STATES,
+                                     "Resume");
+   fpi_ssm_set_data(self->task_ssm, ssm_data, (GDestroyNotify)g_free);
+   fpi_ssm_start(self->task_ssm, resume_ssm_done);
+}
+
 /* class init ============================================================== */
 
+enum {
+   PROP_0,
+   PROP_IMAGE_QUALITY_THRESHOLD,
+   PROP_IDENTIFY_FIRST,
+   PROP_USB_ROUND_TRIPS,
+   N_PROPS,
+};
+
+static GParamSpec *properties[N_PROPS];
+
+static void fpi_device_syna_tudor_moc_get_property(GObject *object,
+                                                   guint prop_id,
+                                                   GValue *value,
+                                                   GParamSpec *pspec)
+{
+   FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(object);
+
+   switch (prop_id) {
+   case PROP_IMAGE_QUALITY_THRESHOLD:
+      g_value_set_uint(value, self->img_quality_threshold);
+      break;
+   case PROP_IDENTIFY_FIRST:
+      g_value_set_boolean(value, self->identify_first);
+      break;
+   case PROP_USB_ROUND_TRIPS:
+      g_value_set_uint(value, self->usb_round_trips);
+      break;
+   default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+   }
+}
+
+static void fpi_device_syna_tudor_moc_set_property(GObject *object,
+                                                   guint prop_id,
+                                                   const GValue *value,
+                                                   GParamSpec *pspec)
+{
+   FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(object);
+
+   switch (prop_id) {
+   case PROP_IMAGE_QUALITY_THRESHOLD:
+      self->img_quality_threshold = g_value_get_uint(value);
+      break;
+   case PROP_IDENTIFY_FIRST:
+      self->identify_first = g_value_get_boolean(value);
+      break;
+   default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+   }
+}
+
 static void fpi_device_syna_tudor_moc_init(FpiDeviceSynaTudorMoc *self)
 {
    G_DEBUG_HERE();
+   self->img_quality_threshold = IMAGE_QUALITY_THRESHOLD;
+   random_provider_init_from_env(&self->random);
+
+#ifdef SYNA_TUDOR_MOC_TESTING
+   if (g_strcmp0(g_getenv(SYNA_TUDOR_MOC_EMULATOR_ENV), "1") == 0) {
+      GError *error = NULL;
+      self->emulator = emulator_new(&self->random, &error);
+      if (self->emulator == NULL) {
+         fp_warn("Unable to create sensor emulator: %s",
+                 error != NULL ? error->message : "unknown error");
+         g_clear_error(&error);
+      }
+   }
+#endif
+}
+
+static void fpi_device_syna_tudor_moc_finalize(GObject *object)
+{
+   FpiDeviceSynaTudorMoc *self = FPI_DEVICE_SYNA_TUDOR_MOC(object);
+
+#ifdef SYNA_TUDOR_MOC_TESTING
+   g_clear_pointer(&self->emulator, emulator_free);
+#endif
+   random_provider_clear(&self->random);
+
+   G_OBJECT_CLASS(fpi_device_syna_tudor_moc_parent_class)->finalize(object);
 }
 
 static void
 fpi_device_syna_tudor_moc_class_init(FpiDeviceSynaTudorMocClass *klass)
 {
    FpDeviceClass *dev_class = FP_DEVICE_CLASS(klass);
+   GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+   object_class->get_property = fpi_device_syna_tudor_moc_get_property;
+   object_class->set_property = fpi_device_syna_tudor_moc_set_property;
+   object_class->finalize = fpi_device_syna_tudor_moc_finalize;
+
+   /* captures with lower image quality (in %) are captured again during
+    * verify and identify */
+   properties[PROP_IMAGE_QUALITY_THRESHOLD] = g_param_spec_uint(
+       "image-quality-threshold", "Image quality threshold",
+       "Minimal image quality in percent accepted by verify and identify", 0,
+       100, IMAGE_QUALITY_THRESHOLD,
+       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+   /* sends identify right after the capture and gets image metrics only when
+    * the match fails, saving a round trip on successful matches */
+   properties[PROP_IDENTIFY_FIRST] = g_param_spec_boolean(
+       "identify-first", "Identify first",
+       "Get image metrics only when identify fails to match", FALSE,
+       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+   /* lets the umockdev tests check that an action does not talk to the sensor
+    * more often than it needs to */
+   properties[PROP_USB_ROUND_TRIPS] = g_param_spec_uint(
+       "usb-round-trips", "USB round trips",
+       "Number of USB round trips since the last action started", 0,
+       G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+   g_object_class_install_properties(object_class, N_PROPS, properties);
 
    dev_class->id = FP_COMPONENT;
    dev_class->full_name = SYNA_TUDOR_MOC_DRIVER_FULLNAME;
@@ -1336,6 +2310,8 @@ fpi_device_syna_tudor_moc_class_init(FpiDeviceSynaTudorMocClass *klass)
    dev_class->delete = delete;
    dev_class->clear_storage = clear_storage;
    dev_class->cancel = cancel;
+   dev_class->suspend = suspend;
+   dev_class->resume = resume;
 
    fpi_device_class_auto_initialize_features(dev_class);
 }
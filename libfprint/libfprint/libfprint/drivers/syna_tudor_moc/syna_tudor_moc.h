@@ -29,4 +29,21 @@
 #define SYNA_TUDOR_MOC_DRIVER_FULLNAME "Synaptics Tudor Match-In-Sensor"
 #define SYNA_TUDOR_MOC_DRIVER_NR_ENROLL_STAGES 10
 
+/* default of the image-quality-threshold property */
 #define IMAGE_QUALITY_THRESHOLD 50
+/* number of captures with too low image quality after which verify and
+ * identify report FP_DEVICE_RETRY_GENERAL */
+#define AUTH_MAX_LOW_QUALITY_CAPTURES 3
+
+/* set to 1 to wait for image metrics before sending identify, which is useful
+ * for comparing latency with the pipelined path */
+#define SYNA_TUDOR_MOC_SEQUENTIAL_AUTH_ENV "FP_SYNA_TUDOR_MOC_SEQUENTIAL_AUTH"
+
+/* set to 1 to log the timing of the last commands on close (see
+ * cmd_trace_dump) */
+#define SYNA_TUDOR_MOC_TRACE_ENV "FP_SYNA_TUDOR_MOC_TRACE"
+
+/* set to 1 to use an emulated sensor in place of the USB device, which is
+ * useful for measuring the overhead of the driver; only honoured in builds
+ * with the syna_tudor_moc_testing option (see emulator.h) */
+#define SYNA_TUDOR_MOC_EMULATOR_ENV "FP_SYNA_TUDOR_MOC_EMULATOR"
@@ -40,12 +40,10 @@
 #include <openssl/ec.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
-#include <openssl/hmac.h>
 #include <openssl/kdf.h>
 #include <openssl/param_build.h>
 #include <openssl/params.h>
 #include <openssl/rand.h>
-#include <openssl/sha.h>
 #include <openssl/ssl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,10 +53,134 @@
 
 // #define TLS_DEBUG
 
+/* Random provider ========================================================= */
+
+/* The system provider uses the CSPRNG and clock of the system. A seeded one
+ * makes everything sent to the sensor the same on every run, so that a capture
+ * can be replayed or the CPU time of two builds compared. Its keys are the
+ * sample key, as gnutls cannot derive the public key of a private key made
+ * from the seed, so it is only built with the syna_tudor_moc_testing option. */
+#ifdef SYNA_TUDOR_MOC_TESTING
+#define RANDOM_DEFAULT_SEED 0x54554452
+#define RANDOM_SEEDED_UNIX_TIME 0x66000000
+#endif
+
+static gboolean random_system_fill(random_provider_t *provider, guint8 *data,
+                                   gsize size, GError **error)
+{
+   gboolean ret = TRUE;
+
+   GNUTLS_CHECK(gnutls_rnd(GNUTLS_RND_RANDOM, data, size));
+
+error:
+   return ret;
+}
+
+static guint32 random_system_unix_time(random_provider_t *provider)
+{
+   return g_get_real_time() / G_USEC_PER_SEC;
+}
+
+static gboolean random_system_generate_key(random_provider_t *provider,
+                                           gnutls_privkey_t privkey,
+                                           GError **error)
+{
+   gboolean ret = TRUE;
+
+   GNUTLS_CHECK(gnutls_privkey_generate(
+       privkey, GNUTLS_PK_ECDSA,
+       GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1), 0));
+
+error:
+   return ret;
+}
+
+#ifdef SYNA_TUDOR_MOC_TESTING
+static gboolean random_seeded_fill(random_provider_t *provider, guint8 *data,
+                                   gsize size, GError **error)
+{
+   for (gsize i = 0; i < size; ++i) {
+      data[i] = g_rand_int_range(provider->rand, 0, 256);
+   }
+   return TRUE;
+}
+
+static guint32 random_seeded_unix_time(random_provider_t *provider)
+{
+   return RANDOM_SEEDED_UNIX_TIME;
+}
+
+static gboolean random_seeded_generate_key(random_provider_t *provider,
+                                           gnutls_privkey_t privkey,
+                                           GError **error)
+{
+   gboolean ret = TRUE;
+
+   GNUTLS_CHECK(gnutls_privkey_import_ecc_raw(
+       privkey, GNUTLS_ECC_CURVE_SECP256R1, &sample_privkey_x_datum,
+       &sample_privkey_y_datum, &sample_privkey_k_datum));
+
+error:
+   return ret;
+}
+#endif
+
+void random_provider_init_system(random_provider_t *provider)
+{
+   provider->fill = random_system_fill;
+   provider->unix_time = random_system_unix_time;
+   provider->generate_key = random_system_generate_key;
+   provider->reproducible = FALSE;
+   provider->rand = NULL;
+}
+
+#ifdef SYNA_TUDOR_MOC_TESTING
+void random_provider_init_seeded(random_provider_t *provider, guint32 seed)
+{
+   provider->fill = random_seeded_fill;
+   provider->unix_time = random_seeded_unix_time;
+   provider->generate_key = random_seeded_generate_key;
+   provider->reproducible = TRUE;
+   provider->rand = g_rand_new_with_seed(seed);
+}
+#endif
+
+/* uses the seed from SYNA_TUDOR_MOC_RANDOM_SEED_ENV, the default seed under
+ * FP_DEVICE_EMULATION, which the umockdev tests set, and the system provider
+ * otherwise; without the syna_tudor_moc_testing option it is always the system
+ * provider */
+void random_provider_init_from_env(random_provider_t *provider)
+{
+#ifdef SYNA_TUDOR_MOC_TESTING
+   const gchar *seed = g_getenv(SYNA_TUDOR_MOC_RANDOM_SEED_ENV);
+
+   if (seed != NULL) {
+      fp_info("Using random numbers seeded with %s", seed);
+      random_provider_init_seeded(provider, g_ascii_strtoull(seed, NULL, 0));
+      return;
+   }
+   if (g_strcmp0(g_getenv("FP_DEVICE_EMULATION"), "1") == 0) {
+      random_provider_init_seeded(provider, RANDOM_DEFAULT_SEED);
+      return;
+   }
+#endif
+   random_provider_init_system(provider);
+}
+
+void random_provider_clear(random_provider_t *provider)
+{
+   g_clear_pointer(&provider->rand, g_rand_free);
+}
+
+unsigned random_provider_sign_flags(random_provider_t *provider)
+{
+   return provider->reproducible ? GNUTLS_PRIVKEY_FLAG_REPRODUCIBLE : 0;
+}
+
 /* Supported ciphersuites and extensions =================================== */
 
 /* the only ciphersuite which seemed to be usable */
-static cipher_suit_t tls_ecdh_ecdsa_with_aes_256_gcm_sha384 = {
+cipher_suit_t tls_ecdh_ecdsa_with_aes_256_gcm_sha384 = {
     .id = 0xC02E,
     .mac_algo = "SHA384",
 };
@@ -73,8 +195,10 @@ static extension_t ec_point_formats = {
 
 /*===========================================================================*/
 
-static gboolean write_record_header(FpiByteWriter *writer,
-                                    const record_t *record)
+static gboolean tls_resume_session(FpiDeviceSynaTudorMoc *self,
+                                   GError **error);
+
+gboolean write_record_header(FpiByteWriter *writer, const record_t *record)
 {
    gboolean written = TRUE;
 
@@ -85,7 +209,7 @@ static gboolean write_record_header(FpiByteWriter *writer,
    return written;
 }
 
-static gboolean read_record_header(FpiByteReader *reader, record_t *record)
+gboolean read_record_header(FpiByteReader *reader, record_t *record)
 {
    gboolean read_ok = TRUE;
 
@@ -96,21 +220,30 @@ static gboolean read_record_header(FpiByteReader *reader, record_t *record)
    return read_ok;
 }
 
-static gboolean read_record(const guint8 *serialized_record,
-                            const gsize serialized_record_size,
-                            record_t *record)
+/* record msg points into serialized_record and must not be freed */
+gboolean read_record_in_place(guint8 *serialized_record,
+                              const gsize serialized_record_size,
+                              record_t *record)
 {
    gboolean ret = TRUE;
+   const guint8 *msg = NULL;
 
    FpiByteReader reader;
    fpi_byte_reader_init(&reader, serialized_record, serialized_record_size);
    ret &= read_record_header(&reader, record);
    ret &= fpi_byte_reader_get_uint16_be(&reader, &record->msg_len);
-   ret &= fpi_byte_reader_dup_data(&reader, record->msg_len, &record->msg);
+   ret &= fpi_byte_reader_get_data(&reader, record->msg_len, &msg);
+   record->msg = (guint8 *)msg;
 
    return ret;
 }
 
+guint16 record_version(const record_t *record)
+{
+   return (record->version_major << 8) | record->version_minor;
+}
+
+/* decrypts record msg in place; on success ptext points into the record msg */
 static gboolean decrypt_record(FpiDeviceSynaTudorMoc *self,
                                record_t *record_to_decrypt, guint8 **ptext,
                                gsize *ptext_len, GError **error)
@@ -121,78 +254,31 @@ static gboolean decrypt_record(FpiDeviceSynaTudorMoc *self,
 #endif
 
    gboolean ret = TRUE;
-   gboolean crypt_initialized = FALSE;
 
+   *ptext = NULL;
    *ptext_len = 0;
 
-   /* Setup storage for additional data */
-   gsize additional_data_size =
-       sizeof(self->tls.decrypt_seq_num) + RECORD_HEADER_SIZE;
-   guint8 additional_data[additional_data_size];
-
-   /* Split input msg into nonce and crypttext */
-   guint64 nonce = FP_READ_UINT64_BE(record_to_decrypt->msg);
-   guint8 *ctext = record_to_decrypt->msg + sizeof(nonce);
-   gsize ctext_len = record_to_decrypt->msg_len - sizeof(nonce);
-   gsize expected_ptext_len = ctext_len - self->tls.tag_size;
-
-   /* create GCM IV = decryption_iv + nonce */
-   gnutls_datum_t gcm_iv = {.data = NULL, .size = 0};
-   g_assert(self->tls.decryption_iv.size != 0);
-   gcm_iv.size = sizeof(nonce) + self->tls.decryption_iv.size;
-   gcm_iv.data = g_malloc(gcm_iv.size);
-   memcpy(gcm_iv.data, self->tls.decryption_iv.data,
-          self->tls.decryption_iv.size);
-   FP_WRITE_UINT64_BE(gcm_iv.data + self->tls.decryption_iv.size, nonce);
-
-#ifdef TLS_DEBUG
-   fp_dbg("\tdecryption nonce: %lu", nonce);
-   fp_dbg("\tdecryption IV:");
-   fp_dbg_large_hex(self->tls.decryption_iv.data, self->tls.decryption_iv.size);
-   fp_dbg("\tGCM IV:");
-   fp_dbg_large_hex(gcm_iv.data, gcm_iv.size);
-   fp_dbg("\tdecryption key:");
-   fp_dbg_large_hex(self->tls.decryption_key.data,
-                    self->tls.decryption_key.size);
-#endif
-
-   /* Initialize GCM cipher */
-   g_assert(self->tls.cipher_alg == GNUTLS_CIPHER_AES_256_GCM);
-   gnutls_aead_cipher_hd_t aead_hd;
-   GNUTLS_CHECK(gnutls_aead_cipher_init(&aead_hd, self->tls.cipher_alg,
-                                        &self->tls.decryption_key));
-   crypt_initialized = TRUE;
+   g_assert(self->tls.record_layer.keys_set);
 
-   /* Setup additional data
-    * = decryption_seq_num (8) + record_header (5) */
-   FpiByteWriter writer;
-   gboolean written = TRUE;
-   fpi_byte_writer_init_with_data(&writer, additional_data,
-                                  additional_data_size, FALSE);
-   written &= fpi_byte_writer_put_uint64_be(&writer, self->tls.decrypt_seq_num);
-   written &= write_record_header(&writer, record_to_decrypt);
-   written &= fpi_byte_writer_put_uint16_be(&writer, expected_ptext_len);
-   /* NOTE: this should have no way of failing */
-   WRITTEN_CHECK(written);
-
-   /* Allocate for result */
-   gsize allocated_for_ptext = expected_ptext_len;
-   *ptext = g_malloc(allocated_for_ptext);
+   if (record_to_decrypt->msg_len < AES_GCM_RECORD_OVERHEAD) {
+      *error = set_and_report_error(FP_DEVICE_ERROR_PROTO,
+                                    "Encrypted record is too short: %u",
+                                    record_to_decrypt->msg_len);
+      ret = FALSE;
+      goto error;
+   }
 
 #ifdef TLS_DEBUG
-   fp_dbg("Decryption - auth data:");
-   fp_dbg_large_hex(additional_data, additional_data_size);
+   fp_dbg("\tdecryption nonce: %lu", FP_READ_UINT64_BE(record_to_decrypt->msg));
+   fp_dbg("\tdecryption sequence number: %lu",
+          self->tls.record_layer.decrypt_seq_num);
 #endif
 
-   /* Decrypt text */
-   GNUTLS_CHECK(gnutls_aead_cipher_decrypt(
-       aead_hd, gcm_iv.data, gcm_iv.size, additional_data, additional_data_size,
-       self->tls.tag_size, ctext, ctext_len, *ptext, &allocated_for_ptext));
-
-   /* Set decrypted text size (decryption may be shorter) */
-   *ptext_len = allocated_for_ptext;
-
-   self->tls.decrypt_seq_num += 1;
+   /* the cached decryption context only gets the IV of this record */
+   BOOL_CHECK(syna_tls_record_layer_decrypt(
+       &self->tls.record_layer, record_to_decrypt->type,
+       record_version(record_to_decrypt), record_to_decrypt->msg,
+       record_to_decrypt->msg_len, ptext, ptext_len, error));
 
 #ifdef TLS_DEBUG
    fp_dbg("Decrypted:");
@@ -200,17 +286,6 @@ static gboolean decrypt_record(FpiDeviceSynaTudorMoc *self,
 #endif
 
 error:
-   if (crypt_initialized) {
-      gnutls_aead_cipher_deinit(aead_hd);
-   }
-   if (!ret && *ptext != NULL) {
-      g_free(*ptext);
-      *ptext = NULL;
-   }
-   if (gcm_iv.data != NULL) {
-      g_free(gcm_iv.data);
-   }
-
    return ret;
 }
 
@@ -221,94 +296,24 @@ void fp_err_tls_alert(const guint alert_level, const guint alert_description)
           SSL_alert_desc_string_long(alert_description));
 }
 
-static gboolean tls_prf(const char *hmac_algo, const gnutls_datum_t secret,
-                        const char *label, const guint8 *seed, gsize seed_len,
-                        guint8 **output, gsize output_len, GError **error)
+/* allocates output and fills it with the PRF of the shared transport */
+gboolean tls_prf(const char *hmac_algo, const gnutls_datum_t secret,
+                 const char *label, const guint8 *seed, gsize seed_len,
+                 guint8 **output, gsize output_len, GError **error)
 {
-   /* Validate input parameters */
    g_return_val_if_fail(label != NULL, FALSE);
    g_return_val_if_fail(seed != NULL, FALSE);
    g_return_val_if_fail(output != NULL, FALSE);
    g_return_val_if_fail(output_len > 0, FALSE);
 
-   gboolean ret = TRUE;
-
-   const gsize buf_size = 128;
-   const EVP_MD *evp_md = EVP_get_digestbyname(hmac_algo);
-   const gsize hmac_size = EVP_MD_size(evp_md);
-
-   g_autofree guint8 *input = NULL;
-   *output = NULL;
-   g_autofree guint8 *to_digest = NULL;
-
-   /* prepare buffers */
-   guint8 A[hmac_size];
-   guint8 buf_digested[hmac_size];
-
-   gsize label_len = strlen(label);
-   g_assert(label_len > 0);
-
-   /* Check if seed and label fit */
-   if (hmac_size + label_len + seed_len > buf_size) {
-      fprintf(stderr, "Input arguments too large in %s\n", __FUNCTION__);
+   *output = g_malloc(output_len);
+   if (!syna_tls_prf(hmac_algo, secret.data, secret.size, label, seed,
+                     seed_len, *output, output_len, error)) {
+      g_clear_pointer(output, g_free);
       return FALSE;
    }
 
-   /* Allocate output buffer */
-   *output = g_malloc0(output_len);
-
-   /* prepare input = label + seed */
-   gsize input_len = label_len + seed_len;
-   input = g_malloc0(input_len);
-   memcpy(input, label, label_len);
-   memcpy(input + label_len, seed, seed_len);
-
-   /* prepare to_digest buffer */
-   gsize to_digest_len = sizeof(A) + input_len;
-   to_digest = g_malloc(to_digest_len);
-
-   /* Initialize A to the first input */
-   memset(A, 0, sizeof(A));
-
-   /* update A with first hash */
-   if (NULL ==
-       HMAC(evp_md, secret.data, secret.size, input, input_len, A, NULL)) {
-      goto error;
-   }
-
-   gsize output_offset = 0;
-   while (output_offset < output_len) {
-
-      /* Prepare to_digest buffer */
-      memcpy(to_digest, A, sizeof(A));
-      memcpy(to_digest + sizeof(A), input, input_len);
-
-      /* update output */
-      if (NULL == HMAC(evp_md, secret.data, secret.size, to_digest,
-                       to_digest_len, buf_digested, NULL)) {
-         goto error;
-      }
-
-      gsize remains_to_write = output_len - output_offset;
-      gsize to_write =
-          remains_to_write < hmac_size ? remains_to_write : hmac_size;
-      g_assert(output_offset + to_write <= output_len);
-      memcpy(*output + output_offset, buf_digested, to_write);
-      output_offset += to_write;
-
-      /* update A */
-      if (NULL ==
-          HMAC(evp_md, secret.data, secret.size, A, sizeof(A), A, NULL)) {
-         goto error;
-      }
-   }
-
-error:
-   if ((!ret) && (*output != NULL)) {
-      g_free(*output);
-      *output = NULL;
-   }
-   return ret;
+   return TRUE;
 }
 
 static gboolean check_server_finished_verify_data(FpiDeviceSynaTudorMoc *self,
@@ -319,8 +324,8 @@ static gboolean check_server_finished_verify_data(FpiDeviceSynaTudorMoc *self,
 {
    gboolean ret = TRUE;
    *is_correct = FALSE;
-   const guint hash_size = SHA256_DIGEST_LENGTH;
-   guint8 sent_messages_hash[hash_size];
+   guint8 sent_messages_hash[EVP_MAX_MD_SIZE];
+   gsize hash_size = 0;
 
    g_autofree guint8 *verify_data = NULL;
    g_autofree guint8 *recv_verify_data = NULL;
@@ -335,18 +340,12 @@ static gboolean check_server_finished_verify_data(FpiDeviceSynaTudorMoc *self,
 
    fpi_byte_reader_dup_data(reader, VERIFY_DATA_SIZE, &recv_verify_data);
 
-#ifdef TLS_DEBUG
-   fp_dbg("Server finished sent messages:");
-   fp_dbg_large_hex(self->tls.sent_handshake_msgs,
-                    self->tls.sent_handshake_msgs_size);
-#endif
-
-   SHA256(self->tls.sent_handshake_msgs, self->tls.sent_handshake_msgs_size,
-          sent_messages_hash);
+   BOOL_CHECK(syna_tls_transcript_get_digest(
+       &self->tls.transcript, sent_messages_hash, &hash_size, error));
 
 #ifdef TLS_DEBUG
    fp_dbg("Handshake finished sent messages hash:");
-   fp_dbg_large_hex(sent_messages_hash, sizeof(sent_messages_hash));
+   fp_dbg_large_hex(sent_messages_hash, hash_size);
 #endif
 
    BOOL_CHECK(tls_prf(self->tls.mac_algo, self->tls.master_secret,
@@ -552,7 +551,8 @@ gboolean get_remote_tls_status(FpiDeviceSynaTudorMoc *self, gboolean *status,
        REQUEST_TLS_SESSION_STATUS, 0, 0, TLS_SESSION_STATUS_DATA_RESP_LEN);
 
    transfer->short_is_error = TRUE;
-   fpi_usb_transfer_submit_sync(transfer, TLS_SESSION_STATUS_TIMEOUT_MS, error);
+   syna_usb_transfer_submit_sync(transfer, TLS_SESSION_STATUS_TIMEOUT_MS,
+                                 error);
 
    if (*error) {
       goto error;
@@ -568,39 +568,27 @@ error:
    return ret;
 }
 
-static void update_handshake_messages_data(FpiDeviceSynaTudorMoc *self,
-                                           const guint8 *data, const gsize size)
+static gboolean update_handshake_messages_data(FpiDeviceSynaTudorMoc *self,
+                                               const guint8 *data,
+                                               const gsize size, GError **error)
 {
-   /* NOTE: per decompiled code do not update with *finished messages* */
-   gsize remaining_alloc_size = self->tls.sent_handshake_msgs_alloc_size -
-                                self->tls.sent_handshake_msgs_size;
-
-   if (remaining_alloc_size <= size) {
-      gsize realloc_size =
-          (self->tls.sent_handshake_msgs_alloc_size + size) * 2;
-      self->tls.sent_handshake_msgs =
-          g_realloc(self->tls.sent_handshake_msgs, realloc_size);
-      self->tls.sent_handshake_msgs_alloc_size = realloc_size;
-   }
-
-   memcpy(&self->tls.sent_handshake_msgs[self->tls.sent_handshake_msgs_size],
-          data, size);
-   self->tls.sent_handshake_msgs_size += size;
-
 #ifdef TLS_DEBUG
-   fp_dbg("sent messages:");
-   fp_dbg_large_hex(self->tls.sent_handshake_msgs,
-                    self->tls.sent_handshake_msgs_size);
+   fp_dbg("Hashing handshake messages:");
+   fp_dbg_large_hex(data, size);
 #endif
+
+   return syna_tls_transcript_update(&self->tls.transcript, data, size, error);
 }
 
-static void update_handshake_messages_data_record(FpiDeviceSynaTudorMoc *self,
-                                                  const record_t *rec)
+static gboolean
+update_handshake_messages_data_record(FpiDeviceSynaTudorMoc *self,
+                                      const record_t *rec, GError **error)
 {
    /* windows driver does not update with HS_FINISHED messages */
-   if (rec->msg[0] != HS_FINISHED) {
-      update_handshake_messages_data(self, rec->msg, rec->msg_len);
+   if (rec->msg[0] == HS_FINISHED) {
+      return TRUE;
    }
+   return update_handshake_messages_data(self, rec->msg, rec->msg_len, error);
 }
 
 static void send_tls(FpiDeviceSynaTudorMoc *self, const record_t *send_records,
@@ -640,23 +628,19 @@ static void send_tls(FpiDeviceSynaTudorMoc *self, const record_t *send_records,
                             FALSE, callback);
 }
 
-static void init_client_hello(FpiDeviceSynaTudorMoc *self,
-                              hello_t *client_hello)
+static gboolean init_client_hello(FpiDeviceSynaTudorMoc *self,
+                                  hello_t *client_hello, GError **error)
 {
-
    client_hello->version_major = self->tls.version_major,
    client_hello->version_minor = self->tls.version_minor;
 
-   GDateTime *datetime = g_date_time_new_now_utc();
-   client_hello->current_timestamp = g_date_time_to_unix(datetime);
-   g_date_time_unref(datetime);
+   client_hello->current_timestamp = self->random.unix_time(&self->random);
 
    /* generate client random */
-   GRand *rand = g_rand_new();
-   for (int i = 0; i < sizeof(client_hello->random); ++i) {
-      client_hello->random[i] = g_rand_int_range(rand, 0, 255);
+   if (!self->random.fill(&self->random, client_hello->random,
+                          sizeof(client_hello->random), error)) {
+      return FALSE;
    }
-   g_rand_free(rand);
 
    /* store client random*/
    FP_WRITE_UINT32_BE(self->tls.client_random, client_hello->current_timestamp);
@@ -674,8 +658,15 @@ static void init_client_hello(FpiDeviceSynaTudorMoc *self,
    fp_dbg_large_hex(client_hello->random, sizeof(client_hello->random));
 #endif
 
-   /* copy session id from self */
-   memcpy(&client_hello->session_id, self->tls.session_id, SESSION_ID_LEN);
+   /* offer the cached session for resumption, a zeroed session id requests a
+    * new one */
+   if (self->tls_session_cache.present) {
+      fp_dbg("Offering cached TLS session for resumption");
+      memcpy(&client_hello->session_id, self->tls_session_cache.session_id,
+             SESSION_ID_LEN);
+   } else {
+      memset(&client_hello->session_id, 0, SESSION_ID_LEN);
+   }
 
    /* only ciphersuite which seemed to work is 0xC02E
     * -> for now hardcode everything per this */
@@ -686,6 +677,8 @@ static void init_client_hello(FpiDeviceSynaTudorMoc *self,
    client_hello->extensions = g_new(extension_t, client_hello->extension_cnt);
    memcpy(&client_hello->extensions[0], &supported_groups, sizeof(extension_t));
    memcpy(&client_hello->extensions[1], &ec_point_formats, sizeof(extension_t));
+
+   return TRUE;
 }
 
 static gboolean parse_and_process_server_hello(FpiDeviceSynaTudorMoc *self,
@@ -739,6 +732,11 @@ static gboolean parse_and_process_server_hello(FpiDeviceSynaTudorMoc *self,
    ret &= fpi_byte_reader_get_data(reader, SESSION_ID_LEN, &to_copy);
    if (ret) {
       memcpy(self->tls.session_id, to_copy, SESSION_ID_LEN);
+      /* the server echoes our session id if it accepts the resumption */
+      self->tls.resumed =
+          self->tls_session_cache.present &&
+          0 == memcmp(self->tls_session_cache.session_id,
+                      self->tls.session_id, SESSION_ID_LEN);
    }
 
    /* read cipher cuites */
@@ -764,6 +762,13 @@ static gboolean parse_and_process_server_hello(FpiDeviceSynaTudorMoc *self,
              read_end_pos, read_start_pos + read_len);
    }
 
+   if (ret && self->tls.resumed) {
+      BOOL_CHECK(tls_resume_session(self, error));
+   } else if (ret && self->tls_session_cache.present) {
+      fp_info("Sensor refused TLS session resumption - doing full handshake");
+      tls_session_cache_clear(self);
+   }
+
 error:
    return ret;
 }
@@ -836,7 +841,11 @@ static gboolean parse_and_process_hs_finished(FpiDeviceSynaTudorMoc *self,
       goto error;
    }
    fp_dbg("Server verify message matches");
-   self->tls.established = TRUE;
+   /* on resumption the server finishes first - the session is established
+    * only after our finished message is sent */
+   if (!self->tls.resumed) {
+      self->tls.established = TRUE;
+   }
    self->tls.handshake_state = TLS_HS_STATE_FINISHED;
 
 error:
@@ -950,18 +959,19 @@ static void parse_and_process_records(FpiDeviceSynaTudorMoc *self,
       read_ok &= fpi_byte_reader_get_uint8(&reader, &record.version_major);
       read_ok &= fpi_byte_reader_get_uint8(&reader, &record.version_minor);
       read_ok &= fpi_byte_reader_get_uint16_be(&reader, &record.msg_len);
+      /* records are processed in place in the receive buffer */
+      const guint8 *msg = NULL;
       if (read_ok) {
-         read_ok &=
-             fpi_byte_reader_dup_data(&reader, record.msg_len, &record.msg);
+         read_ok &= fpi_byte_reader_get_data(&reader, record.msg_len, &msg);
       }
       READ_OK_CHECK_ASYNC(self->task_ssm, read_ok);
+      record.msg = (guint8 *)msg;
 
       if (self->tls.remote_sends_encrypted) {
          guint8 *ptext = NULL;
          gsize ptext_size = 0;
          BOOL_CHECK_ASYNC(self->task_ssm, decrypt_record(self, &record, &ptext,
                                                          &ptext_size, &error));
-         g_free(record.msg);
          record.msg = ptext;
          record.msg_len = ptext_size;
       }
@@ -997,7 +1007,8 @@ static void parse_and_process_records(FpiDeviceSynaTudorMoc *self,
          break;
 
       case RECORD_TYPE_HANDSHAKE:
-         update_handshake_messages_data_record(self, &record);
+         BOOL_CHECK_ASYNC(self->task_ssm, update_handshake_messages_data_record(
+                                              self, &record, &error));
          BOOL_CHECK_ASYNC(self->task_ssm, parse_and_process_handshake_record(
                                               self, &record, &error));
          break;
@@ -1045,17 +1056,9 @@ static void parse_and_process_records(FpiDeviceSynaTudorMoc *self,
          goto error;
          break;
       }
-      if (record.msg != NULL) {
-         g_free(record.msg);
-         record.msg = NULL;
-      }
    }
 
 error:
-   if (record.msg != NULL) {
-      g_free(record.msg);
-   }
-   g_free(recv_data);
    if (error != NULL) {
       fpi_ssm_mark_failed(self->task_ssm, error);
    } else if (self->tls.alert_level != 0) {
@@ -1162,20 +1165,14 @@ static gboolean append_certificate_verify_to_record(FpiDeviceSynaTudorMoc *self,
                                                     GError **error)
 {
    gboolean ret = TRUE;
-   const guint hash_size = SHA256_DIGEST_LENGTH;
-   guint8 sent_messages_hash[hash_size];
-   gnutls_datum_t sent_messages_hash_datum = {.data = sent_messages_hash,
-                                              .size = hash_size};
+   guint8 sent_messages_hash[EVP_MAX_MD_SIZE];
+   gsize hash_size = 0;
    gnutls_datum_t signature = {.data = NULL, .size = 0};
 
-#ifdef TLS_DEBUG
-   fp_dbg("Messages to certificate veify");
-   fp_dbg_large_hex(self->tls.sent_handshake_msgs,
-                    self->tls.sent_handshake_msgs_size);
-#endif
-
-   SHA256(self->tls.sent_handshake_msgs, self->tls.sent_handshake_msgs_size,
-          &sent_messages_hash);
+   BOOL_CHECK(syna_tls_transcript_get_digest(
+       &self->tls.transcript, sent_messages_hash, &hash_size, error));
+   gnutls_datum_t sent_messages_hash_datum = {.data = sent_messages_hash,
+                                              .size = hash_size};
 
 #ifdef TLS_DEBUG
    fp_dbg("Siging hash:");
@@ -1184,8 +1181,9 @@ static gboolean append_certificate_verify_to_record(FpiDeviceSynaTudorMoc *self,
 #endif
 
    GNUTLS_CHECK(gnutls_privkey_sign_hash2(
-       self->pairing_data.private_key, GNUTLS_SIGN_ECDSA_SHA256, 0,
-       &sent_messages_hash_datum, &signature));
+       self->pairing_data.private_key, GNUTLS_SIGN_ECDSA_SHA256,
+       random_provider_sign_flags(&self->random), &sent_messages_hash_datum,
+       &signature));
 
 #ifdef TLS_DEBUG
    fp_dbg("Signature:");
@@ -1204,8 +1202,13 @@ error:
    return ret;
 }
 
+/* encrypts record msg into ctext, which has to have space for at least
+ * msg_len + AES_GCM_RECORD_OVERHEAD bytes; ctext_len is set to the size of the
+ * written nonce, ciphertext and tag
+ * - if msg is already placed at ctext + AES_GCM_NONCE_SIZE, it is encrypted in
+ *   place without any copy */
 static gboolean encrypt_record(FpiDeviceSynaTudorMoc *self,
-                               record_t *record_to_encrypt, guint8 **ctext,
+                               record_t *record_to_encrypt, guint8 *ctext,
                                gsize *ctext_len, GError **error)
 {
 #ifdef TLS_DEBUG
@@ -1214,99 +1217,29 @@ static gboolean encrypt_record(FpiDeviceSynaTudorMoc *self,
 #endif
 
    gboolean ret = TRUE;
-   gboolean crypt_initialized = FALSE;
-
-   gnutls_datum_t gcm_iv = {.data = NULL, .size = 0};
 
-   /* Setup storage for additional data */
-   gsize additional_data_size =
-       sizeof(self->tls.encrypt_seq_num) + RECORD_HEADER_SIZE;
-   guint8 additional_data[additional_data_size];
+   *ctext_len = 0;
 
-   /* create random nonce */
-   guint64 nonce;
-   OPENSSL_CHECK(RAND_bytes((guint8 *)&nonce, sizeof(nonce)));
-
-   /* create GCM IV = encryption_iv + nonce */
-   g_assert(self->tls.encryption_iv.size != 0);
-   gcm_iv.size = sizeof(nonce) + self->tls.encryption_iv.size;
-   gcm_iv.data = g_malloc(gcm_iv.size);
-   memcpy(gcm_iv.data, self->tls.encryption_iv.data,
-          self->tls.encryption_iv.size);
-   FP_WRITE_UINT64_BE(gcm_iv.data + self->tls.encryption_iv.size, nonce);
+   g_assert(self->tls.record_layer.keys_set);
 
 #ifdef TLS_DEBUG
-   fp_dbg("Encryption nonce: %lu", nonce);
-   fp_dbg("Encryption IV:");
-   fp_dbg_large_hex(self->tls.encryption_iv.data, self->tls.encryption_iv.size);
-   fp_dbg("GCM IV:");
-   fp_dbg_large_hex(gcm_iv.data, gcm_iv.size);
-   fp_dbg("Encryption key:");
-   fp_dbg_large_hex(self->tls.encryption_key.data,
-                    self->tls.encryption_key.size);
+   fp_dbg("Encryption sequence number: %lu",
+          self->tls.record_layer.encrypt_seq_num);
 #endif
 
-   /* Initialize GCM cipher */
-   g_assert(self->tls.cipher_alg == GNUTLS_CIPHER_AES_256_GCM);
-   gnutls_aead_cipher_hd_t aead_hd;
-   GNUTLS_CHECK(gnutls_aead_cipher_init(&aead_hd, self->tls.cipher_alg,
-                                        &self->tls.encryption_key));
-   crypt_initialized = TRUE;
-
-   /* Set additional data
-    * = encryption_seq_num (8) + record_header (5) */
-   FpiByteWriter writer;
-   gboolean written = TRUE;
-   fpi_byte_writer_init_with_data(&writer, additional_data,
-                                  additional_data_size, FALSE);
-   written &= fpi_byte_writer_put_uint64_be(&writer, self->tls.encrypt_seq_num);
-   written &= write_record_header(&writer, record_to_encrypt);
-   written &=
-       fpi_byte_writer_put_uint16_be(&writer, record_to_encrypt->msg_len);
-   /* NOTE: this should have no way of failing */
-   WRITTEN_CHECK(written);
-
-#ifdef TLS_DEBUG
-   fp_dbg("Encryption - auth data:");
-   fp_dbg_large_hex(additional_data, additional_data_size);
-#endif
-
-   /* Allocate for result */
-   gsize allocated_for_ctext = record_to_encrypt->msg_len + self->tls.tag_size;
-   gsize to_allocate = sizeof(nonce) + allocated_for_ctext;
-   *ctext = g_malloc(to_allocate);
-
-   /* add nonce to output */
-   FP_WRITE_UINT64_BE(*ctext, nonce);
-
-   /* Encrypt text */
-   GNUTLS_CHECK(gnutls_aead_cipher_encrypt(
-       aead_hd, gcm_iv.data, gcm_iv.size, additional_data, additional_data_size,
-       self->tls.tag_size, record_to_encrypt->msg, record_to_encrypt->msg_len,
-       (*ctext) + sizeof(nonce), &allocated_for_ctext));
-
-   /* Set encrypted text size (encryption may be shorter) */
-   *ctext_len = sizeof(nonce) + allocated_for_ctext;
-
-   self->tls.encrypt_seq_num += 1;
+   /* the cached encryption context only gets the IV of this record, the
+    * nonce and tag are written around msg directly in ctext */
+   BOOL_CHECK(syna_tls_record_layer_encrypt(
+       &self->tls.record_layer, record_to_encrypt->type,
+       record_version(record_to_encrypt), record_to_encrypt->msg,
+       record_to_encrypt->msg_len, ctext, ctext_len, error));
 
 #ifdef TLS_DEBUG
    fp_dbg("Encrypted:");
-   fp_dbg_large_hex(*ctext, *ctext_len);
+   fp_dbg_large_hex(ctext, *ctext_len);
 #endif
 
 error:
-   if (crypt_initialized) {
-      gnutls_aead_cipher_deinit(aead_hd);
-   }
-   if (!ret && *ctext != NULL) {
-      g_free(*ctext);
-      *ctext = NULL;
-   }
-   if (gcm_iv.data != NULL) {
-      g_free(gcm_iv.data);
-   }
-
    return ret;
 }
 
@@ -1315,32 +1248,28 @@ static gboolean append_encrypted_handshake_finish_to_record(
 {
    gboolean ret = TRUE;
 
-   const gsize prf_size = 12;
-   guint8 sent_messages_sha256[SHA256_DIGEST_LENGTH];
+   const gsize prf_size = VERIFY_DATA_SIZE;
+   guint8 sent_messages_hash[EVP_MAX_MD_SIZE];
+   gsize hash_size = 0;
    g_autofree guint8 *tls_prf_output = NULL;
    g_autofree guint8 *to_encrypt = NULL;
    gsize to_encrypt_size = 0;
-   g_autofree guint8 *encrypted = NULL;
-   gsize encrypted_size = 0;
    const gsize header_size = 4;
+   /* handshake header (4) + verify data */
+   guint8 encrypted[4 + VERIFY_DATA_SIZE + AES_GCM_RECORD_OVERHEAD];
+   gsize encrypted_size = 0;
 
-#ifdef TLS_DEBUG
-   fp_dbg("Handshake finished sent messages:");
-   fp_dbg_large_hex(self->tls.sent_handshake_msgs,
-                    self->tls.sent_handshake_msgs_size);
-#endif
-
-   SHA256(self->tls.sent_handshake_msgs, self->tls.sent_handshake_msgs_size,
-          sent_messages_sha256);
+   BOOL_CHECK(syna_tls_transcript_get_digest(
+       &self->tls.transcript, sent_messages_hash, &hash_size, error));
 
 #ifdef TLS_DEBUG
    fp_dbg("Handshake finished sent messages hash:");
-   fp_dbg_large_hex(sent_messages_sha256, sizeof(sent_messages_sha256));
+   fp_dbg_large_hex(sent_messages_hash, hash_size);
 #endif
 
    BOOL_CHECK(tls_prf(self->tls.mac_algo, self->tls.master_secret,
-                      "client finished", sent_messages_sha256,
-                      SHA256_DIGEST_LENGTH, &tls_prf_output, prf_size, error));
+                      "client finished", sent_messages_hash, hash_size,
+                      &tls_prf_output, prf_size, error));
 
 #ifdef TLS_DEBUG
    fp_dbg("tls prf client finished output:");
@@ -1365,7 +1294,7 @@ static gboolean append_encrypted_handshake_finish_to_record(
        .msg = to_encrypt,
    };
 
-   BOOL_CHECK(encrypt_record(self, &record_to_encrypt, &encrypted,
+   BOOL_CHECK(encrypt_record(self, &record_to_encrypt, encrypted,
                              &encrypted_size, error));
 
    /* Append to record data */
@@ -1375,137 +1304,150 @@ error:
    return ret;
 }
 
+static void free_aead_keys(FpiDeviceSynaTudorMoc *self)
+{
+   syna_tls_record_layer_clear(&self->tls.record_layer);
+}
+
 static gboolean generate_and_store_aead_keys(FpiDeviceSynaTudorMoc *self,
                                              GError **error)
 {
    gboolean ret = TRUE;
-   g_autofree guint8 *data = NULL;
+   guint8 key_block[SYNA_TLS_KEY_BLOCK_SIZE];
 
-   gsize key_size = self->tls.encryption_key.size;
-   if (!tls_prf(self->tls.mac_algo, self->tls.master_secret, "key expansion",
-                self->tls.derive_input, sizeof(self->tls.derive_input), &data,
-                4 * key_size, error)) {
-      ret = FALSE;
-      goto error;
-   }
+   BOOL_CHECK(syna_tls_prf(self->tls.mac_algo, self->tls.master_secret.data,
+                           self->tls.master_secret.size, "key expansion",
+                           self->tls.derive_input,
+                           sizeof(self->tls.derive_input), key_block,
+                           sizeof(key_block), error));
 
 #ifdef TLS_DEBUG
    fp_dbg("key expansion data:");
-   fp_dbg_large_hex(data, 4 * key_size);
+   fp_dbg_large_hex(key_block, sizeof(key_block));
 #endif
 
-   g_assert(self->tls.encryption_key.size != 0);
-   g_assert(self->tls.decryption_key.size != 0);
-   g_assert(self->tls.encryption_iv.size != 0);
-   g_assert(self->tls.decryption_iv.size != 0);
-
-   /* store parameters */
-   guint offset = 0;
-   self->tls.encryption_key.data =
-       g_memdup2(data, self->tls.encryption_key.size);
-   offset += self->tls.encryption_key.size;
-
-   self->tls.decryption_key.data =
-       g_memdup2(data + offset, self->tls.decryption_key.size);
-   offset += self->tls.decryption_key.size;
-
-   self->tls.encryption_iv.data =
-       g_memdup2(data + offset, self->tls.encryption_iv.size);
-   offset += self->tls.encryption_iv.size;
-
-   self->tls.decryption_iv.data =
-       g_memdup2(data + offset, self->tls.decryption_iv.size);
-   offset += self->tls.decryption_iv.size;
-   g_assert(offset <= 4 * key_size);
+   /* the cipher contexts are created with the first keys and kept until
+    * deinit_tls(), a new session only re-keys them and sequence numbers start
+    * again from zero */
+   const guint8 *encryption_key = key_block;
+   const guint8 *decryption_key = encryption_key + AES_GCM_KEY_SIZE;
+   const guint8 *encryption_iv = decryption_key + AES_GCM_KEY_SIZE;
+   const guint8 *decryption_iv = encryption_iv + AES_GCM_IV_SIZE;
+   BOOL_CHECK(syna_tls_record_layer_set_keys(&self->tls.record_layer,
+                                             encryption_key, encryption_iv,
+                                             decryption_key, decryption_iv,
+                                             error));
+   self->tls.record_layer.sequential_nonce = self->random.reproducible;
 
 error:
+   OPENSSL_cleanse(key_block, sizeof(key_block));
    return ret;
 }
 
 static gboolean tls_aead_encryption_algorithm_init(FpiDeviceSynaTudorMoc *self,
                                                    GError **error)
 {
-   gboolean ret = TRUE;
-
-   self->tls.encrypt_seq_num = 0;
-   self->tls.decrypt_seq_num = 0;
-
-   self->tls.encryption_key.size = AES_GCM_KEY_SIZE;
-   self->tls.decryption_key.size = AES_GCM_KEY_SIZE;
-
-   self->tls.decryption_iv.size = AES_GCM_IV_SIZE;
-   self->tls.encryption_iv.size = AES_GCM_IV_SIZE;
-
-   self->tls.tag_size = AES_GCM_TAG_SIZE;
-   self->tls.cipher_alg = GNUTLS_CIPHER_AES_256_GCM;
-
-   ret = generate_and_store_aead_keys(self, error);
-
-   return ret;
+   return generate_and_store_aead_keys(self, error);
 }
 
-gboolean tls_wrap(FpiDeviceSynaTudorMoc *self, guint8 *ptext, gsize ptext_size,
-                  guint8 **ctext, gsize *ctext_size, GError **error)
+/* encrypts a record in place
+ * - the plaintext has to be already placed at TLS_RECORD_PTEXT_OFFSET of record
+ *   and there has to be AES_GCM_TAG_SIZE bytes of space after it
+ * - record_size is set to the size of the whole wrapped record */
+gboolean tls_wrap(FpiDeviceSynaTudorMoc *self, guint8 *record,
+                  gsize ptext_size, gsize *record_size, GError **error)
 {
    gboolean ret = TRUE;
    gboolean written = TRUE;
-   g_autofree guint8 *encrypted_msg = NULL;
 
    if (!self->tls.established) {
-      fp_warn("Calling wrap while TLS session is not established");
-      *ctext = ptext;
-      *ctext_size = ptext_size;
-      return ret;
+      *error = set_and_report_error(
+          FP_DEVICE_ERROR_GENERAL,
+          "Calling wrap while TLS session is not established");
+      ret = FALSE;
+      goto error;
    }
 
    record_t record_to_encrypt = {
        .type = RECORD_TYPE_APPLICATION_DATA,
        .version_major = self->tls.version_major,
        .version_minor = self->tls.version_minor,
-       .msg = ptext,
+       .msg = record + TLS_RECORD_PTEXT_OFFSET,
        .msg_len = ptext_size,
    };
 
-   g_autofree guint8 *encrypted_record = NULL;
    gsize encrypted_record_size = 0;
-   BOOL_CHECK(encrypt_record(self, &record_to_encrypt, &encrypted_record,
+   BOOL_CHECK(encrypt_record(self, &record_to_encrypt,
+                             record + RECORD_HEADER_SIZE,
                              &encrypted_record_size, error));
 
-   *ctext_size = RECORD_HEADER_SIZE + encrypted_record_size;
-   *ctext = g_malloc(*ctext_size);
+   *record_size = RECORD_HEADER_SIZE + encrypted_record_size;
 
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_data(&writer, *ctext, *ctext_size, FALSE);
+   fpi_byte_writer_init_with_data(&writer, record, RECORD_HEADER_SIZE, FALSE);
    written &= write_record_header(&writer, &record_to_encrypt);
    written &= fpi_byte_writer_put_uint16_be(&writer, encrypted_record_size);
-   written &= fpi_byte_writer_put_data(&writer, encrypted_record,
-                                       encrypted_record_size);
 
    WRITTEN_CHECK(written);
 
 error:
-   if (!ret && *ctext != NULL) {
-      g_free(*ctext);
-      *ctext = NULL;
+   return ret;
+}
+
+/* reverts the last tls_wrap, which was not sent yet
+ * - the plaintext is restored at TLS_RECORD_PTEXT_OFFSET of record and the
+ *   encryption sequence number is decremented, so that another record can be
+ *   wrapped first */
+gboolean tls_unwrap_unsent(FpiDeviceSynaTudorMoc *self, guint8 *record,
+                           gsize record_size, GError **error)
+{
+   gboolean ret = TRUE;
+
+   g_assert(self->tls.record_layer.keys_set);
+   g_assert(self->tls.record_layer.encrypt_seq_num > 0);
+
+   record_t wrapped_record = {0};
+   if (!read_record_in_place(record, record_size, &wrapped_record) ||
+       wrapped_record.msg_len < AES_GCM_RECORD_OVERHEAD) {
+      *error = set_and_report_error(FP_DEVICE_ERROR_GENERAL,
+                                    "Record to unwrap is malformed");
+      ret = FALSE;
+      goto error;
    }
+
+   /* the encryption context holds the same key, so it can decrypt as well */
+   BOOL_CHECK(syna_tls_record_layer_revert_encrypt(
+       &self->tls.record_layer, wrapped_record.type,
+       record_version(&wrapped_record), wrapped_record.msg,
+       wrapped_record.msg_len, error));
+
+error:
    return ret;
 }
 
-gboolean tls_unwrap(FpiDeviceSynaTudorMoc *self, guint8 *ctext,
-                    gsize ctext_size, guint8 **ptext, gsize *ptext_size,
+/* decrypts a record in place; ptext points into the record buffer */
+gboolean tls_unwrap(FpiDeviceSynaTudorMoc *self, guint8 *record,
+                    gsize record_size, guint8 **ptext, gsize *ptext_size,
                     GError **error)
 {
    gboolean ret = TRUE;
 
    if (!self->tls.established) {
       fp_warn("Calling unwrap while tls is not established");
-      *ptext = ctext;
-      *ptext_size = ctext_size;
+      *ptext = record;
+      *ptext_size = record_size;
       return ret;
    }
 
+   *ptext = NULL;
+
    record_t encrypted_record = {0};
-   BOOL_CHECK(read_record(ctext, ctext_size, &encrypted_record));
+   if (!read_record_in_place(record, record_size, &encrypted_record)) {
+      *error = set_and_report_error(FP_DEVICE_ERROR_PROTO,
+                                    "Received TLS record is malformed");
+      ret = FALSE;
+      goto error;
+   }
 
    BOOL_CHECK(
        decrypt_record(self, &encrypted_record, ptext, ptext_size, error));
@@ -1518,20 +1460,15 @@ gboolean tls_unwrap(FpiDeviceSynaTudorMoc *self, guint8 *ctext,
    }
 
 error:
-   if (!ret && *ptext != NULL) {
-      g_free(*ptext);
+   if (!ret) {
       *ptext = NULL;
    }
-   if (encrypted_record.msg != NULL) {
-      g_free(encrypted_record.msg);
-   }
    return ret;
 }
 
 static void send_tls_alert(FpiDeviceSynaTudorMoc *self, guint alert_level,
                            guint alert_desc)
 {
-   g_autofree guint8 *encrypted = NULL;
    const guint expected_recv_size = 256;
 
    record_t record_to_encrypt = {
@@ -1541,17 +1478,21 @@ static void send_tls_alert(FpiDeviceSynaTudorMoc *self, guint alert_level,
        .msg_len = 2,
    };
 
-   guint8 msg[record_to_encrypt.msg_len];
+   guint8 msg[2];
    msg[0] = alert_level;
    msg[1] = alert_desc;
    record_to_encrypt.msg = msg;
 
+   /* ciphertext is written directly after the record header */
+   guint8 *send_data = g_malloc(RECORD_HEADER_SIZE +
+                                record_to_encrypt.msg_len +
+                                AES_GCM_RECORD_OVERHEAD);
+
    GError *error = NULL;
    gsize encrypted_size = 0;
-   BOOL_CHECK_ASYNC(self->task_ssm,
-                    encrypt_record(self, &record_to_encrypt, &encrypted,
-                                   &encrypted_size, &error));
-   if (error != NULL) {
+   if (!encrypt_record(self, &record_to_encrypt, send_data + RECORD_HEADER_SIZE,
+                       &encrypted_size, &error)) {
+      g_free(send_data);
       fpi_ssm_mark_failed(self->task_ssm, error);
       return;
    }
@@ -1559,15 +1500,17 @@ static void send_tls_alert(FpiDeviceSynaTudorMoc *self, guint alert_level,
    const gsize send_size = RECORD_HEADER_SIZE + encrypted_size;
 
    FpiByteWriter writer;
-   fpi_byte_writer_init_with_size(&writer, send_size, FALSE);
+   fpi_byte_writer_init_with_data(&writer, send_data, RECORD_HEADER_SIZE,
+                                  FALSE);
 
    gboolean written = TRUE;
    written &= write_record_header(&writer, &record_to_encrypt);
    written &= fpi_byte_writer_put_uint16_be_inline(&writer, encrypted_size);
-   written &= fpi_byte_writer_put_data(&writer, encrypted, encrypted_size);
+   if (!written) {
+      g_free(send_data);
+   }
    WRITTEN_CHECK_ASYNC(self->task_ssm, written);
 
-   guint8 *send_data = fpi_byte_writer_reset_and_get_data(&writer);
    synaptics_secure_connect(self, send_data, send_size, expected_recv_size,
                             FALSE, parse_and_process_records);
 }
@@ -1582,16 +1525,25 @@ void tls_close_session(FpiDeviceSynaTudorMoc *self)
 
 /* Establish session funcitons ============================================= */
 
-void tls_handshake_state_prepare(FpiDeviceSynaTudorMoc *self)
+gboolean tls_handshake_state_prepare(FpiDeviceSynaTudorMoc *self,
+                                     GError **error)
 {
    self->tls.version_major = TLS_PROTOCOL_VERSION_MAJOR;
    self->tls.version_minor = TLS_PROTOCOL_VERSION_MINOR;
    self->tls.remote_sends_encrypted = FALSE;
-   self->tls.sent_handshake_msgs = NULL;
-   self->tls.sent_handshake_msgs_size = 0;
-   self->tls.sent_handshake_msgs_alloc_size = 0;
+   self->tls.resumed = FALSE;
 
-   self->tls.handshake_state += 1; /* TLS_HS_STATE_START */
+   /* the sensor hashes the handshake messages with SHA-256 regardless of the
+    * ciphersuite */
+   syna_tls_transcript_clear(&self->tls.transcript);
+   if (!syna_tls_transcript_init(&self->tls.transcript,
+                                 SYNA_TLS_TRANSCRIPT_DIGEST, error)) {
+      return FALSE;
+   }
+
+   /* also after a failed handshake, which is retried */
+   self->tls.handshake_state = TLS_HS_STATE_START;
+   return TRUE;
 }
 
 gboolean load_sample_pairing_data(FpiDeviceSynaTudorMoc *self, GError **error)
@@ -1626,8 +1578,12 @@ error:
 
 void tls_handshake_state_start(FpiDeviceSynaTudorMoc *self)
 {
+   GError *error = NULL;
    hello_t client_hello = {.extensions = NULL};
-   init_client_hello(self, &client_hello);
+   if (!init_client_hello(self, &client_hello, &error)) {
+      fpi_ssm_mark_failed(self->task_ssm, error);
+      return;
+   }
 
    record_t client_hello_record = {.msg = NULL};
    BOOL_CHECK_ASYNC(
@@ -1635,14 +1591,25 @@ void tls_handshake_state_start(FpiDeviceSynaTudorMoc *self)
        get_client_hello_record(self, &client_hello, &client_hello_record));
 
    /* update stored all sent msg data */
-   update_handshake_messages_data_record(self, &client_hello_record);
-
-   send_tls(self, &client_hello_record, 1, TRUE, parse_and_process_records);
+   if (update_handshake_messages_data_record(self, &client_hello_record,
+                                             &error)) {
+      send_tls(self, &client_hello_record, 1, TRUE, parse_and_process_records);
+   } else {
+      fpi_ssm_mark_failed(self->task_ssm, error);
+   }
 
    g_free(client_hello.extensions);
    g_free(client_hello_record.msg);
 }
 
+static void prepare_derive_input(FpiDeviceSynaTudorMoc *self)
+{
+   memcpy(self->tls.derive_input, self->tls.client_random,
+          sizeof(self->tls.client_random));
+   memcpy(self->tls.derive_input + sizeof(self->tls.client_random),
+          self->tls.server_random, sizeof(self->tls.server_random));
+}
+
 static gboolean calculate_premaster_secret(FpiDeviceSynaTudorMoc *self,
                                            gnutls_privkey_t privkey,
                                            gnutls_datum_t *premaster_secret,
@@ -1702,11 +1669,7 @@ static gboolean calculate_master_secret(FpiDeviceSynaTudorMoc *self,
    fp_dbg_large_hex(premaster_secret.data, premaster_secret.size);
 #endif
 
-   /* prepare derive_input */
-   memcpy(self->tls.derive_input, self->tls.client_random,
-          sizeof(self->tls.client_random));
-   memcpy(self->tls.derive_input + sizeof(self->tls.client_random),
-          self->tls.server_random, sizeof(self->tls.server_random));
+   prepare_derive_input(self);
 
    /* calculate master secret */
    self->tls.master_secret.size = MASTER_SECRET_SIZE;
@@ -1762,17 +1725,18 @@ void tls_handshake_state_end(FpiDeviceSynaTudorMoc *self)
    gsize client_cert_pos_after = fpi_byte_writer_get_pos(&writer);
 
    /* update stored all sent msg data */
-   update_handshake_messages_data(
-       self, writer.parent.data + client_cert_pos_before,
-       client_cert_pos_after - client_cert_pos_before);
+   if (!update_handshake_messages_data(
+           self, writer.parent.data + client_cert_pos_before,
+           client_cert_pos_after - client_cert_pos_before, &error)) {
+      goto error;
+   }
 
    gnutls_privkey_t privkey;
    GNUTLS_CHECK_ASYNC(self->task_ssm, gnutls_privkey_init(&privkey));
    eph_privkey_initialized = TRUE;
-   GNUTLS_CHECK_ASYNC(self->task_ssm,
-                      gnutls_privkey_generate(
-                          privkey, GNUTLS_PK_ECDSA,
-                          GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1), 0));
+   if (!self->random.generate_key(&self->random, privkey, &error)) {
+      goto error;
+   }
 
 #ifdef TLS_DEBUG
    gnutls_datum_t x;
@@ -1798,9 +1762,11 @@ void tls_handshake_state_end(FpiDeviceSynaTudorMoc *self)
    }
 
    /* update stored all sent msg data */
-   update_handshake_messages_data(self,
-                                  writer.parent.data + client_kex_pos_before,
-                                  client_kex_pos_after - client_kex_pos_before);
+   if (!update_handshake_messages_data(
+           self, writer.parent.data + client_kex_pos_before,
+           client_kex_pos_after - client_kex_pos_before, &error)) {
+      goto error;
+   }
 
    gsize cert_verify_pos_before = fpi_byte_writer_get_pos(&writer);
    written &= append_certificate_verify_to_record(self, &writer, &error);
@@ -1814,9 +1780,11 @@ void tls_handshake_state_end(FpiDeviceSynaTudorMoc *self)
    records_to_send[0].msg = fpi_byte_writer_reset_and_get_data(&writer);
 
    /* update stored all sent msg data */
-   update_handshake_messages_data(
-       self, records_to_send[0].msg + cert_verify_pos_before,
-       cert_verify_pos_after - cert_verify_pos_before);
+   if (!update_handshake_messages_data(
+           self, records_to_send[0].msg + cert_verify_pos_before,
+           cert_verify_pos_after - cert_verify_pos_before, &error)) {
+      goto error;
+   }
 
    if (!written) {
       fp_err("%s: error while writing first part", __FUNCTION__);
@@ -1885,6 +1853,109 @@ error:
    }
 }
 
+/* Session resumption ====================================================== */
+
+static gboolean tls_resume_session(FpiDeviceSynaTudorMoc *self, GError **error)
+{
+   gboolean ret = TRUE;
+
+   fp_dbg("Sensor accepted TLS session resumption");
+
+   /* reuse the cached master secret with the new randoms */
+   prepare_derive_input(self);
+
+   if (self->tls.master_secret.data != NULL) {
+      g_free(self->tls.master_secret.data);
+   }
+   self->tls.master_secret.size = MASTER_SECRET_SIZE;
+   self->tls.master_secret.data =
+       g_memdup2(self->tls_session_cache.master_secret, MASTER_SECRET_SIZE);
+
+   BOOL_CHECK(tls_aead_encryption_algorithm_init(self, error));
+
+   /* server hello is directly followed by change cipher spec and finished */
+   self->tls.handshake_state = TLS_HS_STATE_END;
+
+error:
+   return ret;
+}
+
+void tls_handshake_state_end_resumed(FpiDeviceSynaTudorMoc *self)
+{
+   GError *error = NULL;
+
+   record_t records_to_send[2];
+   records_to_send[0].msg = NULL;
+   records_to_send[1].msg = NULL;
+
+   if (self->tls.handshake_state != TLS_HS_STATE_FINISHED) {
+      error = set_and_report_error(
+          FP_DEVICE_ERROR_PROTO,
+          "Sensor did not send finished for resumed session - handshake "
+          "state is %d",
+          self->tls.handshake_state);
+      goto error;
+   }
+
+   /* send change cipher spec */
+   records_to_send[0].type = RECORD_TYPE_CHANGE_CIPHER_SPEC;
+   records_to_send[0].version_major = self->tls.version_major;
+   records_to_send[0].version_minor = self->tls.version_minor;
+
+   gboolean written = TRUE;
+   FpiByteWriter writer;
+   fpi_byte_writer_init(&writer);
+   written &= fpi_byte_writer_put_uint8(&writer, 0x01);
+   records_to_send[0].msg_len = fpi_byte_writer_get_pos(&writer);
+   records_to_send[0].msg = fpi_byte_writer_reset_and_get_data(&writer);
+
+   /* send handshake finished */
+   records_to_send[1].type = RECORD_TYPE_HANDSHAKE;
+   records_to_send[1].version_major = self->tls.version_major;
+   records_to_send[1].version_minor = self->tls.version_minor;
+
+   fpi_byte_writer_init(&writer);
+   written &=
+       append_encrypted_handshake_finish_to_record(self, &writer, &error);
+   if (error != NULL) {
+      goto error;
+   }
+   records_to_send[1].msg_len = fpi_byte_writer_get_pos(&writer);
+   records_to_send[1].msg = fpi_byte_writer_reset_and_get_data(&writer);
+
+   if (!written) {
+      error = set_and_report_error(FP_DEVICE_ERROR_GENERAL,
+                                   "Error while writing resumed handshake end");
+      goto error;
+   }
+
+   send_tls(self, records_to_send, 2, TRUE, parse_and_process_records);
+
+error:
+   g_free(records_to_send[0].msg);
+   g_free(records_to_send[1].msg);
+   if (error != NULL) {
+      fpi_ssm_mark_failed(self->task_ssm, error);
+   }
+}
+
+/* stores session of a successful full handshake for resumption */
+void tls_session_cache_update(FpiDeviceSynaTudorMoc *self)
+{
+   g_assert(self->tls.master_secret.size == MASTER_SECRET_SIZE);
+
+   memcpy(self->tls_session_cache.session_id, self->tls.session_id,
+          SESSION_ID_LEN);
+   memcpy(self->tls_session_cache.master_secret, self->tls.master_secret.data,
+          MASTER_SECRET_SIZE);
+   self->tls_session_cache.present = TRUE;
+}
+
+void tls_session_cache_clear(FpiDeviceSynaTudorMoc *self)
+{
+   OPENSSL_cleanse(&self->tls_session_cache, sizeof(self->tls_session_cache));
+}
+
 /* ========================================================================= */
 static gboolean
 sensor_pub_key_compatibility_check(FpiDeviceSynaTudorMoc *self,
@@ -1918,6 +1989,184 @@ sensor_pub_key_compatibility_check(FpiDeviceSynaTudorMoc *self,
    return ret;
 }
 
+/* Pairing data cache ====================================================== */
+
+/* Importing the private key and verifying the sensor certificate are the most
+ * expensive steps of an open, while their inputs change only when the sensor
+ * is paired again. Their results are therefore kept for the lifetime of the
+ * process, one entry per sensor serial number, and reused as long as the
+ * digest of the stored pairing data matches. A verified certificate is
+ * additionally only reused on the sensor and firmware it was verified on. */
+#define PAIRING_DATA_DIGEST_SIZE 32 /* SHA-256 */
+
+typedef struct pairing_cache_entry {
+   guint8 pairing_data_digest[PAIRING_DATA_DIGEST_SIZE];
+   gnutls_privkey_t private_key;
+   /* sensor certificate was verified on the sensor with this serial number,
+    * firmware build and security flags, which select the sensor key */
+   gboolean sensor_cert_verified;
+   guint8 verified_serial_number[6];
+   guint32 verified_build_num;
+   guint16 verified_security;
+} pairing_cache_entry_t;
+
+G_LOCK_DEFINE_STATIC(pairing_cache);
+/* GBytes serial number -> pairing_cache_entry_t */
+static GHashTable *pairing_cache = NULL;
+
+static void pairing_cache_entry_clear(pairing_cache_entry_t *entry)
+{
+   gnutls_privkey_deinit(entry->private_key);
+}
+
+static void pairing_cache_entry_release(gpointer entry)
+{
+   g_atomic_rc_box_release_full(
+       entry, (GDestroyNotify)pairing_cache_entry_clear);
+}
+
+static GBytes *pairing_cache_serial_key(FpiDeviceSynaTudorMoc *self)
+{
+   return g_bytes_new(self->mis_version.serial_number,
+                      sizeof(self->mis_version.serial_number));
+}
+
+/* covers everything the cached results are derived from */
+static void pairing_data_digest(FpiDeviceSynaTudorMoc *self,
+                                gnutls_ecc_curve_t curve,
+                                const gnutls_datum_t *x,
+                                const gnutls_datum_t *y,
+                                const gnutls_datum_t *k, guint8 *digest)
+{
+   g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+   gsize digest_size = PAIRING_DATA_DIGEST_SIZE;
+   guint32 curve_le = GUINT32_TO_LE(curve);
+
+   g_checksum_update(checksum, (guint8 *)&self->pairing_data.host_cert,
+                     CERTIFICATE_SIZE);
+   g_checksum_update(checksum, (guint8 *)&self->pairing_data.sensor_cert,
+                     CERTIFICATE_SIZE);
+   g_checksum_update(checksum, (guint8 *)&curve_le, sizeof(curve_le));
+   g_checksum_update(checksum, x->data, x->size);
+   g_checksum_update(checksum, y->data, y->size);
+   g_checksum_update(checksum, k->data, k->size);
+   g_checksum_get_digest(checksum, digest, &digest_size);
+}
+
+gboolean import_pairing_private_key(FpiDeviceSynaTudorMoc *self,
+                                    gnutls_ecc_curve_t curve,
+                                    const gnutls_datum_t *x,
+                                    const gnutls_datum_t *y,
+                                    const gnutls_datum_t *k, GError **error)
+{
+   gboolean ret = TRUE;
+   g_autoptr(GBytes) serial = pairing_cache_serial_key(self);
+   guint8 digest[PAIRING_DATA_DIGEST_SIZE];
+   gnutls_privkey_t private_key = NULL;
+   pairing_cache_entry_t *entry = NULL;
+
+   g_assert(!self->pairing_data.private_key_initialized);
+
+   pairing_data_digest(self, curve, x, y, k, digest);
+
+   G_LOCK(pairing_cache);
+   if (pairing_cache != NULL) {
+      entry = g_hash_table_lookup(pairing_cache, serial);
+   }
+   if (entry != NULL && memcmp(entry->pairing_data_digest, digest,
+                               sizeof(digest)) == 0) {
+      entry = g_atomic_rc_box_acquire(entry);
+   } else {
+      entry = NULL;
+   }
+   G_UNLOCK(pairing_cache);
+
+   if (entry != NULL) {
+      fp_dbg("Using cached private key");
+      self->pairing_data.cache_entry = entry;
+      self->pairing_data.private_key = entry->private_key;
+      self->pairing_data.private_key_initialized = TRUE;
+      goto error;
+   }
+
+   GNUTLS_CHECK(gnutls_privkey_init(&private_key));
+   GNUTLS_CHECK(gnutls_privkey_import_ecc_raw(private_key, curve, x, y, k));
+   GNUTLS_CHECK(gnutls_privkey_verify_params(private_key));
+
+   entry = g_atomic_rc_box_new0(pairing_cache_entry_t);
+   memcpy(entry->pairing_data_digest, digest, sizeof(digest));
+   entry->private_key = g_steal_pointer(&private_key);
+
+   G_LOCK(pairing_cache);
+   if (pairing_cache == NULL) {
+      pairing_cache =
+          g_hash_table_new_full(g_bytes_hash, g_bytes_equal,
+                                (GDestroyNotify)g_bytes_unref,
+                                pairing_cache_entry_release);
+   }
+   /* replaces the entry of previous pairing data of this sensor */
+   g_hash_table_replace(pairing_cache, g_bytes_ref(serial),
+                        g_atomic_rc_box_acquire(entry));
+   G_UNLOCK(pairing_cache);
+
+   self->pairing_data.cache_entry = entry;
+   self->pairing_data.private_key = entry->private_key;
+   self->pairing_data.private_key_initialized = TRUE;
+
+error:
+   if (private_key != NULL) {
+      gnutls_privkey_deinit(private_key);
+   }
+   return ret;
+}
+
+void pairing_cache_invalidate(FpiDeviceSynaTudorMoc *self)
+{
+   g_autoptr(GBytes) serial = pairing_cache_serial_key(self);
+
+   G_LOCK(pairing_cache);
+   if (pairing_cache != NULL && g_hash_table_remove(pairing_cache, serial)) {
+      fp_dbg("Dropped cached pairing data");
+   }
+   G_UNLOCK(pairing_cache);
+}
+
+static gboolean sensor_cert_verified_cached(FpiDeviceSynaTudorMoc *self)
+{
+   pairing_cache_entry_t *entry = self->pairing_data.cache_entry;
+   const mis_version_t *sensor = &self->mis_version;
+   gboolean verified = FALSE;
+
+   if (entry != NULL) {
+      G_LOCK(pairing_cache);
+      verified = entry->sensor_cert_verified &&
+                 memcmp(entry->verified_serial_number, sensor->serial_number,
+                        sizeof(sensor->serial_number)) == 0 &&
+                 entry->verified_build_num == sensor->build_num &&
+                 entry->verified_security == sensor->security;
+      G_UNLOCK(pairing_cache);
+   }
+   return verified;
+}
+
+static void sensor_cert_verified_store(FpiDeviceSynaTudorMoc *self)
+{
+   pairing_cache_entry_t *entry = self->pairing_data.cache_entry;
+   const mis_version_t *sensor = &self->mis_version;
+
+   if (entry != NULL) {
+      G_LOCK(pairing_cache);
+      entry->sensor_cert_verified = TRUE;
+      memcpy(entry->verified_serial_number, sensor->serial_number,
+             sizeof(sensor->serial_number));
+      entry->verified_build_num = sensor->build_num;
+      entry->verified_security = sensor->security;
+      G_UNLOCK(pairing_cache);
+   }
+}
+
+/* ========================================================================= */
+
 gboolean verify_sensor_certificate(FpiDeviceSynaTudorMoc *self, GError **error)
 {
    gboolean ret = TRUE;
@@ -1927,8 +2176,6 @@ gboolean verify_sensor_certificate(FpiDeviceSynaTudorMoc *self, GError **error)
    gboolean key_flag = (self->mis_version.security & 0x20) != 0;
 
    /* get sensor public key */
-   pubkey_initialized = TRUE;
-
    fp_dbg("Sensor certificate verify key_flag: %d", key_flag);
    sensor_pub_key_t sensor_pub_key;
    if (key_flag) {
@@ -1937,7 +2184,15 @@ gboolean verify_sensor_certificate(FpiDeviceSynaTudorMoc *self, GError **error)
       sensor_pub_key = pubkey_v10_1;
    }
 
+   /* the firmware may have changed since the certificate was verified */
    BOOL_CHECK(sensor_pub_key_compatibility_check(self, &sensor_pub_key, error));
+
+   if (sensor_cert_verified_cached(self)) {
+      fp_dbg("Sensor certificate was already verified");
+      goto error;
+   }
+
+   pubkey_initialized = TRUE;
    gnutls_pubkey_init(&pubkey);
    GNUTLS_CHECK(gnutls_pubkey_import_ecc_raw(pubkey, GNUTLS_ECC_CURVE_SECP256R1,
                                              &sensor_pub_key.x,
@@ -1956,6 +2211,7 @@ gboolean verify_sensor_certificate(FpiDeviceSynaTudorMoc *self, GError **error)
                                            &data, &signature));
 
    fp_dbg("Sensor certificate verify success");
+   sensor_cert_verified_store(self);
 
 error:
    if (pubkey_initialized) {
@@ -1971,23 +2227,17 @@ void deinit_tls(FpiDeviceSynaTudorMoc *self)
    if (self->tls.master_secret.data != NULL) {
       g_free(self->tls.master_secret.data);
    }
-   if (self->tls.encryption_key.data != NULL) {
-      g_free(self->tls.encryption_key.data);
-   }
-   if (self->tls.decryption_key.data != NULL) {
-      g_free(self->tls.decryption_key.data);
-   }
-   if (self->tls.encryption_iv.data != NULL) {
-      g_free(self->tls.encryption_iv.data);
-   }
-   if (self->tls.decryption_iv.data != NULL) {
-      g_free(self->tls.decryption_iv.data);
-   }
+   free_aead_keys(self);
 }
 
 void free_pairing_data(FpiDeviceSynaTudorMoc *self)
 {
-   if (self->pairing_data.private_key_initialized) {
+   if (self->pairing_data.cache_entry != NULL) {
+      /* the key is owned by the cache entry */
+      g_clear_pointer(&self->pairing_data.cache_entry,
+                      pairing_cache_entry_release);
+      self->pairing_data.private_key_initialized = FALSE;
+   } else if (self->pairing_data.private_key_initialized) {
       gnutls_privkey_deinit(self->pairing_data.private_key);
       self->pairing_data.private_key_initialized = FALSE;
    }
@@ -2116,8 +2366,9 @@ static gboolean create_host_certificate(FpiDeviceSynaTudorMoc *self,
 
    gnutls_datum_t to_sign = {.data = host_certificate,
                              .size = CERTIFICATE_SIZE_WITHOUT_SIGNATURE};
-   GNUTLS_CHECK(gnutls_privkey_sign_data(hs_privkey, GNUTLS_DIG_SHA256, 0,
-                                         &to_sign, &signature));
+   GNUTLS_CHECK(gnutls_privkey_sign_data(
+       hs_privkey, GNUTLS_DIG_SHA256, random_provider_sign_flags(&self->random),
+       &to_sign, &signature));
    g_assert(signature.size <= SIGNATURE_SIZE);
 
    written &= fpi_byte_writer_put_uint16_le(&writer, signature.size);
@@ -2164,17 +2415,26 @@ void pair(FpiDeviceSynaTudorMoc *self)
 
    fp_dbg("Pairing sensor");
 
-   /* Create keypair */
+   /* cached session and keys belong to the old pairing data */
+   tls_session_cache_clear(self);
+   free_pairing_data(self);
+   pairing_cache_invalidate(self);
+
+   /* Create keypair - it is stored with the pairing data, so it always comes
+    * from the system provider, also when the session uses a seeded one */
+   GError *error = NULL;
+   random_provider_t system_random;
+   random_provider_init_system(&system_random);
    GNUTLS_CHECK_ASYNC(self->task_ssm,
                       gnutls_privkey_init(&self->pairing_data.private_key));
    self->pairing_data.private_key_initialized = TRUE;
-   GNUTLS_CHECK_ASYNC(self->task_ssm,
-                      gnutls_privkey_generate(
-                          self->pairing_data.private_key, GNUTLS_PK_ECDSA,
-                          GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1), 0));
+   if (!system_random.generate_key(&system_random,
+                                   self->pairing_data.private_key, &error)) {
+      fpi_ssm_mark_failed(self->task_ssm, error);
+      return;
+   }
 
    /* we create it already serialized, as we do not need it in struct form */
-   GError *error = NULL;
    if (!create_host_certificate(self, host_certificate, &error)) {
       fpi_ssm_mark_failed(self->task_ssm, error);
       return;
@@ -2232,15 +2492,11 @@ void send_get_remote_tls_status(FpiDeviceSynaTudorMoc *self)
        REQUEST_TLS_SESSION_STATUS, 0, 0, TLS_SESSION_STATUS_DATA_RESP_LEN);
 
    self->cmd_transfer->short_is_error = TRUE;
-   fpi_usb_transfer_submit(self->cmd_transfer, USB_TRANSFER_TIMEOUT_MS, NULL,
-                           recv_get_remote_tls_status, NULL);
+   syna_usb_transfer_submit(self->cmd_transfer, USB_TRANSFER_TIMEOUT_MS,
+                            NULL, recv_get_remote_tls_status, NULL);
 }
 
 void tls_handshake_cleanup(FpiDeviceSynaTudorMoc *self)
 {
-   self->tls.sent_handshake_msgs_alloc_size = 0;
-   self->tls.sent_handshake_msgs_size = 0;
-   if (self->tls.sent_handshake_msgs != NULL) {
-      g_free(self->tls.sent_handshake_msgs);
-   }
+   syna_tls_transcript_clear(&self->tls.transcript);
 }
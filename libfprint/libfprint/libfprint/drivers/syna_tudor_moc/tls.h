@@ -28,7 +28,10 @@
 
 #pragma once
 
+#include "../synatls.h"
 #include "device.h"
+#include "fpi-byte-reader.h"
+#include "fpi-byte-writer.h"
 #include <glib.h>
 #include <gnutls/gnutls.h>
 
@@ -38,6 +41,13 @@
 
 #define VERIFY_DATA_SIZE 12
 
+/* set to a number to seed the random numbers, time and keys sent to the
+ * sensor, so that every run sends the same data, which is useful for comparing
+ * the CPU time of two builds with the emulator (FP_DEVICE_EMULATION=1 uses a
+ * default seed); only honoured in builds with the syna_tudor_moc_testing
+ * option, the pairing key always comes from the system */
+#define SYNA_TUDOR_MOC_RANDOM_SEED_ENV "FP_SYNA_TUDOR_MOC_RANDOM_SEED"
+
 #define TLS_PROTOCOL_VERSION_MAJOR 3
 #define TLS_PROTOCOL_VERSION_MINOR 3
 
@@ -47,10 +57,15 @@
 #define CERTIFICATE_MAGIC 0x5f3f
 #define CERTIFICATE_CURVE 23
 
-#define MASTER_SECRET_SIZE 48
-#define AES_GCM_KEY_SIZE 32
-#define AES_GCM_IV_SIZE 4
-#define AES_GCM_TAG_SIZE 16
+/* the record layer itself is shared with the synatlsmoc driver */
+#define AES_GCM_KEY_SIZE SYNA_TLS_AES_GCM_KEY_SIZE
+#define AES_GCM_IV_SIZE SYNA_TLS_AES_GCM_IV_SIZE
+#define AES_GCM_TAG_SIZE SYNA_TLS_AES_GCM_TAG_SIZE
+#define AES_GCM_NONCE_SIZE SYNA_TLS_AES_GCM_NONCE_SIZE
+/* explicit nonce is sent in front of the ciphertext and tag */
+#define AES_GCM_RECORD_OVERHEAD SYNA_TLS_RECORD_OVERHEAD
+/* offset of plaintext in a buffer which is wrapped in place */
+#define TLS_RECORD_PTEXT_OFFSET (RECORD_HEADER_SIZE + AES_GCM_NONCE_SIZE)
 
 typedef enum {
    RECORD_TYPE_CHANGE_CIPHER_SPEC = 0x14,
@@ -104,15 +119,45 @@ typedef struct {
    guint8 *msg;
 } record_t;
 
+/* the only supported ciphersuite, also used by the sensor emulator */
+extern cipher_suit_t tls_ecdh_ecdsa_with_aes_256_gcm_sha384;
+
+gboolean write_record_header(FpiByteWriter *writer, const record_t *record);
+
+gboolean read_record_header(FpiByteReader *reader, record_t *record);
+
+/* record msg points into serialized_record and must not be freed */
+gboolean read_record_in_place(guint8 *serialized_record,
+                              const gsize serialized_record_size,
+                              record_t *record);
+
+guint16 record_version(const record_t *record);
+
+/* allocates output and fills it with the PRF of the shared transport */
+gboolean tls_prf(const char *hmac_algo, const gnutls_datum_t secret,
+                 const char *label, const guint8 *seed, gsize seed_len,
+                 guint8 **output, gsize output_len, GError **error);
+
 gboolean establish_tls_session(FpiDeviceSynaTudorMoc *self, GError **error);
 
 void tls_close_session(FpiDeviceSynaTudorMoc *self);
 
-gboolean tls_wrap(FpiDeviceSynaTudorMoc *self, guint8 *ptext, gsize ptext_size,
-                  guint8 **ctext, gsize *ctext_size, GError **error);
+void random_provider_init_system(random_provider_t *provider);
+#ifdef SYNA_TUDOR_MOC_TESTING
+void random_provider_init_seeded(random_provider_t *provider, guint32 seed);
+#endif
+void random_provider_init_from_env(random_provider_t *provider);
+void random_provider_clear(random_provider_t *provider);
+unsigned random_provider_sign_flags(random_provider_t *provider);
+
+gboolean tls_wrap(FpiDeviceSynaTudorMoc *self, guint8 *record,
+                  gsize ptext_size, gsize *record_size, GError **error);
+
+gboolean tls_unwrap_unsent(FpiDeviceSynaTudorMoc *self, guint8 *record,
+                           gsize record_size, GError **error);
 
-gboolean tls_unwrap(FpiDeviceSynaTudorMoc *self, guint8 *ctext,
-                    gsize ctext_size, guint8 **ptext, gsize *ptext_size,
+gboolean tls_unwrap(FpiDeviceSynaTudorMoc *self, guint8 *record,
+                    gsize record_size, guint8 **ptext, gsize *ptext_size,
                     GError **error);
 
 gboolean get_remote_tls_status(FpiDeviceSynaTudorMoc *self, gboolean *status,
@@ -129,14 +174,26 @@ gboolean handle_tls_statuses_for_sensor_and_host(FpiDeviceSynaTudorMoc *self,
 
 void free_pairing_data(FpiDeviceSynaTudorMoc *self);
 
+gboolean import_pairing_private_key(FpiDeviceSynaTudorMoc *self,
+                                    gnutls_ecc_curve_t curve,
+                                    const gnutls_datum_t *x,
+                                    const gnutls_datum_t *y,
+                                    const gnutls_datum_t *k, GError **error);
+
+void pairing_cache_invalidate(FpiDeviceSynaTudorMoc *self);
+
 void pair(FpiDeviceSynaTudorMoc *self);
 
 gboolean parse_certificate(const guint8 *data, const gsize len, cert_t *cert);
 
 void send_get_remote_tls_status(FpiDeviceSynaTudorMoc *self);
 
-void tls_handshake_state_prepare(FpiDeviceSynaTudorMoc *self);
+gboolean tls_handshake_state_prepare(FpiDeviceSynaTudorMoc *self,
+                                     GError **error);
 void tls_handshake_state_start(FpiDeviceSynaTudorMoc *self);
 void tls_handshake_state_end(FpiDeviceSynaTudorMoc *self);
+void tls_handshake_state_end_resumed(FpiDeviceSynaTudorMoc *self);
 void tls_handshake_cleanup(FpiDeviceSynaTudorMoc *self);
+void tls_session_cache_update(FpiDeviceSynaTudorMoc *self);
+void tls_session_cache_clear(FpiDeviceSynaTudorMoc *self);
 void fp_err_tls_alert(const guint alert_level, const guint alert_description);
@@ -23,7 +23,6 @@
 
 #include "fpi-device.h"
 #include "utils.h"
-#include <stdio.h>
 
 void reverse_array(guint8 *arr, gsize size)
 {
@@ -43,14 +42,16 @@ void reverse_array(guint8 *arr, gsize size)
    }
 }
 
-void fp_dbg_large_hex(const guint8 *arr, const gint size)
+void fp_dbg_large_hex_format(const guint8 *arr, const gint size)
 {
+   static const char hex_digits[] = "0123456789abcdef";
    g_autofree char *output = NULL;
 
    if (arr == NULL) {
-      fp_dbg("NULL");
+      g_log(SYNA_TUDOR_MOC_HEX_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "NULL");
    } else if (size == 0) {
-      fp_dbg("array of size 0");
+      g_log(SYNA_TUDOR_MOC_HEX_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
+            "array of size 0");
    } else {
       /* +4 -> '\t' + 0' + 'x' +...+ '\0'
        * *2 -> %02x */
@@ -61,11 +62,11 @@ void fp_dbg_large_hex(const guint8 *arr, const gint size)
       output[char_idx++] = '0';
       output[char_idx++] = 'x';
       for (int arr_idx = 0; arr_idx < size; arr_idx++) {
-         sprintf(&output[char_idx], "%02x", arr[arr_idx]);
-         char_idx += 2;
+         output[char_idx++] = hex_digits[arr[arr_idx] >> 4];
+         output[char_idx++] = hex_digits[arr[arr_idx] & 0xf];
       }
       output[char_idx] = '\0';
-      fp_dbg("%s", output);
+      g_log(SYNA_TUDOR_MOC_HEX_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s", output);
    }
 }
 
@@ -172,7 +172,32 @@
 
 void reverse_array(guint8 *arr, gsize size);
 
-void fp_dbg_large_hex(const guint8 *arr, const gint size);
+/* Hex dumps format whole buffers, which is too slow for the hot paths and
+ * some of the buffers hold secrets, so fp_dbg_large_hex is compiled in only
+ * when SYNA_TUDOR_MOC_HEX_DUMP is defined (e.g. -DSYNA_TUDOR_MOC_HEX_DUMP).
+ * The dumps are then logged to their own log domain, which has to be enabled
+ * in G_MESSAGES_DEBUG, and buffers are formatted only if it is. */
+#define SYNA_TUDOR_MOC_HEX_LOG_DOMAIN G_LOG_DOMAIN "-hex"
+
+#ifdef SYNA_TUDOR_MOC_HEX_DUMP
+#define fp_dbg_large_hex(arr, size)                                            \
+   do {                                                                        \
+      if (!g_log_writer_default_would_drop(G_LOG_LEVEL_DEBUG,                  \
+                                           SYNA_TUDOR_MOC_HEX_LOG_DOMAIN)) {   \
+         fp_dbg_large_hex_format(arr, size);                                   \
+      }                                                                        \
+   } while (0)
+#else
+/* the arguments are still type checked, but never evaluated */
+#define fp_dbg_large_hex(arr, size)                                            \
+   do {                                                                        \
+      if (0) {                                                                 \
+         fp_dbg_large_hex_format(arr, size);                                   \
+      }                                                                        \
+   } while (0)
+#endif
+
+void fp_dbg_large_hex_format(const guint8 *arr, const gint size);
 
 void fp_dbg_enrollment(enrollment_t *enrollment);
 
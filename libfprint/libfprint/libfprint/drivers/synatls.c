@@ -0,0 +1,429 @@
+/*
+ * Shared TLS transport of the Synaptics Tudor Match-In-Sensor drivers
+ * Copyright (C) 2024 Vojtěch Pluskal
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "synatls"
+
+#include "drivers_api.h"
+#include "fpi-byte-utils.h"
+
+#include <string.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+
+#include "synatls.h"
+
+#define AES_GCM_FULL_IV_SIZE \
+  (SYNA_TLS_AES_GCM_IV_SIZE + SYNA_TLS_AES_GCM_NONCE_SIZE)
+/* sequence number, type, version and length of the plaintext */
+#define AAD_SIZE 13
+
+static GError *
+openssl_error_new (const char *what)
+{
+  return fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
+                                   "OpenSSL error occurred in %s: %s", what,
+                                   ERR_error_string (ERR_get_error (), NULL));
+}
+
+/* PRF ------------------------------------------------------------------- */
+
+/* fetching the KDF looks it up in the provider, do it only once */
+static EVP_KDF *
+get_tls1_prf (void)
+{
+  static gsize kdf_fetched = 0;
+  static EVP_KDF *kdf = NULL;
+
+  if (g_once_init_enter (&kdf_fetched))
+    {
+      kdf = EVP_KDF_fetch (NULL, "TLS1-PRF", NULL);
+      g_once_init_leave (&kdf_fetched, 1);
+    }
+
+  return kdf;
+}
+
+gboolean
+syna_tls_prf (const char   *digest_name,
+              const guint8 *secret,
+              gsize         secret_size,
+              const char   *label,
+              const guint8 *seed,
+              gsize         seed_size,
+              guint8       *out,
+              gsize         out_size,
+              GError      **error)
+{
+  EVP_KDF *kdf = get_tls1_prf ();
+  EVP_KDF_CTX *kctx = NULL;
+  OSSL_PARAM params[5], *p = params;
+  gboolean ret = TRUE;
+
+  if (kdf != NULL)
+    kctx = EVP_KDF_CTX_new (kdf);
+  if (kctx == NULL)
+    {
+      g_propagate_error (error, openssl_error_new ("TLS PRF setup"));
+      return FALSE;
+    }
+
+  *p++ = OSSL_PARAM_construct_utf8_string (OSSL_KDF_PARAM_DIGEST,
+                                           (char *) digest_name, 0);
+  *p++ = OSSL_PARAM_construct_octet_string (OSSL_KDF_PARAM_SECRET,
+                                            (guint8 *) secret, secret_size);
+  /* TLS1-PRF concatenates the seed parameters, label first */
+  *p++ = OSSL_PARAM_construct_octet_string (OSSL_KDF_PARAM_SEED,
+                                            (char *) label, strlen (label));
+  *p++ = OSSL_PARAM_construct_octet_string (OSSL_KDF_PARAM_SEED,
+                                            (guint8 *) seed, seed_size);
+  *p = OSSL_PARAM_construct_end ();
+
+  if (!EVP_KDF_derive (kctx, out, out_size, params))
+    {
+      g_propagate_error (error, openssl_error_new ("TLS PRF"));
+      ret = FALSE;
+    }
+
+  EVP_KDF_CTX_free (kctx);
+  return ret;
+}
+
+/* Handshake transcript -------------------------------------------------- */
+
+gboolean
+syna_tls_transcript_init (SynaTlsTranscript *self,
+                          const char        *digest_name,
+                          GError           **error)
+{
+  const EVP_MD *md = EVP_get_digestbyname (digest_name);
+
+  if (self->md_ctx == NULL)
+    self->md_ctx = EVP_MD_CTX_new ();
+  if (self->peek_ctx == NULL)
+    self->peek_ctx = EVP_MD_CTX_new ();
+
+  if (md == NULL || self->md_ctx == NULL || self->peek_ctx == NULL ||
+      !EVP_DigestInit_ex (self->md_ctx, md, NULL))
+    {
+      g_propagate_error (error, openssl_error_new ("transcript init"));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+void
+syna_tls_transcript_clear (SynaTlsTranscript *self)
+{
+  g_clear_pointer (&self->md_ctx, EVP_MD_CTX_free);
+  g_clear_pointer (&self->peek_ctx, EVP_MD_CTX_free);
+}
+
+gboolean
+syna_tls_transcript_update (SynaTlsTranscript *self,
+                            const guint8      *data,
+                            gsize              size,
+                            GError           **error)
+{
+  if (!EVP_DigestUpdate (self->md_ctx, data, size))
+    {
+      g_propagate_error (error, openssl_error_new ("transcript update"));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* The digest of the messages so far, the transcript can still be updated
+ * afterwards. out needs to hold at least EVP_MAX_MD_SIZE bytes. */
+gboolean
+syna_tls_transcript_get_digest (SynaTlsTranscript *self,
+                                guint8            *out,
+                                gsize             *out_size,
+                                GError           **error)
+{
+  guint size;
+
+  if (!EVP_MD_CTX_copy_ex (self->peek_ctx, self->md_ctx) ||
+      !EVP_DigestFinal_ex (self->peek_ctx, out, &size))
+    {
+      g_propagate_error (error, openssl_error_new ("transcript digest"));
+      return FALSE;
+    }
+
+  *out_size = size;
+  return TRUE;
+}
+
+/* verify_data of a Finished message, label is either "client finished" or
+ * "server finished" */
+gboolean
+syna_tls_transcript_get_verify_data (SynaTlsTranscript *self,
+                                     const guint8      *master_secret,
+                                     const char        *label,
+                                     guint8            *verify_data,
+                                     GError           **error)
+{
+  guint8 digest[EVP_MAX_MD_SIZE];
+  gsize digest_size;
+
+  if (!syna_tls_transcript_get_digest (self, digest, &digest_size, error))
+    return FALSE;
+
+  return syna_tls_prf (SYNA_TLS_PRF_DIGEST, master_secret,
+                       SYNA_TLS_MASTER_SECRET_SIZE, label, digest, digest_size,
+                       verify_data, SYNA_TLS_VERIFY_DATA_SIZE, error);
+}
+
+/* Record layer ---------------------------------------------------------- */
+
+void
+syna_tls_record_layer_clear (SynaTlsRecordLayer *self)
+{
+  g_clear_pointer (&self->encrypt_ctx, EVP_CIPHER_CTX_free);
+  g_clear_pointer (&self->decrypt_ctx, EVP_CIPHER_CTX_free);
+  OPENSSL_cleanse (self, sizeof (*self));
+}
+
+static gboolean
+cipher_ctx_set_key (EVP_CIPHER_CTX **ctx, int enc, const guint8 *key)
+{
+  if (*ctx == NULL)
+    {
+      *ctx = EVP_CIPHER_CTX_new ();
+      if (*ctx == NULL ||
+          !EVP_CipherInit_ex (*ctx, EVP_aes_256_gcm (), NULL, NULL, NULL,
+                              enc) ||
+          !EVP_CIPHER_CTX_ctrl (*ctx, EVP_CTRL_GCM_SET_IVLEN,
+                                AES_GCM_FULL_IV_SIZE, NULL))
+        return FALSE;
+    }
+
+  /* the key schedule is kept, records then only set a new IV */
+  return EVP_CipherInit_ex (*ctx, NULL, NULL, key, NULL, enc);
+}
+
+gboolean
+syna_tls_record_layer_set_keys (SynaTlsRecordLayer *self,
+                                const guint8       *encrypt_key,
+                                const guint8       *encrypt_iv,
+                                const guint8       *decrypt_key,
+                                const guint8       *decrypt_iv,
+                                GError            **error)
+{
+  if (!cipher_ctx_set_key (&self->encrypt_ctx, 1, encrypt_key) ||
+      !cipher_ctx_set_key (&self->decrypt_ctx, 0, decrypt_key))
+    {
+      g_propagate_error (error, openssl_error_new ("record layer keying"));
+      return FALSE;
+    }
+
+  memcpy (self->encrypt_iv, encrypt_iv, SYNA_TLS_AES_GCM_IV_SIZE);
+  memcpy (self->decrypt_iv, decrypt_iv, SYNA_TLS_AES_GCM_IV_SIZE);
+  self->encrypt_seq_num = 0;
+  self->decrypt_seq_num = 0;
+  self->keys_set = TRUE;
+
+  return TRUE;
+}
+
+static void
+fill_aad (guint8 *aad, guint64 seq_num, guint8 type, guint16 version,
+          gsize ptext_size)
+{
+  for (int i = 7; i >= 0; --i)
+    {
+      aad[i] = seq_num & 0xff;
+      seq_num >>= 8;
+    }
+  aad[8] = type;
+  aad[9] = version >> 8;
+  aad[10] = version & 0xff;
+  aad[11] = ptext_size >> 8;
+  aad[12] = ptext_size & 0xff;
+}
+
+/* Runs AES-GCM in place over data with the IV made of iv and the explicit
+ * nonce, tag is either computed (enc) or checked (!enc). */
+static gboolean
+gcm_crypt (EVP_CIPHER_CTX *ctx, int enc, const guint8 *iv,
+           const guint8 *nonce, const guint8 *aad, guint8 *data, gsize size,
+           guint8 *tag)
+{
+  guint8 full_iv[AES_GCM_FULL_IV_SIZE];
+  int len;
+
+  memcpy (full_iv, iv, SYNA_TLS_AES_GCM_IV_SIZE);
+  memcpy (full_iv + SYNA_TLS_AES_GCM_IV_SIZE, nonce,
+          SYNA_TLS_AES_GCM_NONCE_SIZE);
+
+  if (!EVP_CipherInit_ex (ctx, NULL, NULL, NULL, full_iv, enc) ||
+      !EVP_CipherUpdate (ctx, NULL, &len, aad, AAD_SIZE))
+    return FALSE;
+
+  if (size > 0 && !EVP_CipherUpdate (ctx, data, &len, data, size))
+    return FALSE;
+
+  if (!enc && !EVP_CIPHER_CTX_ctrl (ctx, EVP_CTRL_GCM_SET_TAG,
+                                    SYNA_TLS_AES_GCM_TAG_SIZE, tag))
+    return FALSE;
+
+  /* fails on tag mismatch when decrypting */
+  if (!EVP_CipherFinal_ex (ctx, data + size, &len))
+    return FALSE;
+
+  if (enc && !EVP_CIPHER_CTX_ctrl (ctx, EVP_CTRL_GCM_GET_TAG,
+                                   SYNA_TLS_AES_GCM_TAG_SIZE, tag))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Encrypts ptext into fragment as explicit nonce, ciphertext and tag.
+ * fragment has to hold ptext_size + SYNA_TLS_RECORD_OVERHEAD bytes, ptext may
+ * already be in place at fragment + SYNA_TLS_AES_GCM_NONCE_SIZE. */
+gboolean
+syna_tls_record_layer_encrypt (SynaTlsRecordLayer *self,
+                               guint8              type,
+                               guint16             version,
+                               const guint8       *ptext,
+                               gsize               ptext_size,
+                               guint8             *fragment,
+                               gsize              *fragment_size,
+                               GError            **error)
+{
+  guint8 aad[AAD_SIZE];
+  guint8 *data = fragment + SYNA_TLS_AES_GCM_NONCE_SIZE;
+
+  g_return_val_if_fail (self->keys_set, FALSE);
+
+  if (ptext != data)
+    memmove (data, ptext, ptext_size);
+
+  if (self->sequential_nonce)
+    FP_WRITE_UINT64_BE (fragment, self->encrypt_seq_num);
+  else if (RAND_bytes (fragment, SYNA_TLS_AES_GCM_NONCE_SIZE) != 1)
+    {
+      g_propagate_error (error, openssl_error_new ("nonce generation"));
+      return FALSE;
+    }
+
+  fill_aad (aad, self->encrypt_seq_num, type, version, ptext_size);
+
+  if (!gcm_crypt (self->encrypt_ctx, 1, self->encrypt_iv, fragment, aad, data,
+                  ptext_size, data + ptext_size))
+    {
+      g_propagate_error (error, openssl_error_new ("record encryption"));
+      return FALSE;
+    }
+
+  self->encrypt_seq_num++;
+  *fragment_size = ptext_size + SYNA_TLS_RECORD_OVERHEAD;
+
+  return TRUE;
+}
+
+static gboolean
+decrypt_with (EVP_CIPHER_CTX *ctx, const guint8 *iv, guint64 seq_num,
+              guint8 type, guint16 version, guint8 *fragment,
+              gsize fragment_size, GError **error)
+{
+  guint8 aad[AAD_SIZE];
+  gsize ptext_size;
+
+  if (fragment_size < SYNA_TLS_RECORD_OVERHEAD)
+    {
+      g_propagate_error (error,
+                         fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                   "Encrypted record is too short: %" G_GSIZE_FORMAT,
+                                                   fragment_size));
+      return FALSE;
+    }
+  ptext_size = fragment_size - SYNA_TLS_RECORD_OVERHEAD;
+
+  fill_aad (aad, seq_num, type, version, ptext_size);
+
+  if (!gcm_crypt (ctx, 0, iv, fragment, aad,
+                  fragment + SYNA_TLS_AES_GCM_NONCE_SIZE, ptext_size,
+                  fragment + SYNA_TLS_AES_GCM_NONCE_SIZE + ptext_size))
+    {
+      /* a tag mismatch does not leave anything in the OpenSSL error queue */
+      g_propagate_error (error,
+                         fpi_device_error_new_msg (FP_DEVICE_ERROR_PROTO,
+                                                   "Record decryption or authentication failed"));
+      ERR_clear_error ();
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Turns the last encrypted record back into plaintext in place, for records
+ * which could not be sent. The plaintext is then again at
+ * fragment + SYNA_TLS_AES_GCM_NONCE_SIZE and the sequence number is reverted,
+ * so that another record can be encrypted first. */
+gboolean
+syna_tls_record_layer_revert_encrypt (SynaTlsRecordLayer *self,
+                                      guint8              type,
+                                      guint16             version,
+                                      guint8             *fragment,
+                                      gsize               fragment_size,
+                                      GError            **error)
+{
+  g_return_val_if_fail (self->keys_set, FALSE);
+  g_return_val_if_fail (self->encrypt_seq_num > 0, FALSE);
+
+  /* gcm_crypt sets the direction for every record, so the encryption context
+   * can be used to decrypt here */
+  if (!decrypt_with (self->encrypt_ctx, self->encrypt_iv,
+                     self->encrypt_seq_num - 1, type, version, fragment,
+                     fragment_size, error))
+    return FALSE;
+
+  self->encrypt_seq_num--;
+
+  return TRUE;
+}
+
+/* Decrypts fragment in place, ptext then points into fragment */
+gboolean
+syna_tls_record_layer_decrypt (SynaTlsRecordLayer *self,
+                               guint8              type,
+                               guint16             version,
+                               guint8             *fragment,
+                               gsize               fragment_size,
+                               guint8            **ptext,
+                               gsize              *ptext_size,
+                               GError            **error)
+{
+  g_return_val_if_fail (self->keys_set, FALSE);
+
+  if (!decrypt_with (self->decrypt_ctx, self->decrypt_iv,
+                     self->decrypt_seq_num, type, version, fragment,
+                     fragment_size, error))
+    return FALSE;
+
+  self->decrypt_seq_num++;
+  *ptext = fragment + SYNA_TLS_AES_GCM_NONCE_SIZE;
+  *ptext_size = fragment_size - SYNA_TLS_RECORD_OVERHEAD;
+
+  return TRUE;
+}
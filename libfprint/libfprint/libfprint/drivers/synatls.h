@@ -0,0 +1,143 @@
+/*
+ * Shared TLS transport of the Synaptics Tudor Match-In-Sensor drivers
+ * Copyright (C) 2024 Vojtěch Pluskal
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <openssl/evp.h>
+
+/*
+ * The sensors speak TLS 1.2 with TLS_ECDH_ECDSA_WITH_AES_256_GCM_SHA384 only,
+ * so the record layer implements just AES-256-GCM with an explicit nonce.
+ */
+
+#define SYNA_TLS_RECORD_HEADER_SIZE 5
+#define SYNA_TLS_RANDOM_SIZE 32
+#define SYNA_TLS_MASTER_SECRET_SIZE 48
+#define SYNA_TLS_VERIFY_DATA_SIZE 12
+
+#define SYNA_TLS_AES_GCM_KEY_SIZE 32
+#define SYNA_TLS_AES_GCM_IV_SIZE 4
+#define SYNA_TLS_AES_GCM_NONCE_SIZE 8
+#define SYNA_TLS_AES_GCM_TAG_SIZE 16
+/* the explicit nonce precedes the ciphertext and the tag follows it */
+#define SYNA_TLS_RECORD_OVERHEAD \
+  (SYNA_TLS_AES_GCM_NONCE_SIZE + SYNA_TLS_AES_GCM_TAG_SIZE)
+/* client write key, server write key, client write IV, server write IV */
+#define SYNA_TLS_KEY_BLOCK_SIZE \
+  (2 * SYNA_TLS_AES_GCM_KEY_SIZE + 2 * SYNA_TLS_AES_GCM_IV_SIZE)
+
+/* PRF of the ciphersuite and digest of the handshake messages, which the
+ * sensors compute with SHA-256 regardless of the ciphersuite */
+#define SYNA_TLS_PRF_DIGEST "SHA384"
+#define SYNA_TLS_TRANSCRIPT_DIGEST "SHA256"
+
+gboolean syna_tls_prf (const char   *digest_name,
+                       const guint8 *secret,
+                       gsize         secret_size,
+                       const char   *label,
+                       const guint8 *seed,
+                       gsize         seed_size,
+                       guint8       *out,
+                       gsize         out_size,
+                       GError      **error);
+
+/* Running digest of the handshake messages, so that they do not need to be
+ * kept and hashed again for every message which needs the digest. */
+typedef struct
+{
+  EVP_MD_CTX *md_ctx;
+  /* copy of md_ctx which is finalized to get intermediate digests */
+  EVP_MD_CTX *peek_ctx;
+} SynaTlsTranscript;
+
+gboolean syna_tls_transcript_init (SynaTlsTranscript *self,
+                                   const char        *digest_name,
+                                   GError           **error);
+
+void syna_tls_transcript_clear (SynaTlsTranscript *self);
+
+gboolean syna_tls_transcript_update (SynaTlsTranscript *self,
+                                     const guint8      *data,
+                                     gsize              size,
+                                     GError           **error);
+
+gboolean syna_tls_transcript_get_digest (SynaTlsTranscript *self,
+                                         guint8            *out,
+                                         gsize             *out_size,
+                                         GError           **error);
+
+gboolean syna_tls_transcript_get_verify_data (SynaTlsTranscript *self,
+                                              const guint8      *master_secret,
+                                              const char        *label,
+                                              guint8            *verify_data,
+                                              GError           **error);
+
+/* AES-GCM contexts of a session, which are keyed once and reused for every
+ * record. Records are encrypted and decrypted in place in buffers owned by the
+ * callers.
+ *
+ * With sequential_nonce set after the keys, the explicit nonce is the
+ * sequence number instead of a random one, so that the records are the same
+ * on every run, e.g. when replaying a capture. */
+typedef struct
+{
+  EVP_CIPHER_CTX *encrypt_ctx;
+  EVP_CIPHER_CTX *decrypt_ctx;
+  guint8          encrypt_iv[SYNA_TLS_AES_GCM_IV_SIZE];
+  guint8          decrypt_iv[SYNA_TLS_AES_GCM_IV_SIZE];
+  guint64         encrypt_seq_num;
+  guint64         decrypt_seq_num;
+  gboolean        keys_set;
+  gboolean        sequential_nonce;
+} SynaTlsRecordLayer;
+
+void syna_tls_record_layer_clear (SynaTlsRecordLayer *self);
+
+gboolean syna_tls_record_layer_set_keys (SynaTlsRecordLayer *self,
+                                         const guint8       *encrypt_key,
+                                         const guint8       *encrypt_iv,
+                                         const guint8       *decrypt_key,
+                                         const guint8       *decrypt_iv,
+                                         GError            **error);
+
+gboolean syna_tls_record_layer_encrypt (SynaTlsRecordLayer *self,
+                                        guint8              type,
+                                        guint16             version,
+                                        const guint8       *ptext,
+                                        gsize               ptext_size,
+                                        guint8             *fragment,
+                                        gsize              *fragment_size,
+                                        GError            **error);
+
+gboolean syna_tls_record_layer_revert_encrypt (SynaTlsRecordLayer *self,
+                                               guint8              type,
+                                               guint16             version,
+                                               guint8             *fragment,
+                                               gsize               fragment_size,
+                                               GError            **error);
+
+gboolean syna_tls_record_layer_decrypt (SynaTlsRecordLayer *self,
+                                        guint8              type,
+                                        guint16             version,
+                                        guint8             *fragment,
+                                        gsize               fragment_size,
+                                        guint8            **ptext,
+                                        gsize              *ptext_size,
+                                        GError            **error);
@@ -28,11 +28,11 @@
 #include <openssl/core_names.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
-#include <openssl/kdf.h>
 #include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <stdio.h>
 
+#include "../synatls.h"
 #include "fpi-byte-writer.h"
 #include "fpi-device.h"
 #include "fpi-log.h"
@@ -46,7 +46,6 @@
 #define VERIFY_DATA_SIZE 12
 #define MAX_SESSION_ID_SIZE 32
 #define MAX_HASH_SIZE 64
-#define MAX_KEY_BLOCK_SIZE 128
 #define CERTIFICATE_MAX_KEY_SIZE 68
 #define SIGNATURE_SIZE 256
 
@@ -57,7 +56,6 @@
 #define VERIFY_DATA_SIZE 12
 #define MAX_SESSION_ID_SIZE 32
 #define MAX_HASH_SIZE 64
-#define MAX_KEY_BLOCK_SIZE 128
 
 #define ASPRINTF_ERROR_CHECK(msg, ...)       \
   do {                                       \
@@ -126,7 +124,7 @@ struct _TlsSession
   gboolean recv_closed;
 
   HandshakePhase handshake_phase;
-  FpiByteWriter handshake_buffer;
+  SynaTlsTranscript transcript;
 
   guint16 server_cs;
   guint16 client_cs;
@@ -135,16 +133,7 @@ struct _TlsSession
   guint8 client_random[RANDOM_SIZE];
   guint8 server_random[RANDOM_SIZE];
 
-  guint64 encr_seq_num;
-  guint64 decr_seq_num;
-  guint8 *encr_key;
-  guint8 encr_key_len;
-  guint8 *decr_key;
-  guint8 decr_key_len;
-  guint8 *encr_iv;
-  guint8 encr_iv_len;
-  guint8 *decr_iv;
-  guint8 decr_iv_len;
+  SynaTlsRecordLayer record_layer;
 
   guint16 version;
 
@@ -214,53 +203,16 @@ void tls_session_free(TlsSession *self)
   g_free(self->suites);
   g_free(self->supported_extensions);
 
-  g_free(self->encr_key);
-  g_free(self->decr_key);
-
-  g_free(self->encr_iv);
-  g_free(self->decr_iv);
+  syna_tls_record_layer_clear(&self->record_layer);
+  syna_tls_transcript_clear(&self->transcript);
 
   fpi_byte_writer_reset(&self->send_buffer);
   fpi_byte_writer_reset(&self->content_buffer);
   fpi_byte_writer_reset(&self->application_data);
-  fpi_byte_writer_reset(&self->handshake_buffer);
 
   g_free(self);
 }
 
-static gboolean tls_prf(guint8 *secret, gsize secret_size, gchar *label,
-                        gsize label_size, guint8 *seed, gsize seed_size,
-                        guint8 *out, gsize outsize, char *hash_algo,
-                        GError **error)
-{
-  g_autoptr(EVP_KDF) kdf = NULL;
-  g_autoptr(EVP_KDF_CTX) kctx;
-  OSSL_PARAM params[5], *p = params;
-
-  kdf = EVP_KDF_fetch(NULL, "TLS1-PRF", NULL);
-  kctx = EVP_KDF_CTX_new(kdf);
-
-  *p++ = OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, hash_algo,
-                                          strlen(hash_algo));
-  *p++ = OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SECRET, secret,
-                                           secret_size);
-  *p++ =
-      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, label, label_size);
-  *p++ =
-      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, seed, seed_size);
-  *p = OSSL_PARAM_construct_end();
-
-  if (!EVP_KDF_derive(kctx, out, outsize, params))
-  {
-    g_propagate_error(error, fpi_device_error_new_msg(
-                                 FP_DEVICE_ERROR_GENERAL, "TLS_PRF failed: %s",
-                                 ERR_error_string(ERR_get_error(), NULL)));
-    return FALSE;
-  }
-
-  return TRUE;
-}
-
 static void tls_handshake_free(Handshake *msg)
 {
   g_free(msg->body);
@@ -279,196 +231,47 @@ static void tls_plaintext_free(TlsRecord *record)
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(TlsRecord, tls_plaintext_free);
 
-static gboolean tls_session_handshake_hash(TlsSession *self, guint8 *out,
-                                           gsize *outlen, GError **error)
-{
-  g_autoptr(EVP_MD_CTX) ctx = EVP_MD_CTX_new();
-  guint hash_len;
-
-  gsize hdata_len = fpi_byte_writer_get_pos(&self->handshake_buffer);
-  g_autofree guint8 *hdata =
-      fpi_byte_writer_reset_and_get_data(&self->handshake_buffer);
-  fpi_byte_writer_init(&self->handshake_buffer);
-  fpi_byte_writer_put_data(&self->handshake_buffer, hdata, hdata_len);
-
-  if (ctx == NULL || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) ||
-      !EVP_DigestUpdate(ctx, hdata, hdata_len) ||
-      !EVP_DigestFinal_ex(ctx, out, &hash_len))
-  {
-    g_propagate_error(
-        error, fpi_device_error_new_msg(
-                   FP_DEVICE_ERROR_GENERAL,
-                   "OpenSSL error occured while calculating handshake hash: %s",
-                   ERR_error_string(ERR_get_error(), NULL)));
-    return FALSE;
-  }
-
-  *outlen = hash_len;
-
-  return TRUE;
-}
-
-static gboolean gcm_encrypt(unsigned char *plaintext, int plaintext_len,
-                            unsigned char *aad, int aad_len, unsigned char *key,
-                            unsigned char *iv, int iv_len,
-                            unsigned char *ciphertext, int *ciphertext_len,
-                            unsigned char *tag, GError **error)
-{
-  int len, discard_len;
-  // Create and initialise the context
-  g_autoptr(EVP_CIPHER_CTX) ctx = EVP_CIPHER_CTX_new();
-
-  if (ctx == NULL ||
-      // Initialise the encryption operation
-      !EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) ||
-      // Set IV length
-      !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv_len, NULL) ||
-      // Initialise key and IV
-      !EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv) ||
-      // Provide any AAD data
-      !EVP_EncryptUpdate(ctx, NULL, &discard_len, aad, aad_len) ||
-      // Provide the message to be encrypted, and obtain the encrypted output
-      !EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len) ||
-      // Finalise: note get no output for GCM
-      !EVP_EncryptFinal_ex(ctx, ciphertext + len, &discard_len) ||
-      // Get the tag
-      !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AES_GCM_TAG_SIZE, tag))
-  {
-    g_propagate_error(error, fpi_device_error_new_msg(
-                                 FP_DEVICE_ERROR_GENERAL,
-                                 "OpenSSL error occured in gcm_encrypt: %s",
-                                 ERR_error_string(ERR_get_error(), NULL)));
-    return FALSE;
-  }
-
-  *ciphertext_len = len;
-
-  return TRUE;
-}
-
-static gboolean gcm_decrypt(unsigned char *ciphertext, int ciphertext_len,
-                            unsigned char *aad, int aad_len, unsigned char *tag,
-                            unsigned char *key, unsigned char *iv, int iv_len,
-                            unsigned char *plaintext, gsize *plaintext_len,
-                            GError **error)
-{
-  int len, discard_len;
-
-  // Create and initialise the context
-  g_autoptr(EVP_CIPHER_CTX) ctx = EVP_CIPHER_CTX_new();
-
-  if (ctx == NULL ||
-      // Initialise the decryption operation
-      !EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) ||
-      // Set IV length
-      !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, iv_len, NULL) ||
-      // Initialise key and IV
-      !EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv) ||
-      // Provide any AAD data
-      !EVP_DecryptUpdate(ctx, NULL, &discard_len, aad, aad_len) ||
-      // Provide the message to be decrypted, and obtain the plaintext output
-      !EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len) ||
-      /* Set expected tag value. Works in OpenSSL 1.0.1d and later */
-      !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, AES_GCM_TAG_SIZE, tag) ||
-      // Finalise the decryption
-      !EVP_DecryptFinal_ex(ctx, plaintext + len, &discard_len))
-  {
-    g_propagate_error(error, fpi_device_error_new_msg(
-                                 FP_DEVICE_ERROR_GENERAL,
-                                 "OpenSSL error occured in gcm_decrypt: %s",
-                                 ERR_error_string(ERR_get_error(), NULL)));
-    return FALSE;
-  }
-
-  *plaintext_len = len;
-
-  return TRUE;
-}
-
+/* appends the record to out, ptext may point into out */
 static gboolean tls_session_encrypt(TlsSession *self, guint8 type,
-                                    guint8 *ptext, gsize ptext_size,
-                                    guint8 **ctext, gsize *ctext_size,
-                                    GError **error)
+                                    const guint8 *ptext, gsize ptext_size,
+                                    FpiByteWriter *out, GError **error)
 {
-  GError *local_error = NULL;
-  FpiByteWriter writer;
   gboolean written = TRUE;
 
-  fpi_byte_writer_init(&writer);
-  written &= fpi_byte_writer_put_uint8(&writer, type);
-  written &= fpi_byte_writer_put_uint16_le(&writer, self->version);
+  written &= fpi_byte_writer_put_uint8(out, type);
+  written &= fpi_byte_writer_put_uint16_le(out, self->version);
 
   switch (self->client_cs)
   {
     case TLS_NULL_WITH_NULL_NULL:
     {
-      written &= fpi_byte_writer_put_uint16_be(&writer, ptext_size);
-      written &= fpi_byte_writer_put_data(&writer, ptext, ptext_size);
+      written &= fpi_byte_writer_put_uint16_be(out, ptext_size);
+      written &= fpi_byte_writer_put_data(out, ptext, ptext_size);
       RETURN_FALSE_AND_SET_ERROR_IF_NOT_WRITTEN(written);
-
-      *ctext_size = fpi_byte_writer_get_pos(&writer);
-      *ctext = fpi_byte_writer_reset_and_get_data(&writer);
       break;
     }
     case TLS_ECDH_ECDSA_WITH_AES_256_GCM_SHA384:
     {
-      g_autofree guint8 *gcm_iv = NULL;
-
-      // Create random nonce & add it to output
-      guint8 nonce[NONCE_SIZE];
-      RAND_bytes(nonce, NONCE_SIZE);
-
-      // encr_iv + nonce
-      gcm_iv = g_malloc(AES_GCM_IV_SIZE + NONCE_SIZE);
-      memcpy(gcm_iv, self->encr_iv, AES_GCM_IV_SIZE);
-      memcpy(gcm_iv + self->encr_iv_len, nonce, NONCE_SIZE);
-
-      // additional_data = seq_num + TLSCompressed.type + TLSCompressed.version
-      // + TLSCompressed.length;
-      FpiByteWriter adwriter;
-      fpi_byte_writer_init(&adwriter);
-      written &= fpi_byte_writer_put_uint64_be(&adwriter, self->encr_seq_num);
-      written &= fpi_byte_writer_put_uint8(&adwriter, type);
-      written &= fpi_byte_writer_put_uint16_be(&adwriter, self->version);
-      written &= fpi_byte_writer_put_uint16_be(&adwriter, ptext_size);
+      gsize fragment_size = ptext_size + SYNA_TLS_RECORD_OVERHEAD;
 
+      written &= fpi_byte_writer_put_uint16_be(out, fragment_size);
+      // Reserve the fragment, it is then encrypted in place
+      guint fragment_pos = fpi_byte_writer_get_pos(out);
+      written &= fpi_byte_writer_fill(out, 0, fragment_size);
       RETURN_FALSE_AND_SET_ERROR_IF_NOT_WRITTEN(written);
 
-      gsize additional_size = fpi_byte_writer_get_pos(&adwriter);
-      g_autofree guint8 *additional =
-          fpi_byte_writer_reset_and_get_data(&adwriter);
-
-      gint cdata_size = ptext_size + AES_GCM_TAG_SIZE;
-      g_autofree guint8 *cdata = g_malloc(cdata_size);
-
-      /* Buffer for the tag */
-      unsigned char tag[AES_GCM_TAG_SIZE];
-
-      if (!gcm_encrypt(ptext, ptext_size, additional, additional_size,
-                       self->encr_key, gcm_iv, NONCE_SIZE + AES_GCM_IV_SIZE,
-                       cdata, &cdata_size, tag, &local_error))
-      {
-        g_propagate_error(error, local_error);
+      if (!syna_tls_record_layer_encrypt(&self->record_layer, type,
+                                         self->version, ptext, ptext_size,
+                                         out->parent.data + fragment_pos,
+                                         &fragment_size, error))
         return FALSE;
-      }
-
-      written &= fpi_byte_writer_put_uint16_be(
-          &writer, NONCE_SIZE + cdata_size + AES_GCM_TAG_SIZE);
-      written &= fpi_byte_writer_put_data(&writer, nonce, NONCE_SIZE);
-      written &= fpi_byte_writer_put_data(&writer, cdata, cdata_size);
-      written &= fpi_byte_writer_put_data(&writer, tag, AES_GCM_TAG_SIZE);
-      RETURN_FALSE_AND_SET_ERROR_IF_NOT_WRITTEN(written);
-
-      self->encr_seq_num += 1;
-      *ctext_size = fpi_byte_writer_get_pos(&writer);
-      *ctext = fpi_byte_writer_reset_and_get_data(&writer);
       break;
     }
     default:
     {
-      local_error = fpi_device_error_new_msg(FP_DEVICE_ERROR_PROTO,
-                                             "Cipher suite not supported");
-      g_propagate_error(error, local_error);
+      g_propagate_error(error,
+                        fpi_device_error_new_msg(FP_DEVICE_ERROR_PROTO,
+                                                 "Cipher suite not supported"));
       return FALSE;
     }
   }
@@ -476,6 +279,7 @@ static gboolean tls_session_encrypt(TlsSession *self, guint8 type,
   return TRUE;
 }
 
+/* decrypts ctext in place, ptext points into ctext */
 static gboolean tls_session_decrypt(TlsSession *self, guint8 type,
                                     guint16 version, guint8 *ctext,
                                     gsize ctext_size, guint8 **ptext,
@@ -485,63 +289,16 @@ static gboolean tls_session_decrypt(TlsSession *self, guint8 type,
   {
     case TLS_NULL_WITH_NULL_NULL:
     {
-      *ptext = g_memdup2(ctext, ctext_size);
+      *ptext = ctext;
       *ptext_size = ctext_size;
     }
     break;
     case TLS_ECDH_ECDSA_WITH_AES_256_GCM_SHA384:
     {
-      g_autofree guint8 *gcm_iv = NULL;
-      gsize gcm_iv_size;
-      FpiByteReader reader;
-      gboolean read_ok = TRUE;
-
-      g_autofree guint8 *nonce = NULL;
-      g_autofree guint8 *cdata = NULL;
-      g_autofree guint8 *tag = NULL;
-
-      fpi_byte_reader_init(&reader, ctext, ctext_size);
-      read_ok &= fpi_byte_reader_dup_data(&reader, NONCE_SIZE, &nonce);
-      read_ok &= fpi_byte_reader_dup_data(
-          &reader, ctext_size - NONCE_SIZE - AES_GCM_TAG_SIZE, &cdata);
-      read_ok &= fpi_byte_reader_dup_data(&reader, AES_GCM_TAG_SIZE, &tag);
-      RETURN_FALSE_AND_SET_ERROR_IF_NOT_READ(read_ok);
-
-      // encr_iv + nonce
-      gcm_iv_size = NONCE_SIZE + self->decr_iv_len;
-      gcm_iv = g_malloc(gcm_iv_size);
-      memcpy(gcm_iv, self->decr_iv, self->decr_iv_len);
-      memcpy(gcm_iv + self->decr_iv_len, nonce, NONCE_SIZE);
-
-      FpiByteWriter adwriter;
-      gboolean written = TRUE;
-
-      fpi_byte_writer_init(&adwriter);
-      written &= fpi_byte_writer_put_uint64_be(&adwriter, self->decr_seq_num);
-      written &= fpi_byte_writer_put_uint8(&adwriter, type);
-      written &= fpi_byte_writer_put_uint16_be(&adwriter, version);
-      written &= fpi_byte_writer_put_uint16_be(
-          &adwriter, ctext_size - NONCE_SIZE - AES_GCM_TAG_SIZE);
-
-      RETURN_FALSE_AND_SET_ERROR_IF_NOT_WRITTEN(written);
-
-      gsize additional_size = fpi_byte_writer_get_pos(&adwriter);
-      g_autofree guint8 *additional =
-          fpi_byte_writer_reset_and_get_data(&adwriter);
-
-      *ptext_size = ctext_size - NONCE_SIZE - AES_GCM_TAG_SIZE;
-      *ptext = g_malloc(*ptext_size);
-
-      GError *local_error = NULL;
-      if (!gcm_decrypt(cdata, ctext_size - NONCE_SIZE - AES_GCM_TAG_SIZE,
-                       additional, additional_size, tag, self->decr_key, gcm_iv,
-                       gcm_iv_size, *ptext, ptext_size, &local_error))
-      {
-        g_propagate_error(error, local_error);
+      if (!syna_tls_record_layer_decrypt(&self->record_layer, type, version,
+                                         ctext, ctext_size, ptext, ptext_size,
+                                         error))
         return FALSE;
-      }
-
-      self->decr_seq_num += 1;
     }
     break;
     default:
@@ -560,27 +317,20 @@ static gboolean tls_session_flush_content_buffer(TlsSession *self,
                                                  GError **error)
 {
   GError *local_error = NULL;
-  g_autofree guint8 *plaintext = NULL;
-  g_autofree guint8 *ciphertext = NULL;
-  gsize plaintext_size, ciphertext_size;
 
   if (self->content_buffer_type != 0)
   {
-    plaintext_size = fpi_byte_writer_get_pos(&self->content_buffer);
-    plaintext = fpi_byte_writer_reset_and_get_data(&self->content_buffer);
-
-    fpi_byte_writer_init(&self->content_buffer);
-
-    if (!tls_session_encrypt(self, self->content_buffer_type, plaintext,
-                             plaintext_size, &ciphertext, &ciphertext_size,
-                             &local_error))
+    // The content buffer is kept allocated for the next records
+    if (!tls_session_encrypt(self, self->content_buffer_type,
+                             self->content_buffer.parent.data,
+                             fpi_byte_writer_get_pos(&self->content_buffer),
+                             &self->send_buffer, &local_error))
     {
       g_propagate_error(error, local_error);
       return FALSE;
     }
 
-    fpi_byte_writer_put_data(&self->send_buffer, ciphertext, ciphertext_size);
-
+    fpi_byte_writer_set_pos(&self->content_buffer, 0);
     self->content_buffer_type = 0;
   }
 
@@ -712,12 +462,10 @@ static gboolean tls_session_send_handshake_msg(TlsSession *self, Handshake *msg,
   // Update hash
   // BROKEN The windows driver only updates it when the message isn't
   // "Finished"
-  if (msg->msg_type != SSL3_MT_FINISHED)
-  {
-    written &= fpi_byte_writer_put_data(&self->handshake_buffer,
-                                        record->fragment, record->length);
-    RETURN_FALSE_AND_SET_ERROR_IF_NOT_WRITTEN(written);
-  }
+  if (msg->msg_type != SSL3_MT_FINISHED &&
+      !syna_tls_transcript_update(&self->transcript, record->fragment,
+                                  record->length, error))
+    return FALSE;
 
   if (!tls_session_send(self, record, &local_error))
   {
@@ -955,16 +703,15 @@ static gboolean tls_session_receive_handshake(TlsSession *self, Handshake *msg,
   // BROKEN The windows driver only updates it when the message isn't "Finished"
   if (msg->msg_type != SSL3_MT_FINISHED)
   {
-    gboolean written = TRUE;
-
-    written &=
-        fpi_byte_writer_put_uint8(&self->handshake_buffer, msg->msg_type);
-    written &=
-        fpi_byte_writer_put_uint24_be(&self->handshake_buffer, msg->length);
-    written &= fpi_byte_writer_put_data(&self->handshake_buffer, msg->body,
-                                        msg->length);
-
-    RETURN_FALSE_AND_SET_ERROR_IF_NOT_WRITTEN(written);
+    guint8 header[4];
+
+    header[0] = msg->msg_type;
+    FP_WRITE_UINT24_BE(header + 1, msg->length);
+    if (!syna_tls_transcript_update(&self->transcript, header, sizeof(header),
+                                    error) ||
+        !syna_tls_transcript_update(&self->transcript, msg->body, msg->length,
+                                    error))
+      return FALSE;
   }
 
   fpi_byte_reader_init(&reader, msg->body, msg->length);
@@ -1163,21 +910,24 @@ static gboolean tls_session_receive_handshake(TlsSession *self, Handshake *msg,
         return FALSE;
       }
 
-      gsize hdata_len = fpi_byte_writer_get_pos(&self->handshake_buffer);
-      g_autofree guint8 *hdata =
-          fpi_byte_writer_reset_and_get_data(&self->handshake_buffer);
-      fpi_byte_writer_init(&self->handshake_buffer);
-      fpi_byte_writer_put_data(&self->handshake_buffer, hdata, hdata_len);
-
-      g_autoptr(EVP_MD_CTX) ctx = EVP_MD_CTX_new();
+      // Sign the SHA-256 digest of the handshake messages so far
+      guint8 digest[EVP_MAX_MD_SIZE];
+      gsize digest_size;
+      g_autoptr(EVP_PKEY_CTX) sctx =
+          EVP_PKEY_CTX_new(self->pairing_data->client_key, NULL);
       g_autofree guint8 *signature = NULL;
       gsize signature_len;
 
-      if (ctx == NULL ||
-          !EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL,
-                              self->pairing_data->client_key) ||
-          !EVP_DigestSignUpdate(ctx, hdata, hdata_len) ||
-          !EVP_DigestSignFinal(ctx, NULL, &signature_len))
+      if (!syna_tls_transcript_get_digest(&self->transcript, digest,
+                                          &digest_size, &local_error))
+      {
+        g_propagate_error(error, local_error);
+        return FALSE;
+      }
+
+      if (sctx == NULL || EVP_PKEY_sign_init(sctx) <= 0 ||
+          EVP_PKEY_CTX_set_signature_md(sctx, EVP_sha256()) <= 0 ||
+          EVP_PKEY_sign(sctx, NULL, &signature_len, digest, digest_size) <= 0)
       {
         g_propagate_error(error,
                           fpi_device_error_new_msg(
@@ -1190,7 +940,8 @@ static gboolean tls_session_receive_handshake(TlsSession *self, Handshake *msg,
 
       signature = g_malloc(signature_len);
 
-      if (!EVP_DigestSignFinal(ctx, signature, &signature_len))
+      if (EVP_PKEY_sign(sctx, signature, &signature_len, digest,
+                        digest_size) <= 0)
       {
         g_propagate_error(error, fpi_device_error_new_msg(
                                      FP_DEVICE_ERROR_GENERAL,
@@ -1212,7 +963,7 @@ static gboolean tls_session_receive_handshake(TlsSession *self, Handshake *msg,
       g_autofree guint8 *premaster_secret = NULL;
       gsize premaster_secret_len;
 
-      if (ctx == NULL || !EVP_PKEY_derive_init(pctx) ||
+      if (pctx == NULL || !EVP_PKEY_derive_init(pctx) ||
           !EVP_PKEY_derive_set_peer(pctx,
                                     self->pairing_data->server_cert.pub_key) ||
           !EVP_PKEY_derive(pctx, NULL, &premaster_secret_len))
@@ -1244,20 +995,19 @@ static gboolean tls_session_receive_handshake(TlsSession *self, Handshake *msg,
       memcpy(rnd, self->client_random, RANDOM_SIZE);
       memcpy(rnd + RANDOM_SIZE, self->server_random, RANDOM_SIZE);
 
-      gchar *label = "master secret";
-      if (!tls_prf(premaster_secret, premaster_secret_len, label, strlen(label),
-                   rnd, sizeof(rnd), self->master_secret, MASTER_SECRET_SIZE,
-                   self->hash_algo, &local_error))
+      if (!syna_tls_prf(self->hash_algo, premaster_secret,
+                        premaster_secret_len, "master secret", rnd,
+                        sizeof(rnd), self->master_secret, MASTER_SECRET_SIZE,
+                        &local_error))
       {
         g_propagate_error(error, local_error);
         return FALSE;
       }
 
-      guint8 key_block[MAX_KEY_BLOCK_SIZE];
-      label = "key expansion";
-      if (!tls_prf(self->master_secret, MASTER_SECRET_SIZE, label,
-                   strlen(label), rnd, sizeof(rnd), key_block,
-                   MAX_KEY_BLOCK_SIZE, self->hash_algo, NULL))
+      guint8 key_block[SYNA_TLS_KEY_BLOCK_SIZE];
+      if (!syna_tls_prf(self->hash_algo, self->master_secret,
+                        MASTER_SECRET_SIZE, "key expansion", rnd, sizeof(rnd),
+                        key_block, sizeof(key_block), &local_error))
       {
         g_propagate_error(error, local_error);
         return FALSE;
@@ -1270,40 +1020,30 @@ static gboolean tls_session_receive_handshake(TlsSession *self, Handshake *msg,
         return FALSE;
       }
 
-      guint8 *key_block_ptr = key_block;
-
-      self->encr_key_len = AES_GCM_KEY_SIZE;
-      self->encr_key = g_memdup2(key_block_ptr, AES_GCM_KEY_SIZE);
-      key_block_ptr += AES_GCM_KEY_SIZE;
-
-      self->decr_key_len = AES_GCM_KEY_SIZE;
-      self->decr_key = g_memdup2(key_block_ptr, AES_GCM_KEY_SIZE);
-      key_block_ptr += AES_GCM_KEY_SIZE;
-
-      self->encr_iv_len = AES_GCM_IV_SIZE;
-      self->encr_iv = g_memdup2(key_block_ptr, AES_GCM_IV_SIZE);
-      key_block_ptr += AES_GCM_IV_SIZE;
-
-      self->decr_iv_len = AES_GCM_IV_SIZE;
-      self->decr_iv = g_memdup2(key_block_ptr, AES_GCM_IV_SIZE);
-
-      self->client_cs = self->pending_cs;
-
-      label = "client finished";
-      guint8 verify_data[VERIFY_DATA_SIZE];
-
-      gsize digest_size = EVP_MD_size(EVP_sha256());
-      guint8 digest[digest_size];
-
-      if (!tls_session_handshake_hash(self, digest, &digest_size, &local_error))
+      // Key block is client key, server key, client IV and server IV
+      guint8 *encr_key = key_block;
+      guint8 *decr_key = encr_key + AES_GCM_KEY_SIZE;
+      guint8 *encr_iv = decr_key + AES_GCM_KEY_SIZE;
+      guint8 *decr_iv = encr_iv + AES_GCM_IV_SIZE;
+      gboolean keys_set =
+          syna_tls_record_layer_set_keys(&self->record_layer, encr_key,
+                                         encr_iv, decr_key, decr_iv,
+                                         &local_error);
+      OPENSSL_cleanse(key_block, sizeof(key_block));
+      if (!keys_set)
       {
         g_propagate_error(error, local_error);
         return FALSE;
       }
 
-      if (!tls_prf(self->master_secret, MASTER_SECRET_SIZE, label,
-                   strlen(label), digest, digest_size, verify_data,
-                   VERIFY_DATA_SIZE, self->hash_algo, &local_error))
+      self->client_cs = self->pending_cs;
+
+      guint8 verify_data[VERIFY_DATA_SIZE];
+
+      if (!syna_tls_transcript_get_verify_data(&self->transcript,
+                                               self->master_secret,
+                                               "client finished", verify_data,
+                                               &local_error))
       {
         g_propagate_error(error, local_error);
         return FALSE;
@@ -1356,21 +1096,12 @@ static gboolean tls_session_receive_handshake(TlsSession *self, Handshake *msg,
 #endif
 
       // Handle verify data
-      gchar *label = "server finished";
       guint8 verify_data[VERIFY_DATA_SIZE];
 
-      gsize digest_size = EVP_MD_size(EVP_sha256());
-      guint8 digest[digest_size];
-
-      if (!tls_session_handshake_hash(self, digest, &digest_size, &local_error))
-      {
-        g_propagate_error(error, local_error);
-        return FALSE;
-      }
-
-      if (!tls_prf(self->master_secret, MASTER_SECRET_SIZE, label,
-                   strlen(label), digest, digest_size, verify_data,
-                   VERIFY_DATA_SIZE, self->hash_algo, &local_error))
+      if (!syna_tls_transcript_get_verify_data(&self->transcript,
+                                               self->master_secret,
+                                               "server finished", verify_data,
+                                               &local_error))
       {
         g_propagate_error(error, local_error);
         return FALSE;
@@ -1555,13 +1286,13 @@ gboolean tls_session_receive_ciphertext(TlsSession *self, guint8 *data,
     guint8 content_type = 0;
     guint16 cfrag_size = 0;
     gsize pfrag_size = 0;
-    g_autofree guint8 *cfrag = NULL;
-    g_autofree guint8 *pfrag = NULL;
+    const guint8 *cfrag = NULL;
+    guint8 *pfrag = NULL;
 
     read_ok &= fpi_byte_reader_get_uint8(&reader, &content_type);
     read_ok &= fpi_byte_reader_get_uint16_be(&reader, &version);
     read_ok &= fpi_byte_reader_get_uint16_be(&reader, &cfrag_size);
-    read_ok &= fpi_byte_reader_dup_data(&reader, cfrag_size, &cfrag);
+    read_ok &= fpi_byte_reader_get_data(&reader, cfrag_size, &cfrag);
 
     RETURN_FALSE_AND_SET_ERROR_IF_NOT_READ(read_ok);
 
@@ -1575,9 +1306,13 @@ gboolean tls_session_receive_ciphertext(TlsSession *self, guint8 *data,
       return FALSE;
     }
 
-    // Read TlsCiphertext and convert to plaintext
-    tls_session_decrypt(self, content_type, version, cfrag, cfrag_size, &pfrag,
-                        &pfrag_size, &local_error);
+    // Read TlsCiphertext and convert to plaintext in place
+    if (!tls_session_decrypt(self, content_type, version, (guint8 *)cfrag,
+                             cfrag_size, &pfrag, &pfrag_size, &local_error))
+    {
+      g_propagate_error(error, local_error);
+      return FALSE;
+    }
 
     TlsRecord plaintext = {.type = content_type,
                            .version = self->version,
@@ -1673,7 +1408,10 @@ gboolean tls_session_init(TlsSession *self, SensorPairingData *pairing_data,
 
   self->pairing_data = pairing_data;
 
-  fpi_byte_writer_init(&self->handshake_buffer);
+  if (!syna_tls_transcript_init(&self->transcript, SYNA_TLS_TRANSCRIPT_DIGEST,
+                                error))
+    return FALSE;
+
   fpi_byte_writer_init(&self->send_buffer);
   fpi_byte_writer_init(&self->content_buffer);
   fpi_byte_writer_init(&self->application_data);
@@ -1755,8 +1493,8 @@ static gboolean generate_hs_priv_key(EVP_PKEY **hs_privkey, GError **error)
   gchar *label = "HS_KEY_PAIR_GEN";
 
   guint8 privkey_k[ECC_KEY_SIZE];
-  if (!tls_prf(secret, sizeof(secret), label, strlen(label), seed, sizeof(seed),
-               privkey_k, ECC_KEY_SIZE, SN_sha256, error))
+  if (!syna_tls_prf(SN_sha256, secret, sizeof(secret), label, seed,
+                    sizeof(seed), privkey_k, ECC_KEY_SIZE, error))
   {
     return FALSE;
   }
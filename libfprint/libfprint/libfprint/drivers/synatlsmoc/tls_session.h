@@ -75,6 +75,7 @@ gboolean tls_session_init(TlsSession *self, SensorPairingData *pairing_data,
 gboolean tls_session_flush_send_buffer(TlsSession *self, guint8 **data,
                                        gsize *size, GError **error);
 gboolean tls_session_has_data(TlsSession *self);
+/* records in data are decrypted in place */
 gboolean tls_session_receive_ciphertext(TlsSession *self, guint8 *data,
                                         gsize size, GError **error);
 gboolean tls_session_wrap(TlsSession *self, guint8 *pdata, gsize pdata_size,
@@ -37,6 +37,8 @@ typedef struct
   FpImage            *capture_image;
 
   gint                bz3_threshold;
+  /* Allocated on first use, kept so the tables stay warm across matches */
+  struct bz_context  *bz3_context;
 } FpImageDevicePrivate;
 
 
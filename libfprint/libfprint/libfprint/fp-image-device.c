@@ -22,6 +22,8 @@
 
 #include "fp-image-device-private.h"
 
+#include <nbis.h>
+
 #define BOZORTH3_DEFAULT_THRESHOLD 40
 
 /**
@@ -150,6 +152,7 @@ fp_image_device_finalize (GObject *object)
   FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
 
   g_assert (priv->active == FALSE);
+  g_clear_pointer (&priv->bz3_context, bz_context_free);
 
   G_OBJECT_CLASS (fp_image_device_parent_class)->finalize (object);
 }
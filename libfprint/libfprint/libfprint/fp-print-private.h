@@ -43,4 +43,6 @@ struct _FpPrint
 
   GVariant  *data;
   GPtrArray *prints;
+  /* Precomputed bozorth3 form of prints, see fpi_print_bz3_precompute() */
+  GPtrArray *bz3_galleries;
 };
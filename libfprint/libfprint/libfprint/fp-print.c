@@ -80,6 +80,7 @@ fp_print_finalize (GObject *object)
   g_clear_pointer (&self->enroll_date, g_date_free);
   g_clear_pointer (&self->data, g_variant_unref);
   g_clear_pointer (&self->prints, g_ptr_array_unref);
+  g_clear_pointer (&self->bz3_galleries, g_ptr_array_unref);
 
   G_OBJECT_CLASS (fp_print_parent_class)->finalize (object);
 }
@@ -195,6 +196,7 @@ fp_print_set_property (GObject      *object,
 
     case PROP_FPI_PRINTS:
       g_clear_pointer (&self->prints, g_ptr_array_unref);
+      g_clear_pointer (&self->bz3_galleries, g_ptr_array_unref);
       self->prints = g_value_get_pointer (value);
       break;
 
@@ -869,6 +871,8 @@ fp_print_deserialize (const guchar *data,
 
           g_ptr_array_add (result->prints, g_steal_pointer (&xyt));
         }
+
+      fpi_print_bz3_precompute (result);
     }
   else if (type == FPI_PRINT_RAW)
     {
@@ -28,6 +28,14 @@
 
 #include "fpi-assembling.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FPI_ASSEMBLING_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define FPI_ASSEMBLING_NEON 1
+#include <arm_neon.h>
+#endif
+
 /**
  * SECTION:fpi-assembling
  * @title: Image frame assembly
@@ -92,6 +100,240 @@ calc_error (struct fpi_frame_asmbl_ctx *ctx,
   return err;
 }
 
+/* Sum of absolute differences of two rows of 8-bit pixels */
+typedef unsigned int (*SadRowFunc) (const guint8 *a,
+                                    const guint8 *b,
+                                    unsigned int  len);
+
+static unsigned int
+sad_row_scalar (const guint8 *a, const guint8 *b, unsigned int len)
+{
+  unsigned int i, sum = 0;
+
+  for (i = 0; i < len; i++)
+    sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+  return sum;
+}
+
+#ifdef FPI_ASSEMBLING_X86
+__attribute__((target ("sse2"))) static unsigned int
+sad_row_sse2 (const guint8 *a, const guint8 *b, unsigned int len)
+{
+  __m128i acc = _mm_setzero_si128 ();
+  unsigned int i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    acc = _mm_add_epi64 (acc,
+                         _mm_sad_epu8 (_mm_loadu_si128 ((const __m128i *) (a + i)),
+                                       _mm_loadu_si128 ((const __m128i *) (b + i))));
+
+  return _mm_cvtsi128_si32 (acc) + _mm_cvtsi128_si32 (_mm_srli_si128 (acc, 8)) +
+         sad_row_scalar (a + i, b + i, len - i);
+}
+
+__attribute__((target ("avx2"))) static unsigned int
+sad_row_avx2 (const guint8 *a, const guint8 *b, unsigned int len)
+{
+  __m256i acc = _mm256_setzero_si256 ();
+  __m128i sum;
+  unsigned int i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+    acc = _mm256_add_epi64 (acc,
+                            _mm256_sad_epu8 (_mm256_loadu_si256 ((const __m256i *) (a + i)),
+                                             _mm256_loadu_si256 ((const __m256i *) (b + i))));
+
+  sum = _mm_add_epi64 (_mm256_castsi256_si128 (acc),
+                       _mm256_extracti128_si256 (acc, 1));
+
+  return _mm_cvtsi128_si32 (sum) + _mm_cvtsi128_si32 (_mm_srli_si128 (sum, 8)) +
+         sad_row_scalar (a + i, b + i, len - i);
+}
+#endif
+
+#ifdef FPI_ASSEMBLING_NEON
+static unsigned int
+sad_row_neon (const guint8 *a, const guint8 *b, unsigned int len)
+{
+  uint32x4_t acc = vdupq_n_u32 (0);
+  unsigned int i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    acc = vpadalq_u16 (acc, vpaddlq_u8 (vabdq_u8 (vld1q_u8 (a + i),
+                                                  vld1q_u8 (b + i))));
+
+  return vgetq_lane_u32 (acc, 0) + vgetq_lane_u32 (acc, 1) +
+         vgetq_lane_u32 (acc, 2) + vgetq_lane_u32 (acc, 3) +
+         sad_row_scalar (a + i, b + i, len - i);
+}
+#endif
+
+static SadRowFunc
+get_sad_row_func (void)
+{
+  static gsize func = 0;
+
+  if (g_once_init_enter (&func))
+    {
+      SadRowFunc sad_row = sad_row_scalar;
+
+#if defined(FPI_ASSEMBLING_X86)
+      __builtin_cpu_init ();
+      if (__builtin_cpu_supports ("avx2"))
+        sad_row = sad_row_avx2;
+      else if (__builtin_cpu_supports ("sse2"))
+        sad_row = sad_row_sse2;
+#elif defined(FPI_ASSEMBLING_NEON)
+      sad_row = sad_row_neon;
+#endif
+
+      g_once_init_leave (&func, (gsize) sad_row);
+    }
+
+  return (SadRowFunc) func;
+}
+
+/* The horizontal search range, dx is in [-OVERLAP_MAX_DX, OVERLAP_MAX_DX) */
+#define OVERLAP_MAX_DX 8
+#define OVERLAP_NUM_DX (2 * OVERLAP_MAX_DX)
+
+typedef struct
+{
+  SadRowFunc   sad_row;
+  gboolean     prune;
+  /* Best candidate so far, index is its position in the order of the
+   * exhaustive search, which decides between equal errors. */
+  unsigned int err;
+  int          index;
+  int          dx;
+  int          dy;
+} OverlapSearch;
+
+/* Same as calc_error() for frames of plain rows, but gives up as soon as the
+ * candidate cannot beat the best one anymore. */
+static void
+try_overlap_plain (struct fpi_frame_asmbl_ctx *ctx,
+                   OverlapSearch              *search,
+                   struct fpi_frame           *first_frame,
+                   struct fpi_frame           *second_frame,
+                   int                         dx,
+                   int                         dy)
+{
+  unsigned int width, height, area;
+  unsigned int x1, x2, i, err;
+  int index = (dy - 2) * OVERLAP_NUM_DX + dx + OVERLAP_MAX_DX;
+  guint64 limit;
+
+  width = ctx->frame_width - (dx > 0 ? dx : -dx);
+  height = ctx->frame_height - dy;
+  area = ctx->frame_height * ctx->frame_width;
+
+  if (height == 0 || width == 0)
+    {
+      err = INT_MAX;
+      goto out;
+    }
+
+  /* The error only grows with every row, so a row sum is a lower bound of
+   * the normalized error. Bail out once it is above the best error, or
+   * equal to it if the best candidate comes first. */
+  limit = (guint64) search->err * height * width;
+  if (index < search->index)
+    limit += (guint64) height * width;
+
+  x1 = dx < 0 ? 0 : dx;
+  x2 = dx < 0 ? -dx : 0;
+  err = 0;
+  for (i = 0; i < height; i++)
+    {
+      err += search->sad_row (first_frame->data + i * ctx->frame_width + x1,
+                              second_frame->data + (i + dy) * ctx->frame_width + x2,
+                              width);
+
+      if (search->prune && (guint64) err * area >= limit)
+        return;
+    }
+
+  /* Normalize error */
+  err *= area;
+  err /= (height * width);
+
+out:
+  if (err < search->err || (err == search->err && index < search->index))
+    {
+      search->err = err;
+      search->index = index;
+      search->dx = dx;
+      search->dy = dy;
+    }
+}
+
+/* Finds the same overlap as the exhaustive search, but starts with the
+ * overlap of the previous pair of frames and a coarse grid, so that most
+ * candidates of the full search can be dropped after a few rows. */
+static void
+find_overlap_plain (struct fpi_frame_asmbl_ctx *ctx,
+                    struct fpi_frame           *first_frame,
+                    struct fpi_frame           *second_frame,
+                    int                         hint_dx,
+                    int                         hint_dy,
+                    int                        *dx_out,
+                    int                        *dy_out,
+                    unsigned int               *min_error)
+{
+  OverlapSearch search = { 0, };
+  g_autofree gboolean *tried = NULL;
+  unsigned int area = ctx->frame_height * ctx->frame_width;
+  int dx, dy;
+
+  search.sad_row = get_sad_row_func ();
+  /* The pruning relies on the error not overflowing while normalizing */
+  search.prune = (guint64) 255 * area * area <= G_MAXUINT;
+  search.err = 255 * area;
+  /* The initial error is only replaced by a smaller one */
+  search.index = -1;
+
+  if (ctx->frame_height <= 2)
+    {
+      *min_error = search.err;
+      return;
+    }
+
+  tried = g_new0 (gboolean, (ctx->frame_height - 2) * OVERLAP_NUM_DX);
+
+#define TRY_OVERLAP(dx, dy) \
+  G_STMT_START { \
+    int _i = ((dy) - 2) * OVERLAP_NUM_DX + (dx) + OVERLAP_MAX_DX; \
+    if (!tried[_i]) \
+      { \
+        tried[_i] = TRUE; \
+        try_overlap_plain (ctx, &search, first_frame, second_frame, dx, dy); \
+      } \
+  } G_STMT_END
+
+  if (hint_dy >= 2 && hint_dy < ctx->frame_height &&
+      -hint_dx >= -OVERLAP_MAX_DX && -hint_dx < OVERLAP_MAX_DX)
+    TRY_OVERLAP (-hint_dx, hint_dy);
+
+  for (dy = 2; dy < ctx->frame_height; dy += 2)
+    for (dx = -OVERLAP_MAX_DX; dx < OVERLAP_MAX_DX; dx += 4)
+      TRY_OVERLAP (dx, dy);
+
+  for (dy = 2; dy < ctx->frame_height; dy++)
+    for (dx = -OVERLAP_MAX_DX; dx < OVERLAP_MAX_DX; dx++)
+      TRY_OVERLAP (dx, dy);
+
+#undef TRY_OVERLAP
+
+  *min_error = search.err;
+  if (search.index >= 0)
+    {
+      *dx_out = -search.dx;
+      *dy_out = search.dy;
+    }
+}
+
 /* This function is rather CPU-intensive. It's better to use hardware
  * to detect movement direction when possible.
  */
@@ -99,6 +341,8 @@ static void
 find_overlap (struct fpi_frame_asmbl_ctx *ctx,
               struct fpi_frame           *first_frame,
               struct fpi_frame           *second_frame,
+              int                         hint_dx,
+              int                         hint_dy,
               int                        *dx_out,
               int                        *dy_out,
               unsigned int               *min_error)
@@ -106,6 +350,13 @@ find_overlap (struct fpi_frame_asmbl_ctx *ctx,
   int dx, dy;
   unsigned int err;
 
+  if (ctx->plain_rows)
+    {
+      find_overlap_plain (ctx, first_frame, second_frame, hint_dx, hint_dy,
+                          dx_out, dy_out, min_error);
+      return;
+    }
+
   *min_error = 255 * ctx->frame_height * ctx->frame_width;
 
   /* Seeking in horizontal and vertical dimensions,
@@ -138,6 +389,7 @@ do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
   guint num_frames = 1;
   struct fpi_frame *prev_stripe;
   unsigned int min_error;
+  int hint_dx = 0, hint_dy = 0;
   /* Max error is width * height * 255, for AES2501 which has the largest
    * sensor its 192*16*255 = 783360. So for 32bit value it's ~5482 frame before
    * we might get int overflow. Use 64bit value here to prevent integer overflow
@@ -155,17 +407,21 @@ do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
 
       if (reverse)
         {
-          find_overlap (ctx, prev_stripe, cur_stripe,
+          find_overlap (ctx, prev_stripe, cur_stripe, hint_dx, hint_dy,
                         &cur_stripe->delta_x, &cur_stripe->delta_y,
                         &min_error);
+          hint_dx = cur_stripe->delta_x;
+          hint_dy = cur_stripe->delta_y;
           cur_stripe->delta_y = -cur_stripe->delta_y;
           cur_stripe->delta_x = -cur_stripe->delta_x;
         }
       else
         {
-          find_overlap (ctx, cur_stripe, prev_stripe,
+          find_overlap (ctx, cur_stripe, prev_stripe, hint_dx, hint_dy,
                         &cur_stripe->delta_x, &cur_stripe->delta_y,
                         &min_error);
+          hint_dx = cur_stripe->delta_x;
+          hint_dy = cur_stripe->delta_y;
         }
       total_error += min_error;
 
@@ -312,6 +568,248 @@ fpi_assemble_frames (struct fpi_frame_asmbl_ctx *ctx,
   return img;
 }
 
+/* The image as it is assembled with the movement estimated in one of the two
+ * directions that fpi_do_movement_estimation() tries. Rows are stored from the
+ * first frame onwards, so the canvas of the reverse direction is upside down.
+ */
+typedef struct
+{
+  guint8            *rows;
+  guint              n_rows;
+  int                x;
+  int                y;
+  int                hint_dx;
+  int                hint_dy;
+  unsigned long long total_error;
+} FrameCanvas;
+
+struct _FpiFrameAssembler
+{
+  struct fpi_frame_asmbl_ctx ctx;
+  struct fpi_frame          *prev_stripe;
+  guint                      n_frames;
+  gboolean                   finished;
+  FrameCanvas                canvas[2];
+};
+
+static void
+frame_canvas_grow (struct fpi_frame_asmbl_ctx *ctx,
+                   FrameCanvas                *canvas,
+                   guint                       n_rows)
+{
+  if (n_rows <= canvas->n_rows)
+    return;
+
+  n_rows = MAX (n_rows, canvas->n_rows * 2);
+  canvas->rows = g_realloc (canvas->rows, n_rows * ctx->image_width);
+  memset (canvas->rows + canvas->n_rows * ctx->image_width, 0,
+          (n_rows - canvas->n_rows) * ctx->image_width);
+  canvas->n_rows = n_rows;
+}
+
+/* Same as aes_blit_stripe(), the image is only ever as high as needed */
+static void
+frame_canvas_blit (struct fpi_frame_asmbl_ctx *ctx,
+                   FrameCanvas                *canvas,
+                   struct fpi_frame           *stripe,
+                   gboolean                    reverse)
+{
+  unsigned int fx1, ix1, fx, ix, fy, len;
+  guint8 *row;
+
+  frame_canvas_grow (ctx, canvas, ABS (canvas->y) + ctx->frame_height);
+
+  if (canvas->x < 0)
+    {
+      ix1 = 0;
+      fx1 = -canvas->x;
+    }
+  else
+    {
+      ix1 = canvas->x;
+      fx1 = 0;
+    }
+
+  if (fx1 >= ctx->frame_width || ix1 >= ctx->image_width)
+    return;
+
+  len = MIN (ctx->frame_width - fx1, ctx->image_width - ix1);
+
+  for (fy = 0; fy < ctx->frame_height; fy++)
+    {
+      if (reverse)
+        row = canvas->rows + (ctx->frame_height - 1 - fy - canvas->y) * ctx->image_width;
+      else
+        row = canvas->rows + (canvas->y + fy) * ctx->image_width;
+
+      if (ctx->plain_rows)
+        memcpy (row + ix1, stripe->data + fy * ctx->frame_width + fx1, len);
+      else
+        for (fx = fx1, ix = ix1; ix < ix1 + len; fx++, ix++)
+          row[ix] = ctx->get_pixel (ctx, stripe, fx, fy);
+    }
+}
+
+/**
+ * fpi_frame_assembler_new:
+ * @ctx: #fpi_frame_asmbl_ctx - frame assembling context
+ * @n_frames_hint: the number of frames a swipe usually has, or 0
+ *
+ * Creates a #FpiFrameAssembler, @ctx is copied. The image is preallocated
+ * for @n_frames_hint frames and grows as needed when more are added.
+ *
+ * Returns: (transfer full): a new #FpiFrameAssembler
+ */
+FpiFrameAssembler *
+fpi_frame_assembler_new (struct fpi_frame_asmbl_ctx *ctx,
+                         guint                       n_frames_hint)
+{
+  FpiFrameAssembler *self;
+
+  g_return_val_if_fail (ctx != NULL, NULL);
+  g_return_val_if_fail (ctx->image_width > 0 && ctx->frame_height > 0, NULL);
+
+  self = g_new0 (FpiFrameAssembler, 1);
+  self->ctx = *ctx;
+
+  for (guint i = 0; i < G_N_ELEMENTS (self->canvas); i++)
+    {
+      self->canvas[i].x = ((int) ctx->image_width - (int) ctx->frame_width) / 2;
+      frame_canvas_grow (&self->ctx, &self->canvas[i],
+                         MAX (n_frames_hint, 1) * ctx->frame_height);
+    }
+
+  return self;
+}
+
+/**
+ * fpi_frame_assembler_free:
+ * @self: a #FpiFrameAssembler
+ *
+ * Frees @self and the frames it still holds.
+ */
+void
+fpi_frame_assembler_free (FpiFrameAssembler *self)
+{
+  if (self == NULL)
+    return;
+
+  for (guint i = 0; i < G_N_ELEMENTS (self->canvas); i++)
+    g_free (self->canvas[i].rows);
+
+  g_free (self->prev_stripe);
+  g_free (self);
+}
+
+/**
+ * fpi_frame_assembler_add:
+ * @self: a #FpiFrameAssembler
+ * @stripe: (transfer full): the next #fpi_frame of the swipe
+ *
+ * Estimates the movement between @stripe and the previous frame and draws
+ * @stripe into the image. @stripe must have been allocated with g_malloc(),
+ * @delta_x and @delta_y are ignored.
+ */
+void
+fpi_frame_assembler_add (FpiFrameAssembler *self,
+                         struct fpi_frame  *stripe)
+{
+  FrameCanvas *canvas = self->canvas;
+  FrameCanvas *rev_canvas = self->canvas + 1;
+  unsigned int min_error;
+  int dx, dy;
+
+  g_return_if_fail (stripe != NULL);
+  g_return_if_fail (!self->finished);
+
+  if (self->prev_stripe)
+    {
+      dx = dy = 0;
+      find_overlap (&self->ctx, stripe, self->prev_stripe,
+                    canvas->hint_dx, canvas->hint_dy, &dx, &dy, &min_error);
+      canvas->hint_dx = dx;
+      canvas->hint_dy = dy;
+      canvas->total_error += min_error;
+      canvas->x += dx;
+      canvas->y += dy;
+
+      dx = dy = 0;
+      find_overlap (&self->ctx, self->prev_stripe, stripe,
+                    rev_canvas->hint_dx, rev_canvas->hint_dy, &dx, &dy, &min_error);
+      rev_canvas->hint_dx = dx;
+      rev_canvas->hint_dy = dy;
+      rev_canvas->total_error += min_error;
+      rev_canvas->x -= dx;
+      rev_canvas->y -= dy;
+    }
+
+  frame_canvas_blit (&self->ctx, canvas, stripe, FALSE);
+  frame_canvas_blit (&self->ctx, rev_canvas, stripe, TRUE);
+
+  g_free (self->prev_stripe);
+  self->prev_stripe = stripe;
+  self->n_frames++;
+}
+
+/**
+ * fpi_frame_assembler_get_n_frames:
+ * @self: a #FpiFrameAssembler
+ *
+ * Returns: the number of frames added so far
+ */
+guint
+fpi_frame_assembler_get_n_frames (FpiFrameAssembler *self)
+{
+  return self->n_frames;
+}
+
+/**
+ * fpi_frame_assembler_finish:
+ * @self: a #FpiFrameAssembler
+ *
+ * Picks the direction of the swipe and returns the assembled image. At
+ * least one frame must have been added, and no frames can be added
+ * afterwards.
+ *
+ * Returns: (transfer full): a newly allocated #FpImage
+ */
+FpImage *
+fpi_frame_assembler_finish (FpiFrameAssembler *self)
+{
+  FrameCanvas *canvas;
+  FpImage *img;
+  int err, rev_err;
+  guint height;
+
+  g_return_val_if_fail (self->n_frames > 0, NULL);
+  g_return_val_if_fail (!self->finished, NULL);
+
+  self->finished = TRUE;
+
+  err = self->canvas[0].total_error / self->n_frames;
+  rev_err = self->canvas[1].total_error / self->n_frames;
+  fp_dbg ("errors: %d rev: %d", err, rev_err);
+  canvas = err < rev_err ? &self->canvas[0] : &self->canvas[1];
+
+  height = ABS (canvas->y) + self->ctx.frame_height;
+  fp_dbg ("height is %d", height);
+
+  img = fp_image_new (self->ctx.image_width, height);
+  img->flags = FPI_IMAGE_COLORS_INVERTED;
+  img->flags |= canvas->y < 0 ? 0 : FPI_IMAGE_H_FLIPPED | FPI_IMAGE_V_FLIPPED;
+  img->width = self->ctx.image_width;
+  img->height = height;
+
+  if (canvas == &self->canvas[0])
+    memcpy (img->data, canvas->rows, height * img->width);
+  else
+    for (guint y = 0; y < height; y++)
+      memcpy (img->data + y * img->width,
+              canvas->rows + (height - 1 - y) * img->width, img->width);
+
+  return img;
+}
+
 static int
 cmpint (const void *p1, const void *p2, gpointer data)
 {
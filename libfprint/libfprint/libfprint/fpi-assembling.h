@@ -44,6 +44,8 @@ struct fpi_frame
  * @frame_height: height of the frame
  * @image_width: resulting image width
  * @get_pixel: pixel accessor, returns pixel brightness at x,y of frame
+ * @plain_rows: frames store one byte per pixel, row by row, so that
+ *              @get_pixel returns `data[x + y * frame_width]`
  *
  * #fpi_frame_asmbl_ctx is a structure holding the context for frame
  * assembling routines.
@@ -51,6 +53,10 @@ struct fpi_frame
  * Drivers should define their own #fpi_frame_asmbl_ctx depending on
  * hardware parameters of scanner. @image_width is usually 25% wider than
  * @frame_width to take horizontal movement into account.
+ *
+ * Drivers whose frames are in the layout described for @plain_rows should
+ * set it, movement estimation then compares whole rows at once rather than
+ * calling @get_pixel for every pixel.
  */
 struct fpi_frame_asmbl_ctx
 {
@@ -61,6 +67,7 @@ struct fpi_frame_asmbl_ctx
                              struct fpi_frame           *frame,
                              unsigned int                x,
                              unsigned int                y);
+  gboolean      plain_rows;
 };
 
 void fpi_do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
@@ -69,6 +76,27 @@ void fpi_do_movement_estimation (struct fpi_frame_asmbl_ctx *ctx,
 FpImage *fpi_assemble_frames (struct fpi_frame_asmbl_ctx *ctx,
                               GSList                     *stripes);
 
+/**
+ * FpiFrameAssembler:
+ *
+ * #FpiFrameAssembler assembles frames of swipe sensors while they are
+ * being captured. It gives the same image as fpi_do_movement_estimation()
+ * followed by fpi_assemble_frames(), but the movement between each new
+ * frame and the previous one is estimated as soon as the frame is added
+ * and the frame is drawn into the image right away.
+ */
+typedef struct _FpiFrameAssembler FpiFrameAssembler;
+
+FpiFrameAssembler *fpi_frame_assembler_new (struct fpi_frame_asmbl_ctx *ctx,
+                                            guint                       n_frames_hint);
+void fpi_frame_assembler_free (FpiFrameAssembler *self);
+void fpi_frame_assembler_add (FpiFrameAssembler *self,
+                              struct fpi_frame  *stripe);
+guint fpi_frame_assembler_get_n_frames (FpiFrameAssembler *self);
+FpImage *fpi_frame_assembler_finish (FpiFrameAssembler *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FpiFrameAssembler, fpi_frame_assembler_free)
+
 /**
  * fpi_line_asmbl_ctx:
  * @line_width: width of line
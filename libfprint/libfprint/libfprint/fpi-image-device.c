@@ -23,6 +23,8 @@
 #include "fp-image-device-private.h"
 #include "fp-image-device.h"
 
+#include <nbis.h>
+
 /**
  * SECTION: fpi-image-device
  * @title: Internal FpImageDevice
@@ -232,6 +234,44 @@ fp_image_device_maybe_complete_action (FpImageDevice *self, GError *error)
     }
 }
 
+static struct bz_context *
+fp_image_device_get_bz3_context (FpImageDevice *self)
+{
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  if (!priv->bz3_context)
+    priv->bz3_context = bz_context_new ();
+
+  return priv->bz3_context;
+}
+
+static void
+fpi_image_device_identify_done (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  FpPrint *print = FP_PRINT (source_object);
+  g_autoptr(FpPrint) result = NULL;
+  GError *error = NULL;
+  FpImageDevice *self = FP_IMAGE_DEVICE (user_data);
+  FpImageDevicePrivate *priv = fp_image_device_get_instance_private (self);
+
+  priv->minutiae_scan_active = FALSE;
+
+  result = fpi_print_bz3_identify_finish (print, res, &error);
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      fp_image_device_maybe_complete_action (self, g_steal_pointer (&error));
+      fpi_image_device_deactivate (self, TRUE);
+      return;
+    }
+
+  if (!error || error->domain == FP_DEVICE_RETRY)
+    fpi_device_identify_report (FP_DEVICE (self), result, g_object_ref (print),
+                                g_steal_pointer (&error));
+
+  fp_image_device_maybe_complete_action (self, g_steal_pointer (&error));
+}
+
 static void
 fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
@@ -323,7 +363,9 @@ fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, g
 
       fpi_device_get_verify_data (device, &template);
       if (print)
-        result = fpi_print_bz3_match (template, print, priv->bz3_threshold, &error);
+        result = fpi_print_bz3_match (template, print, priv->bz3_threshold,
+                                      fp_image_device_get_bz3_context (self),
+                                      &error);
       else
         result = FPI_MATCH_ERROR;
 
@@ -334,24 +376,25 @@ fpi_image_device_minutiae_detected (GObject *source_object, GAsyncResult *res, g
     }
   else if (action == FPI_DEVICE_ACTION_IDENTIFY)
     {
-      gint i;
       GPtrArray *templates;
-      FpPrint *result = NULL;
 
-      fpi_device_get_identify_data (device, &templates);
-      for (i = 0; !error && i < templates->len; i++)
+      if (print)
         {
-          FpPrint *template = g_ptr_array_index (templates, i);
-
-          if (fpi_print_bz3_match (template, print, priv->bz3_threshold, &error) == FPI_MATCH_SUCCESS)
-            {
-              result = template;
-              break;
-            }
+          fpi_device_get_identify_data (device, &templates);
+
+          /* The gallery is matched in a thread pool, the action is only
+           * completed once fpi_image_device_identify_done() runs. */
+          priv->minutiae_scan_active = TRUE;
+          fpi_print_bz3_identify (templates, print,
+                                  priv->bz3_threshold,
+                                  fpi_device_get_cancellable (device),
+                                  fpi_image_device_identify_done,
+                                  self);
+          return;
         }
 
       if (!error || error->domain == FP_DEVICE_RETRY)
-        fpi_device_identify_report (device, result, g_steal_pointer (&print), g_steal_pointer (&error));
+        fpi_device_identify_report (device, NULL, NULL, g_steal_pointer (&error));
 
       fp_image_device_maybe_complete_action (self, g_steal_pointer (&error));
     }
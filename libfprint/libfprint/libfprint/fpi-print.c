@@ -34,6 +34,139 @@
  * #FpPrint routines.
  */
 
+/* A bozorth3 match context, which is large, together with the probe that is
+ * loaded into it. Contexts are reused while matching is going on, and freed
+ * once nothing uses them anymore, so at most one per thread of the identify
+ * pool and per precomputing thread exists, and none while idle. */
+typedef struct
+{
+  struct bz_context *ctx;
+  /* Serial of the identification whose probe is loaded into ctx */
+  guint              probe_serial;
+  gint               probe_len;
+} FpiBz3Worker;
+
+static GMutex bz3_workers_lock;
+/* Workers which are not in use, only valid while bz3_workers_users > 0 */
+static GPtrArray *bz3_idle_workers;
+/* Running identifications and precomputations */
+static guint bz3_workers_users;
+
+static void
+fpi_print_bz3_worker_free (gpointer data)
+{
+  FpiBz3Worker *worker = data;
+
+  bz_context_free (worker->ctx);
+  g_free (worker);
+}
+
+static void
+fpi_print_bz3_workers_hold (void)
+{
+  g_mutex_lock (&bz3_workers_lock);
+  if (bz3_workers_users++ == 0)
+    bz3_idle_workers = g_ptr_array_new_with_free_func (fpi_print_bz3_worker_free);
+  g_mutex_unlock (&bz3_workers_lock);
+}
+
+static void
+fpi_print_bz3_workers_release (void)
+{
+  g_autoptr(GPtrArray) idle_workers = NULL;
+
+  g_mutex_lock (&bz3_workers_lock);
+  g_assert (bz3_workers_users > 0);
+  if (--bz3_workers_users == 0)
+    idle_workers = g_steal_pointer (&bz3_idle_workers);
+  g_mutex_unlock (&bz3_workers_lock);
+}
+
+/* Only valid between fpi_print_bz3_workers_hold() and _release() */
+static FpiBz3Worker *
+fpi_print_bz3_worker_get (void)
+{
+  FpiBz3Worker *worker = NULL;
+
+  g_mutex_lock (&bz3_workers_lock);
+  g_assert (bz3_workers_users > 0);
+  if (bz3_idle_workers->len > 0)
+    worker = g_ptr_array_steal_index_fast (bz3_idle_workers,
+                                           bz3_idle_workers->len - 1);
+  g_mutex_unlock (&bz3_workers_lock);
+
+  if (!worker)
+    {
+      worker = g_new0 (FpiBz3Worker, 1);
+      worker->ctx = bz_context_new ();
+    }
+
+  return worker;
+}
+
+static void
+fpi_print_bz3_worker_put (FpiBz3Worker *worker)
+{
+  g_mutex_lock (&bz3_workers_lock);
+  g_ptr_array_add (bz3_idle_workers, worker);
+  g_mutex_unlock (&bz3_workers_lock);
+}
+
+/**
+ * fpi_print_bz3_precompute:
+ * @print: A #FpPrint of type #FPI_PRINT_NBIS
+ *
+ * Builds the precomputed bozorth3 gallery form of all prints in @print that
+ * do not have one yet. Matching against the precomputed form skips the
+ * computation of the pairwise comparison table of the template, which is
+ * otherwise redone for every match.
+ *
+ * This is done when a print is deserialized or enrolled, prints without a
+ * precomputed form are still matched, just more slowly.
+ */
+void
+fpi_print_bz3_precompute (FpPrint *print)
+{
+  FpiBz3Worker *worker;
+  guint i;
+
+  g_return_if_fail (print->type == FPI_PRINT_NBIS);
+
+  if (!print->bz3_galleries)
+    print->bz3_galleries =
+      g_ptr_array_new_with_free_func ((GDestroyNotify) bozorth_gallery_free);
+
+  if (print->bz3_galleries->len == print->prints->len)
+    return;
+
+  fpi_print_bz3_workers_hold ();
+  worker = fpi_print_bz3_worker_get ();
+  for (i = print->bz3_galleries->len; i < print->prints->len; i++)
+    g_ptr_array_add (print->bz3_galleries,
+                     bozorth_gallery_new (worker->ctx,
+                                          g_ptr_array_index (print->prints, i)));
+  fpi_print_bz3_worker_put (worker);
+  fpi_print_bz3_workers_release ();
+}
+
+static gint
+fpi_print_bz3_score (struct bz_context *ctx,
+                     gint               probe_len,
+                     struct xyt_struct *pstruct,
+                     FpPrint           *template,
+                     guint              index)
+{
+  struct xyt_struct *gstruct = g_ptr_array_index (template->prints, index);
+
+  /* The prints may have been replaced since they were precomputed */
+  if (template->bz3_galleries &&
+      template->bz3_galleries->len == template->prints->len)
+    return bozorth_to_precomputed_gallery (ctx, probe_len, pstruct, gstruct,
+                                           g_ptr_array_index (template->bz3_galleries, index));
+
+  return bozorth_to_gallery (ctx, probe_len, pstruct, gstruct);
+}
+
 /**
  * fpi_print_add_print:
  * @print: A #FpPrint
@@ -51,6 +184,7 @@ fpi_print_add_print (FpPrint *print, FpPrint *add)
 
   g_assert (add->prints->len == 1);
   g_ptr_array_add (print->prints, g_memdup2 (add->prints->pdata[0], sizeof (struct xyt_struct)));
+  fpi_print_bz3_precompute (print);
 }
 
 /**
@@ -194,11 +328,35 @@ fpi_print_add_from_image (FpPrint *print,
   return TRUE;
 }
 
+static gboolean
+fpi_print_bz3_check (FpPrint *template, FpPrint *print, GError **error)
+{
+  /* XXX: Use a different error type? */
+  if (template->type != FPI_PRINT_NBIS || print->type != FPI_PRINT_NBIS)
+    {
+      g_propagate_error (error,
+                         fpi_device_error_new_msg (FP_DEVICE_ERROR_NOT_SUPPORTED,
+                                                   "It is only possible to match NBIS type print data"));
+      return FALSE;
+    }
+
+  if (print->prints->len != 1)
+    {
+      g_propagate_error (error,
+                         fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
+                                                   "New print contains more than one print!"));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /**
  * fpi_print_bz3_match:
  * @template: A #FpPrint containing one or more prints
  * @print: A newly scanned #FpPrint to test
  * @bz3_threshold: The BZ3 match threshold
+ * @ctx: The bozorth3 match context to use, see bz_context_new()
  * @error: Return location for error
  *
  * Match the newly scanned @print (containing exactly one print) against the
@@ -207,39 +365,30 @@ fpi_print_add_from_image (FpPrint *print,
  * Both @template and @print need to be of type #FPI_PRINT_NBIS for this to
  * work.
  *
+ * The match context holds all the scratch tables of the matcher. It should be
+ * allocated once and reused, and must not be used by two matches at the same
+ * time; matches with separate contexts may run in parallel.
+ *
  * Returns: Whether the prints match, @error will be set if #FPI_MATCH_ERROR is returned
  */
 FpiMatchResult
-fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint bz3_threshold, GError **error)
+fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint bz3_threshold,
+                     struct bz_context *ctx, GError **error)
 {
   struct xyt_struct *pstruct;
   gint probe_len;
   gint i;
 
-  /* XXX: Use a different error type? */
-  if (template->type != FPI_PRINT_NBIS || print->type != FPI_PRINT_NBIS)
-    {
-      *error = fpi_device_error_new_msg (FP_DEVICE_ERROR_NOT_SUPPORTED,
-                                         "It is only possible to match NBIS type print data");
-      return FPI_MATCH_ERROR;
-    }
-
-  if (print->prints->len != 1)
-    {
-      *error = fpi_device_error_new_msg (FP_DEVICE_ERROR_GENERAL,
-                                         "New print contains more than one print!");
-      return FPI_MATCH_ERROR;
-    }
+  if (!fpi_print_bz3_check (template, print, error))
+    return FPI_MATCH_ERROR;
 
   pstruct = g_ptr_array_index (print->prints, 0);
-  probe_len = bozorth_probe_init (pstruct);
+  probe_len = bozorth_probe_init (ctx, pstruct);
 
   for (i = 0; i < template->prints->len; i++)
     {
-      struct xyt_struct *gstruct;
       gint score;
-      gstruct = g_ptr_array_index (template->prints, i);
-      score = bozorth_to_gallery (probe_len, pstruct, gstruct);
+      score = fpi_print_bz3_score (ctx, probe_len, pstruct, template, i);
       fp_dbg ("score %d/%d", score, bz3_threshold);
 
       if (score >= bz3_threshold)
@@ -249,6 +398,236 @@ fpi_print_bz3_match (FpPrint *template, FpPrint *print, gint bz3_threshold, GErr
   return FPI_MATCH_FAIL;
 }
 
+typedef struct _FpiBz3Identify FpiBz3Identify;
+
+typedef struct
+{
+  FpiBz3Identify *identify;
+  guint           index;
+} FpiBz3IdentifyJob;
+
+struct _FpiBz3Identify
+{
+  /* Owned by the jobs, the last one to finish returns and drops it */
+  GTask             *task;
+  GPtrArray         *templates;
+  struct xyt_struct *pstruct;
+  gint               bz3_threshold;
+  guint              serial;
+
+  /* Both only accessed atomically */
+  gint               pending;
+  gint               match;
+
+  FpiBz3IdentifyJob *jobs;
+};
+
+static void
+fpi_print_bz3_identify_free (FpiBz3Identify *identify)
+{
+  g_ptr_array_unref (identify->templates);
+  g_free (identify->jobs);
+  g_free (identify);
+}
+
+static void
+fpi_print_bz3_identify_set_match (FpiBz3Identify *identify, guint index)
+{
+  gint match;
+
+  /* Keep the lowest index, so that the result is the same as when matching
+   * the templates one after another. */
+  do
+    {
+      match = g_atomic_int_get (&identify->match);
+      if (match <= (gint) index)
+        return;
+    }
+  while (!g_atomic_int_compare_and_exchange (&identify->match, match, index));
+}
+
+static void
+fpi_print_bz3_identify_job (gpointer data, gpointer user_data)
+{
+  FpiBz3IdentifyJob *job = data;
+  FpiBz3Identify *identify = job->identify;
+  GCancellable *cancellable = g_task_get_cancellable (identify->task);
+  FpPrint *template = g_ptr_array_index (identify->templates, job->index);
+  FpiBz3Worker *worker = fpi_print_bz3_worker_get ();
+  gint i;
+
+  for (i = 0; i < template->prints->len; i++)
+    {
+      gint score;
+
+      /* Nothing to do if an earlier template matched already */
+      if (g_atomic_int_get (&identify->match) < (gint) job->index ||
+          g_cancellable_is_cancelled (cancellable))
+        break;
+
+      if (worker->probe_serial != identify->serial)
+        {
+          worker->probe_len = bozorth_probe_init (worker->ctx, identify->pstruct);
+          worker->probe_serial = identify->serial;
+        }
+
+      score = fpi_print_bz3_score (worker->ctx, worker->probe_len,
+                                   identify->pstruct, template, i);
+      fp_dbg ("template %u score %d/%d", job->index, score,
+              identify->bz3_threshold);
+
+      if (score >= identify->bz3_threshold)
+        {
+          fpi_print_bz3_identify_set_match (identify, job->index);
+          break;
+        }
+    }
+
+  fpi_print_bz3_worker_put (worker);
+
+  if (g_atomic_int_dec_and_test (&identify->pending))
+    {
+      g_autoptr(GTask) task = g_steal_pointer (&identify->task);
+      gint match = g_atomic_int_get (&identify->match);
+
+      if (match == G_MAXINT)
+        g_task_return_pointer (task, NULL, NULL);
+      else
+        g_task_return_pointer (task,
+                               g_object_ref (g_ptr_array_index (identify->templates, match)),
+                               g_object_unref);
+
+      fpi_print_bz3_workers_release ();
+    }
+}
+
+static GThreadPool *
+fpi_print_bz3_get_pool (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool))
+    {
+      GThreadPool *new_pool;
+
+      /* A shared pool never fails to be created */
+      new_pool = g_thread_pool_new (fpi_print_bz3_identify_job, NULL,
+                                    g_get_num_processors (), FALSE, NULL);
+      g_once_init_leave (&pool, (gsize) new_pool);
+    }
+
+  return (GThreadPool *) pool;
+}
+
+/**
+ * fpi_print_bz3_identify:
+ * @templates: (element-type FpPrint): The #FpPrint gallery to search
+ * @print: (transfer none): A newly scanned #FpPrint to test
+ * @bz3_threshold: The BZ3 match threshold
+ * @cancellable: a #GCancellable, or %NULL
+ * @callback: the function to call on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Match the newly scanned @print against every template in @templates, like
+ * fpi_print_bz3_match() does for a single template. The templates are
+ * matched in parallel on a thread pool sized to the number of processors,
+ * so large galleries do not block the main context.
+ *
+ * Templates after the first match are skipped, and the result is the first
+ * matching template of @templates. Cancelling @cancellable stops the
+ * matching as well. @callback is invoked in the thread-default main context
+ * of the caller, with @print as source object. The task keeps a reference
+ * to @print and @templates until it completes, so the caller may drop its
+ * own references right away.
+ */
+void
+fpi_print_bz3_identify (GPtrArray          *templates,
+                        FpPrint            *print,
+                        gint                bz3_threshold,
+                        GCancellable       *cancellable,
+                        GAsyncReadyCallback callback,
+                        gpointer            user_data)
+{
+  static gint serial = 0;
+  g_autoptr(GTask) task = NULL;
+  FpiBz3Identify *identify;
+  GError *error = NULL;
+  guint i;
+
+  g_return_if_fail (FP_IS_PRINT (print));
+  g_return_if_fail (templates != NULL);
+
+  task = g_task_new (print, cancellable, callback, user_data);
+  g_task_set_source_tag (task, fpi_print_bz3_identify);
+  g_task_set_check_cancellable (task, TRUE);
+
+  for (i = 0; i < templates->len; i++)
+    {
+      if (!fpi_print_bz3_check (g_ptr_array_index (templates, i), print, &error))
+        {
+          g_task_return_error (task, error);
+          return;
+        }
+    }
+
+  if (templates->len == 0)
+    {
+      g_task_return_pointer (task, NULL, NULL);
+      return;
+    }
+
+  identify = g_new0 (FpiBz3Identify, 1);
+  identify->templates = g_ptr_array_ref (templates);
+  identify->pstruct = g_ptr_array_index (print->prints, 0);
+  identify->bz3_threshold = bz3_threshold;
+  /* Zero is what fresh workers have loaded, so skip it */
+  do
+    identify->serial = g_atomic_int_add (&serial, 1) + 1;
+  while (identify->serial == 0);
+  identify->pending = templates->len;
+  identify->match = G_MAXINT;
+  identify->jobs = g_new0 (FpiBz3IdentifyJob, templates->len);
+  g_task_set_task_data (task, identify,
+                        (GDestroyNotify) fpi_print_bz3_identify_free);
+
+  identify->task = g_steal_pointer (&task);
+
+  /* Released by the last job */
+  fpi_print_bz3_workers_hold ();
+
+  /* Jobs are processed in order, so the first templates are tried first.
+   * Note that identify may be gone once the last job was pushed. */
+  for (i = 0; i < templates->len; i++)
+    {
+      identify->jobs[i].identify = identify;
+      identify->jobs[i].index = i;
+      g_thread_pool_push (fpi_print_bz3_get_pool (), &identify->jobs[i], NULL);
+    }
+}
+
+/**
+ * fpi_print_bz3_identify_finish:
+ * @print: The #FpPrint passed to fpi_print_bz3_identify()
+ * @result: A #GAsyncResult
+ * @error: Return location for errors, or %NULL to ignore
+ *
+ * Finish an identification started with fpi_print_bz3_identify().
+ *
+ * Returns: (transfer full) (nullable): The matching template, or %NULL if no
+ *   template matched or an error occurred
+ */
+FpPrint *
+fpi_print_bz3_identify_finish (FpPrint      *print,
+                               GAsyncResult *result,
+                               GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, print), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) ==
+                        fpi_print_bz3_identify, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
 /**
  * fpi_print_generate_user_id:
  * @print: #FpPrint to generate the ID for
@@ -6,6 +6,8 @@
 
 G_BEGIN_DECLS
 
+struct bz_context;
+
 /**
  * FpiPrintType:
  * @FPI_PRINT_UNDEFINED: Undefined type, this happens prior to enrollment
@@ -38,14 +40,27 @@ void     fpi_print_set_type (FpPrint     *print,
 void     fpi_print_set_device_stored (FpPrint *print,
                                       gboolean device_stored);
 
+void     fpi_print_bz3_precompute (FpPrint *print);
+
 gboolean fpi_print_add_from_image (FpPrint *print,
                                    FpImage *image,
                                    GError **error);
 
-FpiMatchResult fpi_print_bz3_match (FpPrint *temp,
-                                    FpPrint *print,
-                                    gint     bz3_threshold,
-                                    GError **error);
+FpiMatchResult fpi_print_bz3_match (FpPrint           *temp,
+                                    FpPrint           *print,
+                                    gint               bz3_threshold,
+                                    struct bz_context *ctx,
+                                    GError           **error);
+
+void           fpi_print_bz3_identify (GPtrArray          *templates,
+                                       FpPrint            *print,
+                                       gint                bz3_threshold,
+                                       GCancellable       *cancellable,
+                                       GAsyncReadyCallback callback,
+                                       gpointer            user_data);
+FpPrint *      fpi_print_bz3_identify_finish (FpPrint      *print,
+                                              GAsyncResult *result,
+                                              GError      **error);
 
 /* Helpers to encode metadata into user ID strings. */
 gchar *  fpi_print_generate_user_id (FpPrint *print);
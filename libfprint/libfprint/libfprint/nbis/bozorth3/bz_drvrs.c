@@ -64,6 +64,11 @@ of the software.
 #cat:                        same probe fingerprint is matches repeatedly
 #cat:                        to multiple gallery fingerprints as in
 #cat:                        identification mode
+#cat: bozorth_gallery_new -  precomputes the pairwise minutia comparison
+#cat:                        table of a gallery fingerprint once, so
+#cat:                        that it can be matched repeatedly
+#cat: bozorth_to_precomputed_gallery - like bozorth_to_gallery, but
+#cat:                        matches against a precomputed gallery
 #cat: bozorth_main -         supports the matching scenario where a
 #cat:                        single probe fingerprint is to be matched
 #cat:                        to a single gallery fingerprint as in
@@ -74,11 +79,15 @@ of the software.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <glib.h>
 #include <bozorth.h>
 
+/* Rows of precomputed galleries start on a cache line */
+#define BZ_GALLERY_ALIGNMENT 64
+
 /**************************************************************************/
 
-int bozorth_probe_init( struct xyt_struct * pstruct )
+int bozorth_probe_init( struct bz_context * ctx, struct xyt_struct * pstruct )
 {
 int sim;	/* number of pointwise comparisons for Subject's record*/
 int msim;	/* Pruned length of Subject's comparison pointer list */
@@ -93,14 +102,14 @@ bz_comp(
 	pstruct->ycol,
 	pstruct->thetacol,
 	&sim,
-	scols,
-	scolpt );
+	ctx->scols,
+	ctx->scolpt );
 
 msim = sim;	/* Init search to end of Subject's pointwise comparison table (last edge in Web) */
 
 
 
-bz_find( &msim, scolpt );
+bz_find( &msim, ctx->scolpt );
 
 
 
@@ -116,7 +125,7 @@ return msim;
 
 /**************************************************************************/
 
-int bozorth_gallery_init( struct xyt_struct * gstruct )
+int bozorth_gallery_init( struct bz_context * ctx, struct xyt_struct * gstruct )
 {
 int fim;	/* number of pointwise comparisons for On-File record*/
 int mfim;	/* Pruned length of On-File Record's pointer list */
@@ -130,14 +139,14 @@ bz_comp(
 	gstruct->ycol,
 	gstruct->thetacol,
 	&fim,
-	fcols,
-	fcolpt );
+	ctx->fcols,
+	ctx->fcolpt );
 
 mfim = fim;	/* Init search to end of On-File Record's pointwise comparison table (last edge in Web) */
 
 
 
-bz_find( &mfim, fcolpt );
+bz_find( &mfim, ctx->fcolpt );
 
 
 
@@ -154,6 +163,7 @@ return mfim;
 /**************************************************************************/
 
 int bozorth_to_gallery(
+		struct bz_context * ctx,
 		int probe_len,
 		struct xyt_struct * pstruct,
 		struct xyt_struct * gstruct
@@ -162,9 +172,62 @@ int bozorth_to_gallery(
 int np;
 int gallery_len;
 
-gallery_len = bozorth_gallery_init( gstruct );
-np = bz_match( probe_len, gallery_len );
-return bz_match_score( np, pstruct, gstruct );
+gallery_len = bozorth_gallery_init( ctx, gstruct );
+np = bz_match( ctx, probe_len, gallery_len );
+return bz_match_score( ctx, np, pstruct, gstruct );
+}
+
+/**************************************************************************/
+
+struct bz_gallery * bozorth_gallery_new(
+		struct bz_context * ctx,
+		struct xyt_struct * gstruct
+		)
+{
+struct bz_gallery * gallery;
+int i;
+
+gallery = g_new0( struct bz_gallery, 1 );
+gallery->len = bozorth_gallery_init( ctx, gstruct );
+
+/* Only the rows in reach of the pruned pointer list are used by bz_match(), */
+/* keep them compact and in sorted order. */
+if ( posix_memalign( (void **) &gallery->cols, BZ_GALLERY_ALIGNMENT,
+		MAX( gallery->len, 1 ) * sizeof( gallery->cols[0] ) ) != 0 )
+	g_error( "Failed to allocate precomputed bozorth3 gallery" );
+
+for ( i = 0; i < gallery->len; i++ )
+	memcpy( gallery->cols[i], ctx->fcolpt[i], sizeof( gallery->cols[0] ) );
+
+return gallery;
+}
+
+/**************************************************************************/
+
+void bozorth_gallery_free( struct bz_gallery * gallery )
+{
+free( gallery->cols );
+g_free( gallery );
+}
+
+/**************************************************************************/
+
+int bozorth_to_precomputed_gallery(
+		struct bz_context * ctx,
+		int probe_len,
+		struct xyt_struct * pstruct,
+		struct xyt_struct * gstruct,
+		struct bz_gallery * gallery
+		)
+{
+int np;
+int i;
+
+for ( i = 0; i < gallery->len; i++ )
+	ctx->fcolpt[i] = gallery->cols[i];
+
+np = bz_match( ctx, probe_len, gallery->len );
+return bz_match_score( ctx, np, pstruct, gstruct );
 }
 
 /**************************************************************************/
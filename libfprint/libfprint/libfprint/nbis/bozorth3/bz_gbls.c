@@ -50,78 +50,31 @@ of the software.
                       Stan Janet (NIST)
       DATE:           09/21/2004
 
-      Contains global variables responsible for supporting the
+      Contains the allocation of the match context, which holds the
+      arrays (formerly global variables) responsible for supporting the
       Bozorth3 fingerprint matching "core" algorithm.
 
 ***********************************************************************
 ***********************************************************************/
 
+#include <glib.h>
 #include <bozorth.h>
 
 /**************************************************************************/
-/* General supporting global variables */
+/* The match context is large (tens of megabytes, most of which is only  */
+/* touched for big minutiae sets), so it should be allocated once and    */
+/* reused for every match.  A context must only be used by one thread at */
+/* a time, but any number of contexts may be used concurrently.          */
 /**************************************************************************/
 
-int colp[ COLP_SIZE_1 ][ COLP_SIZE_2 ];		/* Output from match(), this is a sorted table of compatible edge pairs containing: */
-						/*	DeltaThetaKJs, Subject's K, J, then On-File's {K,J} or {J,K} depending */
-						/* Sorted first on Subject's point index K, */
-						/*	then On-File's K or J point index (depending), */
-						/*	lastly on Subject's J point index */
-int scols[ SCOLS_SIZE_1 ][ COLS_SIZE_2 ];	/* Subject's pointwise comparison table containing: */
-						/*	Distance,min(BetaK,BetaJ),max(BetaK,BbetaJ), K,J,ThetaKJ */
-int fcols[ FCOLS_SIZE_1 ][ COLS_SIZE_2 ];	/* On-File Record's pointwise comparison table with: */
-						/*	Distance,min(BetaK,BetaJ),max(BetaK,BbetaJ),K,J, ThetaKJ */
-int * scolpt[ SCOLPT_SIZE ];			/* Subject's list of pointers to pointwise comparison rows, sorted on: */
-						/*	Distance, min(BetaK,BetaJ), then max(BetaK,BetaJ) */
-int * fcolpt[ FCOLPT_SIZE ];			/* On-File Record's list of pointers to pointwise comparison rows sorted on: */
-						/*	Distance, min(BetaK,BetaJ), then max(BetaK,BetaJ) */
-int sc[ SC_SIZE ];				/* Flags all compatible edges in the Subject's Web */
-
-int yl[ YL_SIZE_1 ][ YL_SIZE_2 ];
-
+struct bz_context * bz_context_new( void )
+{
+return g_new0( struct bz_context, 1 );
+}
 
 /**************************************************************************/
-/* Globals used significantly by sift() */
-/**************************************************************************/
-#ifdef TARGET_OS
-   int rq[ RQ_SIZE ];
-   int tq[ TQ_SIZE ];
-   int zz[ ZZ_SIZE ];
-
-   int rx[ RX_SIZE ];
-   int mm[ MM_SIZE ];
-   int nn[ NN_SIZE ];
-
-   int qq[ QQ_SIZE ];
-
-   int rk[ RK_SIZE ];
-
-   int cp[ CP_SIZE ];
-   int rp[ RP_SIZE ];
-
-   int rf[RF_SIZE_1][RF_SIZE_2];
-   int cf[CF_SIZE_1][CF_SIZE_2];
-
-   int bz_y[20000];
-#else
-   int rq[ RQ_SIZE ] = {};
-   int tq[ TQ_SIZE ] = {};
-   int zz[ ZZ_SIZE ] = {};
-
-   int rx[ RX_SIZE ] = {};
-   int mm[ MM_SIZE ] = {};
-   int nn[ NN_SIZE ] = {};
-
-   int qq[ QQ_SIZE ] = {};
-
-   int rk[ RK_SIZE ] = {};
-
-   int cp[ CP_SIZE ] = {};
-   int rp[ RP_SIZE ] = {};
-
-   int rf[RF_SIZE_1][RF_SIZE_2] = {};
-   int cf[CF_SIZE_1][CF_SIZE_2] = {};
-
-   int bz_y[20000] = {};
-#endif
 
+void bz_context_free( struct bz_context * ctx )
+{
+g_free( ctx );
+}
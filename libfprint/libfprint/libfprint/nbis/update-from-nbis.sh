@@ -201,3 +201,10 @@ patch -p0 < remove-perimeter-pts.patch
 
 # Fix build on musl by dropping unnecessary redeclaration of stderr
 patch -p0 < fix-musl-build.patch
+
+# Keep the bozorth3 state in a match context instead of globals, so that
+# matching is reentrant
+patch -p0 < bozorth-context.patch
+
+# Allow precomputing the comparison table of gallery prints
+patch -p0 < bozorth-precomputed-gallery.patch
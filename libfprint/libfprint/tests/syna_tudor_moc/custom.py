@@ -0,0 +1,138 @@
+#!/usr/bin/python3
+
+import traceback
+import sys
+import os
+import json
+import gi
+
+gi.require_version('FPrint', '2.0')
+from gi.repository import FPrint, GLib
+
+# Exit with error on any exception, included those happening in async callbacks
+sys.excepthook = lambda *args: (traceback.print_exception(*args), sys.exit(1))
+
+# The USB round trips of every action are stored next to the capture when it is
+# recorded and have to match when it is replayed, so that an action which talks
+# to the sensor more often (e.g. an extra EVENT_READ) fails even if umockdev
+# would still be able to replay it.
+round_trips_path = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                'round-trips.json')
+replaying = 'UMOCKDEV_DIR' in os.environ
+if replaying:
+    with open(round_trips_path) as f:
+        expected_round_trips = json.load(f)
+round_trips = {}
+
+def check_round_trips(action):
+    count = d.get_property('usb-round-trips')
+    print(f'{action}: {count} USB round trips')
+    assert action not in round_trips
+    round_trips[action] = count
+    if replaying:
+        assert count == expected_round_trips[action], \
+            f'{action}: expected {expected_round_trips[action]} USB round trips, got {count}'
+
+ctx = GLib.main_context_default()
+
+c = FPrint.Context()
+c.enumerate()
+devices = c.get_devices()
+
+d = devices[0]
+del devices
+
+assert d.get_driver() == "syna_tudor_moc"
+assert not d.has_feature(FPrint.DeviceFeature.CAPTURE)
+assert d.has_feature(FPrint.DeviceFeature.IDENTIFY)
+assert d.has_feature(FPrint.DeviceFeature.VERIFY)
+assert d.has_feature(FPrint.DeviceFeature.STORAGE)
+assert d.has_feature(FPrint.DeviceFeature.STORAGE_LIST)
+assert d.has_feature(FPrint.DeviceFeature.STORAGE_DELETE)
+assert d.has_feature(FPrint.DeviceFeature.STORAGE_CLEAR)
+
+d.open_sync()
+check_round_trips('open')
+
+def enroll_progress(*args):
+    print('enroll progress: ' + str(args))
+
+def identify_done(dev, res):
+    global identified
+    identified = True
+    identify_match, identify_print = dev.identify_finish(res)
+    print('indentification_done: ', identify_match, identify_print)
+    assert identify_match.equal(identify_print)
+
+print("clear device storage")
+d.clear_storage_sync()
+check_round_trips('clear-storage')
+print("clear done")
+
+print("listing - device should be empty")
+stored = d.list_prints_sync()
+check_round_trips('list-empty')
+assert len(stored) == 0
+del stored
+
+print("enrolling")
+template = FPrint.Print.new(d)
+template.set_finger(FPrint.Finger.LEFT_INDEX)
+p1 = d.enroll_sync(template, None, enroll_progress, None)
+check_round_trips('enroll')
+print("enroll done")
+del template
+
+print("listing - device should have 1 print")
+stored = d.list_prints_sync()
+check_round_trips('list')
+assert len(stored) == 1
+assert stored[0].equal(p1)
+
+print("verifying")
+verify_res, verify_print = d.verify_sync(p1)
+check_round_trips('verify')
+print("verify done")
+assert verify_res == True
+
+identified = False
+deserialized_prints = []
+for p in stored:
+    deserialized_prints.append(FPrint.Print.deserialize(p.serialize()))
+    assert deserialized_prints[-1].equal(p)
+del stored
+
+print('async identifying')
+d.identify(deserialized_prints, callback=identify_done)
+del deserialized_prints
+
+while not identified:
+    ctx.iteration(True)
+check_round_trips('identify')
+
+print("deleting print")
+d.delete_print_sync(p1)
+check_round_trips('delete')
+print("delete done")
+del p1
+
+print("listing - device should be empty")
+stored = d.list_prints_sync()
+check_round_trips('list-deleted')
+assert len(stored) == 0
+del stored
+
+d.close_sync()
+
+if replaying:
+    # an action which was recorded but not replayed, or the other way round,
+    # fails as well
+    assert round_trips == expected_round_trips, \
+        f'recorded round trips {expected_round_trips}, got {round_trips}'
+else:
+    with open(round_trips_path, 'w') as f:
+        json.dump(round_trips, f, indent=4, sort_keys=True)
+        f.write('\n')
+
+del d
+del c
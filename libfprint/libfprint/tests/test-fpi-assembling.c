@@ -125,12 +125,184 @@ test_frame_assembling (void)
   g_assert (1);
 }
 
+static unsigned char
+plain_get_pixel (struct fpi_frame_asmbl_ctx *ctx,
+                 struct fpi_frame           *frame,
+                 unsigned int                x,
+                 unsigned int                y)
+{
+  return frame->data[x + y * ctx->frame_width];
+}
+
+/* Cuts the green channel of a capture into stripes with one byte per pixel,
+ * moving the finger by a varying amount in both directions. */
+static GSList *
+plain_stripes_new (const char                 *driver,
+                   struct fpi_frame_asmbl_ctx *ctx)
+{
+  g_autofree char *path = NULL;
+  cairo_surface_t *img = NULL;
+  int width, height, stride;
+  guchar *data;
+  GSList *frames = NULL;
+  gint xborder = 4;
+  guint i = 0;
+
+  path = g_test_build_filename (G_TEST_DIST, driver, "capture.png", NULL);
+
+  img = cairo_image_surface_create_from_png (path);
+  g_assert_cmpint (cairo_surface_status (img), ==, CAIRO_STATUS_SUCCESS);
+  data = cairo_image_surface_get_data (img);
+  width = cairo_image_surface_get_width (img);
+  height = cairo_image_surface_get_height (img);
+  stride = cairo_image_surface_get_stride (img);
+  g_assert_cmpint (cairo_image_surface_get_format (img), ==, CAIRO_FORMAT_RGB24);
+
+  ctx->get_pixel = plain_get_pixel;
+  ctx->frame_width = width - 2 * xborder;
+  ctx->frame_height = 20;
+  ctx->image_width = width;
+
+  for (int y = 0; y + ctx->frame_height < height; y += 3 + i % 6, i++)
+    {
+      struct fpi_frame *frame;
+      int x = xborder + (int) (i % 5) - 2;
+
+      frame = g_malloc (sizeof (struct fpi_frame) +
+                        ctx->frame_width * ctx->frame_height);
+      for (int fy = 0; fy < ctx->frame_height; fy++)
+        for (int fx = 0; fx < ctx->frame_width; fx++)
+          frame->data[fx + fy * ctx->frame_width] =
+            data[(x + fx) * 4 + (y + fy) * stride + 1];
+
+      frames = g_slist_append (frames, frame);
+    }
+
+  cairo_surface_destroy (img);
+
+  return frames;
+}
+
+static const char *plain_captures[] = { "vfs5011", "elan", "egis0570" };
+
+static void
+test_frame_assembling_plain_rows (void)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (plain_captures); i++)
+    {
+      struct fpi_frame_asmbl_ctx ctx = { 0, };
+      g_autoptr(GArray) deltas = g_array_new (FALSE, FALSE, sizeof (int));
+      GSList *frames = plain_stripes_new (plain_captures[i], &ctx);
+      guint n = 0;
+
+      fpi_do_movement_estimation (&ctx, frames);
+      for (GSList *l = frames; l != NULL; l = l->next)
+        {
+          struct fpi_frame *frame = l->data;
+
+          g_array_append_val (deltas, frame->delta_x);
+          g_array_append_val (deltas, frame->delta_y);
+        }
+
+      /* The fast path must find exactly the same movement */
+      ctx.plain_rows = TRUE;
+      fpi_do_movement_estimation (&ctx, frames);
+      for (GSList *l = frames; l != NULL; l = l->next, n += 2)
+        {
+          struct fpi_frame *frame = l->data;
+
+          g_assert_cmpint (frame->delta_x, ==, g_array_index (deltas, int, n));
+          g_assert_cmpint (frame->delta_y, ==, g_array_index (deltas, int, n + 1));
+        }
+
+      g_slist_free_full (frames, g_free);
+    }
+}
+
+static void
+test_frame_assembler (void)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (plain_captures) * 4; i++)
+    {
+      struct fpi_frame_asmbl_ctx ctx = { 0, };
+      g_autoptr(FpiFrameAssembler) assembler = NULL;
+      g_autoptr(FpImage) streamed = NULL;
+      g_autoptr(FpImage) img = NULL;
+      GSList *frames = plain_stripes_new (plain_captures[i / 4], &ctx);
+      gsize frame_size = sizeof (struct fpi_frame) +
+                         ctx.frame_width * ctx.frame_height;
+
+      ctx.plain_rows = i % 2;
+      /* Swipe in the other direction */
+      if (i % 4 >= 2)
+        frames = g_slist_reverse (frames);
+
+      assembler = fpi_frame_assembler_new (&ctx, 4);
+      for (GSList *l = frames; l != NULL; l = l->next)
+        fpi_frame_assembler_add (assembler, g_memdup2 (l->data, frame_size));
+      g_assert_cmpuint (fpi_frame_assembler_get_n_frames (assembler), ==,
+                        g_slist_length (frames));
+      streamed = fpi_frame_assembler_finish (assembler);
+
+      fpi_do_movement_estimation (&ctx, frames);
+      img = fpi_assemble_frames (&ctx, frames);
+
+      g_assert_cmpuint (streamed->width, ==, img->width);
+      g_assert_cmpuint (streamed->height, ==, img->height);
+      g_assert_cmpuint (streamed->flags, ==, img->flags);
+      g_assert_cmpmem (streamed->data, streamed->width * streamed->height,
+                       img->data, img->width * img->height);
+
+      g_slist_free_full (frames, g_free);
+    }
+}
+
+static void
+test_frame_assembling_plain_rows_perf (void)
+{
+  const guint runs = 20;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Not running performance tests");
+      return;
+    }
+
+  for (guint i = 0; i < G_N_ELEMENTS (plain_captures); i++)
+    {
+      struct fpi_frame_asmbl_ctx ctx = { 0, };
+      GSList *frames = plain_stripes_new (plain_captures[i], &ctx);
+      gdouble elapsed[2];
+
+      for (guint plain_rows = 0; plain_rows < 2; plain_rows++)
+        {
+          ctx.plain_rows = plain_rows;
+
+          g_test_timer_start ();
+          for (guint run = 0; run < runs; run++)
+            fpi_do_movement_estimation (&ctx, frames);
+          elapsed[plain_rows] = g_test_timer_elapsed () / runs;
+        }
+
+      g_test_minimized_result (elapsed[1],
+                               "%s: %u stripes in %.3fms, %.3fms with get_pixel (%.1fx)",
+                               plain_captures[i], g_slist_length (frames),
+                               elapsed[1] * 1000, elapsed[0] * 1000,
+                               elapsed[0] / elapsed[1]);
+
+      g_slist_free_full (frames, g_free);
+    }
+}
+
 int
 main (int argc, char *argv[])
 {
   g_test_init (&argc, &argv, NULL);
 
   g_test_add_func ("/assembling/frames", test_frame_assembling);
+  g_test_add_func ("/assembling/frames/plain-rows", test_frame_assembling_plain_rows);
+  g_test_add_func ("/assembling/frames/assembler", test_frame_assembler);
+  g_test_add_func ("/assembling/frames/plain-rows/perf", test_frame_assembling_plain_rows_perf);
 
   return g_test_run ();
 }
@@ -0,0 +1,380 @@
+/*
+ * Unit tests for the NBIS matching of libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+
+#include "fpi-compat.h"
+#include "fpi-device.h"
+#include "fp-print-private.h"
+
+#define TEST_BZ3_THRESHOLD 40
+/* Prints per template, like an enrollment of an image device */
+#define TEST_PRINTS_PER_TEMPLATE 5
+
+static struct xyt_struct *
+test_xyt_new (GRand *rand)
+{
+  struct xyt_struct *xyt = g_new0 (struct xyt_struct, 1);
+  gint i;
+
+  xyt->nrows = g_rand_int_range (rand, 30, 60);
+  for (i = 0; i < xyt->nrows; i++)
+    {
+      xyt->xcol[i] = g_rand_int_range (rand, 0, 300);
+      xyt->ycol[i] = g_rand_int_range (rand, 0, 400);
+      xyt->thetacol[i] = g_rand_int_range (rand, -179, 181);
+    }
+
+  return xyt;
+}
+
+static FpPrint *
+test_print_new (FpiPrintType type)
+{
+  FpPrint *print = g_object_new (FP_TYPE_PRINT, NULL);
+
+  g_object_ref_sink (print);
+  fpi_print_set_type (print, type);
+
+  return print;
+}
+
+/* Creates a gallery of random templates, the probe is added to the templates
+ * listed in matching (terminated by -1). The templates are precomputed, like
+ * deserialized or enrolled ones. */
+static GPtrArray *
+test_gallery_new (GRand             *rand,
+                  guint              n_templates,
+                  struct xyt_struct *probe,
+                  const gint        *matching)
+{
+  GPtrArray *templates = g_ptr_array_new_with_free_func (g_object_unref);
+  guint i, j;
+
+  for (i = 0; i < n_templates; i++)
+    {
+      FpPrint *template = test_print_new (FPI_PRINT_NBIS);
+
+      for (j = 0; j < TEST_PRINTS_PER_TEMPLATE; j++)
+        g_ptr_array_add (template->prints, test_xyt_new (rand));
+
+      g_ptr_array_add (templates, template);
+    }
+
+  for (i = 0; matching && matching[i] >= 0; i++)
+    {
+      FpPrint *template = g_ptr_array_index (templates, matching[i]);
+
+      /* Replace the last print, so that all others have to be tried first */
+      g_ptr_array_remove_index (template->prints, TEST_PRINTS_PER_TEMPLATE - 1);
+      g_ptr_array_add (template->prints,
+                       g_memdup2 (probe, sizeof (struct xyt_struct)));
+    }
+
+  for (i = 0; i < n_templates; i++)
+    fpi_print_bz3_precompute (g_ptr_array_index (templates, i));
+
+  return templates;
+}
+
+static void
+test_gallery_drop_precomputed (GPtrArray *templates)
+{
+  guint i;
+
+  for (i = 0; i < templates->len; i++)
+    {
+      FpPrint *template = g_ptr_array_index (templates, i);
+
+      g_clear_pointer (&template->bz3_galleries, g_ptr_array_unref);
+    }
+}
+
+static FpPrint *
+test_probe_new (GRand *rand)
+{
+  FpPrint *probe = test_print_new (FPI_PRINT_NBIS);
+
+  g_ptr_array_add (probe->prints, test_xyt_new (rand));
+
+  return probe;
+}
+
+static void
+test_identify_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GTask **result = user_data;
+
+  *result = g_object_ref (G_TASK (res));
+}
+
+static FpPrint *
+test_identify_sync (GPtrArray    *templates,
+                    FpPrint      *probe,
+                    GCancellable *cancellable,
+                    GError      **error)
+{
+  g_autoptr(GTask) result = NULL;
+
+  fpi_print_bz3_identify (templates, probe, TEST_BZ3_THRESHOLD, cancellable,
+                          test_identify_cb, &result);
+
+  while (!result)
+    g_main_context_iteration (NULL, TRUE);
+
+  return fpi_print_bz3_identify_finish (probe, G_ASYNC_RESULT (result), error);
+}
+
+static FpPrint *
+test_identify_serial (GPtrArray *templates, FpPrint *probe)
+{
+  struct bz_context *ctx = bz_context_new ();
+  FpPrint *result = NULL;
+  guint i;
+
+  for (i = 0; i < templates->len; i++)
+    {
+      FpPrint *template = g_ptr_array_index (templates, i);
+      g_autoptr(GError) error = NULL;
+
+      if (fpi_print_bz3_match (template, probe, TEST_BZ3_THRESHOLD, ctx,
+                               &error) == FPI_MATCH_SUCCESS)
+        {
+          result = template;
+          break;
+        }
+      g_assert_no_error (error);
+    }
+
+  bz_context_free (ctx);
+
+  return result;
+}
+
+static void
+test_identify_match (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (1);
+  g_autoptr(FpPrint) probe = test_probe_new (rand);
+  g_autoptr(GPtrArray) templates = NULL;
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GError) error = NULL;
+  const gint matching[] = { 7, 12, -1 };
+
+  templates = test_gallery_new (rand, 20, g_ptr_array_index (probe->prints, 0),
+                                matching);
+
+  result = test_identify_sync (templates, probe, NULL, &error);
+  g_assert_no_error (error);
+
+  /* The first matching template is reported, as with serial matching */
+  g_assert_true (result == g_ptr_array_index (templates, 7));
+  g_assert_true (result == test_identify_serial (templates, probe));
+}
+
+static void
+test_identify_probe_unref (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (7);
+  FpPrint *probe = test_probe_new (rand);
+  g_autoptr(GPtrArray) templates = NULL;
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GError) error = NULL;
+  const gint matching[] = { 3, -1 };
+
+  templates = test_gallery_new (rand, 10, g_ptr_array_index (probe->prints, 0),
+                                matching);
+
+  /* The probe is not transferred, the task keeps its own reference */
+  fpi_print_bz3_identify (templates, probe, TEST_BZ3_THRESHOLD, NULL,
+                          test_identify_cb, &task);
+  g_object_unref (probe);
+
+  while (!task)
+    g_main_context_iteration (NULL, TRUE);
+
+  probe = FP_PRINT (g_task_get_source_object (task));
+  result = fpi_print_bz3_identify_finish (probe, G_ASYNC_RESULT (task), &error);
+  g_assert_no_error (error);
+  g_assert_true (result == g_ptr_array_index (templates, 3));
+}
+
+static void
+test_match_precomputed (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (6);
+  g_autoptr(FpPrint) probe = test_probe_new (rand);
+  g_autoptr(FpPrint) other = test_probe_new (rand);
+  g_autoptr(FpPrint) template = test_print_new (FPI_PRINT_NBIS);
+  struct bz_context *ctx = bz_context_new ();
+  g_autoptr(GError) error = NULL;
+
+  /* Enrolling precomputes the added prints */
+  fpi_print_add_print (template, other);
+  fpi_print_add_print (template, probe);
+  g_assert_nonnull (template->bz3_galleries);
+  g_assert_cmpuint (template->bz3_galleries->len, ==, template->prints->len);
+
+  g_assert_cmpint (fpi_print_bz3_match (template, probe, TEST_BZ3_THRESHOLD,
+                                        ctx, &error), ==, FPI_MATCH_SUCCESS);
+  g_assert_no_error (error);
+
+  /* Prints without a precomputed form are still matched */
+  g_clear_pointer (&template->bz3_galleries, g_ptr_array_unref);
+  g_assert_cmpint (fpi_print_bz3_match (template, probe, TEST_BZ3_THRESHOLD,
+                                        ctx, &error), ==, FPI_MATCH_SUCCESS);
+  g_assert_no_error (error);
+
+  bz_context_free (ctx);
+}
+
+static void
+test_identify_no_match (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (2);
+  g_autoptr(FpPrint) probe = test_probe_new (rand);
+  g_autoptr(GPtrArray) templates = NULL;
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GError) error = NULL;
+
+  templates = test_gallery_new (rand, 20, NULL, NULL);
+
+  result = test_identify_sync (templates, probe, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_null (result);
+  g_assert_null (test_identify_serial (templates, probe));
+}
+
+static void
+test_identify_empty (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (3);
+  g_autoptr(FpPrint) probe = test_probe_new (rand);
+  g_autoptr(GPtrArray) templates = g_ptr_array_new ();
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GError) error = NULL;
+
+  result = test_identify_sync (templates, probe, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_null (result);
+}
+
+static void
+test_identify_cancelled (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (4);
+  g_autoptr(FpPrint) probe = test_probe_new (rand);
+  g_autoptr(GPtrArray) templates = NULL;
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GError) error = NULL;
+  const gint matching[] = { 19, -1 };
+
+  templates = test_gallery_new (rand, 20, g_ptr_array_index (probe->prints, 0),
+                                matching);
+
+  g_cancellable_cancel (cancellable);
+  result = test_identify_sync (templates, probe, cancellable, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_null (result);
+}
+
+static void
+test_identify_not_nbis (void)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (5);
+  g_autoptr(FpPrint) probe = test_probe_new (rand);
+  g_autoptr(GPtrArray) templates = NULL;
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GError) error = NULL;
+
+  templates = test_gallery_new (rand, 3, NULL, NULL);
+  g_ptr_array_add (templates, test_print_new (FPI_PRINT_RAW));
+
+  result = test_identify_sync (templates, probe, NULL, &error);
+  g_assert_error (error, FP_DEVICE_ERROR, FP_DEVICE_ERROR_NOT_SUPPORTED);
+  g_assert_null (result);
+}
+
+static void
+test_identify_perf (gconstpointer user_data)
+{
+  guint n_prints = GPOINTER_TO_UINT (user_data);
+  g_autoptr(GRand) rand = g_rand_new_with_seed (n_prints);
+  g_autoptr(FpPrint) probe = test_probe_new (rand);
+  g_autoptr(GPtrArray) templates = NULL;
+  g_autoptr(FpPrint) result = NULL;
+  g_autoptr(GError) error = NULL;
+  gdouble serial, parallel, raw;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Not running performance tests");
+      return;
+    }
+
+  /* Nothing matches, so the whole gallery is searched */
+  templates = test_gallery_new (rand,
+                                MAX (n_prints / TEST_PRINTS_PER_TEMPLATE, 1),
+                                NULL, NULL);
+
+  g_test_timer_start ();
+  g_assert_null (test_identify_serial (templates, probe));
+  serial = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  result = test_identify_sync (templates, probe, NULL, &error);
+  parallel = g_test_timer_elapsed ();
+  g_assert_no_error (error);
+  g_assert_null (result);
+
+  test_gallery_drop_precomputed (templates);
+  g_test_timer_start ();
+  g_assert_null (test_identify_serial (templates, probe));
+  raw = g_test_timer_elapsed ();
+
+  g_test_minimized_result (parallel,
+                           "Identify against %u prints: %.3fs serial, %.3fs in %u threads (%.1fx)",
+                           n_prints, serial, parallel, g_get_num_processors (),
+                           serial / parallel);
+  g_test_message ("Precomputed templates: %.3fs serial, %.3fs without (%.1fx)",
+                  serial, raw, raw / serial);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/print/bz3/match/precomputed", test_match_precomputed);
+  g_test_add_func ("/print/bz3/identify/match", test_identify_match);
+  g_test_add_func ("/print/bz3/identify/no_match", test_identify_no_match);
+  g_test_add_func ("/print/bz3/identify/empty", test_identify_empty);
+  g_test_add_func ("/print/bz3/identify/cancelled", test_identify_cancelled);
+  g_test_add_func ("/print/bz3/identify/not_nbis", test_identify_not_nbis);
+  g_test_add_func ("/print/bz3/identify/probe_unref", test_identify_probe_unref);
+  g_test_add_data_func ("/print/bz3/identify/perf/10",
+                        GUINT_TO_POINTER (10), test_identify_perf);
+  g_test_add_data_func ("/print/bz3/identify/perf/100",
+                        GUINT_TO_POINTER (100), test_identify_perf);
+  g_test_add_data_func ("/print/bz3/identify/perf/1000",
+                        GUINT_TO_POINTER (1000), test_identify_perf);
+
+  return g_test_run ();
+}
@@ -0,0 +1,456 @@
+/*
+ * Unit tests and benchmark of the shared Synaptics TLS transport
+ * Copyright (C) 2024 Vojtěch Pluskal
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "fpi-byte-utils.h"
+#include "drivers/synatls.h"
+
+#define TLS_VERSION_1_2 0x0303
+#define RECORD_TYPE_HANDSHAKE 0x16
+#define RECORD_TYPE_APPLICATION_DATA 0x17
+#define BENCHMARK_CYCLES 10000
+/* a typical command with a frame-sized reply of the sensors */
+#define BENCHMARK_CMD_SIZE 64
+#define BENCHMARK_REPLY_SIZE 2048
+
+typedef struct
+{
+  SynaTlsRecordLayer host;
+  SynaTlsRecordLayer sensor;
+  SynaTlsTranscript  host_transcript;
+  SynaTlsTranscript  sensor_transcript;
+  guint8             master_secret[SYNA_TLS_MASTER_SECRET_SIZE];
+} Session;
+
+static void
+session_clear (Session *session)
+{
+  syna_tls_record_layer_clear (&session->host);
+  syna_tls_record_layer_clear (&session->sensor);
+  syna_tls_transcript_clear (&session->host_transcript);
+  syna_tls_transcript_clear (&session->sensor_transcript);
+}
+
+static void
+session_set_keys (Session *session, const guint8 *key_block)
+{
+  g_autoptr(GError) error = NULL;
+  const guint8 *client_key = key_block;
+  const guint8 *server_key = client_key + SYNA_TLS_AES_GCM_KEY_SIZE;
+  const guint8 *client_iv = server_key + SYNA_TLS_AES_GCM_KEY_SIZE;
+  const guint8 *server_iv = client_iv + SYNA_TLS_AES_GCM_IV_SIZE;
+
+  g_assert_true (syna_tls_record_layer_set_keys (&session->host,
+                                                 client_key, client_iv,
+                                                 server_key, server_iv,
+                                                 &error));
+  g_assert_no_error (error);
+  g_assert_true (syna_tls_record_layer_set_keys (&session->sensor,
+                                                 server_key, server_iv,
+                                                 client_key, client_iv,
+                                                 &error));
+  g_assert_no_error (error);
+}
+
+static void
+session_init_with_random_keys (Session *session)
+{
+  guint8 key_block[SYNA_TLS_KEY_BLOCK_SIZE];
+
+  memset (session, 0, sizeof (*session));
+  g_assert_cmpint (RAND_bytes (key_block, sizeof (key_block)), ==, 1);
+  session_set_keys (session, key_block);
+}
+
+/* wraps ptext on one side and unwraps it on the other */
+static void
+round_trip (SynaTlsRecordLayer *from, SynaTlsRecordLayer *to, guint8 type,
+            const guint8 *ptext, gsize ptext_size, guint8 *record)
+{
+  g_autoptr(GError) error = NULL;
+  guint8 *unwrapped = NULL;
+  gsize unwrapped_size = 0;
+  gsize fragment_size = 0;
+
+  g_assert_true (syna_tls_record_layer_encrypt (from, type, TLS_VERSION_1_2,
+                                                ptext, ptext_size, record,
+                                                &fragment_size, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (fragment_size, ==, ptext_size + SYNA_TLS_RECORD_OVERHEAD);
+
+  g_assert_true (syna_tls_record_layer_decrypt (to, type, TLS_VERSION_1_2,
+                                                record, fragment_size,
+                                                &unwrapped, &unwrapped_size,
+                                                &error));
+  g_assert_no_error (error);
+  g_assert_cmpmem (unwrapped, unwrapped_size, ptext, ptext_size);
+}
+
+static void
+test_prf (void)
+{
+  g_autoptr(GError) error = NULL;
+  /* widely used TLS 1.2 PRF test vector */
+  const guint8 secret[] = {
+    0x9b, 0xbe, 0x43, 0x6b, 0xa9, 0x40, 0xf0, 0x17,
+    0xb1, 0x76, 0x52, 0x84, 0x9a, 0x71, 0xdb, 0x35,
+  };
+  const guint8 seed[] = {
+    0xa0, 0xba, 0x9f, 0x93, 0x6c, 0xda, 0x31, 0x18,
+    0x27, 0xa6, 0xf7, 0x96, 0xff, 0xd5, 0x19, 0x8c,
+  };
+  const guint8 expected_sha256[] = {
+    0xe3, 0xf2, 0x29, 0xba, 0x72, 0x7b, 0xe1, 0x7b,
+    0x8d, 0x12, 0x26, 0x20, 0x55, 0x7c, 0xd4, 0x53,
+    0xc2, 0xaa, 0xb2, 0x1d, 0x07, 0xc3, 0xd4, 0x95,
+    0x32, 0x9b, 0x52, 0xd4, 0xe6, 0x1e, 0xdb, 0x5a,
+    0x6b, 0x30, 0x17, 0x91, 0xe9, 0x0d, 0x35, 0xc9,
+    0xc9, 0xa4, 0x6b, 0x4e, 0x14, 0xba, 0xf9, 0xaf,
+    0x0f, 0xa0, 0x22, 0xf7, 0x07, 0x7d, 0xef, 0x17,
+    0xab, 0xfd, 0x37, 0x97, 0xc0, 0x56, 0x4b, 0xab,
+    0x4f, 0xbc, 0x91, 0x66, 0x6e, 0x9d, 0xef, 0x9b,
+    0x97, 0xfc, 0xe3, 0x4f, 0x79, 0x67, 0x89, 0xba,
+    0xa4, 0x80, 0x82, 0xd1, 0x22, 0xee, 0x42, 0xc5,
+    0xa7, 0x2e, 0x5a, 0x51, 0x10, 0xff, 0xf7, 0x01,
+    0x87, 0x34, 0x7b, 0x66,
+  };
+  const guint8 expected_sha384[] = {
+    0xdd, 0x88, 0x77, 0x5c, 0xd8, 0x27, 0x18, 0x7b,
+    0x67, 0xa3, 0xf7, 0x65, 0x2b, 0x5c, 0x13, 0xf7,
+    0x15, 0x79, 0x1c, 0xc4, 0x6e, 0x02, 0x74, 0xa6,
+    0xd3, 0xfb, 0x16, 0x65, 0x11, 0x03, 0xde, 0xfc,
+    0x54, 0x4c, 0xd8, 0xaf, 0xb6, 0x83, 0x69, 0xa2,
+    0x19, 0xbb, 0x91, 0x8b, 0x8b, 0x21, 0xdd, 0xb1,
+  };
+  guint8 out[sizeof (expected_sha256)];
+
+  g_assert_true (syna_tls_prf ("SHA256", secret, sizeof (secret),
+                               "test label", seed, sizeof (seed), out,
+                               sizeof (expected_sha256), &error));
+  g_assert_no_error (error);
+  g_assert_cmpmem (out, sizeof (expected_sha256), expected_sha256,
+                   sizeof (expected_sha256));
+
+  g_assert_true (syna_tls_prf (SYNA_TLS_PRF_DIGEST, secret, sizeof (secret),
+                               "test label", seed, sizeof (seed), out,
+                               sizeof (expected_sha384), &error));
+  g_assert_no_error (error);
+  g_assert_cmpmem (out, sizeof (expected_sha384), expected_sha384,
+                   sizeof (expected_sha384));
+}
+
+static gchar *
+transcript_digest_hex (SynaTlsTranscript *transcript)
+{
+  g_autoptr(GError) error = NULL;
+  guint8 digest[EVP_MAX_MD_SIZE];
+  gsize digest_size = 0;
+  GString *hex = g_string_new (NULL);
+
+  g_assert_true (syna_tls_transcript_get_digest (transcript, digest,
+                                                 &digest_size, &error));
+  g_assert_no_error (error);
+  for (gsize i = 0; i < digest_size; ++i)
+    g_string_append_printf (hex, "%02x", digest[i]);
+
+  return g_string_free (hex, FALSE);
+}
+
+static void
+test_transcript (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *expected = NULL;
+  g_autofree gchar *digest = NULL;
+  SynaTlsTranscript transcript = { 0 };
+  guint8 messages[300];
+
+  for (gsize i = 0; i < sizeof (messages); ++i)
+    messages[i] = i & 0xff;
+
+  g_assert_true (syna_tls_transcript_init (&transcript,
+                                           SYNA_TLS_TRANSCRIPT_DIGEST,
+                                           &error));
+  g_assert_true (syna_tls_transcript_update (&transcript, messages, 100,
+                                             &error));
+  g_assert_no_error (error);
+
+  digest = transcript_digest_hex (&transcript);
+  expected = g_compute_checksum_for_data (G_CHECKSUM_SHA256, messages, 100);
+  g_assert_cmpstr (digest, ==, expected);
+
+  /* the transcript goes on after a digest was taken */
+  g_assert_true (syna_tls_transcript_update (&transcript, messages + 100,
+                                             sizeof (messages) - 100,
+                                             &error));
+  g_assert_no_error (error);
+
+  g_clear_pointer (&digest, g_free);
+  g_clear_pointer (&expected, g_free);
+  digest = transcript_digest_hex (&transcript);
+  expected = g_compute_checksum_for_data (G_CHECKSUM_SHA256, messages,
+                                          sizeof (messages));
+  g_assert_cmpstr (digest, ==, expected);
+
+  syna_tls_transcript_clear (&transcript);
+}
+
+static void
+test_record_layer (void)
+{
+  g_autoptr(GError) error = NULL;
+  Session session;
+  guint8 ptext[256];
+  guint8 record[sizeof (ptext) + SYNA_TLS_RECORD_OVERHEAD];
+  guint8 *unwrapped = NULL;
+  gsize unwrapped_size = 0;
+  gsize fragment_size = 0;
+
+  session_init_with_random_keys (&session);
+  g_assert_cmpint (RAND_bytes (ptext, sizeof (ptext)), ==, 1);
+
+  for (gsize size = 0; size <= sizeof (ptext); size += 37)
+    {
+      round_trip (&session.host, &session.sensor,
+                  RECORD_TYPE_APPLICATION_DATA, ptext, size, record);
+      round_trip (&session.sensor, &session.host,
+                  RECORD_TYPE_APPLICATION_DATA, ptext, size, record);
+    }
+
+  /* in place encryption of plaintext behind the nonce */
+  memcpy (record + SYNA_TLS_AES_GCM_NONCE_SIZE, ptext, 100);
+  round_trip (&session.host, &session.sensor, RECORD_TYPE_APPLICATION_DATA,
+              record + SYNA_TLS_AES_GCM_NONCE_SIZE, 100, record);
+  g_assert_cmpmem (record + SYNA_TLS_AES_GCM_NONCE_SIZE, 100, ptext, 100);
+
+  /* a modified ciphertext is rejected */
+  g_assert_true (syna_tls_record_layer_encrypt (&session.host,
+                                                RECORD_TYPE_APPLICATION_DATA,
+                                                TLS_VERSION_1_2, ptext, 50,
+                                                record, &fragment_size,
+                                                &error));
+  record[SYNA_TLS_AES_GCM_NONCE_SIZE] ^= 1;
+  g_assert_false (syna_tls_record_layer_decrypt (&session.sensor,
+                                                 RECORD_TYPE_APPLICATION_DATA,
+                                                 TLS_VERSION_1_2, record,
+                                                 fragment_size, &unwrapped,
+                                                 &unwrapped_size, &error));
+  g_assert_nonnull (error);
+  g_clear_error (&error);
+
+  /* a record which was not sent can be reverted and then sent again */
+  session_clear (&session);
+  session_init_with_random_keys (&session);
+  g_assert_true (syna_tls_record_layer_encrypt (&session.host,
+                                                RECORD_TYPE_HANDSHAKE,
+                                                TLS_VERSION_1_2, ptext, 50,
+                                                record, &fragment_size,
+                                                &error));
+  g_assert_true (syna_tls_record_layer_revert_encrypt (&session.host,
+                                                       RECORD_TYPE_HANDSHAKE,
+                                                       TLS_VERSION_1_2,
+                                                       record, fragment_size,
+                                                       &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (session.host.encrypt_seq_num, ==, 0);
+  g_assert_cmpmem (record + SYNA_TLS_AES_GCM_NONCE_SIZE, 50, ptext, 50);
+  round_trip (&session.host, &session.sensor, RECORD_TYPE_APPLICATION_DATA,
+              ptext, 10, record);
+
+  /* truncated records are rejected */
+  g_assert_false (syna_tls_record_layer_decrypt (&session.sensor,
+                                                 RECORD_TYPE_APPLICATION_DATA,
+                                                 TLS_VERSION_1_2, record,
+                                                 SYNA_TLS_RECORD_OVERHEAD - 1,
+                                                 &unwrapped, &unwrapped_size,
+                                                 &error));
+  g_assert_nonnull (error);
+  g_clear_error (&error);
+
+  /* sequential nonces make the records reproducible */
+  session_clear (&session);
+  session_init_with_random_keys (&session);
+  session.host.sequential_nonce = TRUE;
+  for (guint64 seq_num = 0; seq_num < 3; seq_num++)
+    {
+      guint8 expected_nonce[SYNA_TLS_AES_GCM_NONCE_SIZE];
+
+      FP_WRITE_UINT64_BE (expected_nonce, seq_num);
+      round_trip (&session.host, &session.sensor,
+                  RECORD_TYPE_APPLICATION_DATA, ptext, 20, record);
+      g_assert_cmpmem (record, SYNA_TLS_AES_GCM_NONCE_SIZE, expected_nonce,
+                       SYNA_TLS_AES_GCM_NONCE_SIZE);
+    }
+
+  session_clear (&session);
+}
+
+static void
+derive_premaster_secret (EVP_PKEY *key, EVP_PKEY *peer, guint8 *secret,
+                         gsize *secret_size)
+{
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new (key, NULL);
+
+  g_assert_nonnull (ctx);
+  g_assert_cmpint (EVP_PKEY_derive_init (ctx), ==, 1);
+  g_assert_cmpint (EVP_PKEY_derive_set_peer (ctx, peer), ==, 1);
+  g_assert_cmpint (EVP_PKEY_derive (ctx, secret, secret_size), ==, 1);
+  EVP_PKEY_CTX_free (ctx);
+}
+
+/* Full handshake as done with the sensors on both sides followed by wrapping
+ * and unwrapping of commands and replies, which reports the time taken by
+ * each part. */
+static void
+test_benchmark (void)
+{
+  g_autoptr(GError) error = NULL;
+  Session session = { 0 };
+  EVP_PKEY *host_key = NULL;
+  EVP_PKEY *sensor_key = NULL;
+  guint8 randoms[2 * SYNA_TLS_RANDOM_SIZE];
+  guint8 host_secret[64], sensor_secret[64];
+  gsize host_secret_size = sizeof (host_secret);
+  gsize sensor_secret_size = sizeof (sensor_secret);
+  guint8 key_block[SYNA_TLS_KEY_BLOCK_SIZE];
+  guint8 host_verify_data[SYNA_TLS_VERIFY_DATA_SIZE];
+  guint8 sensor_verify_data[SYNA_TLS_VERIFY_DATA_SIZE];
+  guint8 hello[512];
+  g_autofree guint8 *cmd = g_malloc (BENCHMARK_CMD_SIZE);
+  g_autofree guint8 *reply = g_malloc (BENCHMARK_REPLY_SIZE);
+  g_autofree guint8 *record =
+    g_malloc (BENCHMARK_REPLY_SIZE + SYNA_TLS_RECORD_OVERHEAD);
+  gdouble handshake_time, cycles_time;
+
+  if (!g_test_perf ())
+    {
+      g_test_skip ("Not running performance tests");
+      return;
+    }
+
+  g_assert_cmpint (RAND_bytes (randoms, sizeof (randoms)), ==, 1);
+  g_assert_cmpint (RAND_bytes (hello, sizeof (hello)), ==, 1);
+  g_assert_cmpint (RAND_bytes (cmd, BENCHMARK_CMD_SIZE), ==, 1);
+  g_assert_cmpint (RAND_bytes (reply, BENCHMARK_REPLY_SIZE), ==, 1);
+
+  g_test_timer_start ();
+
+  g_assert_true (syna_tls_transcript_init (&session.host_transcript,
+                                           SYNA_TLS_TRANSCRIPT_DIGEST,
+                                           &error));
+  g_assert_true (syna_tls_transcript_init (&session.sensor_transcript,
+                                           SYNA_TLS_TRANSCRIPT_DIGEST,
+                                           &error));
+  g_assert_no_error (error);
+
+  /* hello messages, certificates and key exchange */
+  for (gsize offset = 0; offset < sizeof (hello); offset += 128)
+    {
+      g_assert_true (syna_tls_transcript_update (&session.host_transcript,
+                                                 hello + offset, 128, &error));
+      g_assert_true (syna_tls_transcript_update (&session.sensor_transcript,
+                                                 hello + offset, 128, &error));
+    }
+  g_assert_no_error (error);
+
+  host_key = EVP_EC_gen ("P-256");
+  sensor_key = EVP_EC_gen ("P-256");
+  g_assert_nonnull (host_key);
+  g_assert_nonnull (sensor_key);
+  derive_premaster_secret (host_key, sensor_key, host_secret,
+                           &host_secret_size);
+  derive_premaster_secret (sensor_key, host_key, sensor_secret,
+                           &sensor_secret_size);
+  g_assert_cmpmem (host_secret, host_secret_size, sensor_secret,
+                   sensor_secret_size);
+
+  g_assert_true (syna_tls_prf (SYNA_TLS_PRF_DIGEST, host_secret,
+                               host_secret_size, "master secret", randoms,
+                               sizeof (randoms), session.master_secret,
+                               sizeof (session.master_secret), &error));
+  g_assert_true (syna_tls_prf (SYNA_TLS_PRF_DIGEST, session.master_secret,
+                               sizeof (session.master_secret),
+                               "key expansion", randoms, sizeof (randoms),
+                               key_block, sizeof (key_block), &error));
+  g_assert_no_error (error);
+  session_set_keys (&session, key_block);
+
+  /* both sides compute the same finished messages */
+  g_assert_true (syna_tls_transcript_get_verify_data (&session.host_transcript,
+                                                      session.master_secret,
+                                                      "client finished",
+                                                      host_verify_data,
+                                                      &error));
+  g_assert_true (syna_tls_transcript_get_verify_data (&session.sensor_transcript,
+                                                      session.master_secret,
+                                                      "client finished",
+                                                      sensor_verify_data,
+                                                      &error));
+  g_assert_no_error (error);
+  g_assert_cmpmem (host_verify_data, sizeof (host_verify_data),
+                   sensor_verify_data, sizeof (sensor_verify_data));
+  round_trip (&session.host, &session.sensor, RECORD_TYPE_HANDSHAKE,
+              host_verify_data, sizeof (host_verify_data), record);
+
+  handshake_time = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  for (guint i = 0; i < BENCHMARK_CYCLES; ++i)
+    {
+      round_trip (&session.host, &session.sensor,
+                  RECORD_TYPE_APPLICATION_DATA, cmd, BENCHMARK_CMD_SIZE,
+                  record);
+      round_trip (&session.sensor, &session.host,
+                  RECORD_TYPE_APPLICATION_DATA, reply, BENCHMARK_REPLY_SIZE,
+                  record);
+    }
+  cycles_time = g_test_timer_elapsed ();
+
+  g_assert_cmpuint (session.host.encrypt_seq_num, ==, BENCHMARK_CYCLES + 1);
+  g_assert_cmpuint (session.host.decrypt_seq_num, ==, BENCHMARK_CYCLES);
+
+  g_test_message ("handshake: %.3f ms", handshake_time * 1000);
+  g_test_message ("%d wrap/unwrap cycles: %.3f ms, %.2f us per cycle",
+                  BENCHMARK_CYCLES, cycles_time * 1000,
+                  cycles_time * 1e6 / BENCHMARK_CYCLES);
+  g_test_minimized_result (cycles_time * 1e6 / BENCHMARK_CYCLES,
+                           "wrap/unwrap cycle: %.2f us",
+                           cycles_time * 1e6 / BENCHMARK_CYCLES);
+
+  EVP_PKEY_free (host_key);
+  EVP_PKEY_free (sensor_key);
+  session_clear (&session);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/synatls/prf", test_prf);
+  g_test_add_func ("/synatls/transcript", test_transcript);
+  g_test_add_func ("/synatls/record-layer", test_record_layer);
+  g_test_add_func ("/synatls/benchmark", test_benchmark);
+
+  return g_test_run ();
+}